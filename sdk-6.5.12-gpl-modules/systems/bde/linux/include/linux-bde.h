@@ -148,6 +148,19 @@ typedef struct linux_bde_bus_s {
  */
 #define BDE_DEV_STATE_CHANGED      (2)
 
+/*
+ * Interrupt sources which can be served by an MSI-X vector of their own.
+ * With MSI-X enabled (usemsi=2), source n is signalled on MSI-X table
+ * entry n. Sources without a vector share the device interrupt, which
+ * is also used for LKBDE_INTR_SRC_DEFAULT.
+ */
+#define LKBDE_INTR_SRC_DEFAULT     0
+#define LKBDE_INTR_SRC_PKT_DMA     1   /* Packet DMA */
+#define LKBDE_INTR_SRC_CNT_DMA     2   /* Counter (statistics) DMA */
+#define LKBDE_INTR_SRC_SBUS_DMA    3   /* SBUS and FIFO DMA */
+#define LKBDE_INTR_SRC_LINK        4   /* Link scan */
+#define LKBDE_INTR_SRC_COUNT       5
+
 extern int linux_bde_create(linux_bde_bus_t* bus, ibde_t** bde);
 extern int linux_bde_destroy(ibde_t* bde);
 #ifdef BCM_INSTANCE_SUPPORT
@@ -169,6 +182,23 @@ extern int linux_bde_instance_attach(unsigned int dev_mask,unsigned int dma_size
  * (IOVA) translated by IOMMU.
  */
 extern int lkbde_get_dma_info(phys_addr_t *cpu_pbase, phys_addr_t *dma_pbase, ssize_t *size);
+/* DMA pool used for device d, see the dmapool module parameter */
+extern int lkbde_get_dev_dma_info(int d, phys_addr_t *cpu_pbase, phys_addr_t *dma_pbase, ssize_t *size);
+/* Page size and fault counts of DMA mmap via /dev/linux-kernel-bde */
+extern int lkbde_get_dma_mmap_info(unsigned long *page_size, unsigned long *huge_faults, unsigned long *page_faults);
+/* Map DMA pool memory at cpu physical page vma->vm_pgoff */
+struct vm_area_struct;
+extern int lkbde_dma_mmap(struct vm_area_struct *vma);
+/*
+ * DMA memory accounting per owner, see /proc/linux-kernel-bde.
+ * Memory allocated through salloc and kmalloc_giant is accounted
+ * automatically, other users report what they allocate or reserve.
+ */
+#define LKBDE_DMA_OWNER_KERNEL  0
+#define LKBDE_DMA_OWNER_USER    1
+#define LKBDE_DMA_OWNER_KNET    2
+#define LKBDE_DMA_OWNER_COUNT   3
+extern int lkbde_dma_owner_update(int owner, int bytes);
 extern uint32 lkbde_get_dev_phys(int d);
 extern uint32 lkbde_get_dev_phys_hi(int d);
 
@@ -222,6 +252,37 @@ extern int lkbde_dev_instid_set(int d, uint32 instid);
 extern int lkbde_irq_mask_set(int d, uint32 addr, uint32 mask, uint32 fmask);
 extern int lkbde_irq_mask_get(int d, uint32 *mask, uint32 *fmask);
 
+/*
+ * Per-source interrupt handlers on MSI-X vectors, see LKBDE_INTR_SRC_xxx.
+ * Connect fails if the source shares the device interrupt, in which
+ * case the device handlers demultiplex it as before.
+ */
+extern int lkbde_irq_source_connect(int d, int src,
+                                    void (*isr)(void *), void *isr_data);
+extern int lkbde_irq_source_disconnect(int d, int src);
+extern int lkbde_irq_source_get(int d, int src, int *irq, int *cpu);
+
+/*
+ * Interrupt polling. With a non-zero interval the device interrupt is
+ * released and the handlers are called from a timer instead.
+ */
+extern int lkbde_intr_poll_set(int d, int usecs);
+extern int lkbde_intr_poll_get(int d);
+
+/*
+ * Bulk iProc register access. Accesses are grouped by PAXB sub-window,
+ * so accesses to different sub-windows may be reordered.
+ */
+typedef struct lkbde_iproc_op_s {
+    uint32 addr;
+    uint32 data;        /* Value to write or value read */
+    uint32 write;       /* Non-zero to write */
+} lkbde_iproc_op_t;
+
+extern int lkbde_iproc_bulk(int d, lkbde_iproc_op_t *ops, int cnt);
+extern int lkbde_iproc_stats_get(int d, unsigned long *accesses,
+                                 uint32 *switches);
+
 #if (defined(BCM_PETRA_SUPPORT) || defined(BCM_DFE_SUPPORT))
 extern int lkbde_cpu_write(int d, uint32 addr, uint32 *buf);
 extern int lkbde_cpu_read(int d, uint32 addr, uint32 *buf);
@@ -59,6 +59,7 @@
 #endif
 
 extern void _dma_init(int robo_switch);
+extern void _dma_dev_init(void);
 extern int _dma_cleanup(void);
 extern void _dma_pprint(void);
 extern uint32_t *_salloc(int d, int size, const char *name);
@@ -69,6 +70,8 @@ extern sal_paddr_t _l2p(int d, void *vaddr);
 extern void *_p2l(int d, sal_paddr_t paddr);
 extern int _dma_pool_allocated(void);
 extern int _dma_range_valid(unsigned long phys_addr, unsigned long size);
+struct vm_area_struct;
+extern int _dma_sg_mmap(struct vm_area_struct *vma);
 
 #endif /* __KERNEL__ */
 
@@ -32,5 +32,29 @@ extern void  mpool_free(mpool_handle_t pool, void* ptr);
 extern int mpool_destroy(mpool_handle_t pool);
 
 extern int mpool_usage(mpool_handle_t pool);
+extern int mpool_block_size(mpool_handle_t pool, void *ptr);
+
+/* Size classes reported in mpool_stats_t, the last one is large blocks */
+#define MPOOL_STATS_CLASSES 17
+
+typedef struct mpool_stats_s {
+    int used;                       /* Bytes allocated by users */
+    int cached;                     /* Bytes held in magazines */
+    unsigned long cache_hits;       /* Allocations served from magazine */
+    unsigned long cache_misses;     /* Allocations that refilled magazine */
+    unsigned long lock_contended;   /* Lock acquisitions that had to wait */
+    int size;                       /* Usable size of pool */
+    int peak;                       /* Highest used + cached since create */
+    int free;                       /* Bytes outside of slabs in use */
+    int largest_free;               /* Largest contiguous free block */
+    int frag;                       /* 100 - 100 * largest_free / free */
+    unsigned long alloc_fails;      /* Allocations that failed */
+    unsigned long bad_frees;        /* Frees of unknown or free blocks */
+    int class_size[MPOOL_STATS_CLASSES];    /* Block size, 0 for large */
+    int class_used[MPOOL_STATS_CLASSES];    /* Blocks allocated by users */
+    int class_bytes[MPOOL_STATS_CLASSES];   /* Bytes allocated by users */
+} mpool_stats_t;
+
+extern int mpool_stats_get(mpool_handle_t pool, mpool_stats_t *stats);
 
 #endif /* __MPOOL_H__ */
@@ -28,6 +28,7 @@
 #include <mpool.h>
 #include <linux/delay.h>
 #include <linux/types.h>
+#include <linux/mutex.h>
 #include <sdk_config.h>
 #include <soc/devids.h>
 #include <soc/cmic.h>
@@ -88,6 +89,36 @@ LKM_MOD_PARAM(usemsi, "i", int, 0);
 MODULE_PARM_DESC(usemsi,
 "Use MSI/ MSIX interrupts if supported by kernel");
 
+/* Number of MSI-X vectors, one per LKBDE_INTR_SRC_xxx interrupt source */
+int msix_vectors = LKBDE_INTR_SRC_COUNT;
+LKM_MOD_PARAM(msix_vectors, "i", int, 0);
+MODULE_PARM_DESC(msix_vectors,
+"Number of MSI-X vectors per device when usemsi=2 (default 5)");
+
+/* Poll interrupt status instead of using the device interrupt */
+int intr_poll_usecs = 0;
+LKM_MOD_PARAM(intr_poll_usecs, "i", int, 0);
+MODULE_PARM_DESC(intr_poll_usecs,
+"Poll device interrupt status every N microseconds instead of using the interrupt (default 0, minimum 10)");
+
+/*
+ * Shortest poll interval. The poll timer runs the handlers in hard
+ * interrupt context, so shorter intervals could starve the CPU.
+ */
+#define BDE_INTR_POLL_MIN_USECS 10
+
+/*
+ * Only update the iProc PAXB sub-window when it changes. User mode SDK
+ * code may reprogram PAXB IMAP0_7 directly, so the cached sub-window
+ * is forgotten whenever iproc_lock is taken and is only trusted until
+ * the lock is released. Bulk accesses keep the lock for a group of
+ * accesses to one sub-window.
+ */
+int iproc_subwin_cache = 1;
+LKM_MOD_PARAM(iproc_subwin_cache, "i", int, 0);
+MODULE_PARM_DESC(iproc_subwin_cache,
+"Skip iProc PAXB sub-window updates within bulk accesses (default 1)");
+
 /* Ignore all recognized devices (for debug purposes) */
 int nodevices;
 LKM_MOD_PARAM(nodevices, "i", int, 0);
@@ -193,6 +224,72 @@ MODULE_PARM_DESC(eadevices,
 #endif /* */
 #endif /* BCM_EA_SUPPORT */
 
+/* Interrupt polling needs hrtimer_forward_now */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+#define BDE_INTR_POLL_SUPPORT
+#include <linux/hrtimer.h>
+#endif
+
+/* Simulated devices are run from the interrupt poll timer */
+#ifdef BDE_INTR_POLL_SUPPORT
+#define BDE_SIM_SUPPORT
+#include "linux_sim.h"
+
+/* Number of simulated CMICx devices, see linux_sim.c */
+static int sim_devices = 0;
+LKM_MOD_PARAM(sim_devices, "i", int, 0);
+MODULE_PARM_DESC(sim_devices,
+"Number of simulated CMICx devices to create (default 0)");
+
+static uint32_t sim_devid = BCM56870_DEVICE_ID;
+LKM_MOD_PARAM(sim_devid, "i", uint, 0);
+MODULE_PARM_DESC(sim_devid,
+"Device ID of simulated devices (default 0xb870)");
+
+static uint32_t sim_revid = BCM56870_A0_REV_ID;
+LKM_MOD_PARAM(sim_revid, "i", uint, 0);
+MODULE_PARM_DESC(sim_revid,
+"Revision ID of simulated devices (default 1)");
+
+static int sim_poll_usecs = 10;
+LKM_MOD_PARAM(sim_poll_usecs, "i", int, 0);
+MODULE_PARM_DESC(sim_poll_usecs,
+"DMA engine run interval of simulated devices in microseconds (default 10, minimum 10)");
+
+static int sim_selftest = 0;
+LKM_MOD_PARAM(sim_selftest, "i", int, 0);
+MODULE_PARM_DESC(sim_selftest,
+"Test interrupt polling on simulated devices when loaded (default 0)");
+
+static int _sim_poll_selftest(int d);
+#endif
+
+#if USE_LINUX_BDE_MMAP
+/*
+ * Map the DMA pool with PMD (huge page) entries where the physical
+ * layout allows it. This requires transparent huge page support and
+ * special PMD pfn mappings (6.12), since older kernels do not mark the
+ * inserted PMDs special and GUP-fast would treat them as THP.
+ */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && \
+    defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0)
+#define BDE_MMAP_HUGE_SUPPORT
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#endif
+
+static int dma_mmap_huge = 1;
+LKM_MOD_PARAM(dma_mmap_huge, "i", int, 0);
+MODULE_PARM_DESC(dma_mmap_huge,
+"Map DMA memory to user space using huge pages when possible (default 1)");
+
+/* Page faults served by DMA mmap */
+static unsigned long _mmap_huge_faults;
+static unsigned long _mmap_page_faults;
+#endif /* USE_LINUX_BDE_MMAP */
+
 /* Compatibility */
 #ifdef LKM_2_4
 #define _ISR_RET void
@@ -289,6 +386,21 @@ struct bde_spi_device_id {
     uint32  spifreq;
 };
 
+/*
+ * MSI-X vector
+ *
+ * Vector n serves interrupt source n (LKBDE_INTR_SRC_xxx). A source
+ * handler connected through lkbde_irq_source_connect is called
+ * instead of the device handlers when the vector fires.
+ */
+typedef struct bde_msix_vec_s {
+    struct bde_ctrl_s *ctrl;
+    void (*isr)(void *);
+    void *isr_data;
+    int cpu;                /* Affinity hint, -1 if none */
+    atomic_long_t count;    /* Interrupts taken */
+} bde_msix_vec_t;
+
 /* Control Data */
 typedef struct bde_ctrl_s {
     struct list_head list;
@@ -302,6 +414,7 @@ typedef struct bde_ctrl_s {
     int use_msi;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
     struct msix_entry *entries;
+    bde_msix_vec_t msix_vec[LKBDE_INTR_SRC_COUNT];
 #endif
     int msix_cnt;
     union {
@@ -346,9 +459,24 @@ typedef struct bde_ctrl_s {
     uint32_t imask;  /* Enabled interrupts for primary handler */
     uint32_t imask2; /* Enabled interrupts for secondary handler */
     spinlock_t lock; /* Lock for IRQ mask synchronization */
+    struct mutex intr_lock; /* Serializes interrupt connect and mode switch */
+
+#ifdef BDE_INTR_POLL_SUPPORT
+    /* Interrupt polling, see intr_poll_usecs */
+    int poll_usecs;
+    int poll_active;
+    struct hrtimer poll_timer;
+    unsigned long poll_count;
+#endif
+#ifdef BDE_SIM_SUPPORT
+    /* Software device model, NULL for real devices */
+    lksim_t *sim;
+#endif
 
     /* Hardware abstraction for shared BDE functions */
     shbde_hal_t shbde;
+    spinlock_t iproc_lock; /* Lock for iProc sub-window access */
+    unsigned long iproc_accesses;
 
     /* Device state : BDE_DEV_STATE_REMOVED/CHANGED */
     uint32 dev_state;
@@ -366,6 +494,184 @@ static int  robo_switch = 0;
 
 #define VALID_DEVICE(_n) ((_n >= 0) && (_n < _ndevices))
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+/*
+ * Function: _msix_isr
+ *
+ * Purpose:
+ *    MSI-X vector handler.
+ * Parameters:
+ *    dev_id - MSI-X vector (bde_msix_vec_t)
+ * Returns:
+ *    IRQ_HANDLED
+ * Notes:
+ *    Calls the source handler of the vector if one is connected,
+ *    and the device handlers otherwise.
+ */
+static _ISR_RET
+_msix_isr(_ISR_PARAMS(irq, dev_id, iregs))
+{
+    bde_msix_vec_t *vec = (bde_msix_vec_t *)dev_id;
+    bde_ctrl_t *ctrl = vec->ctrl;
+    void (*isr)(void *);
+
+    atomic_long_inc(&vec->count);
+    isr = vec->isr;
+    if (isr) {
+        smp_rmb();
+        isr(vec->isr_data);
+        return IRQ_HANDLED;
+    }
+    if (ctrl->isr) {
+        ctrl->isr(ctrl->isr_data);
+    }
+    if (ctrl->isr2) {
+        ctrl->isr2(ctrl->isr2_data);
+    }
+    return IRQ_HANDLED;
+}
+
+/*
+ * Function: _msix_request_irqs
+ *
+ * Purpose:
+ *    Install the handlers of all MSI-X vectors of a device.
+ * Parameters:
+ *    ctrl - device
+ *    d - device number
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    The vectors of a device are spread over the CPUs closest to the
+ *    device, so packet DMA does not compete with the other sources.
+ *    Source handlers connected before are kept.
+ */
+static int
+_msix_request_irqs(bde_ctrl_t *ctrl, int d)
+{
+    bde_msix_vec_t *vec;
+    int i, ret = 0;
+
+    for (i = 0; i < ctrl->msix_cnt; i++) {
+        vec = &ctrl->msix_vec[i];
+        vec->ctrl = ctrl;
+        vec->cpu = -1;
+        ret = request_irq(ctrl->entries[i].vector, _msix_isr, 0,
+                          LINUX_KERNEL_BDE_NAME, vec);
+        if (ret < 0) {
+            break;
+        }
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+        vec->cpu = cpumask_local_spread(d * LKBDE_INTR_SRC_COUNT + i,
+                                        dev_to_node(&ctrl->pci_device->dev));
+        irq_set_affinity_hint(ctrl->entries[i].vector, cpumask_of(vec->cpu));
+#endif
+        if (unlikely(debug >= 1))
+            gprintk("%s: device# = %d, vector %d irq = %d cpu = %d\n",
+                    __func__, d, i, ctrl->entries[i].vector, vec->cpu);
+    }
+    if (ret < 0) {
+        while (--i >= 0) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+            irq_set_affinity_hint(ctrl->entries[i].vector, NULL);
+#endif
+            free_irq(ctrl->entries[i].vector, &ctrl->msix_vec[i]);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Function: _msix_free_irqs
+ *
+ * Purpose:
+ *    Remove the handlers of all MSI-X vectors of a device.
+ * Parameters:
+ *    ctrl - device
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Source handlers stay connected, so they are back in place when
+ *    the vectors are requested again, e.g. after polling mode.
+ */
+static void
+_msix_free_irqs(bde_ctrl_t *ctrl)
+{
+    int i;
+
+    for (i = 0; i < ctrl->msix_cnt; i++) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0))
+        irq_set_affinity_hint(ctrl->entries[i].vector, NULL);
+#endif
+        free_irq(ctrl->entries[i].vector, &ctrl->msix_vec[i]);
+        ctrl->msix_vec[i].cpu = -1;
+    }
+}
+
+/*
+ * Function: _msix_sources_reset
+ *
+ * Purpose:
+ *    Disconnect the source handlers of all MSI-X vectors of a device.
+ * Parameters:
+ *    ctrl - device
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Called when the device interrupt is disconnected, while no
+ *    vector handler is installed.
+ */
+static void
+_msix_sources_reset(bde_ctrl_t *ctrl)
+{
+    int i;
+
+    for (i = 0; i < LKBDE_INTR_SRC_COUNT; i++) {
+        ctrl->msix_vec[i].isr = NULL;
+        ctrl->msix_vec[i].isr_data = NULL;
+    }
+}
+#endif
+
+/*
+ * Function: _irq_sync
+ *
+ * Purpose:
+ *    Wait for running interrupt handlers of a device to complete.
+ * Parameters:
+ *    ctrl - device
+ * Returns:
+ *    Nothing
+ */
+static void
+_irq_sync(bde_ctrl_t *ctrl)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    int i;
+#endif
+
+#ifdef BDE_INTR_POLL_SUPPORT
+    if (ctrl->poll_active) {
+        /* Wait for a running poll, then carry on polling */
+        hrtimer_cancel(&ctrl->poll_timer);
+        hrtimer_start(&ctrl->poll_timer,
+                      ns_to_ktime((u64)ctrl->poll_usecs * 1000),
+                      HRTIMER_MODE_REL);
+        return;
+    }
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+
+    if (ctrl->use_msi == PCI_USE_INT_MSIX && ctrl->msix_cnt > 0) {
+        for (i = 0; i < ctrl->msix_cnt; i++) {
+            SYNC_IRQ(ctrl->entries[i].vector);
+        }
+        return;
+    }
+#endif
+    SYNC_IRQ(ctrl->iLine);
+}
+
 /* CPU MMIO area used with CPU cards provided on demo boards */
 #if (defined(BCM_PETRA_SUPPORT) || defined(BCM_DFE_SUPPORT) || defined(BCM_DNX_SUPPORT) || defined(BCM_DNXF_SUPPORT)) && (defined(__DUNE_WRX_BCM_CPU__) || defined(__DUNE_GTO_BCM_CPU__))
 static void *cpu_address = NULL;
@@ -1953,44 +2259,47 @@ _msi_connect(bde_ctrl_t *ctrl)
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
     int ret;
     if (ctrl->use_msi == PCI_USE_INT_MSIX) {
-        int i;
-        ret = _pci_msix_table_size(ctrl->pci_device);
+        int i, cnt;
+        cnt = _pci_msix_table_size(ctrl->pci_device);
 
-        if (ret == 0) {
+        if (cnt == 0) {
             /* MSI-X failed */
             gprintk("MSI-X not supported.\n");
             goto er_intx;
         }
-        ctrl->entries = kcalloc(ret, sizeof(struct msix_entry)*ret, GFP_KERNEL);
+        /* One vector per interrupt source is all we need */
+        if (cnt > msix_vectors) {
+            cnt = msix_vectors;
+        }
+        if (cnt > LKBDE_INTR_SRC_COUNT) {
+            cnt = LKBDE_INTR_SRC_COUNT;
+        }
+        if (cnt < 1) {
+            cnt = 1;
+        }
+        if (unlikely(debug > 1))
+            gprintk("MSIX vectors requested = %d\n", cnt);
+        ctrl->entries = kcalloc(cnt, sizeof(struct msix_entry), GFP_KERNEL);
 
         if (!ctrl->entries) {
             goto er_intx;
         }
-        /* We need only that much interrupt vecotrs */
-        ctrl->msix_cnt = ret/4;
-        if (unlikely(debug > 1))
-            gprintk("MSIX Table size = %d\n", ctrl->msix_cnt);
-        for (i = 0; i < ctrl->msix_cnt; i++)
+        for (i = 0; i < cnt; i++)
                 ctrl->entries[i].entry = i;
 
+        /*
+         * Accept fewer vectors than requested. Sources without a
+         * vector of their own are served by vector 0.
+         */
         ret = pci_enable_msix_range(ctrl->pci_device,
-                                    ctrl->entries,
-                                    ctrl->msix_cnt, ctrl->msix_cnt);
-        if (ret > 0) {
-            /* Not enough vectors available , Retry MSI-X */
-            gprintk("Retrying with MSI-X interrupts = %d\n", ret);
-            ctrl->msix_cnt = ret;
-            ret = pci_enable_msix_range(ctrl->pci_device,
-                                        ctrl->entries,
-                                        ctrl->msix_cnt, ctrl->msix_cnt);
-            if (ret != 0)
-                goto er_intx_free;
-        } else if (ret < 0) {
+                                    ctrl->entries, 1, cnt);
+        if (ret < 0) {
               /* Error */
               goto er_intx_free;
-        } else {
-          gprintk("Enabled MSI-X interrupts = %d\n", ctrl->msix_cnt);
         }
+        ctrl->msix_cnt = ret;
+        gprintk("Enabled MSI-X interrupts = %d\n", ctrl->msix_cnt);
+        return 0;
     }
 #endif
 
@@ -2025,6 +2334,7 @@ _msi_disconnect(bde_ctrl_t *ctrl)
     if (ctrl->use_msi == PCI_USE_INT_MSIX) {
         pci_disable_msix(ctrl->pci_device);
         kfree(ctrl->entries);
+        ctrl->entries = NULL;
         ctrl->msix_cnt = 0;
     }
 #endif
@@ -2038,7 +2348,6 @@ _msi_disconnect(bde_ctrl_t *ctrl)
 
 #endif
 
-
 static void
 config_pci_intr_type(bde_ctrl_t *ctrl)
 {
@@ -2541,6 +2850,7 @@ _pci_probe(struct pci_dev *dev, const struct pci_device_id *ent)
         icfg->use_msi = ctrl->use_msi;
 
         /* Call shared function */
+        shbde->subwin_cache = iproc_subwin_cache ? 1 : 0;
         paxb_core = shbde_iproc_paxb_init(shbde, iproc_regs, icfg);
 
         /* Save PCI core information for CMIC */
@@ -2681,11 +2991,16 @@ _pci_remove(struct pci_dev* dev)
 
     /* Free our interrupt handler, if we have one */
     if (ctrl->isr || ctrl->isr2) {
+#ifdef BDE_INTR_POLL_SUPPORT
+        if (ctrl->poll_active) {
+            hrtimer_cancel(&ctrl->poll_timer);
+            ctrl->poll_active = 0;
+        }
+        else
+#endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
         if (ctrl->use_msi >= PCI_USE_INT_MSIX) {
-            int i;
-            for (i = 0; i < ctrl->msix_cnt; i++)
-                free_irq(ctrl->entries[i].vector, ctrl->pci_device);
+            _msix_free_irqs(ctrl);
         }
         else
 #endif
@@ -2728,6 +3043,59 @@ _spi_device_setup(void) {
 }
 #endif /* BCM_ICS */
 
+#ifdef BDE_SIM_SUPPORT
+/*
+ * Function: _sim_device_create
+ *
+ * Purpose:
+ *    Add a simulated CMICx device.
+ * Parameters:
+ *    None
+ * Returns:
+ *    0 on success, -1 on error
+ * Notes:
+ *    The device looks like an AXI device without an interrupt line.
+ *    It is serviced by the interrupt poll timer, which also runs the
+ *    device model.
+ */
+static int
+_sim_device_create(void)
+{
+    bde_ctrl_t *ctrl;
+    lksim_t *sim;
+
+    if (_ndevices >= LINUX_BDE_MAX_DEVICES) {
+        return -1;
+    }
+    if ((sim = lksim_create(_ndevices)) == NULL) {
+        gprintk("Unable to create simulated device\n");
+        return -1;
+    }
+
+    ctrl = _devices + _ndevices++;
+    _switch_ndevices++;
+
+    ctrl->dev_type = BDE_AXI_DEV_TYPE | BDE_SWITCH_DEV_TYPE | BDE_256K_REG_SPACE;
+    ctrl->pci_device = NULL; /* No PCI bus */
+    ctrl->sim = sim;
+    ctrl->bde_dev.base_address =
+        (sal_vaddr_t)lksim_regs(sim, &ctrl->phys_address);
+    ctrl->bde_dev.device = sim_devid;
+    ctrl->bde_dev.rev = sim_revid;
+    ctrl->iLine = -1;
+    ctrl->isr = NULL;
+    ctrl->isr_data = NULL;
+#ifdef LINUX_BDE_DMA_DEVICE_SUPPORT
+    ctrl->dma_dev = lksim_dma_dev(sim);
+#endif
+
+    gprintk("Simulated device 0x%x:0x%x at 0x%lx\n",
+            ctrl->bde_dev.device, ctrl->bde_dev.rev,
+            (unsigned long)ctrl->phys_address);
+    return 0;
+}
+#endif /* BDE_SIM_SUPPORT */
+
 
 #ifdef BCM_ROBO_SUPPORT
 
@@ -3694,6 +4062,18 @@ _init(void)
             tok = strtok(NULL,",");
         }
     }
+
+#ifdef BDE_SIM_SUPPORT
+    if (sim_devices > 0) {
+        int i;
+
+        for (i = 0; i < sim_devices; i++) {
+            if (_sim_device_create() < 0) {
+                break;
+            }
+        }
+    }
+#endif
     
     _dma_init(robo_switch);
 
@@ -3721,14 +4101,52 @@ _init(void)
         }
     }
 
+#ifdef BDE_INTR_POLL_SUPPORT
+    if (intr_poll_usecs > 0 && intr_poll_usecs < BDE_INTR_POLL_MIN_USECS) {
+        gprintk("intr_poll_usecs raised to %d\n", BDE_INTR_POLL_MIN_USECS);
+        intr_poll_usecs = BDE_INTR_POLL_MIN_USECS;
+    }
+#endif
+#ifdef BDE_SIM_SUPPORT
+    if (sim_poll_usecs < BDE_INTR_POLL_MIN_USECS) {
+        gprintk("sim_poll_usecs raised to %d\n", BDE_INTR_POLL_MIN_USECS);
+        sim_poll_usecs = BDE_INTR_POLL_MIN_USECS;
+    }
+#endif
+
     /* Initialize device locks */
     if (_ndevices > 0) {
         int i;
 
         for (i = 0; i < _ndevices; i++) {
             spin_lock_init(&_devices[i].lock);
+            spin_lock_init(&_devices[i].iproc_lock);
+            mutex_init(&_devices[i].intr_lock);
+#ifdef BDE_INTR_POLL_SUPPORT
+            _devices[i].poll_usecs = intr_poll_usecs;
+#endif
+#ifdef BDE_SIM_SUPPORT
+            if (_devices[i].sim) {
+                _devices[i].poll_usecs = sim_poll_usecs;
+            }
+#endif
+        }
+    }
+
+    /* Per-device DMA pools depend on the final device order */
+    _dma_dev_init();
+
+#ifdef BDE_SIM_SUPPORT
+    if (sim_selftest) {
+        int i;
+
+        for (i = 0; i < _ndevices; i++) {
+            if (_devices[i].sim) {
+                _sim_poll_selftest(i);
+            }
         }
     }
+#endif
 
     return 0;
 }
@@ -3750,6 +4168,21 @@ _cleanup(void)
 
     _dma_cleanup();
 
+#ifdef BDE_SIM_SUPPORT
+    for (i = 0; i < _ndevices; i++) {
+        bde_ctrl_t *ctrl = _devices + i;
+
+        if (ctrl->sim) {
+            if (ctrl->poll_active) {
+                hrtimer_cancel(&ctrl->poll_timer);
+                ctrl->poll_active = 0;
+            }
+            lksim_destroy(ctrl->sim);
+            ctrl->sim = NULL;
+        }
+    }
+#endif
+
 #ifdef IPROC_CMICD
     if (iproc_has_cmicd()) {
 #ifdef CONFIG_OF
@@ -3822,6 +4255,16 @@ _pprint(void)
     pprintf("Broadcom Device Enumerator (%s)\n", LINUX_KERNEL_BDE_NAME);
 
     _dma_pprint();
+#if USE_LINUX_BDE_MMAP
+    {
+        unsigned long page_size, huge_faults, page_faults;
+
+        lkbde_get_dma_mmap_info(&page_size, &huge_faults, &page_faults);
+        pprintf("DMA mmap: %lu KB pages, %lu huge pages mapped, "
+                "%lu pages mapped on demand\n",
+                page_size / 1024, huge_faults, page_faults);
+    }
+#endif
 
     if (_ndevices == 0) {
         pprintf("No devices found\n");
@@ -3856,6 +4299,7 @@ _pprint(void)
                     (unsigned long)pci_resource_start(ctrl->pci_device, 0),
                     (unsigned long)pci_resource_start(ctrl->pci_device, 2),
                     ctrl->pci_device->irq,
+                    ctrl->use_msi == PCI_USE_INT_MSIX ? " (MSI-X)" :
                     ctrl->use_msi ? " (MSI)" : "");
         } else if (ctrl->dev_type & BDE_SPI_DEV_TYPE) {
             pprintf("SPI Device %d:%x:%x:0x%x:0x%x:%d\n",
@@ -3869,6 +4313,13 @@ _pprint(void)
             pprintf("ICS Device 0x%x:0x%x\n",
                     ctrl->bde_dev.device,
                     ctrl->bde_dev.rev);
+#ifdef BDE_SIM_SUPPORT
+        } else if (ctrl->sim) {
+            pprintf("Simulated CMICx Device 0x%x:0x%x:0x%.8lx\n",
+                    ctrl->bde_dev.device,
+                    ctrl->bde_dev.rev,
+                    (unsigned long)ctrl->phys_address);
+#endif
         } else if (ctrl->dev_type & BDE_AXI_DEV_TYPE) {
             pprintf("AXI Device 0x%x:0x%x:0x%.8lx:%d\n",
                     ctrl->bde_dev.device,
@@ -3880,6 +4331,35 @@ _pprint(void)
                     ctrl->bde_dev.device,
                     ctrl->bde_dev.rev);
         }
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+        if (ctrl->use_msi == PCI_USE_INT_MSIX && ctrl->msix_cnt > 0 &&
+            (ctrl->isr || ctrl->isr2)) {
+            int v;
+
+            for (v = 0; v < ctrl->msix_cnt; v++) {
+                pprintf("\t\tMSI-X %d: irq %d cpu %d count %ld%s\n", v,
+                        ctrl->entries[v].vector,
+                        ctrl->msix_vec[v].cpu,
+                        atomic_long_read(&ctrl->msix_vec[v].count),
+                        ctrl->msix_vec[v].isr ? " (source handler)" : "");
+            }
+        }
+#endif
+#ifdef BDE_INTR_POLL_SUPPORT
+        if (ctrl->poll_active) {
+            pprintf("\t\tInterrupt polling every %d us, %lu polls\n",
+                    ctrl->poll_usecs, ctrl->poll_count);
+        }
+#endif
+#ifdef BDE_SIM_SUPPORT
+        if (ctrl->sim) {
+            lksim_pprint(ctrl->sim);
+        }
+#endif
+        if (ctrl->iproc_accesses) {
+            pprintf("\t\tiProc accesses %lu, sub-window updates %u\n",
+                    ctrl->iproc_accesses, ctrl->shbde.subwin_switches);
+        }
         if (debug >= 1) {
             pprintf("\t\timask:imask2:fmask 0x%x:0x%x:0x%x\n",
                     ctrl->imask,
@@ -3891,50 +4371,184 @@ _pprint(void)
 }
 
 #if USE_LINUX_BDE_MMAP
+#ifdef BDE_MMAP_HUGE_SUPPORT
 /*
- * Some kernels (mainly x86) prevent mapping of kernel RAM memory to
- * user space via the /dev/mem device. The function below provides a
- * backdoor to mapping the DMA pool to user space via the
- * /dev/linux-kernel-bde device.
+ * DMA mmap with huge pages
+ *
+ * The mapping is populated on demand. The huge_fault handler inserts a
+ * PMD mapping whenever the 2MB virtual range is fully inside the VMA and
+ * maps a 2MB aligned physical range. Everything else falls back to the
+ * regular fault handler, which inserts a single page.
  */
-static int _mmap(struct file *filp, struct vm_area_struct *vma)
+static vm_fault_t
+_mmap_fault(struct vm_fault *vmf)
 {
-    unsigned long phys_addr = vma->vm_pgoff << PAGE_SHIFT;
-    unsigned long size = vma->vm_end - vma->vm_start;
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long pfn;
 
-    if(!_dma_range_valid(phys_addr, size)) {
-        return -EINVAL;
-    }
+    pfn = vma->vm_pgoff + ((vmf->address - vma->vm_start) >> PAGE_SHIFT);
+    _mmap_page_faults++;
+    return vmf_insert_pfn(vma, vmf->address & PAGE_MASK, pfn);
+}
 
-#ifdef REMAP_DMA_NONCACHED
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-#endif
+static vm_fault_t
+_mmap_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long addr = vmf->address & PMD_MASK;
+    unsigned long pfn;
 
-    if (remap_pfn_range(vma,
-                        vma->vm_start,
-                        vma->vm_pgoff,
-                        size,
-                        vma->vm_page_prot)) {
-        gprintk("Failed to mmap phys range 0x%lx-0x%lx to 0x%lx-0x%lx\n",
-                phys_addr, phys_addr + size, vma->vm_start,vma->vm_end);
-        return -EAGAIN;
+    if (order != PMD_ORDER) {
+        return VM_FAULT_FALLBACK;
     }
-
-    return 0;
+    if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end) {
+        return VM_FAULT_FALLBACK;
+    }
+    pfn = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    if (pfn & ((PMD_SIZE >> PAGE_SHIFT) - 1)) {
+        return VM_FAULT_FALLBACK;
+    }
+    _mmap_huge_faults++;
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn),
+                              vmf->flags & FAULT_FLAG_WRITE);
 }
-#endif /* USE_LINUX_BDE_MMAP */
 
-/* Workaround for broken Busybox/PPC insmod */
-static char _modname[] = LINUX_KERNEL_BDE_NAME;
+static const struct vm_operations_struct _mmap_huge_ops = {
+    fault: _mmap_fault,
+    huge_fault: _mmap_huge_fault,
+};
 
-static gmodule_t _gmodule = {
-    name: LINUX_KERNEL_BDE_NAME,
-    major: LINUX_KERNEL_BDE_MAJOR,
-    init: _init,
+/*
+ * Align the user address with the physical address modulo PMD_SIZE,
+ * otherwise no PMD mapping can be used.
+ */
+static unsigned long
+_get_unmapped_area(struct file *filp, unsigned long addr, unsigned long len,
+                   unsigned long pgoff, unsigned long flags)
+{
+    /* Handles alignment and fallback for any file */
+    return thp_get_unmapped_area(filp, addr, len, pgoff, flags);
+}
+#endif /* BDE_MMAP_HUGE_SUPPORT */
+
+/*
+ * Function: lkbde_get_dma_mmap_info
+ *
+ * Purpose:
+ *    Report how DMA memory is mapped to user space.
+ * Parameters:
+ *    page_size - (OUT) largest page size used by DMA mmap so far
+ *    huge_faults - (OUT) number of huge pages mapped
+ *    page_faults - (OUT) number of regular pages mapped on demand
+ * Returns:
+ *    Always 0
+ * Notes:
+ *    Private, small or unaligned mappings fall back to regular pages
+ *    even when dma_mmap_huge is set, so PMD_SIZE is only reported once
+ *    a huge page has actually been mapped. The values cover all DMA
+ *    mappings, not a particular one.
+ */
+int
+lkbde_get_dma_mmap_info(unsigned long *page_size,
+                        unsigned long *huge_faults, unsigned long *page_faults)
+{
+    *page_size = PAGE_SIZE;
+#ifdef BDE_MMAP_HUGE_SUPPORT
+    if (_mmap_huge_faults) {
+        *page_size = PMD_SIZE;
+    }
+#endif
+    *huge_faults = _mmap_huge_faults;
+    *page_faults = _mmap_page_faults;
+    return 0;
+}
+
+/*
+ * Function: lkbde_dma_mmap
+ *
+ * Purpose:
+ *    Map part of the DMA pool to user space.
+ * Parameters:
+ *    vma - user mapping, vm_pgoff is the cpu physical page of the pool
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    Also used by the user mode BDE to map per-instance DMA windows.
+ */
+int
+lkbde_dma_mmap(struct vm_area_struct *vma)
+{
+    unsigned long phys_addr = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int rv;
+
+    if(!_dma_range_valid(phys_addr, size)) {
+        return -EINVAL;
+    }
+
+#ifdef REMAP_DMA_NONCACHED
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+#endif
+
+    /* Pools made of scattered pages are not physically contiguous */
+    rv = _dma_sg_mmap(vma);
+    if (rv <= 0) {
+        return rv;
+    }
+
+#ifdef BDE_MMAP_HUGE_SUPPORT
+    /*
+     * Private (copy-on-write) mappings cannot use vmf_insert_pfn, so
+     * they are always set up by remap_pfn_range.
+     */
+    if (dma_mmap_huge && size >= PMD_SIZE && (vma->vm_flags & VM_SHARED)) {
+        /* Same flags as remap_pfn_range, but populated on fault */
+        vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP |
+                     VM_HUGEPAGE);
+        vma->vm_ops = &_mmap_huge_ops;
+        return 0;
+    }
+#endif
+
+    if (remap_pfn_range(vma,
+                        vma->vm_start,
+                        vma->vm_pgoff,
+                        size,
+                        vma->vm_page_prot)) {
+        gprintk("Failed to mmap phys range 0x%lx-0x%lx to 0x%lx-0x%lx\n",
+                phys_addr, phys_addr + size, vma->vm_start,vma->vm_end);
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+/*
+ * Some kernels (mainly x86) prevent mapping of kernel RAM memory to
+ * user space via the /dev/mem device. The function below provides a
+ * backdoor to mapping the DMA pool to user space via the
+ * /dev/linux-kernel-bde device.
+ */
+static int _mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    return lkbde_dma_mmap(vma);
+}
+#endif /* USE_LINUX_BDE_MMAP */
+
+/* Workaround for broken Busybox/PPC insmod */
+static char _modname[] = LINUX_KERNEL_BDE_NAME;
+
+static gmodule_t _gmodule = {
+    name: LINUX_KERNEL_BDE_NAME,
+    major: LINUX_KERNEL_BDE_MAJOR,
+    init: _init,
     cleanup: _cleanup,
     pprint: _pprint,
 #if USE_LINUX_BDE_MMAP
     mmap: _mmap,
+#ifdef BDE_MMAP_HUGE_SUPPORT
+    get_unmapped_area: _get_unmapped_area,
+#endif
 #endif
 };
 
@@ -4162,62 +4776,23 @@ _isr(_ISR_PARAMS(irq, dev_id, iregs))
     return IRQ_HANDLED;
 }
 
+/*
+ * Function: _irq_acquire
+ *
+ * Purpose:
+ *    Enable MSI/MSI-X if configured and install the interrupt handler.
+ * Parameters:
+ *    ctrl - device
+ *    d - device number
+ * Returns:
+ *    0 on success, -1 on error
+ */
 static int
-_interrupt_connect(int d,
-                   void (*isr)(void *),
-                   void *isr_data)
+_irq_acquire(bde_ctrl_t *ctrl, int d)
 {
-    bde_ctrl_t *ctrl;
     unsigned long irq_flags;
-    int isr2_dev;
-    int isr_active;
     int ret = 0;
 
-    isr2_dev = d & LKBDE_ISR2_DEV;
-    d &= ~LKBDE_ISR2_DEV;
-
-    if (!VALID_DEVICE(d)) {
-        gprintk("_interrupt_connect: Invalid device index %d\n", d);
-        return -1;
-    }
-    if (debug >= 1) {
-        gprintk("_interrupt_connect d %d\n", d);
-    }
-    if (!(BDE_DEV_MEM_MAPPED(_devices[d].dev_type))) {
-        gprintk("_interrupt_connect: Not PCI device %d, type %x\n",
-                d, _devices[d].dev_type);
-        return -1;
-    }
-
-    ctrl = _devices + d;
-
-    isr_active = (ctrl->isr || ctrl->isr2) ? 1 : 0;
-
-    if (unlikely(debug > 1))
-        gprintk("%s:isr_active = %d\n", __func__, isr_active);
-
-    if (isr2_dev) {
-        if (debug >= 1) {
-            gprintk("connect secondary isr\n");
-        }
-        ctrl->isr2_data = isr_data;
-        ctrl->isr2 = isr;
-        if (isr_active) {
-            /* Main handler (_isr) already installed */
-            return 0;
-        }
-    } else {
-        if (debug >= 1) {
-            gprintk("connect primary isr\n");
-        }
-        ctrl->isr = isr;
-        ctrl->isr_data = isr_data;
-        if (isr_active) {
-            /* Main handler (_isr) already installed */
-            return 0;
-        }
-    }
-
     if (ctrl->iLine != -1) {
         irq_flags = IRQF_SHARED;
 #ifdef CONFIG_PCI_MSI
@@ -4229,17 +4804,8 @@ _interrupt_connect(int d,
 #endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
         if (ctrl->use_msi == PCI_USE_INT_MSIX) {
-            int i;
-            for (i = 0; i < ctrl->msix_cnt; i++) {
-                 ret = request_irq(ctrl->entries[i].vector, _isr,
-                       irq_flags, LINUX_KERNEL_BDE_NAME, ctrl);
-                 if (ret < 0)
-                     break;
-            }
+            ret = _msix_request_irqs(ctrl, d);
             if (ret < 0) {
-                while (i >= 0)
-                    free_irq(ctrl->entries[i--].vector, ctrl->pci_device);
-
                 goto err_disable_msi;
             }
         }
@@ -4266,38 +4832,266 @@ err_disable_msi:
 msi_exit:
 #endif
      gprintk("could not request IRQ\n");
-            ctrl->isr = NULL;
-            ctrl->isr_data = NULL;
-            ctrl->isr2 = NULL;
-            ctrl->isr2_data = NULL;
+     return -1;
+}
 
+/*
+ * Function: _irq_release
+ *
+ * Purpose:
+ *    Remove the interrupt handler and disable MSI/MSI-X.
+ * Parameters:
+ *    ctrl - device
+ * Returns:
+ *    Nothing
+ */
+static void
+_irq_release(bde_ctrl_t *ctrl)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    if (ctrl->use_msi >= PCI_USE_INT_MSIX) {
+        _msix_free_irqs(ctrl);
+    }
+    else
+#endif
+    {
+        free_irq(ctrl->iLine, ctrl);
+    }
+#ifdef CONFIG_PCI_MSI
+    if (ctrl->use_msi >= PCI_USE_INT_MSI) {
+        _msi_disconnect(ctrl);
+    }
+#endif
+}
+
+#ifdef BDE_INTR_POLL_SUPPORT
+/*
+ * Interrupt polling
+ *
+ * In polling mode the device interrupt is not requested. An hrtimer
+ * instead calls the device handlers every poll_usecs microseconds,
+ * exactly as _isr would. The handlers read the interrupt status
+ * registers and return when nothing is pending.
+ *
+ * For a simulated device each poll first runs the device model, and
+ * the handlers are only called if it raised an enabled interrupt.
+ */
+static void
+_intr_poll_once(bde_ctrl_t *ctrl)
+{
+    ctrl->poll_count++;
+#ifdef BDE_SIM_SUPPORT
+    if (ctrl->sim && !lksim_run(ctrl->sim)) {
+        return;
+    }
+#endif
+    if (ctrl->isr) {
+        ctrl->isr(ctrl->isr_data);
+    }
+    if (ctrl->isr2) {
+        ctrl->isr2(ctrl->isr2_data);
+    }
+}
+
+static enum hrtimer_restart
+_intr_poll(struct hrtimer *timer)
+{
+    bde_ctrl_t *ctrl = container_of(timer, bde_ctrl_t, poll_timer);
+
+    _intr_poll_once(ctrl);
+    hrtimer_forward_now(timer, ns_to_ktime((u64)ctrl->poll_usecs * 1000));
+    return HRTIMER_RESTART;
+}
+
+static void
+_intr_poll_start(bde_ctrl_t *ctrl)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0))
+    hrtimer_setup(&ctrl->poll_timer, _intr_poll,
+                  CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&ctrl->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ctrl->poll_timer.function = _intr_poll;
+#endif
+    ctrl->poll_active = 1;
+    hrtimer_start(&ctrl->poll_timer,
+                  ns_to_ktime((u64)ctrl->poll_usecs * 1000), HRTIMER_MODE_REL);
+}
+
+static void
+_intr_poll_stop(bde_ctrl_t *ctrl)
+{
+    hrtimer_cancel(&ctrl->poll_timer);
+    ctrl->poll_active = 0;
+}
+
+/*
+ * Switch interrupt mode of a device. Assumes intr_lock of the device
+ * is held.
+ */
+static int
+_intr_poll_set(bde_ctrl_t *ctrl, int d, int usecs)
+{
+    unsigned long flags;
+
+    if ((ctrl->isr == NULL && ctrl->isr2 == NULL) ||
+        (usecs > 0 && ctrl->poll_active)) {
+        /* Takes effect on connect, or on the next poll */
+        ctrl->poll_usecs = usecs;
+        return 0;
+    }
+    if (usecs > 0) {
+        _irq_release(ctrl);
+        ctrl->poll_usecs = usecs;
+        _intr_poll_start(ctrl);
+    } else if (ctrl->poll_active) {
+        _intr_poll_stop(ctrl);
+        ctrl->poll_usecs = 0;
+        if (_irq_acquire(ctrl, d) < 0) {
+            /* Keep the device serviced */
+            gprintk("Device %d: staying in polling mode\n", d);
+            ctrl->poll_usecs = intr_poll_usecs > 0 ? intr_poll_usecs : 1000;
+            _intr_poll_start(ctrl);
             return -1;
         }
+        local_irq_save(flags);
+        _intr_poll_once(ctrl);
+        local_irq_restore(flags);
+    }
+    return 0;
+}
 
-static int
-_interrupt_disconnect(int d)
+/*
+ * Function: lkbde_intr_poll_set
+ *
+ * Purpose:
+ *    Switch a device between interrupt and polling mode.
+ * Parameters:
+ *    d - device number
+ *    usecs - poll interval in microseconds, 0 to use the interrupt
+ * Returns:
+ *    0 on success, -1 on error, including intervals below
+ *    BDE_INTR_POLL_MIN_USECS
+ * Notes:
+ *    May sleep. Anything which became pending while switching to
+ *    interrupt mode is dispatched once the interrupt is installed,
+ *    since an MSI will not be raised again for it. Source handlers
+ *    of MSI-X vectors stay connected across the switch.
+ */
+int
+lkbde_intr_poll_set(int d, int usecs)
 {
     bde_ctrl_t *ctrl;
-    int isr2_dev;
+    int rv;
+
+    if (!VALID_DEVICE(d) || usecs < 0 ||
+        (usecs > 0 && usecs < BDE_INTR_POLL_MIN_USECS)) {
+        return -1;
+    }
+    ctrl = _devices + d;
+    if (!BDE_DEV_MEM_MAPPED(ctrl->dev_type)) {
+        return -1;
+    }
+#ifdef BDE_SIM_SUPPORT
+    if (ctrl->sim && usecs == 0) {
+        /* Simulated devices have no interrupt line */
+        return -1;
+    }
+#endif
+    mutex_lock(&ctrl->intr_lock);
+    rv = _intr_poll_set(ctrl, d, usecs);
+    mutex_unlock(&ctrl->intr_lock);
+    return rv;
+}
+#else
+int
+lkbde_intr_poll_set(int d, int usecs)
+{
+    return (usecs == 0) ? 0 : -1;
+}
+#endif /* BDE_INTR_POLL_SUPPORT */
+
+/*
+ * Function: lkbde_intr_poll_get
+ *
+ * Purpose:
+ *    Get the interrupt polling interval of a device.
+ * Parameters:
+ *    d - device number
+ * Returns:
+ *    Poll interval in microseconds if the device is being polled,
+ *    0 otherwise
+ */
+int
+lkbde_intr_poll_get(int d)
+{
+#ifdef BDE_INTR_POLL_SUPPORT
+    if (VALID_DEVICE(d) && _devices[d].poll_active) {
+        return _devices[d].poll_usecs;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Connect interrupt handler. Assumes intr_lock of the device is held.
+ */
+static int
+_intr_connect(bde_ctrl_t *ctrl, int d, int isr2_dev,
+              void (*isr)(void *), void *isr_data)
+{
     int isr_active;
 
-    isr2_dev = d & LKBDE_ISR2_DEV;
-    d &= ~LKBDE_ISR2_DEV;
+    isr_active = (ctrl->isr || ctrl->isr2) ? 1 : 0;
 
-    if (!VALID_DEVICE(d)) {
-        return -1;
+    if (unlikely(debug > 1))
+        gprintk("%s:isr_active = %d\n", __func__, isr_active);
+
+    if (isr2_dev) {
+        if (debug >= 1) {
+            gprintk("connect secondary isr\n");
+        }
+        ctrl->isr2_data = isr_data;
+        ctrl->isr2 = isr;
+        if (isr_active) {
+            /* Main handler (_isr) already installed */
+            return 0;
+        }
+    } else {
+        if (debug >= 1) {
+            gprintk("connect primary isr\n");
+        }
+        ctrl->isr = isr;
+        ctrl->isr_data = isr_data;
+        if (isr_active) {
+            /* Main handler (_isr) already installed */
+            return 0;
+        }
     }
 
-    if (debug >= 1) {
-        gprintk("_interrupt_disconnect d %d\n", d);
+#ifdef BDE_INTR_POLL_SUPPORT
+    if (ctrl->poll_usecs > 0) {
+        _intr_poll_start(ctrl);
+        return 0;
     }
-    if (!(BDE_DEV_MEM_MAPPED(_devices[d].dev_type))) {
-        gprintk("_interrupt_disconnect: Not PCI device %d, type %x\n",
-                d, _devices[d].dev_type);
+#endif
+    if (_irq_acquire(ctrl, d) < 0) {
+        ctrl->isr = NULL;
+        ctrl->isr_data = NULL;
+        ctrl->isr2 = NULL;
+        ctrl->isr2_data = NULL;
         return -1;
     }
+    return 0;
+}
 
-    ctrl = _devices + d;
+/*
+ * Disconnect interrupt handler. Assumes intr_lock of the device is held.
+ */
+static int
+_intr_disconnect(bde_ctrl_t *ctrl, int isr2_dev)
+{
+    int isr_active;
 
     isr_active = (ctrl->isr || ctrl->isr2) ? 1 : 0;
 
@@ -4313,7 +5107,7 @@ _interrupt_disconnect(int d)
         ctrl->fmask = 0;
         if (ctrl->isr) {
             /* Primary handler still active */
-            SYNC_IRQ(ctrl->iLine); 
+            _irq_sync(ctrl);
             return 0;
         }
     } else {
@@ -4324,33 +5118,173 @@ _interrupt_disconnect(int d)
         ctrl->isr_data = NULL;
         if (ctrl->isr2) {
             /* Secondary handler still active */
-            SYNC_IRQ(ctrl->iLine); 
+            _irq_sync(ctrl);
             return 0;
         }
     }
 
     if (isr_active) {
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
-        if (ctrl->use_msi >= PCI_USE_INT_MSIX) {
-            int i;
-            for (i = 0; i < ctrl->msix_cnt; i++)
-                free_irq(ctrl->entries[i].vector, ctrl->pci_device);
+#ifdef BDE_INTR_POLL_SUPPORT
+        if (ctrl->poll_active) {
+            _intr_poll_stop(ctrl);
         }
         else
 #endif
         {
-        free_irq(ctrl->iLine, ctrl);
+            _irq_release(ctrl);
         }
-#ifdef CONFIG_PCI_MSI
-        if (ctrl->use_msi >= PCI_USE_INT_MSI) {
-            _msi_disconnect(ctrl);
-        }
-#endif
     }
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    /* Source handlers are disconnected with the device interrupt */
+    _msix_sources_reset(ctrl);
+#endif
 
     return 0;
 }
 
+static int
+_interrupt_connect(int d,
+                   void (*isr)(void *),
+                   void *isr_data)
+{
+    bde_ctrl_t *ctrl;
+    int isr2_dev;
+    int rv;
+
+    isr2_dev = d & LKBDE_ISR2_DEV;
+    d &= ~LKBDE_ISR2_DEV;
+
+    if (!VALID_DEVICE(d)) {
+        gprintk("_interrupt_connect: Invalid device index %d\n", d);
+        return -1;
+    }
+    if (debug >= 1) {
+        gprintk("_interrupt_connect d %d\n", d);
+    }
+    if (!(BDE_DEV_MEM_MAPPED(_devices[d].dev_type))) {
+        gprintk("_interrupt_connect: Not PCI device %d, type %x\n",
+                d, _devices[d].dev_type);
+        return -1;
+    }
+
+    ctrl = _devices + d;
+
+    mutex_lock(&ctrl->intr_lock);
+    rv = _intr_connect(ctrl, d, isr2_dev, isr, isr_data);
+    mutex_unlock(&ctrl->intr_lock);
+    return rv;
+}
+
+static int
+_interrupt_disconnect(int d)
+{
+    bde_ctrl_t *ctrl;
+    int isr2_dev;
+    int rv;
+
+    isr2_dev = d & LKBDE_ISR2_DEV;
+    d &= ~LKBDE_ISR2_DEV;
+
+    if (!VALID_DEVICE(d)) {
+        return -1;
+    }
+
+    if (debug >= 1) {
+        gprintk("_interrupt_disconnect d %d\n", d);
+    }
+    if (!(BDE_DEV_MEM_MAPPED(_devices[d].dev_type))) {
+        gprintk("_interrupt_disconnect: Not PCI device %d, type %x\n",
+                d, _devices[d].dev_type);
+        return -1;
+    }
+
+    ctrl = _devices + d;
+
+    mutex_lock(&ctrl->intr_lock);
+    rv = _intr_disconnect(ctrl, isr2_dev);
+    mutex_unlock(&ctrl->intr_lock);
+    return rv;
+}
+
+#ifdef BDE_SIM_SUPPORT
+/* Time the poll timer runs in each step of the self-test */
+#define SIM_SELFTEST_MSECS      20
+
+static atomic_t _sim_selftest_calls;
+
+static void
+_sim_selftest_isr(void *isr_data)
+{
+    atomic_inc(&_sim_selftest_calls);
+}
+
+/*
+ * Function: _sim_poll_selftest
+ *
+ * Purpose:
+ *    Test interrupt polling against a simulated device.
+ * Parameters:
+ *    d - device number
+ * Returns:
+ *    0 if the test passed, -1 otherwise
+ * Notes:
+ *    Runs at module load (sim_selftest=1), before any handler is
+ *    connected. Checks that intervals below BDE_INTR_POLL_MIN_USECS
+ *    are rejected, that an idle device is polled without calling the
+ *    handler, and that an interrupt raised by the device model is
+ *    dispatched by the poll timer. The result is logged.
+ */
+static int
+_sim_poll_selftest(int d)
+{
+    bde_ctrl_t *ctrl = _devices + d;
+    unsigned long polls;
+    int calls, rv = 0;
+
+    if (lkbde_intr_poll_set(d, BDE_INTR_POLL_MIN_USECS - 1) == 0) {
+        gprintk("Device %d: poll interval below %d us accepted\n",
+                d, BDE_INTR_POLL_MIN_USECS);
+        rv = -1;
+    }
+
+    atomic_set(&_sim_selftest_calls, 0);
+    polls = ctrl->poll_count;
+    if (_interrupt_connect(d, _sim_selftest_isr, NULL) < 0) {
+        gprintk("Device %d: interrupt poll self-test FAILED, "
+                "unable to connect handler\n", d);
+        return -1;
+    }
+
+    /* Idle device */
+    msleep(SIM_SELFTEST_MSECS);
+    if (ctrl->poll_count == polls) {
+        gprintk("Device %d: poll timer not running\n", d);
+        rv = -1;
+    }
+    calls = atomic_read(&_sim_selftest_calls);
+    if (calls) {
+        gprintk("Device %d: handler called %d times without interrupt\n",
+                d, calls);
+        rv = -1;
+    }
+
+    /* Pending interrupt */
+    lksim_irq_force(ctrl->sim, 1);
+    msleep(SIM_SELFTEST_MSECS);
+    lksim_irq_force(ctrl->sim, 0);
+    _interrupt_disconnect(d);
+    if (atomic_read(&_sim_selftest_calls) == calls) {
+        gprintk("Device %d: pending interrupt not dispatched\n", d);
+        rv = -1;
+    }
+
+    gprintk("Device %d: interrupt poll self-test %s, %lu polls, "
+            "%d handler calls\n", d, rv ? "FAILED" : "passed",
+            ctrl->poll_count - polls, atomic_read(&_sim_selftest_calls));
+    return rv;
+}
+#endif /* BDE_SIM_SUPPORT */
+
 static uint32_t
 _iproc_ihost_read(int d, uint32_t addr)
 {
@@ -4381,6 +5315,10 @@ _iproc_ihost_write(int d, uint32_t addr, uint32_t data)
 static uint32_t
 _iproc_read(int d, uint32_t addr)
 {
+    bde_ctrl_t *ctrl;
+    unsigned long flags;
+    uint32_t data;
+
     if (!VALID_DEVICE(d)) {
         return -1;
     }
@@ -4389,18 +5327,36 @@ _iproc_read(int d, uint32_t addr)
         return -1;
     }
 
+#ifdef BDE_SIM_SUPPORT
+    if (_devices[d].sim) {
+        return lksim_iproc_read(_devices[d].sim, addr);
+    }
+#endif
+
     if (_devices[d].dev_type & BDE_AXI_DEV_TYPE) {
         return _iproc_ihost_read(d, addr);
     }
 
-    return shbde_iproc_pci_read(&_devices[d].shbde,
-                                (void *)_devices[d].bde_dev.base_address1,
+    ctrl = _devices + d;
+
+    /* Sub-window and register access must not be interleaved */
+    spin_lock_irqsave(&ctrl->iproc_lock, flags);
+    shbde_iproc_subwin_flush(&ctrl->shbde);
+    data = shbde_iproc_pci_read(&ctrl->shbde,
+                                (void *)ctrl->bde_dev.base_address1,
                                 addr);
+    ctrl->iproc_accesses++;
+    spin_unlock_irqrestore(&ctrl->iproc_lock, flags);
+
+    return data;
 }
 
 static int
 _iproc_write(int d, uint32_t addr, uint32_t data)
 {
+    bde_ctrl_t *ctrl;
+    unsigned long flags;
+
     if (!VALID_DEVICE(d)) {
         return -1;
     }
@@ -4409,13 +5365,155 @@ _iproc_write(int d, uint32_t addr, uint32_t data)
         return -1;
     }
 
+#ifdef BDE_SIM_SUPPORT
+    if (_devices[d].sim) {
+        lksim_iproc_write(_devices[d].sim, addr, data);
+        return 0;
+    }
+#endif
+
     if (_devices[d].dev_type & BDE_AXI_DEV_TYPE) {
         return _iproc_ihost_write(d, addr, data);
     }
 
-    shbde_iproc_pci_write(&_devices[d].shbde,
-                          (void *)_devices[d].bde_dev.base_address1,
+    ctrl = _devices + d;
+
+    spin_lock_irqsave(&ctrl->iproc_lock, flags);
+    shbde_iproc_subwin_flush(&ctrl->shbde);
+    shbde_iproc_pci_write(&ctrl->shbde,
+                          (void *)ctrl->bde_dev.base_address1,
                           addr, data);
+    ctrl->iproc_accesses++;
+    spin_unlock_irqrestore(&ctrl->iproc_lock, flags);
+
+    return 0;
+}
+
+/* iProc sub-window of an address */
+#define IPROC_SUBWIN(_addr)     ((_addr) & ~0xfff)
+
+/* Most bulk accesses done with interrupts disabled */
+#define IPROC_BULK_LOCK_MAX     64
+
+/*
+ * Function: lkbde_iproc_bulk
+ *
+ * Purpose:
+ *    Execute a set of iProc register accesses grouped by sub-window.
+ * Parameters:
+ *    d - device number
+ *    ops - access records, read results are returned in data
+ *    cnt - number of records
+ * Returns:
+ *    0 on success, -1 on error
+ * Notes:
+ *    The sub-windows are visited in ascending order, so each one is
+ *    programmed once. Accesses within a sub-window keep their order,
+ *    but accesses to different sub-windows may be reordered, so this
+ *    must not be used if they depend on each other.
+ *    For PCI devices iproc_lock is held for up to IPROC_BULK_LOCK_MAX
+ *    accesses to one sub-window, and the sub-window is programmed
+ *    again after the lock was released (see iproc_subwin_cache).
+ */
+int
+lkbde_iproc_bulk(int d, lkbde_iproc_op_t *ops, int cnt)
+{
+    bde_ctrl_t *ctrl;
+    void *regs = NULL;
+    unsigned long flags = 0;
+    uint32 win = 0, next, cur;
+    int i, done, first, locked;
+
+    if (!VALID_DEVICE(d) || ops == NULL || cnt < 0) {
+        return -1;
+    }
+
+    if (!(BDE_DEV_MEM_MAPPED(_devices[d].dev_type))) {
+        return -1;
+    }
+
+    ctrl = _devices + d;
+    if (!(ctrl->dev_type & BDE_AXI_DEV_TYPE)) {
+        /* PCI access through the PAXB sub-window */
+        regs = (void *)ctrl->bde_dev.base_address1;
+    }
+#ifdef BDE_SIM_SUPPORT
+    if (ctrl->sim) {
+        regs = NULL;
+    }
+#endif
+
+    for (done = 0, first = 1; done < cnt; first = 0) {
+        /* Find the lowest sub-window not visited yet */
+        next = ~0;
+        for (i = 0; i < cnt; i++) {
+            cur = IPROC_SUBWIN(ops[i].addr);
+            if ((first || cur > win) && cur <= next) {
+                next = cur;
+            }
+        }
+        win = next;
+        locked = 0;
+        for (i = 0; i < cnt; i++) {
+            if (IPROC_SUBWIN(ops[i].addr) != win) {
+                continue;
+            }
+            if (regs == NULL) {
+                if (ops[i].write) {
+                    _iproc_write(d, ops[i].addr, ops[i].data);
+                } else {
+                    ops[i].data = _iproc_read(d, ops[i].addr);
+                }
+                done++;
+                continue;
+            }
+            if (locked == 0) {
+                spin_lock_irqsave(&ctrl->iproc_lock, flags);
+                shbde_iproc_subwin_flush(&ctrl->shbde);
+            }
+            if (ops[i].write) {
+                shbde_iproc_pci_write(&ctrl->shbde, regs,
+                                      ops[i].addr, ops[i].data);
+            } else {
+                ops[i].data = shbde_iproc_pci_read(&ctrl->shbde, regs,
+                                                   ops[i].addr);
+            }
+            ctrl->iproc_accesses++;
+            done++;
+            if (++locked >= IPROC_BULK_LOCK_MAX) {
+                spin_unlock_irqrestore(&ctrl->iproc_lock, flags);
+                locked = 0;
+            }
+        }
+        if (locked) {
+            spin_unlock_irqrestore(&ctrl->iproc_lock, flags);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Function: lkbde_iproc_stats_get
+ *
+ * Purpose:
+ *    Get iProc register access statistics of a device.
+ * Parameters:
+ *    d - device number
+ *    accesses - (OUT) number of iProc accesses through PCI
+ *    switches - (OUT) number of PAXB sub-window updates
+ * Returns:
+ *    0 on success, -1 on error
+ */
+int
+lkbde_iproc_stats_get(int d, unsigned long *accesses, uint32 *switches)
+{
+    if (!VALID_DEVICE(d) || accesses == NULL || switches == NULL) {
+        return -1;
+    }
+
+    *accesses = _devices[d].iproc_accesses;
+    *switches = _devices[d].shbde.subwin_switches;
 
     return 0;
 }
@@ -5165,10 +6263,162 @@ lkbde_get_num_devices(int type)
     return _num_devices(type);
 }
 
+/*
+ * Function: _irq_source_vec
+ *
+ * Purpose:
+ *    Get the MSI-X vector dedicated to an interrupt source.
+ * Parameters:
+ *    d - device number
+ *    src - interrupt source (LKBDE_INTR_SRC_xxx)
+ * Returns:
+ *    MSI-X vector, or NULL if the source shares the device interrupt
+ */
+static bde_msix_vec_t *
+_irq_source_vec(int d, int src)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    bde_ctrl_t *ctrl;
+
+    if (!VALID_DEVICE(d) || src <= LKBDE_INTR_SRC_DEFAULT ||
+        src >= LKBDE_INTR_SRC_COUNT) {
+        return NULL;
+    }
+    ctrl = _devices + d;
+    if (ctrl->use_msi != PCI_USE_INT_MSIX || src >= ctrl->msix_cnt ||
+        (ctrl->isr == NULL && ctrl->isr2 == NULL)) {
+        return NULL;
+    }
+    return &ctrl->msix_vec[src];
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Function: lkbde_irq_source_connect
+ *
+ * Purpose:
+ *    Connect a handler to the MSI-X vector of an interrupt source.
+ * Parameters:
+ *    d - device number
+ *    src - interrupt source (LKBDE_INTR_SRC_xxx)
+ *    isr - handler
+ *    isr_data - handler argument
+ * Returns:
+ *    0 on success, -1 if the source has no vector of its own
+ * Notes:
+ *    The device interrupt must be connected first. The handler
+ *    replaces the device handlers for this vector, stays connected
+ *    while the device is polled, and is disconnected together with
+ *    the device interrupt.
+ */
+int
+lkbde_irq_source_connect(int d, int src, void (*isr)(void *), void *isr_data)
+{
+    bde_msix_vec_t *vec;
+
+    if (!VALID_DEVICE(d) || isr == NULL) {
+        return -1;
+    }
+    mutex_lock(&_devices[d].intr_lock);
+    vec = _irq_source_vec(d, src);
+    if (vec) {
+        vec->isr_data = isr_data;
+        smp_wmb();
+        vec->isr = isr;
+    }
+    mutex_unlock(&_devices[d].intr_lock);
+    return (vec) ? 0 : -1;
+}
+
+/*
+ * Function: lkbde_irq_source_disconnect
+ *
+ * Purpose:
+ *    Return an interrupt source to the device handlers.
+ * Parameters:
+ *    d - device number
+ *    src - interrupt source (LKBDE_INTR_SRC_xxx)
+ * Returns:
+ *    0 on success, -1 if the source has no vector of its own
+ */
+int
+lkbde_irq_source_disconnect(int d, int src)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    bde_msix_vec_t *vec;
+
+    if (!VALID_DEVICE(d)) {
+        return -1;
+    }
+    mutex_lock(&_devices[d].intr_lock);
+    vec = _irq_source_vec(d, src);
+    if (vec) {
+        vec->isr = NULL;
+        SYNC_IRQ(_devices[d].entries[src].vector);
+        vec->isr_data = NULL;
+    }
+    mutex_unlock(&_devices[d].intr_lock);
+    return (vec) ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Function: lkbde_irq_source_get
+ *
+ * Purpose:
+ *    Get the interrupt routing of an interrupt source.
+ * Parameters:
+ *    d - device number
+ *    src - interrupt source (LKBDE_INTR_SRC_xxx)
+ *    irq - (OUT) Linux IRQ number serving the source
+ *    cpu - (OUT) CPU the IRQ is steered to, -1 if not set
+ * Returns:
+ *    0 if the source has a vector of its own, -1 otherwise
+ * Notes:
+ *    irq and cpu are also filled in for shared sources when the
+ *    device is valid.
+ */
+int
+lkbde_irq_source_get(int d, int src, int *irq, int *cpu)
+{
+    bde_ctrl_t *ctrl;
+    bde_msix_vec_t *vec;
+
+    if (!VALID_DEVICE(d) || irq == NULL || cpu == NULL) {
+        return -1;
+    }
+    ctrl = _devices + d;
+    *irq = ctrl->iLine;
+    *cpu = -1;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    if (ctrl->use_msi == PCI_USE_INT_MSIX && ctrl->msix_cnt > 0) {
+        *irq = ctrl->entries[0].vector;
+        *cpu = ctrl->msix_vec[0].cpu;
+    }
+#endif
+    vec = _irq_source_vec(d, src);
+    if (vec == NULL) {
+        return -1;
+    }
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,84))
+    *irq = ctrl->entries[src].vector;
+    *cpu = vec->cpu;
+#endif
+    return 0;
+}
+
 /*
  * Export functions
  */
 LKM_EXPORT_SYM(linux_bde_create);
+#if USE_LINUX_BDE_MMAP
+LKM_EXPORT_SYM(lkbde_get_dma_mmap_info);
+LKM_EXPORT_SYM(lkbde_dma_mmap);
+#endif
 LKM_EXPORT_SYM(linux_bde_destroy);
 LKM_EXPORT_SYM(lkbde_get_dev_phys);
 LKM_EXPORT_SYM(lkbde_get_dev_virt);
@@ -5177,6 +6427,13 @@ LKM_EXPORT_SYM(lkbde_get_hw_dev);
 LKM_EXPORT_SYM(lkbde_get_dma_dev);
 LKM_EXPORT_SYM(lkbde_irq_mask_set);
 LKM_EXPORT_SYM(lkbde_irq_mask_get);
+LKM_EXPORT_SYM(lkbde_irq_source_connect);
+LKM_EXPORT_SYM(lkbde_irq_source_disconnect);
+LKM_EXPORT_SYM(lkbde_irq_source_get);
+LKM_EXPORT_SYM(lkbde_intr_poll_set);
+LKM_EXPORT_SYM(lkbde_intr_poll_get);
+LKM_EXPORT_SYM(lkbde_iproc_bulk);
+LKM_EXPORT_SYM(lkbde_iproc_stats_get);
 LKM_EXPORT_SYM(lkbde_get_dev_phys_hi);
 LKM_EXPORT_SYM(lkbde_dev_state_set);
 LKM_EXPORT_SYM(lkbde_dev_state_get);
@@ -59,6 +59,81 @@
  * The module parameter dmasize=0M enables this allocation mode, however if
  * DMA memory is requested from a user mode application, a private memory
  * pool will be created and used irrespectively.
+ *
+ * 4. Using the contiguous memory allocator (CMA)
+ * ----------------------------------------------
+ * In this mode the private pool is allocated in one piece through the DMA
+ * API, which takes large allocations from the CMA area reserved at boot.
+ * This avoids the slow assembly of large pools on fragmented systems. The
+ * CMA area must be large enough for the pool (cma=xxM kernel parameter).
+ *
+ * The module parameter dmaalloc=2 enables this allocation mode.
+ *
+ * 5. Using huge page sized blocks
+ * -------------------------------
+ * Like mode 1, but the pool is assembled from the largest blocks the page
+ * allocator can provide instead of 512KB blocks, which reduces the number
+ * of blocks and assembly rounds for large pools.
+ *
+ * The module parameter dmaalloc=3 enables this allocation mode.
+ *
+ * 6. Using a reserved memory region
+ * ---------------------------------
+ * Like mode 2, but the pool is placed at a fixed physical address, e.g. a
+ * region reserved with the memmap=xxM$yyy kernel parameter or a reserved
+ * memory node in the device tree. The region is never returned to the
+ * kernel, so the pool keeps its physical address and contents when the
+ * BDE modules are reloaded, and across kexec if the new kernel reserves
+ * the same region. This avoids reassembling the pool on warm boot and
+ * allocation failures caused by memory fragmentation.
+ *
+ * The module parameter dmabase=<physical address> enables this allocation
+ * mode. The pool size is given by dmasize as usual.
+ *
+ * 7. Using scattered pages behind an IOMMU
+ * ----------------------------------------
+ * In this mode the pool is built from pages which need not be physically
+ * contiguous. The pages are mapped into one virtually contiguous kernel
+ * address range, and into one contiguous IOVA range for each device
+ * through the IOMMU, which may differ between devices. Since no
+ * contiguous memory is needed, large pools can be allocated on systems
+ * with fragmented memory. Every device using the pool must be behind an
+ * IOMMU. User space must map the pool via the /dev/linux-kernel-bde
+ * device, the cpu physical address reported for the pool is only an
+ * mmap offset. The offset lies above any physical address, so it can
+ * never be confused with the range of a physically contiguous pool.
+ * This mode is therefore only available on 64-bit kernels which use
+ * the private BDE mmap (USE_LINUX_BDE_MMAP).
+ *
+ * The module parameter dmaalloc=4 enables this allocation mode.
+ *
+ *
+ * DMA memory pool placement
+ * =========================
+ *
+ * By default a single pool is shared by all devices. The module parameter
+ * dmapool=1 creates an additional pool of the same size for each device,
+ * and dmapool=2 creates one for each NUMA node with devices attached. The
+ * memory of these pools is allocated from the NUMA node of the device.
+ * The shared pool is still used by kmalloc_giant and is the pool returned
+ * by lkbde_get_dma_info.
+ *
+ *
+ * DMA memory accounting
+ * =====================
+ *
+ * Every allocation made through _salloc and kmalloc_giant is accounted
+ * to its owner, so the memory held by the kernel, the user mode BDE
+ * instances and KNET can be told apart. The owner counters are atomic
+ * and the size of a freed block is taken from the allocator, so the
+ * accounting takes no lock and allocates nothing. Owners that manage
+ * DMA memory of their own report it through lkbde_dma_owner_update.
+ * Pool, size class and owner statistics are shown in
+ * /proc/linux-kernel-bde as lines of the form "dma_<type> key=value ...".
+ *
+ * The module parameter dma_track=1 also records each allocation with
+ * its caller and lists all outstanding allocations, which helps to find
+ * DMA memory leaks.
  */
 
 #include <gmodule.h>
@@ -74,12 +149,31 @@
 /* allocation types/methods for the DMA memory pool */
 #define ALLOC_TYPE_CHUNK 0 /* use small allocations and join them */
 #define ALLOC_TYPE_API 1 /* use one allocation */
+#define ALLOC_TYPE_CMA 2 /* use one allocation from the CMA area */
+#define ALLOC_TYPE_HUGE 3 /* join huge page sized allocations */
+#define ALLOC_TYPE_SG 4 /* scattered pages mapped through the IOMMU */
+#if defined(CONFIG_DMA_CMA) && !_SIMPLE_MEMORY_ALLOCATION_
+#include <linux/dma-mapping.h>
+#endif
+
+/*
+ * Largest order the page allocator can provide. MAX_ORDER became
+ * inclusive in 6.4 and was renamed MAX_PAGE_ORDER in 6.8.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0))
+#define DMA_PAGE_ORDER_MAX  MAX_PAGE_ORDER
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0))
+#define DMA_PAGE_ORDER_MAX  MAX_ORDER
+#else
+#define DMA_PAGE_ORDER_MAX  (MAX_ORDER - 1)
+#endif
+
 #if _SIMPLE_MEMORY_ALLOCATION_
 #include <linux/dma-mapping.h>
 #if defined(IPROC_CMICD) && defined(CONFIG_CMA) && defined(CONFIG_CMA_SIZE_MBYTES)
 #define DMA_MAX_ALLOC_SIZE (CONFIG_CMA_SIZE_MBYTES * 1024 * 1024)
 #else
-#define DMA_MAX_ALLOC_SIZE (1 << (MAX_ORDER - 1 + PAGE_SHIFT)) /* Maximum size the kernel can allocate in one allocation */
+#define DMA_MAX_ALLOC_SIZE (1 << (DMA_PAGE_ORDER_MAX + PAGE_SHIFT)) /* Maximum size the kernel can allocate in one allocation */
 #endif
 #endif /* _SIMPLE_MEMORY_ALLOCATION_ */
 
@@ -101,8 +195,22 @@
 #define VIRT_TO_PAGE(p)     virt_to_page((p))
 #endif
 
+/*
+ * Scattered pools need sg_alloc_table_from_pages, and a private mmap
+ * since the pool cannot be mapped through /dev/mem.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)) && \
+    USE_LINUX_BDE_MMAP && defined(CONFIG_64BIT)
+#define DMA_SG_SUPPORT
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+
+/* mmap offset of scattered pools, above any cpu physical address */
+#define DMA_SG_MMAP_BASE    ((phys_addr_t)1 << 60)
+#endif
+
 #ifndef KMALLOC_MAX_SIZE
-#define KMALLOC_MAX_SIZE (1UL << (MAX_ORDER - 1 + PAGE_SHIFT))
+#define KMALLOC_MAX_SIZE (1UL << (DMA_PAGE_ORDER_MAX + PAGE_SHIFT))
 #endif
 
 /* Compatibility */
@@ -144,7 +252,7 @@ MODULE_PARM_DESC(dmasize,
 /* Select DMA memory pool allocation method */
 static int dmaalloc = ALLOC_METHOD_DEFAULT;
 LKM_MOD_PARAM(dmaalloc, "i", int, 0);
-MODULE_PARM_DESC(dmaalloc, "Select DMA memory allocation method");
+MODULE_PARM_DESC(dmaalloc, "Select DMA memory allocation method 0=chunk, 1=api, 2=cma, 3=huge, 4=sg");
 
 /* Use high memory for DMA */
 static char *himem;
@@ -152,6 +260,28 @@ LKM_MOD_PARAM(himem, "s", charp, 0);
 MODULE_PARM_DESC(himem,
 "Use high memory for DMA (default no)");
 
+/* Use reserved memory at a fixed physical address for DMA */
+static char *dmabase;
+LKM_MOD_PARAM(dmabase, "s", charp, 0);
+MODULE_PARM_DESC(dmabase,
+"Physical address of reserved DMA memory kept across module reloads (default none)");
+
+/* Record callers of DMA allocations */
+static int dma_track = 0;
+LKM_MOD_PARAM(dma_track, "i", int, 0);
+MODULE_PARM_DESC(dma_track,
+"Record DMA allocations with their callers and list them in proc (default 0)");
+
+/* DMA memory pool placement */
+#define DMA_POOL_SHARED 0 /* one pool shared by all devices */
+#define DMA_POOL_DEVICE 1 /* one pool per device */
+#define DMA_POOL_NODE   2 /* one pool per NUMA node */
+
+static int dmapool = DMA_POOL_SHARED;
+LKM_MOD_PARAM(dmapool, "i", int, 0);
+MODULE_PARM_DESC(dmapool,
+"DMA pool placement 0=shared, 1=per device, 2=per NUMA node (default 0)");
+
 /* DMA memory allocation */
 
 #define ONE_KB 1024
@@ -168,6 +298,19 @@ MODULE_PARM_DESC(himem,
 /* We try to assemble a contiguous segment from chunks of this size */
 #define DMA_BLOCK_SIZE (512 * ONE_KB)
 
+/*
+ * Chunk size for ALLOC_TYPE_HUGE, which is the largest block the page
+ * allocator can provide (4MB on x86, i.e. at least one huge page).
+ */
+#define DMA_HUGE_BLOCK_SIZE (PAGE_SIZE << DMA_PAGE_ORDER_MAX)
+#define DMA_HUGE_GFP_FLAGS  (GFP_KERNEL | __GFP_NOWARN)
+
+/*
+ * Largest chunk allocated for ALLOC_TYPE_SG. Larger chunks mean fewer
+ * scatterlist entries, smaller ones are used when memory is fragmented.
+ */
+#define DMA_SG_MAX_ORDER    (get_order(DMA_BLOCK_SIZE))
+
 typedef struct _dma_segment {
     struct list_head list;
     unsigned long req_size;     /* Requested DMA segment size */
@@ -179,22 +322,82 @@ typedef struct _dma_segment {
     unsigned long *blk_ptr;     /* Array of logical DMA block addresses */
     int blk_cnt_max;            /* Maximum number of block to allocate */
     int blk_cnt;                /* Current number of blocks allocated */
+    int node;                   /* NUMA node to allocate blocks from */
+    gfp_t gfp;                  /* Flags for block allocations */
+    int rounds;                 /* Assembly rounds needed */
+    int blk_used;               /* Blocks kept in segment */
 } dma_segment_t;
 
-static unsigned int _dma_mem_size = DMA_MEM_DEFAULT;
-static mpool_handle_t _dma_pool = NULL;
-static void __iomem *_dma_vbase = NULL;
-/* cpu physical address for mmap */
-static phys_addr_t _cpu_pbase = 0;
+typedef struct _dma_pool {
+    mpool_handle_t pool;
+    void __iomem *vbase;
+    void *pgbase;               /* Address returned by _pgalloc */
+    /* cpu physical address for mmap */
+    phys_addr_t cpu_pbase;
+    /*
+     * DMA bus address, it is either identical to cpu physical address
+     * or another address(IOVA) translated by IOMMU.
+     */
+    phys_addr_t dma_pbase;
+    unsigned int size;
+    int dev;                    /* Device pool is mapped for, -1 for all */
+    int node;                   /* NUMA node of pool memory, -1 if unknown */
+    int use_dma_mapping;
+    unsigned int alloc_msecs;   /* Time taken to allocate pool memory */
+#ifdef DMA_SG_SUPPORT
+    struct page **pages;        /* Pages of scattered pool */
+    int npages;
+    int nchunks;                /* Page allocations needed */
+    struct sg_table *sgt;       /* Per device mapping of scattered pool */
+    phys_addr_t dev_pbase[LINUX_BDE_MAX_DEVICES]; /* Per device IOVA */
+#endif
+} dma_pool_t;
+
 /*
- * DMA bus address, it is either identical to cpu physical address
- * or another address(IOVA) translated by IOMMU.
+ * Pool 0 is shared by all devices and is the pool exported to the
+ * user mode BDE. Additional pools are created per device or per
+ * NUMA node if requested by the dmapool module parameter.
  */
-static phys_addr_t _dma_pbase = 0;
+#define DMA_MAX_POOLS (LINUX_BDE_MAX_DEVICES + 1)
+
+static unsigned int _dma_mem_size = DMA_MEM_DEFAULT;
+static dma_pool_t _dma_pools[DMA_MAX_POOLS];
+static int _dma_npools = 1;
+static int _dma_dev_pool[LINUX_BDE_MAX_DEVICES];
 static int _use_himem = 0;
-static int _use_dma_mapping = 0;
+static unsigned long _dma_fixed_base = 0;
 static LIST_HEAD(_dma_seg);
 
+#define DMA_POOL_SHARED_PTR (&_dma_pools[0])
+
+/* Allocation records for DMA memory accounting */
+#define DMA_TRACK_HASH_SIZE 64
+#define DMA_TRACK_HASH(_a)  ((((unsigned long)(_a)) >> 6) % DMA_TRACK_HASH_SIZE)
+#define DMA_TRACK_NAME_MAX  16
+#define DMA_TRACK_LIST_MAX  256 /* Allocations listed in proc */
+
+typedef struct _dma_track {
+    struct _dma_track *next;
+    void *addr;
+    int size;                   /* Requested size */
+    int owner;                  /* LKBDE_DMA_OWNER_xxx */
+    void *caller;               /* Return address if dma_track is set */
+    char name[DMA_TRACK_NAME_MAX];
+} dma_track_t;
+
+typedef struct _dma_owner {
+    atomic_long_t bytes;        /* Bytes currently held */
+    atomic_long_t peak;         /* Highest value of bytes */
+    atomic_long_t allocs;       /* Number of allocations */
+} dma_owner_t;
+
+/* Records are only kept if dma_track is set */
+static dma_track_t *_dma_track_hash[DMA_TRACK_HASH_SIZE];
+static int _dma_track_count;
+static unsigned long _dma_track_lost; /* Allocations without record */
+static dma_owner_t _dma_owners[LKBDE_DMA_OWNER_COUNT];
+static spinlock_t _dma_track_lock;
+
 #define DMA_DEV(n)         lkbde_get_dma_dev(n)
 #define BDE_NUM_DEVICES(t) lkbde_get_num_devices(t)
 
@@ -319,7 +522,14 @@ _alloc_dma_blocks(dma_segment_t *dseg, int blks)
          * we have less than 1GB of memory, we can do PCI DMA
          * to all physical RAM locations.
          */
-        addr = __get_free_pages(mem_flags, dseg->blk_order);
+        if (dseg->node < 0) {
+            addr = __get_free_pages(dseg->gfp, dseg->blk_order);
+        } else {
+            struct page *page;
+
+            page = alloc_pages_node(dseg->node, dseg->gfp, dseg->blk_order);
+            addr = (page) ? (unsigned long)page_address(page) : 0;
+        }
         if (addr) {
             dseg->blk_ptr[i] = addr;
         } else {
@@ -338,6 +548,7 @@ _alloc_dma_blocks(dma_segment_t *dseg, int blks)
  * Parameters:
  *    size - requested DMA segment size
  *    blk_size - assemble segment from blocks of this size
+ *    node - NUMA node to allocate from, -1 for any node
  * Returns:
  *    DMA segment descriptor.
  * Notes:
@@ -354,7 +565,7 @@ _alloc_dma_blocks(dma_segment_t *dseg, int blks)
  *    amount is sufficient to proceed.
  */
 static dma_segment_t *
-_dma_segment_alloc(size_t size, size_t blk_size)
+_dma_segment_alloc(size_t size, size_t blk_size, int node)
 {
     dma_segment_t *dseg;
     int i, blk_ptr_size;
@@ -371,6 +582,12 @@ _dma_segment_alloc(size_t size, size_t blk_size)
     }
     memset(dseg, 0, sizeof(dma_segment_t));
     dseg->req_size = size;
+    dseg->node = node;
+    dseg->gfp = mem_flags;
+    if (blk_size > DMA_BLOCK_SIZE) {
+        /* Large blocks may need compaction, so allow sleeping */
+        dseg->gfp = DMA_HUGE_GFP_FLAGS | (mem_flags & (GFP_DMA | GFP_DMA32));
+    }
     dseg->blk_size = PAGE_ALIGN(blk_size);
     while ((PAGE_SIZE << dseg->blk_order) < dseg->blk_size) {
         dseg->blk_order++;
@@ -394,6 +611,7 @@ _dma_segment_alloc(size_t size, size_t blk_size)
     _alloc_dma_blocks(dseg, dseg->req_size / dseg->blk_size);
     /* Allocate more blocks until we have a complete segment */
     do {
+        dseg->rounds++;
         _find_largest_segment(dseg);
         if (dseg->seg_size >= dseg->req_size) {
             break;
@@ -408,6 +626,7 @@ _dma_segment_alloc(size_t size, size_t blk_size)
                  page_addr += PAGE_SIZE) {
                 MEM_MAP_RESERVE(VIRT_TO_PAGE(page_addr));
             }
+            dseg->blk_used++;
         } else if (dseg->blk_ptr[i]) {
             dseg->blk_ptr[i] &= ~3;
             free_pages(dseg->blk_ptr[i], dseg->blk_order);
@@ -456,21 +675,27 @@ _dma_segment_free(dma_segment_t *dseg)
  *    Allocate DMA memory using page allocator
  * Parameters:
  *    size - number of bytes to allocate
+ *    node - NUMA node to allocate from, -1 for any node
  * Returns:
  *    Pointer to allocated DMA memory or NULL if failure.
  * Notes:
  *    For any sizes less than DMA_BLOCK_SIZE, we ask the page
  *    allocator for the entire memory block, otherwise we try
- *    to assemble a contiguous segment ourselves.
+ *    to assemble a contiguous segment ourselves. With
+ *    ALLOC_TYPE_HUGE the segment is assembled from blocks of
+ *    DMA_HUGE_BLOCK_SIZE, which needs far fewer blocks and
+ *    assembly rounds for large pools.
  */
 static void *
-_pgalloc(size_t size)
+_pgalloc(size_t size, int node)
 {
     dma_segment_t *dseg;
-    size_t blk_size;
+    size_t blk_size, max_blk_size;
 
-    blk_size = (size < DMA_BLOCK_SIZE) ? size : DMA_BLOCK_SIZE;
-    if ((dseg = _dma_segment_alloc(size, blk_size)) == NULL) {
+    max_blk_size = (dmaalloc == ALLOC_TYPE_HUGE) ?
+        DMA_HUGE_BLOCK_SIZE : DMA_BLOCK_SIZE;
+    blk_size = (size < max_blk_size) ? size : max_blk_size;
+    if ((dseg = _dma_segment_alloc(size, blk_size, node)) == NULL) {
         return NULL;
     }
     if (dseg->seg_size < size) {
@@ -482,6 +707,29 @@ _pgalloc(size_t size)
     return (void *)dseg->seg_begin;
 }
 
+/*
+ * Function: _pgseg
+ *
+ * Purpose:
+ *    Find DMA segment of memory allocated by _pgalloc
+ * Parameters:
+ *    ptr - pointer returned by _pgalloc
+ * Returns:
+ *    DMA segment descriptor or NULL if not found.
+ */
+static dma_segment_t *
+_pgseg(void *ptr)
+{
+    struct list_head *pos;
+    list_for_each(pos, &_dma_seg) {
+        dma_segment_t *dseg = list_entry(pos, dma_segment_t, list);
+        if (ptr == (void *)dseg->seg_begin) {
+            return dseg;
+        }
+    }
+    return NULL;
+}
+
 /*
  * Function: _pgfree
  *
@@ -495,55 +743,277 @@ _pgalloc(size_t size)
 static int
 _pgfree(void *ptr)
 {
-    struct list_head *pos;
-    list_for_each(pos, &_dma_seg) {
-        dma_segment_t *dseg = list_entry(pos, dma_segment_t, list);
-        if (ptr == (void *)dseg->seg_begin) {
-            list_del(&dseg->list);
-            _dma_segment_free(dseg);
-            return 0;
+    dma_segment_t *dseg = _pgseg(ptr);
+
+    if (dseg == NULL) {
+        return -1;
+    }
+    list_del(&dseg->list);
+    _dma_segment_free(dseg);
+    return 0;
+}
+
+#ifdef DMA_SG_SUPPORT
+/*
+ * Function: _sgfree
+ *
+ * Purpose:
+ *    Free scattered DMA pool memory
+ * Parameters:
+ *    dp - DMA pool
+ * Returns:
+ *    Nothing.
+ */
+static void
+_sgfree(dma_pool_t *dp)
+{
+    int i;
+
+    if (dp->sgt) {
+        for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+            if (dp->sgt[i].sgl == NULL) {
+                continue;
+            }
+            if (dp->dev_pbase[i]) {
+                dma_unmap_sg(DMA_DEV(i), dp->sgt[i].sgl,
+                             dp->sgt[i].orig_nents, DMA_BIDIRECTIONAL);
+                dp->dev_pbase[i] = 0;
+            }
+            sg_free_table(&dp->sgt[i]);
+        }
+        kfree(dp->sgt);
+        dp->sgt = NULL;
+    }
+    if (dp->vbase) {
+        vunmap(dp->vbase);
+        dp->vbase = NULL;
+    }
+    if (dp->pages) {
+        for (i = 0; i < dp->npages && dp->pages[i]; i++) {
+            MEM_MAP_UNRESERVE(dp->pages[i]);
+            __free_page(dp->pages[i]);
+        }
+        vfree(dp->pages);
+        dp->pages = NULL;
+    }
+    dp->npages = 0;
+    dp->use_dma_mapping = 0;
+}
+
+/*
+ * Function: _sgalloc
+ *
+ * Purpose:
+ *    Allocate DMA pool from scattered pages
+ * Parameters:
+ *    dp - DMA pool
+ *    size - size of DMA memory pool
+ * Returns:
+ *    0 on success, < 0 on error.
+ * Notes:
+ *    Pages are allocated in chunks of up to DMA_SG_MAX_ORDER, falling
+ *    back to smaller chunks when memory is fragmented. The pool is
+ *    mapped into one contiguous IOVA range for each device, so every
+ *    device must be behind an IOMMU. The reported cpu physical address
+ *    is an mmap offset derived from the kernel mapping of the pool,
+ *    which is unique for each pool.
+ */
+static int
+_sgalloc(dma_pool_t *dp, size_t size)
+{
+    struct scatterlist *sg;
+    struct page *page;
+    dma_addr_t next;
+    int i, j, n, nents, order, ndevices;
+
+    dp->npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    dp->pages = vmalloc(dp->npages * sizeof(struct page *));
+    if (dp->pages == NULL) {
+        return -1;
+    }
+    memset(dp->pages, 0, dp->npages * sizeof(struct page *));
+
+    order = DMA_SG_MAX_ORDER;
+    for (n = 0; n < dp->npages; ) {
+        while ((1 << order) > dp->npages - n) {
+            order--;
+        }
+        page = alloc_pages_node(dp->node < 0 ? numa_node_id() : dp->node,
+                                order ? DMA_HUGE_GFP_FLAGS | __GFP_NORETRY :
+                                GFP_KERNEL, order);
+        if (page == NULL) {
+            if (order == 0) {
+                gprintk("failed to allocate page %d of %d\n", n, dp->npages);
+                _sgfree(dp);
+                return -1;
+            }
+            /* Memory is fragmented, try smaller chunks */
+            order--;
+            continue;
+        }
+        if (order) {
+            split_page(page, order);
+        }
+        for (j = 0; j < (1 << order); j++) {
+            MEM_MAP_RESERVE(page + j);
+            dp->pages[n++] = page + j;
+        }
+        dp->nchunks++;
+    }
+
+    dp->vbase = vmap(dp->pages, dp->npages, VM_MAP, PAGE_KERNEL);
+    if (dp->vbase == NULL) {
+        gprintk("failed to map the memory pool of size 0x%lx\n", (unsigned long)size);
+        _sgfree(dp);
+        return -1;
+    }
+    dp->size = dp->npages << PAGE_SHIFT;
+
+    dp->sgt = kmalloc(LINUX_BDE_MAX_DEVICES * sizeof(struct sg_table),
+                      GFP_KERNEL);
+    if (dp->sgt == NULL) {
+        _sgfree(dp);
+        return -1;
+    }
+    memset(dp->sgt, 0, LINUX_BDE_MAX_DEVICES * sizeof(struct sg_table));
+
+    ndevices = BDE_NUM_DEVICES(BDE_ALL_DEVICES);
+    for (i = 0; i < ndevices && i < LINUX_BDE_MAX_DEVICES && DMA_DEV(i); i++) {
+        if (dp->dev >= 0 && dp->dev != i) {
+            continue;
+        }
+        if (sg_alloc_table_from_pages(&dp->sgt[i], dp->pages, dp->npages,
+                                      0, dp->size, GFP_KERNEL) < 0) {
+            _sgfree(dp);
+            return -1;
+        }
+        nents = dma_map_sg(DMA_DEV(i), dp->sgt[i].sgl,
+                           dp->sgt[i].orig_nents, DMA_BIDIRECTIONAL);
+        if (nents <= 0) {
+            gprintk("device %d: failed to map the memory pool\n", i);
+            _sgfree(dp);
+            return -1;
+        }
+        dp->dev_pbase[i] = next = sg_dma_address(dp->sgt[i].sgl);
+        /* The IOMMU must present the pages as one contiguous range */
+        for_each_sg(dp->sgt[i].sgl, sg, nents, j) {
+            if (sg_dma_address(sg) != next) {
+                gprintk("device %d: memory pool is not contiguous in DMA space, "
+                        "IOMMU required for dmaalloc=%d\n", i, ALLOC_TYPE_SG);
+                _sgfree(dp);
+                return -1;
+            }
+            next += sg_dma_len(sg);
+        }
+        if (((next - 1) >> 16) > DMA_BIT_MASK(16)) {
+            gprintk("device %d: DMA memory mapped at 0x%lx size 0x%lx is beyond the 4GB limit and not supported.\n",
+                    i, (unsigned long)dp->dev_pbase[i], (unsigned long)dp->size);
+            _sgfree(dp);
+            return -1;
+        }
+        if (!dp->use_dma_mapping) {
+            dp->dma_pbase = dp->dev_pbase[i];
+            dp->use_dma_mapping = 1;
         }
     }
-    return -1;
+    if (!dp->use_dma_mapping) {
+        gprintk("scattered DMA memory pool requires a probed device\n");
+        _sgfree(dp);
+        return -1;
+    }
+
+    /* mmap offset, see _dma_sg_mmap */
+    dp->cpu_pbase = DMA_SG_MMAP_BASE +
+        (PTR_TO_UINTPTR(dp->vbase) - (unsigned long)VMALLOC_START);
+
+    if (dma_debug >= 1) {
+        gprintk("scattered pool vbase:%p dma_pbase:%lx mmap:%lx size:%lx "
+                "chunks:%d dev:%d node:%d\n",
+                dp->vbase, (unsigned long)dp->dma_pbase,
+                (unsigned long)dp->cpu_pbase, (unsigned long)dp->size,
+                dp->nchunks, dp->dev, dp->node);
+    }
+    return 0;
+}
+#endif /* DMA_SG_SUPPORT */
+
+/*
+ * Function: _dma_pool_pbase
+ *
+ * Purpose:
+ *    Get DMA bus address of a pool as seen by a device.
+ * Parameters:
+ *    dp - DMA pool
+ *    d - device number
+ * Returns:
+ *    DMA bus address of the start of the pool
+ * Notes:
+ *    Scattered pools may be mapped at a different IOVA for each device.
+ */
+static phys_addr_t
+_dma_pool_pbase(dma_pool_t *dp, int d)
+{
+#ifdef DMA_SG_SUPPORT
+    if (dp->pages && d >= 0 && d < LINUX_BDE_MAX_DEVICES && dp->dev_pbase[d]) {
+        return dp->dev_pbase[d];
+    }
+#endif
+    return dp->dma_pbase;
 }
 
 /*
  * Function: _pgcleanup
  *
  * Purpose:
- *    Free all memory allocated by _pgalloc
+ *    Free DMA pool memory allocated from the kernel
  * Parameters:
- *    None
+ *    dp - DMA pool
  * Returns:
  *    Nothing.
  */
 static void
-_pgcleanup(void)
+_pgcleanup(dma_pool_t *dp)
 {
     switch (dmaalloc) {
 #if _SIMPLE_MEMORY_ALLOCATION_
       case ALLOC_TYPE_API:
-        if (_dma_vbase) {
-            if (dma_debug >= 1) gprintk("freeing v=%p p=0x%lx size=0x%lx\n", _dma_vbase,(unsigned long) _dma_pbase, (unsigned long)_dma_mem_size);
-            dma_free_coherent(DMA_DEV(0), _dma_mem_size, _dma_vbase, _dma_pbase);
+        if (dp->vbase) {
+            if (dma_debug >= 1) gprintk("freeing v=%p p=0x%lx size=0x%lx\n", dp->vbase,(unsigned long) dp->dma_pbase, (unsigned long)dp->size);
+            dma_free_coherent(DMA_DEV(dp->dev < 0 ? 0 : dp->dev), dp->size, dp->vbase, dp->dma_pbase);
         }
         break;
 #endif /* _SIMPLE_MEMORY_ALLOCATION_ */
 
-      case ALLOC_TYPE_CHUNK: {
-        struct list_head *pos, *tmp;
+#ifdef CONFIG_DMA_CMA
+      case ALLOC_TYPE_CMA:
+        if (dp->vbase) {
+            dma_free_coherent(DMA_DEV(dp->dev < 0 ? 0 : dp->dev), dp->size, dp->vbase, dp->dma_pbase);
+        }
+        break;
+#endif /* CONFIG_DMA_CMA */
+
+#ifdef DMA_SG_SUPPORT
+      case ALLOC_TYPE_SG:
+        _sgfree(dp);
+        break;
+#endif /* DMA_SG_SUPPORT */
+
+      case ALLOC_TYPE_CHUNK:
+      case ALLOC_TYPE_HUGE: {
         int i, ndevices;
-        if (_use_dma_mapping) {
+        if (dp->use_dma_mapping) {
             ndevices = BDE_NUM_DEVICES(BDE_ALL_DEVICES);
             for (i = 0; i < ndevices && DMA_DEV(i); i ++) {
-                dma_unmap_single(DMA_DEV(i), (dma_addr_t)_dma_pbase, _dma_mem_size, DMA_BIDIRECTIONAL);
+                if (dp->dev >= 0 && dp->dev != i) {
+                    continue;
+                }
+                dma_unmap_single(DMA_DEV(i), (dma_addr_t)dp->dma_pbase, dp->size, DMA_BIDIRECTIONAL);
             }
-            _use_dma_mapping = 0;
+            dp->use_dma_mapping = 0;
         }
-        list_for_each_safe(pos, tmp, &_dma_seg) {
-            dma_segment_t *dseg = list_entry(pos, dma_segment_t, list);
-            list_del(&dseg->list);
-            _dma_segment_free(dseg);
+        if (dp->pgbase) {
+            _pgfree(dp->pgbase);
+            dp->pgbase = NULL;
         }
         break;
       }
@@ -559,16 +1029,19 @@ _pgcleanup(void)
  * Purpose:
  *    Allocate DMA memory pool
  * Parameters:
+ *    dp - DMA pool
  *    size - size of DMA memory pool
  * Returns:
  *    Nothing.
  * Notes:
- *    If set up to use high memory, we simply map the memory into
- *    kernel space.
- *    It is assumed there is only one pool.
+ *    If set up to use high memory or a reserved region, we simply map
+ *    the memory into kernel space. High memory can only be used for
+ *    the shared pool.
+ *    A pool with dp->dev set is DMA mapped for that device only,
+ *    otherwise it is mapped for all devices.
  */
 static void
-_alloc_mpool(size_t size)
+_alloc_mpool(dma_pool_t *dp, size_t size)
 {
     int i, ndevices;
     unsigned long pbase = 0;
@@ -582,14 +1055,15 @@ _alloc_mpool(size_t size)
 #endif
 
     if (_use_himem) {
-        /* Use high memory for DMA */
-        pbase = virt_to_bus(high_memory);
+        /* Use high memory or a reserved region for DMA */
+        pbase = _dma_fixed_base ? _dma_fixed_base : virt_to_bus(high_memory);
         if (((pbase + (size - 1)) >> 16) > DMA_BIT_MASK(16)) {
             gprintk("DMA in high memory at 0x%lx size 0x%lx is beyond the 4GB limit and not supported.\n", pbase, (unsigned long)size);
             return;
         }
-        _cpu_pbase = _dma_pbase = pbase;
-        _dma_vbase = IOREMAP(_dma_pbase, size);
+        dp->cpu_pbase = dp->dma_pbase = pbase;
+        dp->vbase = IOREMAP(dp->dma_pbase, size);
+        dp->size = size;
     } else {
         /* Get DMA memory from kernel */
         switch (dmaalloc) {
@@ -602,78 +1076,255 @@ _alloc_mpool(size_t size)
             /* get a memory allocation from the kernel */
             {
                 dma_addr_t dma_handle;
-                if (!(_dma_vbase = dma_alloc_coherent(DMA_DEV(0), alloc_size, &dma_handle, GFP_KERNEL)) || !dma_handle) {
+                if (!(dp->vbase = dma_alloc_coherent(DMA_DEV(dp->dev < 0 ? 0 : dp->dev), alloc_size, &dma_handle, GFP_KERNEL)) || !dma_handle) {
                     gprintk("failed to allocate the memory pool of size 0x%lx\n", (unsigned long)alloc_size);
                     return;
                 }
-                _cpu_pbase = pbase = dma_handle;
+                dp->cpu_pbase = pbase = dma_handle;
             }
 
             if (alloc_size != size) {
                 gprintk("allocated 0x%lx bytes instead of 0x%lx bytes.\n",
                         (unsigned long)alloc_size, (unsigned long)size);
             }
-            size = _dma_mem_size = alloc_size;
+            size = alloc_size;
             break;
           }
 #endif /* _SIMPLE_MEMORY_ALLOCATION_ */
 
+#ifdef CONFIG_DMA_CMA
+          case ALLOC_TYPE_CMA: {
+            /*
+             * The DMA API serves large coherent allocations from the
+             * CMA area, which has been reserved at boot and does not
+             * suffer from fragmentation. The pool size is limited only
+             * by the CMA area size (cma=xxM kernel parameter).
+             */
+            dma_addr_t dma_handle;
+
+            if (DMA_DEV(dp->dev < 0 ? 0 : dp->dev) == NULL) {
+                gprintk("CMA allocation requires a probed device\n");
+                return;
+            }
+            dp->vbase = dma_alloc_coherent(DMA_DEV(dp->dev < 0 ? 0 : dp->dev),
+                                           size, &dma_handle,
+                                           GFP_KERNEL | __GFP_NOWARN);
+            if (!dp->vbase || !dma_handle) {
+                gprintk("failed to allocate the memory pool of size 0x%lx from CMA\n", (unsigned long)size);
+                dp->vbase = NULL;
+                return;
+            }
+            pbase = dma_handle;
+            /* Memory may be remapped, so only trust linear addresses */
+            dp->cpu_pbase = virt_addr_valid(dp->vbase) ?
+                virt_to_phys(dp->vbase) : dma_handle;
+            break;
+          }
+#endif /* CONFIG_DMA_CMA */
+
+#ifdef DMA_SG_SUPPORT
+          case ALLOC_TYPE_SG:
+            /* Bus addresses are per device, nothing else to do */
+            if (_sgalloc(dp, size) < 0) {
+                dp->vbase = NULL;
+            }
+            return;
+#endif /* DMA_SG_SUPPORT */
+
           case ALLOC_TYPE_CHUNK:
-            _dma_vbase = _pgalloc(size);
-            if (!_dma_vbase) {
+          case ALLOC_TYPE_HUGE:
+            dp->pgbase = dp->vbase = _pgalloc(size, dp->node);
+            if (!dp->vbase) {
                 gprintk("failed to allocate the memory pool of size 0x%lx\n", (unsigned long)size);
                 return;
             }
-            _cpu_pbase = virt_to_bus(_dma_vbase);
+            dp->cpu_pbase = virt_to_bus(dp->vbase);
             ndevices = BDE_NUM_DEVICES(BDE_ALL_DEVICES);
             for (i = 0; i < ndevices && DMA_DEV(i); i ++) {
+                if (dp->dev >= 0 && dp->dev != i) {
+                    continue;
+                }
                 /* Use dma_map_single to obtain DMA bus address or IOVA if iommu is present. */
-                pbase = dma_map_single(DMA_DEV(i), _dma_vbase, size, DMA_BIDIRECTIONAL);
-                if (_use_dma_mapping && (orig_pbase != pbase)) {
+                pbase = dma_map_single(DMA_DEV(i), dp->vbase, size, DMA_BIDIRECTIONAL);
+                if (dp->use_dma_mapping && (orig_pbase != pbase)) {
                     /* Bus address/IOVA must be identical for all devices. */
                     gprintk("deivce %d has different pbase: %lx (should be %lx)\n",
                              i, pbase, orig_pbase);
                     dma_unmap_single(DMA_DEV(i), (dma_addr_t)pbase, size, DMA_BIDIRECTIONAL);
                     while (--i >= 0 && DMA_DEV(i)) {
+                        if (dp->dev >= 0 && dp->dev != i) {
+                            continue;
+                        }
                         dma_unmap_single(DMA_DEV(i), (dma_addr_t)orig_pbase, size, DMA_BIDIRECTIONAL);
                     }
-                    _use_dma_mapping = 0;
-                    _pgcleanup();
-                    _dma_vbase = NULL;
+                    dp->use_dma_mapping = 0;
+                    _pgcleanup(dp);
+                    dp->vbase = NULL;
                     return;
                 }
                 orig_pbase = pbase;
-                _use_dma_mapping = 1;
+                dp->use_dma_mapping = 1;
             }
-            if (!_use_dma_mapping) {
+            if (!dp->use_dma_mapping) {
                 /* Device has not been probed. */
-                pbase = _cpu_pbase;
+                pbase = dp->cpu_pbase;
             }
             break;
           default:
-            _dma_vbase = NULL;
+            dp->vbase = NULL;
             gprintk("DMA memory allocation method dmaalloc=%d is not supported\n", dmaalloc);
             return;
         }
 
+        dp->size = size;
         if (((pbase + (size - 1)) >> 16) > DMA_BIT_MASK(16)) {
             gprintk("DMA memory allocated at 0x%lx size 0x%lx is beyond the 4GB limit and not supported.\n", pbase, (unsigned long)size);
-            _pgcleanup();
-            _dma_vbase = NULL;
-            _dma_pbase = 0;
+            dp->dma_pbase = pbase;
+            _pgcleanup(dp);
+            dp->vbase = NULL;
+            dp->dma_pbase = 0;
             return;
         }
 
-        _dma_pbase = pbase;
+        dp->dma_pbase = pbase;
 #ifdef REMAP_DMA_NONCACHED
-        _dma_vbase = IOREMAP(_dma_pbase, size);
+        dp->vbase = IOREMAP(dp->dma_pbase, size);
 #endif
         if (dma_debug >= 1) {
-            gprintk("_use_dma_mapping:%d _dma_vbase:%p _dma_pbase:%lx _cpu_pbase:%lx allocated:%lx dmaalloc:%d\n",
-                     _use_dma_mapping, _dma_vbase, (unsigned long)_dma_pbase,
-                     (unsigned long)_cpu_pbase, (unsigned long)size, dmaalloc);
+            gprintk("use_dma_mapping:%d vbase:%p dma_pbase:%lx cpu_pbase:%lx allocated:%lx dmaalloc:%d dev:%d node:%d\n",
+                     dp->use_dma_mapping, dp->vbase, (unsigned long)dp->dma_pbase,
+                     (unsigned long)dp->cpu_pbase, (unsigned long)size, dmaalloc,
+                     dp->dev, dp->node);
+        }
+    }
+}
+
+/*
+ * Function: _dma_pool_free
+ *
+ * Purpose:
+ *    Release DMA pool memory and allocator.
+ * Parameters:
+ *    dp - DMA pool
+ * Returns:
+ *    Nothing.
+ */
+static void
+_dma_pool_free(dma_pool_t *dp)
+{
+    if (dp->vbase) {
+        if (dp->pool) {
+            mpool_destroy(dp->pool);
+            dp->pool = NULL;
+        }
+        if (_use_himem) {
+            iounmap(dp->vbase);
+        } else {
+#ifdef REMAP_DMA_NONCACHED
+            iounmap(dp->vbase);
+#endif
+            _pgcleanup(dp);
+        }
+        dp->vbase = NULL;
+        dp->dma_pbase = 0;
+        dp->cpu_pbase = 0;
+    }
+}
+
+/*
+ * Function: _dma_pool_create
+ *
+ * Purpose:
+ *    Allocate DMA pool memory and create its allocator.
+ * Parameters:
+ *    dp - DMA pool
+ *    dev - device to map pool for, -1 for all devices
+ *    node - NUMA node to allocate from, -1 for any node
+ * Returns:
+ *    0 on success, < 0 on error.
+ */
+static int
+_dma_pool_create(dma_pool_t *dp, int dev, int node)
+{
+    unsigned long start;
+
+    memset(dp, 0, sizeof(*dp));
+    dp->dev = dev;
+    dp->node = node;
+
+    start = jiffies;
+    _alloc_mpool(dp, _dma_mem_size);
+    dp->alloc_msecs = jiffies_to_msecs(jiffies - start);
+    if (dp->vbase == NULL) {
+        return -1;
+    }
+    dp->pool = mpool_create(dp->vbase, dp->size);
+    if (dp->pool == NULL) {
+        _dma_pool_free(dp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: _dma_dev_pool_get
+ *
+ * Purpose:
+ *    Get DMA pool used for device allocations.
+ * Parameters:
+ *    d - device number
+ * Returns:
+ *    DMA pool
+ */
+static dma_pool_t *
+_dma_dev_pool_get(int d)
+{
+    if (d < 0 || d >= LINUX_BDE_MAX_DEVICES) {
+        return DMA_POOL_SHARED_PTR;
+    }
+    return &_dma_pools[_dma_dev_pool[d]];
+}
+
+/*
+ * Function: _dma_pool_find
+ *
+ * Purpose:
+ *    Find DMA pool containing a logical or DMA bus address.
+ * Parameters:
+ *    d - device number
+ *    vaddr - logical address or NULL
+ *    paddr - DMA bus address (if vaddr is NULL)
+ * Returns:
+ *    DMA pool
+ * Notes:
+ *    The pool of the device is checked first. Memory from the shared
+ *    pool may be passed to any device, so all pools are searched. If
+ *    no pool contains the address, the shared pool is returned.
+ */
+static dma_pool_t *
+_dma_pool_find(int d, void *vaddr, sal_paddr_t paddr)
+{
+    dma_pool_t *dp = _dma_dev_pool_get(d);
+    int p;
+
+    for (p = -1; p < _dma_npools; p++) {
+        if (p >= 0) {
+            dp = &_dma_pools[p];
+        }
+        if (dp->vbase == NULL) {
+            continue;
+        }
+        if (vaddr) {
+            if (PTR_TO_UINTPTR(vaddr) >= PTR_TO_UINTPTR(dp->vbase) &&
+                PTR_TO_UINTPTR(vaddr) < PTR_TO_UINTPTR(dp->vbase) + dp->size) {
+                return dp;
+            }
+        } else if (paddr >= _dma_pool_pbase(dp, d) &&
+                   paddr < _dma_pool_pbase(dp, d) + dp->size) {
+            return dp;
         }
     }
+    return DMA_POOL_SHARED_PTR;
 }
 
 /*
@@ -689,25 +1340,72 @@ _alloc_mpool(size_t size)
 int
 _dma_cleanup(void)
 {
-    if (_dma_vbase) {
-        mpool_destroy(_dma_pool);
-        if (_use_himem) {
-            iounmap(_dma_vbase);
-        } else {
-#ifdef REMAP_DMA_NONCACHED
-            iounmap(_dma_vbase);
-#endif
-            _pgcleanup();
+    struct list_head *pos, *tmp;
+    dma_track_t *rec;
+    int p;
+
+    for (p = _dma_npools - 1; p >= 0; p--) {
+        _dma_pool_free(&_dma_pools[p]);
+    }
+    _dma_npools = 1;
+    memset(_dma_dev_pool, 0, sizeof(_dma_dev_pool));
+
+    /* Free segments allocated by _salloc without a pool */
+    list_for_each_safe(pos, tmp, &_dma_seg) {
+        dma_segment_t *dseg = list_entry(pos, dma_segment_t, list);
+        list_del(&dseg->list);
+        _dma_segment_free(dseg);
+    }
+
+    /* Drop allocation records of memory that was never freed */
+    for (p = 0; p < DMA_TRACK_HASH_SIZE; p++) {
+        while ((rec = _dma_track_hash[p]) != NULL) {
+            _dma_track_hash[p] = rec->next;
+            kfree(rec);
         }
-        _dma_vbase = NULL;
-        _dma_pbase = 0;
-        _cpu_pbase = 0;
+    }
+    _dma_track_count = 0;
+    _dma_track_lost = 0;
+    for (p = 0; p < LKBDE_DMA_OWNER_COUNT; p++) {
+        atomic_long_set(&_dma_owners[p].bytes, 0);
+        atomic_long_set(&_dma_owners[p].peak, 0);
+        atomic_long_set(&_dma_owners[p].allocs, 0);
     }
     return 0;
 }
 
+/*
+ * Function: _dma_range_reserved
+ *
+ * Purpose:
+ *    Check that a physical range is not managed by the kernel.
+ * Parameters:
+ *    base - page aligned physical start address
+ *    size - size of the range in bytes
+ * Returns:
+ *    1 if no page of the range is owned by the page allocator, 0 otherwise
+ * Notes:
+ *    Pages without a struct page (outside the memory map) count as
+ *    reserved, as do pages marked PageReserved.
+ */
+static int
+_dma_range_reserved(unsigned long base, unsigned long size)
+{
+    unsigned long pfn = base >> PAGE_SHIFT;
+    unsigned long end = pfn + (size >> PAGE_SHIFT);
+
+    for (; pfn < end; pfn++) {
+        if (pfn_valid(pfn) && !PageReserved(pfn_to_page(pfn))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 void _dma_init(int robo_switch)
 {
+    spin_lock_init(&_dma_track_lock);
+
     /* DMA Setup */
     if (dmasize) {
         if ((dmasize[strlen(dmasize)-1] & ~0x20) == 'M') {
@@ -734,15 +1432,82 @@ void _dma_init(int robo_switch)
         }
     }
 
+    if (dmabase) {
+        _dma_fixed_base = simple_strtoul(dmabase, NULL, 0);
+        if (_dma_fixed_base == 0 || (_dma_fixed_base & ~PAGE_MASK)) {
+            gprintk("dmabase must be a page aligned physical address\n");
+            _dma_fixed_base = 0;
+        } else if (_dma_fixed_base + _dma_mem_size < _dma_fixed_base ||
+                   !_dma_range_reserved(_dma_fixed_base, _dma_mem_size)) {
+            /* Memory managed by the kernel cannot be kept */
+            gprintk("dmabase 0x%lx size 0x%lx is not a reserved memory "
+                    "region\n", _dma_fixed_base, (unsigned long)_dma_mem_size);
+            _dma_fixed_base = 0;
+        } else {
+            _use_himem = 1;
+        }
+    }
+
     if (_dma_mem_size) {
-        _alloc_mpool(_dma_mem_size);
-        if (_dma_vbase == NULL) {
+        mpool_init();
+        if (_dma_pool_create(DMA_POOL_SHARED_PTR, -1, -1) < 0) {
             gprintk("no DMA memory available\n");
         }
-        else {
-            mpool_init();
-            _dma_pool = mpool_create(_dma_vbase, _dma_mem_size);
+    }
+}
+
+/*
+ * Function: _dma_dev_init
+ *
+ * Purpose:
+ *    Create per-device or per-NUMA node DMA pools.
+ * Parameters:
+ *    None
+ * Returns:
+ *    Nothing.
+ * Notes:
+ *    Must be called once the device order is final. Each pool is
+ *    allocated from the NUMA node of the device it serves and has the
+ *    same size as the shared pool. Devices fall back to the shared
+ *    pool if a pool cannot be created.
+ */
+void
+_dma_dev_init(void)
+{
+    int d, p, node, ndevices;
+
+    if (dmapool == DMA_POOL_SHARED || _dma_mem_size == 0) {
+        return;
+    }
+    if (_use_himem) {
+        gprintk("DMA pool placement is not supported with high memory\n");
+        return;
+    }
+
+    ndevices = BDE_NUM_DEVICES(BDE_ALL_DEVICES);
+    for (d = 0; d < ndevices && d < LINUX_BDE_MAX_DEVICES && DMA_DEV(d); d++) {
+        node = dev_to_node(DMA_DEV(d));
+        if (dmapool == DMA_POOL_NODE) {
+            /* Devices on the same node share one pool */
+            for (p = 1; p < _dma_npools; p++) {
+                if (_dma_pools[p].node == node) {
+                    break;
+                }
+            }
+            if (p < _dma_npools) {
+                _dma_dev_pool[d] = p;
+                continue;
+            }
+        }
+        p = _dma_npools;
+        if (_dma_pool_create(&_dma_pools[p],
+                             (dmapool == DMA_POOL_DEVICE) ? d : -1,
+                             node) < 0) {
+            gprintk("no DMA memory for device %d, using shared pool\n", d);
+            continue;
         }
+        _dma_dev_pool[d] = p;
+        _dma_npools++;
     }
 }
 
@@ -762,14 +1527,74 @@ void _dma_init(int robo_switch)
 int
 _dma_range_valid(unsigned long phys_addr, unsigned long size)
 {
-    unsigned long pool_start = _cpu_pbase;
-    unsigned long pool_end = pool_start + _dma_mem_size;
+    unsigned long pool_start, pool_end;
+    int p;
+
+    for (p = 0; p < _dma_npools; p++) {
+        pool_start = _dma_pools[p].cpu_pbase;
+        pool_end = pool_start + _dma_pools[p].size;
+        if (_dma_pools[p].vbase &&
+            phys_addr >= pool_start && (phys_addr + size) <= pool_end) {
+            return 1;
+        }
+    }
+    gprintk("range 0x%lx-0x%lx outside DMA pools\n",
+            phys_addr, phys_addr + size);
+    return 0;
+}
 
-    if (phys_addr < pool_start || (phys_addr + size) > pool_end) {
-        gprintk("range 0x%lx-0x%lx outside DMA pool 0x%lx-0x%lx\n",
-                phys_addr, phys_addr + size, pool_start, pool_end);
+/*
+ * Function: _dma_sg_mmap
+ *
+ * Purpose:
+ *    Map a scattered DMA pool to user space.
+ * Parameters:
+ *    vma - user mapping, vm_pgoff holds the cpu physical address
+ *          reported for the pool
+ * Returns:
+ *    0 if mapped, 1 if not a scattered pool, < 0 on error
+ * Notes:
+ *    The pages are mapped in pool order, so user space sees the
+ *    pool as one virtually contiguous block.
+ */
+int
+_dma_sg_mmap(struct vm_area_struct *vma)
+{
+#ifdef DMA_SG_SUPPORT
+    unsigned long phys_addr = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long addr, pfn, len;
+    dma_pool_t *dp;
+    int p, pg, npg;
+
+    for (p = 0; p < _dma_npools; p++) {
+        dp = &_dma_pools[p];
+        if (dp->pages == NULL || phys_addr < dp->cpu_pbase ||
+            phys_addr >= dp->cpu_pbase + dp->size) {
+            continue;
+        }
+        if (phys_addr + size > dp->cpu_pbase + dp->size) {
+            return -EINVAL;
+        }
+        pg = (phys_addr - dp->cpu_pbase) >> PAGE_SHIFT;
+        npg = size >> PAGE_SHIFT;
+        addr = vma->vm_start;
+        while (npg > 0) {
+            /* Map physically contiguous runs in one go */
+            pfn = page_to_pfn(dp->pages[pg]);
+            for (len = 1; len < npg &&
+                     page_to_pfn(dp->pages[pg + len]) == pfn + len; len++);
+            if (remap_pfn_range(vma, addr, pfn, len << PAGE_SHIFT,
+                                vma->vm_page_prot)) {
+                return -EAGAIN;
+            }
+            addr += len << PAGE_SHIFT;
+            pg += len;
+            npg -= len;
+        }
         return 0;
     }
+#endif
     return 1;
 }
 #endif
@@ -788,16 +1613,19 @@ _dma_range_valid(unsigned long phys_addr, unsigned long size)
 int
 _dma_pool_allocated(void)
 {
-    return (_dma_vbase) ? 1 : 0;
+    return (DMA_POOL_SHARED_PTR->vbase) ? 1 : 0;
 }
 
 sal_paddr_t
 _l2p(int d, void *vaddr)
 {
+    dma_pool_t *dp;
+
     if (_dma_mem_size) {
         /* dma memory is a contiguous block */
         if (vaddr) {
-            return _dma_pbase + (PTR_TO_UINTPTR(vaddr) - PTR_TO_UINTPTR(_dma_vbase));
+            dp = _dma_pool_find(d, vaddr, 0);
+            return _dma_pool_pbase(dp, d) + (PTR_TO_UINTPTR(vaddr) - PTR_TO_UINTPTR(dp->vbase));
         }
         return 0;
     }
@@ -807,18 +1635,164 @@ _l2p(int d, void *vaddr)
 void *
 _p2l(int d, sal_paddr_t paddr)
 {
-    sal_vaddr_t vaddr = (sal_vaddr_t)_dma_vbase;
+    dma_pool_t *dp;
 
     if (_dma_mem_size) {
         /* DMA memory is a contiguous block */
         if (paddr == 0) {
             return NULL;
         }
-        return (void *)(vaddr + (sal_vaddr_t)(paddr - _dma_pbase));
+        dp = _dma_pool_find(d, NULL, paddr);
+        return (void *)((sal_vaddr_t)dp->vbase + (sal_vaddr_t)(paddr - _dma_pool_pbase(dp, d)));
     }
     return bus_to_virt(paddr);
 }
 
+/*
+ * Account DMA memory to owner.
+ */
+static void
+_dma_owner_add(int owner, int bytes)
+{
+    dma_owner_t *dow = &_dma_owners[owner];
+    long cur, peak;
+
+    cur = atomic_long_add_return(bytes, &dow->bytes);
+    if (bytes > 0) {
+        atomic_long_inc(&dow->allocs);
+        peak = atomic_long_read(&dow->peak);
+        while (cur > peak) {
+            peak = atomic_long_cmpxchg(&dow->peak, peak, cur);
+        }
+    }
+}
+
+/*
+ * Size of DMA memory block allocated by _salloc or kmalloc_giant.
+ */
+static int
+_dma_block_size(dma_pool_t *dp, void *ptr)
+{
+    dma_segment_t *dseg;
+
+    if (dp) {
+        return mpool_block_size(dp->pool, ptr);
+    }
+    if ((dseg = _pgseg(ptr)) != NULL) {
+        return dseg->req_size;
+    }
+    return ksize(ptr);
+}
+
+/*
+ * Account DMA allocation, and record it for leak tracking if dma_track
+ * is set.
+ */
+static void
+_dma_track_add(void *addr, int bytes, int size, const char *name,
+               void *caller)
+{
+    dma_track_t *rec;
+    unsigned long flags;
+    int h;
+
+    if (addr == NULL) {
+        return;
+    }
+    _dma_owner_add(LKBDE_DMA_OWNER_KERNEL, bytes);
+    if (!dma_track) {
+        return;
+    }
+
+    /* May be called in atomic context */
+    rec = kmalloc(sizeof(*rec), GFP_ATOMIC);
+    if (rec) {
+        rec->addr = addr;
+        rec->size = size;
+        rec->owner = LKBDE_DMA_OWNER_KERNEL;
+        rec->caller = caller;
+        strncpy(rec->name, (name) ? name : "", DMA_TRACK_NAME_MAX - 1);
+        rec->name[DMA_TRACK_NAME_MAX - 1] = 0;
+        /* Keep proc output parsable */
+        for (h = 0; rec->name[h]; h++) {
+            if (rec->name[h] == ' ' || rec->name[h] == '=') {
+                rec->name[h] = '_';
+            }
+        }
+    }
+
+    spin_lock_irqsave(&_dma_track_lock, flags);
+    if (rec) {
+        h = DMA_TRACK_HASH(addr);
+        rec->next = _dma_track_hash[h];
+        _dma_track_hash[h] = rec;
+        _dma_track_count++;
+    } else {
+        _dma_track_lost++;
+    }
+    spin_unlock_irqrestore(&_dma_track_lock, flags);
+}
+
+/*
+ * Account DMA memory being freed, and remove its record if dma_track
+ * is set.
+ */
+static void
+_dma_track_del(void *addr, int bytes)
+{
+    dma_track_t *rec, **prev;
+    unsigned long flags;
+
+    if (addr == NULL) {
+        return;
+    }
+    _dma_owner_add(LKBDE_DMA_OWNER_KERNEL, -bytes);
+    if (!dma_track) {
+        return;
+    }
+
+    spin_lock_irqsave(&_dma_track_lock, flags);
+    prev = &_dma_track_hash[DMA_TRACK_HASH(addr)];
+    while ((rec = *prev) != NULL && rec->addr != addr) {
+        prev = &rec->next;
+    }
+    if (rec) {
+        *prev = rec->next;
+        _dma_track_count--;
+    }
+    spin_unlock_irqrestore(&_dma_track_lock, flags);
+
+    if (rec) {
+        kfree(rec);
+    }
+}
+
+/*
+ * Function: lkbde_dma_owner_update
+ *
+ * Purpose:
+ *    Account DMA memory not allocated through the kernel BDE.
+ * Parameters:
+ *    owner - LKBDE_DMA_OWNER_xxx
+ *    bytes - bytes allocated (positive) or freed (negative)
+ * Returns:
+ *    0 on success, -1 if owner is invalid
+ * Notes:
+ *    Used e.g. by the user mode BDE for DMA memory reserved by
+ *    instances and by KNET for its DCB rings.
+ */
+int
+lkbde_dma_owner_update(int owner, int bytes)
+{
+    if (owner < 0 || owner >= LKBDE_DMA_OWNER_COUNT) {
+        return -1;
+    }
+
+    _dma_owner_add(owner, bytes);
+
+    return 0;
+}
+
 /*
  * Some of the driver malloc's are too large for
  * kmalloc(), so 'sal_alloc' and 'sal_free' in the
@@ -834,24 +1808,39 @@ _p2l(int d, sal_paddr_t paddr)
 
 void* kmalloc_giant(int sz)
 {
-    return mpool_alloc(_dma_pool, sz);
+    void *ptr;
+
+    ptr = mpool_alloc(DMA_POOL_SHARED_PTR->pool, sz);
+    if (ptr) {
+        _dma_track_add(ptr, _dma_block_size(DMA_POOL_SHARED_PTR, ptr), sz,
+                       "giant", __builtin_return_address(0));
+    }
+    return ptr;
 }
 
 void kfree_giant(void* ptr)
 {
-    return mpool_free(_dma_pool, ptr);
+    if (ptr) {
+        _dma_track_del(ptr, _dma_block_size(DMA_POOL_SHARED_PTR, ptr));
+    }
+    return mpool_free(DMA_POOL_SHARED_PTR->pool, ptr);
 }
 
 uint32_t *
 _salloc(int d, int size, const char *name)
 {
+    dma_pool_t *dp = NULL;
     void *ptr;
 
     if (_dma_mem_size) {
-        return mpool_alloc(_dma_pool, size);
+        dp = _dma_dev_pool_get(d);
+        ptr = mpool_alloc(dp->pool, size);
+    } else if ((ptr = kmalloc(size, mem_flags)) == NULL) {
+        ptr = _pgalloc(size, -1);
     }
-    if ((ptr = kmalloc(size, mem_flags)) == NULL) {
-        ptr = _pgalloc(size);
+    if (ptr) {
+        _dma_track_add(ptr, _dma_block_size(dp, ptr), size, name,
+                       __builtin_return_address(0));
     }
     return ptr;
 }
@@ -859,14 +1848,18 @@ _salloc(int d, int size, const char *name)
 void
 _sfree(int d, void *ptr)
 {
-    if (_dma_mem_size) {
-        return mpool_free(_dma_pool, ptr);
+    dma_pool_t *dp = (_dma_mem_size) ? _dma_pool_find(d, ptr, 0) : NULL;
+
+    if (ptr) {
+        _dma_track_del(ptr, _dma_block_size(dp, ptr));
+    }
+    if (dp) {
+        return mpool_free(dp->pool, ptr);
     }
     if (_pgfree(ptr) < 0) {
         kfree(ptr);
     }
 }
-
 int
 _sinval(int d, void *ptr, int length)
 {
@@ -903,27 +1896,206 @@ _sflush(int d, void *ptr, int length)
 int
 lkbde_get_dma_info(phys_addr_t* cpu_pbase, phys_addr_t* dma_pbase, ssize_t* size)
 {
-    if (_dma_vbase == NULL) {
+    dma_pool_t *dp = DMA_POOL_SHARED_PTR;
+    unsigned long start;
+
+    if (dp->vbase == NULL) {
         if (_dma_mem_size == 0) {
             _dma_mem_size = DMA_MEM_DEFAULT;
         }
-        _alloc_mpool(_dma_mem_size);
+        dp->dev = dp->node = -1;
+        start = jiffies;
+        _alloc_mpool(dp, _dma_mem_size);
+        dp->alloc_msecs = jiffies_to_msecs(jiffies - start);
+    }
+    *cpu_pbase = dp->cpu_pbase;
+    *dma_pbase = dp->dma_pbase;
+    *size = (dp->vbase) ? dp->size : 0;
+    return 0;
+}
+
+/*
+ * Function: lkbde_get_dev_dma_info
+ *
+ * Purpose:
+ *    Get DMA pool used for a device.
+ * Parameters:
+ *    d - device number
+ *    cpu_pbase - (OUT) cpu physical address for mmap
+ *    dma_pbase - (OUT) DMA bus address
+ *    size - (OUT) pool size
+ * Returns:
+ *    Always 0
+ * Notes:
+ *    Returns the shared pool unless the device has a pool of its own.
+ */
+int
+lkbde_get_dev_dma_info(int d, phys_addr_t* cpu_pbase, phys_addr_t* dma_pbase, ssize_t* size)
+{
+    dma_pool_t *dp = _dma_dev_pool_get(d);
+
+    if (dp == DMA_POOL_SHARED_PTR) {
+        lkbde_get_dma_info(cpu_pbase, dma_pbase, size);
+    } else {
+        *cpu_pbase = dp->cpu_pbase;
+        *size = dp->size;
     }
-    *cpu_pbase = _cpu_pbase;
-    *dma_pbase = _dma_pbase;
-    *size = (_dma_vbase) ? _dma_mem_size : 0;
+    *dma_pbase = _dma_pool_pbase(dp, d);
     return 0;
 }
 
+/*
+ * Function: _dma_stats_pprint
+ *
+ * Purpose:
+ *    Print DMA memory statistics in a machine readable format.
+ * Parameters:
+ *    None
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Each line starts with the record type followed by key=value
+ *    pairs. Size class 16 holds all blocks larger than the largest
+ *    size class and is reported with size 0.
+ */
+static void
+_dma_stats_pprint(void)
+{
+    static const char *owner_name[] = { "kernel", "user", "knet" };
+    dma_pool_t *dp;
+    dma_track_t *rec, *list = NULL;
+    mpool_stats_t stats;
+    unsigned long flags, lost;
+    int p, cls, h, count, listed = 0;
+
+    for (p = 0; p < _dma_npools; p++) {
+        dp = &_dma_pools[p];
+        if (dp->pool == NULL) {
+            continue;
+        }
+        mpool_stats_get(dp->pool, &stats);
+        pprintf("dma_pool pool=%d size=%d used=%d cached=%d peak=%d "
+                "free=%d largest_free=%d frag=%d fails=%lu "
+                "bad_frees=%lu\n",
+                p, stats.size, stats.used, stats.cached, stats.peak,
+                stats.free, stats.largest_free, stats.frag,
+                stats.alloc_fails, stats.bad_frees);
+        for (cls = 0; cls < MPOOL_STATS_CLASSES; cls++) {
+            if (stats.class_used[cls] == 0) {
+                continue;
+            }
+            pprintf("dma_class pool=%d class=%d size=%d blocks=%d bytes=%d\n",
+                    p, cls, stats.class_size[cls], stats.class_used[cls],
+                    stats.class_bytes[cls]);
+        }
+    }
+
+    for (p = 0; p < LKBDE_DMA_OWNER_COUNT; p++) {
+        pprintf("dma_owner owner=%s bytes=%ld peak=%ld allocs=%ld\n",
+                owner_name[p], atomic_long_read(&_dma_owners[p].bytes),
+                atomic_long_read(&_dma_owners[p].peak),
+                atomic_long_read(&_dma_owners[p].allocs));
+    }
+
+    /* Copy records out, pprintf must not be called with the lock held */
+    if (dma_track) {
+        list = kmalloc(DMA_TRACK_LIST_MAX * sizeof(*list), GFP_KERNEL);
+    }
+    spin_lock_irqsave(&_dma_track_lock, flags);
+    count = _dma_track_count;
+    lost = _dma_track_lost;
+    for (h = 0; list && h < DMA_TRACK_HASH_SIZE; h++) {
+        for (rec = _dma_track_hash[h];
+             rec && listed < DMA_TRACK_LIST_MAX; rec = rec->next) {
+            list[listed++] = *rec;
+        }
+    }
+    spin_unlock_irqrestore(&_dma_track_lock, flags);
+
+    pprintf("dma_track records=%d lost=%lu\n", count, lost);
+    for (h = 0; h < listed; h++) {
+        rec = &list[h];
+        pprintf("dma_alloc addr=0x%lx size=%d owner=%s name=%s "
+                "caller=%pS\n",
+                (unsigned long)rec->addr, rec->size,
+                owner_name[rec->owner],
+                (rec->name[0]) ? rec->name : "-", rec->caller);
+    }
+    if (list) {
+        kfree(list);
+    }
+}
+
 void
 _dma_pprint(void)
 {
+    static const char *placement[] = { "shared", "device", "node" };
+    static const char *method[] = { "chunk", "api", "cma", "huge", "sg" };
+    dma_pool_t *dp = DMA_POOL_SHARED_PTR;
+    dma_segment_t *dseg;
+    mpool_stats_t stats;
+    int p, d, ndevices, usage;
+
+    usage = (dp->pool) ? mpool_usage(dp->pool) : 0;
     pprintf("DMA Memory (%s): %d bytes, %d used, %d free%s\n",
-            (_use_himem) ? "high" : "kernel",
-            (_dma_vbase) ? _dma_mem_size : 0,
-            (_dma_vbase) ? mpool_usage(_dma_pool) : 0,
-            (_dma_vbase) ? _dma_mem_size - mpool_usage(_dma_pool) : 0,
+            (_use_himem) ? (_dma_fixed_base ? "reserved" : "high") : "kernel",
+            (dp->vbase) ? dp->size : 0,
+            usage,
+            (dp->vbase) ? dp->size - usage : 0,
             USE_LINUX_BDE_MMAP ? ", local mmap" : "");
+    if (dmapool >= DMA_POOL_SHARED && dmapool <= DMA_POOL_NODE) {
+        pprintf("DMA Pool placement: %s\n", placement[dmapool]);
+    }
+    for (p = 0; p < _dma_npools; p++) {
+        dp = &_dma_pools[p];
+        if (dp->vbase == NULL) {
+            continue;
+        }
+        usage = (dp->pool) ? mpool_usage(dp->pool) : 0;
+        pprintf("\tpool %d: phys 0x%lx dma 0x%lx, %d bytes, %d used, %d free, "
+                "node %d",
+                p, (unsigned long)dp->cpu_pbase, (unsigned long)dp->dma_pbase,
+                dp->size, usage, dp->size - usage,
+                (dp->pgbase) ? page_to_nid(VIRT_TO_PAGE(dp->pgbase)) : dp->node);
+        if (dp->dev >= 0) {
+            pprintf(", device %d", dp->dev);
+        }
+        pprintf("\n");
+        if (!_use_himem) {
+            pprintf("\t\tallocated by %s in %u ms",
+                    (dmaalloc >= ALLOC_TYPE_CHUNK && dmaalloc <= ALLOC_TYPE_SG) ?
+                    method[dmaalloc] : "unknown", dp->alloc_msecs);
+            dseg = (dp->pgbase) ? _pgseg(dp->pgbase) : NULL;
+            if (dseg) {
+                pprintf(", %d rounds, %d blocks of %lu KB, %d kept, "
+                        "%d discarded",
+                        dseg->rounds, dseg->blk_cnt, dseg->blk_size / ONE_KB,
+                        dseg->blk_used, dseg->blk_cnt - dseg->blk_used);
+            }
+#ifdef DMA_SG_SUPPORT
+            if (dp->pages) {
+                pprintf(", %d pages in %d chunks", dp->npages, dp->nchunks);
+            }
+#endif
+            pprintf("\n");
+        }
+        if (dp->pool) {
+            mpool_stats_get(dp->pool, &stats);
+            pprintf("\t\t%d cached, %lu cache hits, %lu cache misses, "
+                    "%lu lock contended\n",
+                    stats.cached, stats.cache_hits, stats.cache_misses,
+                    stats.lock_contended);
+        }
+    }
+    if (_dma_npools > 1) {
+        ndevices = BDE_NUM_DEVICES(BDE_ALL_DEVICES);
+        for (d = 0; d < ndevices && d < LINUX_BDE_MAX_DEVICES; d++) {
+            pprintf("\tdevice %d: pool %d, device node %d\n", d,
+                    _dma_dev_pool[d],
+                    (DMA_DEV(d)) ? dev_to_node(DMA_DEV(d)) : -1);
+        }
+    }
+    _dma_stats_pprint();
 }
 
 /*
@@ -932,3 +2104,5 @@ _dma_pprint(void)
 LKM_EXPORT_SYM(kmalloc_giant);
 LKM_EXPORT_SYM(kfree_giant);
 LKM_EXPORT_SYM(lkbde_get_dma_info);
+LKM_EXPORT_SYM(lkbde_get_dev_dma_info);
+LKM_EXPORT_SYM(lkbde_dma_owner_update);
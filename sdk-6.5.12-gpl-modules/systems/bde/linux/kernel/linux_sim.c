@@ -0,0 +1,865 @@
+/*
+ * Copyright 2017 Broadcom
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation (the "GPL").
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License version 2 (GPLv2) for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 (GPLv2) along with this source code.
+ */
+/*
+ * $Id: $
+ * $Copyright: (c) 2017 Broadcom Corp.
+ * All Rights Reserved.$
+ *
+ * Linux Kernel BDE software CMICx device
+ *
+ *
+ * Simulated devices
+ * =================
+ *
+ * A simulated device is a block of host memory which takes the place
+ * of the CMICx register space, and a model of the CMICx packet DMA
+ * engine which is run from the interrupt poll timer of the device.
+ * Drivers such as KNET access registers and DCBs exactly as they do
+ * on a real device, so the DMA ring handling can be exercised and
+ * benchmarked on any host.
+ *
+ * The module parameter sim_devices=N creates N simulated devices.
+ *
+ * The model covers the eight packet DMA channels of CMC 0:
+ *
+ *  - DMA_CTRL enable, abort, direction and continuous mode
+ *  - DMA_DESC start address and DMA_HALT halt address
+ *  - DMA_STAT active bit
+ *  - DCB chain, scatter/gather and reload bits
+ *  - DCB status with byte count, start/end of packet and done bit
+ *  - IRQ_STAT descriptor done, chain done and controlled interrupts,
+ *    IRQ_STAT_CLR and the iProc IRQ_ENAB register
+ *
+ * Registers are sampled when the model runs, so the model cannot see
+ * a channel being disabled and enabled again between two runs. Once a
+ * chain is done the DMA_DESC registers of the channel therefore read
+ * SIM_DESC_NONE, and the channel restarts when a new DCB address is
+ * written.
+ *
+ * Packets transmitted on a Tx channel are looped back to the Rx
+ * channels (sim_loopback=1) or discarded. A module header in front of
+ * a Tx packet (DCB bit 19) is not looped back. The model can also
+ * generate broadcast packets of its own (sim_rx_gen). Rx packets are
+ * preceded by a zeroed packet header of sim_pkt_hdr_size bytes, which
+ * must match the header size configured by the SDK. An Rx packet
+ * waits in a queue until an Rx channel has a DCB for it, and is
+ * dropped if the queue is full.
+ *
+ * DCB and packet buffer addresses are host physical addresses, which
+ * is what the DMA API of the simulated device returns. The bits in
+ * sim_dma_hi are removed from the upper address word first.
+ */
+
+#include <gmodule.h>
+#include <linux-bde.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/if_ether.h>
+#include <linux/slab.h>
+
+#include "linux_sim.h"
+
+/* Rx packet header size */
+static int sim_pkt_hdr_size = 64;
+LKM_MOD_PARAM(sim_pkt_hdr_size, "i", int, 0);
+MODULE_PARM_DESC(sim_pkt_hdr_size,
+"Rx packet header size of simulated devices, must match the SDK (default 64)");
+
+/* Loop Tx packets back to the Rx channels */
+static int sim_loopback = 1;
+LKM_MOD_PARAM(sim_loopback, "i", int, 0);
+MODULE_PARM_DESC(sim_loopback,
+"Loop packets transmitted on simulated devices back to Rx (default 1)");
+
+/* Generated Rx packets */
+static int sim_rx_gen = 0;
+LKM_MOD_PARAM(sim_rx_gen, "i", int, 0);
+MODULE_PARM_DESC(sim_rx_gen,
+"Rx packets generated by simulated devices per poll (default 0)");
+
+static int sim_rx_gen_size = 64;
+LKM_MOD_PARAM(sim_rx_gen_size, "i", int, 0);
+MODULE_PARM_DESC(sim_rx_gen_size,
+"Size of Rx packets generated by simulated devices (default 64)");
+
+/* DCBs per channel and poll */
+static int sim_budget = 64;
+LKM_MOD_PARAM(sim_budget, "i", int, 0);
+MODULE_PARM_DESC(sim_budget,
+"DCBs processed per DMA channel and poll on simulated devices (default 64)");
+
+/* Host memory select bits of the upper DMA address word */
+static uint32_t sim_dma_hi = 0x10000000;
+LKM_MOD_PARAM(sim_dma_hi, "i", uint, 0);
+MODULE_PARM_DESC(sim_dma_hi,
+"Bits removed from the upper DMA address word on simulated devices (default 0x10000000)");
+
+/* Register space */
+#define SIM_REG_SIZE            0x40000
+
+#define SIM_DMA_CHANNELS        8
+#define SIM_DMA_CTRLr(ch)       (0x2100 + 0x80 * (ch))
+#define SIM_DMA_DESC_LOr(ch)    (0x2104 + 0x80 * (ch))
+#define SIM_DMA_DESC_HIr(ch)    (0x2108 + 0x80 * (ch))
+#define SIM_DMA_HALT_LOr(ch)    (0x210c + 0x80 * (ch))
+#define SIM_DMA_HALT_HIr(ch)    (0x2110 + 0x80 * (ch))
+#define SIM_DMA_STATr(ch)       (0x2114 + 0x80 * (ch))
+#define SIM_IRQ_STATr           0x106c
+#define SIM_IRQ_STAT_CLRr       0x1074
+
+/* iProc registers */
+#define SIM_IRQ_ENABr           0x18013100
+#define SIM_IPROC_REGS          64
+
+/* DMA_CTRL */
+#define SIM_DC_DIRECTION        0x00000001 /* Tx */
+#define SIM_DC_ENABLE           0x00000002
+#define SIM_DC_ABORT            0x00000004
+#define SIM_DC_CTRLD_INT        0x00000080
+#define SIM_DC_CONTINUOUS       0x00000100
+
+/* DMA_STAT */
+#define SIM_DS_CHAIN_DONE       0x00000001
+#define SIM_DS_ACTIVE           0x00000002
+
+/* DMA_DESC of a channel which is done */
+#define SIM_DESC_NONE           0xffffffff
+
+/* IRQ_STAT */
+#define SIM_IRQ_DESC_DONE(ch)   (0x00000001 << ((ch) * 4))
+#define SIM_IRQ_CHAIN_DONE(ch)  (0x00000002 << ((ch) * 4))
+#define SIM_IRQ_CTRLD_INT(ch)   (0x00000008 << ((ch) * 4))
+
+/* DCB words 2 (control) and 3 (status) */
+#define SIM_DCB_SIZE            16
+#define SIM_DCB_COUNT_MASK      0x0000ffff
+#define SIM_DCB_CHAIN           (1 << 16)
+#define SIM_DCB_SG              (1 << 17)
+#define SIM_DCB_RELOAD          (1 << 18)
+#define SIM_DCB_HG              (1 << 19)
+#define SIM_DCB_DESC_INTR       (1 << 24)
+#define SIM_DCB_END             (1 << 16)
+#define SIM_DCB_START           (1 << 17)
+#define SIM_DCB_DONE            (1U << 31)
+
+/* Tx module header */
+#define SIM_TX_HDR_SIZE         16
+
+#define SIM_PKT_MAX             16384
+#define SIM_RXQ_SIZE            256
+
+#define SIM_REG(_s, _a)         ((_s)->regs[(_a) / 4])
+
+typedef struct sim_pkt_s {
+    int len;
+    uint8_t data[0];
+} sim_pkt_t;
+
+#define SIM_CHAN_IDLE           0
+#define SIM_CHAN_ACTIVE         1
+#define SIM_CHAN_DONE           2
+
+typedef struct sim_chan_s {
+    int state;
+    uint64_t cur;               /* DMA address of current DCB */
+    sim_pkt_t *pkt;             /* Packet being transferred */
+    int pkt_off;
+    unsigned long dcbs;
+    unsigned long pkts;
+    unsigned long long bytes;
+    unsigned long halts;        /* Runs ended at the halt address */
+    unsigned long errors;
+    unsigned long aborts;
+} sim_chan_t;
+
+struct lksim_s {
+    int unit;
+    volatile uint32_t *regs;
+    struct platform_device *pdev;
+    spinlock_t lock;            /* iProc registers */
+    uint32_t irq_enab;
+    int irq_force;              /* See lksim_irq_force */
+    int iproc_cnt;
+    struct {
+        uint32_t addr;
+        uint32_t data;
+    } iproc[SIM_IPROC_REGS];
+    sim_chan_t chan[SIM_DMA_CHANNELS];
+    int chan_next;
+    sim_pkt_t *rxq[SIM_RXQ_SIZE];
+    int rxq_head;
+    int rxq_cnt;
+    unsigned long runs;
+    unsigned long irqs;
+    unsigned long rx_gen;
+    unsigned long rx_drops;
+};
+
+/* Source MAC address of generated packets */
+static const uint8_t _sim_mac[ETH_ALEN] = { 0x02, 0x10, 0x18, 0x00, 0x00, 0x01 };
+
+static const char *_sim_chan_state[] = { "idle", "active", "done" };
+
+/*
+ * Function: _sim_dma_virt
+ *
+ * Purpose:
+ *    Get the kernel address of DMA memory.
+ * Parameters:
+ *    addr - DMA address
+ *    size - size of memory
+ * Returns:
+ *    Kernel address, NULL if the memory is not in the linear mapping
+ */
+static void *
+_sim_dma_virt(uint64_t addr, int size)
+{
+    unsigned long pfn, last;
+
+    addr &= ~((uint64_t)sim_dma_hi << 32);
+    if (size <= 0) {
+        size = 1;
+    }
+    pfn = (unsigned long)(addr >> PAGE_SHIFT);
+    last = (unsigned long)((addr + size - 1) >> PAGE_SHIFT);
+    if (!pfn_valid(pfn) || !pfn_valid(last) ||
+        PageHighMem(pfn_to_page(pfn)) || PageHighMem(pfn_to_page(last))) {
+        return NULL;
+    }
+    return phys_to_virt((phys_addr_t)addr);
+}
+
+static sim_pkt_t *
+_sim_pkt_alloc(int len)
+{
+    sim_pkt_t *pkt;
+
+    pkt = kmalloc(sizeof(*pkt) + len, GFP_ATOMIC);
+    if (pkt) {
+        pkt->len = len;
+    }
+    return pkt;
+}
+
+static void
+_sim_rxq_put(lksim_t *sim, sim_pkt_t *pkt)
+{
+    if (sim->rxq_cnt >= SIM_RXQ_SIZE) {
+        sim->rx_drops++;
+        kfree(pkt);
+        return;
+    }
+    sim->rxq[(sim->rxq_head + sim->rxq_cnt) % SIM_RXQ_SIZE] = pkt;
+    sim->rxq_cnt++;
+}
+
+static sim_pkt_t *
+_sim_rxq_get(lksim_t *sim)
+{
+    sim_pkt_t *pkt;
+
+    if (sim->rxq_cnt == 0) {
+        return NULL;
+    }
+    pkt = sim->rxq[sim->rxq_head];
+    sim->rxq_head = (sim->rxq_head + 1) % SIM_RXQ_SIZE;
+    sim->rxq_cnt--;
+    return pkt;
+}
+
+/*
+ * Function: _sim_rx_gen
+ *
+ * Purpose:
+ *    Queue generated Rx packets.
+ * Parameters:
+ *    sim - simulated device
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Packets are broadcast with the local experimental Ethertype and
+ *    include the CRC, like packets received from a port.
+ */
+static void
+_sim_rx_gen(lksim_t *sim)
+{
+    sim_pkt_t *pkt;
+    uint8_t *eth;
+    int len, i;
+
+    len = sim_rx_gen_size;
+    if (len < ETH_ZLEN) {
+        len = ETH_ZLEN;
+    }
+    if (len > SIM_PKT_MAX) {
+        len = SIM_PKT_MAX;
+    }
+    for (i = 0; i < sim_rx_gen; i++) {
+        if (sim->rxq_cnt >= SIM_RXQ_SIZE) {
+            sim->rx_drops += sim_rx_gen - i;
+            break;
+        }
+        pkt = _sim_pkt_alloc(sim_pkt_hdr_size + len + ETH_FCS_LEN);
+        if (pkt == NULL) {
+            sim->rx_drops++;
+            continue;
+        }
+        memset(pkt->data, 0, pkt->len);
+        eth = pkt->data + sim_pkt_hdr_size;
+        memset(eth, 0xff, ETH_ALEN);
+        memcpy(eth + ETH_ALEN, _sim_mac, ETH_ALEN);
+        eth[12] = ETH_P_802_EX1 >> 8;
+        eth[13] = ETH_P_802_EX1 & 0xff;
+        _sim_rxq_put(sim, pkt);
+        sim->rx_gen++;
+    }
+}
+
+/*
+ * Function: _sim_tx_dcb
+ *
+ * Purpose:
+ *    Transfer the buffer of a Tx DCB.
+ * Parameters:
+ *    sim - simulated device
+ *    chan - DMA channel
+ *    dcb - DCB
+ * Returns:
+ *    DCB status
+ * Notes:
+ *    The packet is assembled in the channel packet buffer, and looped
+ *    back or discarded after the last DCB of the packet.
+ */
+static uint32_t
+_sim_tx_dcb(lksim_t *sim, sim_chan_t *chan, volatile uint32_t *dcb)
+{
+    uint32_t ctrl = dcb[2];
+    uint32_t status = SIM_DCB_DONE;
+    uint64_t addr;
+    uint8_t *buf;
+    int len, skip = 0;
+
+    addr = ((uint64_t)dcb[1] << 32) | dcb[0];
+    len = ctrl & SIM_DCB_COUNT_MASK;
+    buf = _sim_dma_virt(addr, len);
+    if (buf == NULL) {
+        chan->errors++;
+        return status;
+    }
+
+    if (chan->pkt == NULL) {
+        chan->pkt = _sim_pkt_alloc(sim_pkt_hdr_size + SIM_PKT_MAX);
+        if (chan->pkt == NULL) {
+            chan->errors++;
+            return status;
+        }
+        chan->pkt_off = sim_pkt_hdr_size;
+        memset(chan->pkt->data, 0, sim_pkt_hdr_size);
+        status |= SIM_DCB_START;
+        if ((ctrl & SIM_DCB_HG) && len >= SIM_TX_HDR_SIZE) {
+            skip = SIM_TX_HDR_SIZE;
+        }
+    }
+    if (len - skip > chan->pkt->len - chan->pkt_off) {
+        chan->errors++;
+        skip = len;
+    }
+    memcpy(chan->pkt->data + chan->pkt_off, buf + skip, len - skip);
+    chan->pkt_off += len - skip;
+    chan->bytes += len;
+    status |= len;
+
+    if (ctrl & SIM_DCB_SG) {
+        return status;
+    }
+
+    /* Last DCB of the packet */
+    status |= SIM_DCB_END;
+    chan->pkts++;
+    if (sim_loopback) {
+        chan->pkt->len = chan->pkt_off;
+        _sim_rxq_put(sim, chan->pkt);
+    } else {
+        kfree(chan->pkt);
+    }
+    chan->pkt = NULL;
+
+    return status;
+}
+
+/*
+ * Function: _sim_rx_dcb
+ *
+ * Purpose:
+ *    Transfer the next queued Rx packet into the buffer of a Rx DCB.
+ * Parameters:
+ *    sim - simulated device
+ *    chan - DMA channel
+ *    dcb - DCB
+ * Returns:
+ *    DCB status, 0 if no packet is waiting
+ * Notes:
+ *    A packet larger than the buffer continues in the next DCB. It is
+ *    truncated if the chain ends first.
+ */
+static uint32_t
+_sim_rx_dcb(lksim_t *sim, sim_chan_t *chan, volatile uint32_t *dcb)
+{
+    uint32_t ctrl = dcb[2];
+    uint32_t status = SIM_DCB_DONE;
+    uint64_t addr;
+    uint8_t *buf;
+    int len;
+
+    if (chan->pkt == NULL) {
+        if ((chan->pkt = _sim_rxq_get(sim)) == NULL) {
+            return 0;
+        }
+        chan->pkt_off = 0;
+        status |= SIM_DCB_START;
+    }
+
+    addr = ((uint64_t)dcb[1] << 32) | dcb[0];
+    len = ctrl & SIM_DCB_COUNT_MASK;
+    if (len > chan->pkt->len - chan->pkt_off) {
+        len = chan->pkt->len - chan->pkt_off;
+    }
+    buf = _sim_dma_virt(addr, len);
+    if (buf == NULL) {
+        chan->errors++;
+        len = 0;
+    } else {
+        memcpy(buf, chan->pkt->data + chan->pkt_off, len);
+    }
+    chan->pkt_off += len;
+    chan->bytes += len;
+    status |= len;
+
+    if (buf && chan->pkt_off < chan->pkt->len && (ctrl & SIM_DCB_CHAIN)) {
+        return status;
+    }
+    if (chan->pkt_off < chan->pkt->len) {
+        chan->errors++;
+    }
+
+    /* Last DCB of the packet */
+    status |= SIM_DCB_END;
+    chan->pkts++;
+    kfree(chan->pkt);
+    chan->pkt = NULL;
+
+    return status;
+}
+
+/*
+ * Function: _sim_chan_done
+ *
+ * Purpose:
+ *    Stop a DMA channel at the end of a chain or on abort.
+ * Parameters:
+ *    sim - simulated device
+ *    ch - DMA channel
+ * Returns:
+ *    Nothing
+ */
+static void
+_sim_chan_done(lksim_t *sim, int ch)
+{
+    sim_chan_t *chan = &sim->chan[ch];
+
+    chan->state = SIM_CHAN_DONE;
+    if (chan->pkt) {
+        /* Partial packet */
+        chan->errors++;
+        kfree(chan->pkt);
+        chan->pkt = NULL;
+    }
+    SIM_REG(sim, SIM_DMA_DESC_LOr(ch)) = SIM_DESC_NONE;
+    SIM_REG(sim, SIM_DMA_DESC_HIr(ch)) = SIM_DESC_NONE;
+    SIM_REG(sim, SIM_DMA_STATr(ch)) = SIM_DS_CHAIN_DONE;
+}
+
+/*
+ * Function: _sim_chan_run
+ *
+ * Purpose:
+ *    Process the DCBs of a DMA channel.
+ * Parameters:
+ *    sim - simulated device
+ *    ch - DMA channel
+ *    irq_stat - (IN/OUT) interrupt status
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    At most sim_budget DCBs are processed per run. In continuous
+ *    mode the channel stops at the halt address, and resumes once
+ *    the halt address is moved.
+ */
+static void
+_sim_chan_run(lksim_t *sim, int ch, uint32_t *irq_stat)
+{
+    sim_chan_t *chan = &sim->chan[ch];
+    volatile uint32_t *dcb;
+    uint32_t ctrl, status;
+    uint64_t halt;
+    int n;
+
+    ctrl = SIM_REG(sim, SIM_DMA_CTRLr(ch));
+    if (!(ctrl & SIM_DC_ENABLE)) {
+        /* Disabling the channel clears chain done */
+        if (chan->state != SIM_CHAN_IDLE) {
+            if (chan->state == SIM_CHAN_ACTIVE) {
+                _sim_chan_done(sim, ch);
+            }
+            chan->state = SIM_CHAN_IDLE;
+            SIM_REG(sim, SIM_DMA_STATr(ch)) = 0;
+            *irq_stat &= ~SIM_IRQ_CHAIN_DONE(ch);
+        }
+        return;
+    }
+    if (ctrl & SIM_DC_ABORT) {
+        if (chan->state == SIM_CHAN_ACTIVE) {
+            chan->aborts++;
+            _sim_chan_done(sim, ch);
+        }
+        return;
+    }
+    if (chan->state == SIM_CHAN_DONE) {
+        if (SIM_REG(sim, SIM_DMA_DESC_LOr(ch)) == SIM_DESC_NONE ||
+            SIM_REG(sim, SIM_DMA_DESC_HIr(ch)) == SIM_DESC_NONE) {
+            return;
+        }
+        /* New chain written */
+        *irq_stat &= ~SIM_IRQ_CHAIN_DONE(ch);
+        chan->state = SIM_CHAN_IDLE;
+    }
+    if (chan->state == SIM_CHAN_IDLE) {
+        chan->cur = ((uint64_t)SIM_REG(sim, SIM_DMA_DESC_HIr(ch)) << 32) |
+                    SIM_REG(sim, SIM_DMA_DESC_LOr(ch));
+        chan->state = SIM_CHAN_ACTIVE;
+        SIM_REG(sim, SIM_DMA_STATr(ch)) = SIM_DS_ACTIVE;
+    }
+
+    for (n = 0; n < sim_budget; n++) {
+        if (ctrl & SIM_DC_CONTINUOUS) {
+            halt = ((uint64_t)SIM_REG(sim, SIM_DMA_HALT_HIr(ch)) << 32) |
+                   SIM_REG(sim, SIM_DMA_HALT_LOr(ch));
+            if (((chan->cur ^ halt) & ~((uint64_t)sim_dma_hi << 32)) == 0) {
+                chan->halts++;
+                break;
+            }
+        }
+        dcb = _sim_dma_virt(chan->cur, SIM_DCB_SIZE);
+        if (dcb == NULL) {
+            chan->errors++;
+            _sim_chan_done(sim, ch);
+            *irq_stat |= SIM_IRQ_CHAIN_DONE(ch);
+            break;
+        }
+        rmb();
+        if (dcb[2] & SIM_DCB_RELOAD) {
+            chan->cur = ((uint64_t)dcb[1] << 32) | dcb[0];
+            dcb[3] = SIM_DCB_DONE;
+            continue;
+        }
+        if (ctrl & SIM_DC_DIRECTION) {
+            status = _sim_tx_dcb(sim, chan, dcb);
+        } else {
+            status = _sim_rx_dcb(sim, chan, dcb);
+        }
+        if (status == 0) {
+            /* No Rx packet waiting */
+            break;
+        }
+        wmb();
+        dcb[3] = status;
+        chan->dcbs++;
+
+        if (ctrl & SIM_DC_CONTINUOUS) {
+            if ((ctrl & SIM_DC_CTRLD_INT) && (dcb[2] & SIM_DCB_DESC_INTR)) {
+                *irq_stat |= SIM_IRQ_CTRLD_INT(ch);
+            }
+        } else if (status & SIM_DCB_END) {
+            *irq_stat |= SIM_IRQ_DESC_DONE(ch);
+        }
+        if (!(dcb[2] & SIM_DCB_CHAIN)) {
+            _sim_chan_done(sim, ch);
+            *irq_stat |= SIM_IRQ_CHAIN_DONE(ch);
+            break;
+        }
+        chan->cur += SIM_DCB_SIZE;
+    }
+}
+
+/*
+ * Function: lksim_run
+ *
+ * Purpose:
+ *    Run the DMA engine of a simulated device.
+ * Parameters:
+ *    sim - simulated device
+ * Returns:
+ *    1 if an enabled interrupt is pending, 0 otherwise
+ * Notes:
+ *    Called from the interrupt poll timer of the device, so runs of a
+ *    device never overlap. The first channel is rotated to share the
+ *    Rx packets among the Rx channels.
+ */
+int
+lksim_run(lksim_t *sim)
+{
+    uint32_t irq_stat, clr;
+    int n;
+
+    sim->runs++;
+
+    clr = xchg((uint32_t *)&SIM_REG(sim, SIM_IRQ_STAT_CLRr), 0);
+    irq_stat = SIM_REG(sim, SIM_IRQ_STATr) & ~clr;
+
+    if (sim_rx_gen > 0) {
+        _sim_rx_gen(sim);
+    }
+    for (n = 0; n < SIM_DMA_CHANNELS; n++) {
+        _sim_chan_run(sim, (sim->chan_next + n) % SIM_DMA_CHANNELS,
+                      &irq_stat);
+    }
+    sim->chan_next = (sim->chan_next + 1) % SIM_DMA_CHANNELS;
+
+    SIM_REG(sim, SIM_IRQ_STATr) = irq_stat;
+    wmb();
+
+    if ((irq_stat & sim->irq_enab) || sim->irq_force) {
+        sim->irqs++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: lksim_irq_force
+ *
+ * Purpose:
+ *    Hold an interrupt of a simulated device pending.
+ * Parameters:
+ *    sim - simulated device
+ *    on - non-zero to raise the interrupt, 0 to release it
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Used to test interrupt dispatch. Like a level interrupt the
+ *    interrupt is reported by every run until it is released,
+ *    regardless of IRQ_STAT and IRQ_ENAB.
+ */
+void
+lksim_irq_force(lksim_t *sim, int on)
+{
+    sim->irq_force = on;
+}
+
+/*
+ * Function: lksim_iproc_read
+ *
+ * Purpose:
+ *    Read an iProc register of a simulated device.
+ * Parameters:
+ *    sim - simulated device
+ *    addr - iProc register address
+ * Returns:
+ *    Last value written, 0 if the register was never written
+ */
+uint32_t
+lksim_iproc_read(lksim_t *sim, uint32_t addr)
+{
+    unsigned long flags;
+    uint32_t data = 0;
+    int i;
+
+    if (addr == SIM_IRQ_ENABr) {
+        return sim->irq_enab;
+    }
+    spin_lock_irqsave(&sim->lock, flags);
+    for (i = 0; i < sim->iproc_cnt; i++) {
+        if (sim->iproc[i].addr == addr) {
+            data = sim->iproc[i].data;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&sim->lock, flags);
+    return data;
+}
+
+/*
+ * Function: lksim_iproc_write
+ *
+ * Purpose:
+ *    Write an iProc register of a simulated device.
+ * Parameters:
+ *    sim - simulated device
+ *    addr - iProc register address
+ *    data - register value
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Only IRQ_ENAB has an effect. Other registers just keep their
+ *    value, up to SIM_IPROC_REGS of them.
+ */
+void
+lksim_iproc_write(lksim_t *sim, uint32_t addr, uint32_t data)
+{
+    unsigned long flags;
+    int i;
+
+    if (addr == SIM_IRQ_ENABr) {
+        sim->irq_enab = data;
+        return;
+    }
+    spin_lock_irqsave(&sim->lock, flags);
+    for (i = 0; i < sim->iproc_cnt; i++) {
+        if (sim->iproc[i].addr == addr) {
+            break;
+        }
+    }
+    if (i < SIM_IPROC_REGS) {
+        sim->iproc[i].addr = addr;
+        sim->iproc[i].data = data;
+        if (i == sim->iproc_cnt) {
+            sim->iproc_cnt++;
+        }
+    }
+    spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+void *
+lksim_regs(lksim_t *sim, resource_size_t *phys)
+{
+    if (phys) {
+        *phys = virt_to_phys((void *)sim->regs);
+    }
+    return (void *)sim->regs;
+}
+
+struct device *
+lksim_dma_dev(lksim_t *sim)
+{
+    return &sim->pdev->dev;
+}
+
+/*
+ * Function: lksim_pprint
+ *
+ * Purpose:
+ *    Print the state of a simulated device to proc.
+ * Parameters:
+ *    sim - simulated device
+ * Returns:
+ *    Nothing
+ */
+void
+lksim_pprint(lksim_t *sim)
+{
+    sim_chan_t *chan;
+    int ch;
+
+    pprintf("\t\tSimulated CMICx: %lu runs, %lu interrupts, "
+            "Rx queue %d, %lu generated, %lu dropped\n",
+            sim->runs, sim->irqs, sim->rxq_cnt, sim->rx_gen, sim->rx_drops);
+    for (ch = 0; ch < SIM_DMA_CHANNELS; ch++) {
+        chan = &sim->chan[ch];
+        if (chan->state == SIM_CHAN_IDLE && chan->dcbs == 0) {
+            continue;
+        }
+        pprintf("\t\tDMA %d (%s): %s, %lu DCBs, %lu packets, %llu bytes, "
+                "%lu halts, %lu errors, %lu aborts\n", ch,
+                (SIM_REG(sim, SIM_DMA_CTRLr(ch)) & SIM_DC_DIRECTION) ?
+                "tx" : "rx",
+                _sim_chan_state[chan->state], chan->dcbs, chan->pkts,
+                chan->bytes, chan->halts, chan->errors, chan->aborts);
+    }
+}
+
+/*
+ * Function: lksim_create
+ *
+ * Purpose:
+ *    Create a simulated device.
+ * Parameters:
+ *    unit - device number
+ * Returns:
+ *    Simulated device, NULL on error
+ * Notes:
+ *    The register space is physically contiguous, so it can be
+ *    mapped to user space like the BAR of a real device. A platform
+ *    device without address translation provides the DMA API.
+ */
+lksim_t *
+lksim_create(int unit)
+{
+    lksim_t *sim;
+
+    if ((sim = kmalloc(sizeof(*sim), GFP_KERNEL)) == NULL) {
+        return NULL;
+    }
+    memset(sim, 0, sizeof(*sim));
+    sim->unit = unit;
+    spin_lock_init(&sim->lock);
+
+    sim->regs = (uint32_t *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+                                             get_order(SIM_REG_SIZE));
+    if (sim->regs == NULL) {
+        kfree(sim);
+        return NULL;
+    }
+
+    sim->pdev = platform_device_register_simple("linux-kernel-bde-sim",
+                                                unit, NULL, 0);
+    if (IS_ERR(sim->pdev)) {
+        free_pages((unsigned long)sim->regs, get_order(SIM_REG_SIZE));
+        kfree(sim);
+        return NULL;
+    }
+    sim->pdev->dev.coherent_dma_mask = DMA_BIT_MASK(64);
+    sim->pdev->dev.dma_mask = &sim->pdev->dev.coherent_dma_mask;
+
+    return sim;
+}
+
+/*
+ * Function: lksim_destroy
+ *
+ * Purpose:
+ *    Destroy a simulated device.
+ * Parameters:
+ *    sim - simulated device
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    The interrupt poll timer of the device must be stopped.
+ */
+void
+lksim_destroy(lksim_t *sim)
+{
+    int ch;
+
+    for (ch = 0; ch < SIM_DMA_CHANNELS; ch++) {
+        kfree(sim->chan[ch].pkt);
+    }
+    while (sim->rxq_cnt > 0) {
+        kfree(_sim_rxq_get(sim));
+    }
+    platform_device_unregister(sim->pdev);
+    free_pages((unsigned long)sim->regs, get_order(SIM_REG_SIZE));
+    kfree(sim);
+}
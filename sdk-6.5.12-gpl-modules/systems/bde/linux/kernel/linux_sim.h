@@ -0,0 +1,41 @@
+/*
+ * Copyright 2017 Broadcom
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation (the "GPL").
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License version 2 (GPLv2) for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 (GPLv2) along with this source code.
+ */
+/*
+ * $Id: $
+ * $Copyright: (c) 2017 Broadcom Corp.
+ * All Rights Reserved.$
+ *
+ * Software model of a CMICx device, see linux_sim.c
+ */
+
+#ifndef __LINUX_SIM_H__
+#define __LINUX_SIM_H__
+
+struct device;
+
+typedef struct lksim_s lksim_t;
+
+extern lksim_t *lksim_create(int unit);
+extern void lksim_destroy(lksim_t *sim);
+extern void *lksim_regs(lksim_t *sim, resource_size_t *phys);
+extern struct device *lksim_dma_dev(lksim_t *sim);
+extern int lksim_run(lksim_t *sim);
+extern void lksim_irq_force(lksim_t *sim, int on);
+extern uint32_t lksim_iproc_read(lksim_t *sim, uint32_t addr);
+extern void lksim_iproc_write(lksim_t *sim, uint32_t addr, uint32_t data);
+extern void lksim_pprint(lksim_t *sim);
+
+#endif /* __LINUX_SIM_H__ */
@@ -28,6 +28,8 @@
  */
 
 #include <lkm.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
 
 /*
  * We cannot use the linux kernel SAL for MALLOC/FREE because 
@@ -36,11 +38,30 @@
  */
 #define MALLOC(x) kmalloc(x, GFP_ATOMIC)
 #define FREE(x) kfree(x)
+#define MALLOC_LARGE(x) vmalloc(x)
+#define FREE_LARGE(x) vfree(x)
 
 static spinlock_t _mpool_lock;
 #define MPOOL_LOCK_INIT() spin_lock_init(&_mpool_lock)
 #define MPOOL_LOCK() unsigned long flags; spin_lock_irqsave(&_mpool_lock, flags)
 #define MPOOL_UNLOCK() spin_unlock_irqrestore(&_mpool_lock, flags)
+#define MPOOL_LOCK_COUNT(_cnt) \
+    unsigned long flags; \
+    if (!spin_trylock_irqsave(&_mpool_lock, flags)) { \
+        spin_lock_irqsave(&_mpool_lock, flags); \
+        (_cnt)++; \
+    }
+
+/* Per-CPU magazines are accessed with local interrupts disabled */
+#define MPOOL_MAG_LOCK() unsigned long mflags; local_irq_save(mflags)
+#define MPOOL_MAG_UNLOCK() local_irq_restore(mflags)
+#define MPOOL_MAG_GET(_pool) \
+    ((_pool)->mags ? &(_pool)->mags[smp_processor_id()] : NULL)
+
+/* Slab block ownership bits are updated without the mpool lock */
+#define MPOOL_BIT_SET(_bit, _map) set_bit(_bit, _map)
+#define MPOOL_BIT_TEST_CLEAR(_bit, _map) test_and_clear_bit(_bit, _map)
+#define MPOOL_BIT_TEST(_bit, _map) test_bit(_bit, _map)
 
 #else /* !__KERNEL__*/
 
@@ -49,15 +70,40 @@ static spinlock_t _mpool_lock;
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <sal/core/sync.h>
 
 #define MALLOC(x) malloc(x)
 #define FREE(x) free(x)
+#define MALLOC_LARGE(x) malloc(x)
+#define FREE_LARGE(x) free(x)
 
 static sal_sem_t _mpool_lock;
 #define MPOOL_LOCK_INIT() _mpool_lock = sal_sem_create("mpool_lock", 1, 1)
 #define MPOOL_LOCK() sal_sem_take(_mpool_lock, sal_sem_FOREVER)
 #define MPOOL_UNLOCK() sal_sem_give(_mpool_lock)
+#define MPOOL_LOCK_COUNT(_cnt) \
+    if (sal_sem_take(_mpool_lock, 0) != 0) { \
+        sal_sem_take(_mpool_lock, sal_sem_FOREVER); \
+        (_cnt)++; \
+    }
+
+/* Per-thread magazines need no locking */
+#define MPOOL_MAG_LOCK()
+#define MPOOL_MAG_UNLOCK()
+#define MPOOL_MAG_GET(_pool) _mpool_tcache_get(_pool)
+
+/* Slab block ownership bits are updated without the mpool lock */
+#define MPOOL_WORD(_bit) ((_bit) / (8 * sizeof(unsigned long)))
+#define MPOOL_MASK(_bit) (1UL << ((_bit) % (8 * sizeof(unsigned long))))
+#define MPOOL_BIT_SET(_bit, _map) \
+    __sync_fetch_and_or(&(_map)[MPOOL_WORD(_bit)], MPOOL_MASK(_bit))
+#define MPOOL_BIT_TEST_CLEAR(_bit, _map) \
+    ((__sync_fetch_and_and(&(_map)[MPOOL_WORD(_bit)], ~MPOOL_MASK(_bit)) & \
+      MPOOL_MASK(_bit)) != 0)
+#define MPOOL_BIT_TEST(_bit, _map) \
+    (((_map)[MPOOL_WORD(_bit)] & MPOOL_MASK(_bit)) != 0)
 
 #endif /* __KERNEL__ */
 
@@ -70,12 +116,203 @@ static sal_sem_t _mpool_lock;
 #endif
 #endif
 
+/*
+ * The mpool is managed as a slab allocator:
+ *
+ * Size classes are multiples of the cache line size, and requests up to
+ * the largest size class are served from the slabs of that class. A slab
+ * is one chunk of pool memory, aligned to the chunk size, so the slab of
+ * a block is found from the block address.
+ *
+ * Each slab keeps its own list of free blocks (the link is stored in
+ * the first word of the free block), and each size class keeps a list
+ * of slabs with free blocks, so both allocation and free of a small
+ * block are O(1). A slab is returned to the free memory when its last
+ * block is freed.
+ *
+ * Memory that is not used by slabs is kept in an address-ordered list
+ * of free extents with cache line granularity. Slabs are carved from
+ * the lowest extent that holds an aligned chunk. Larger requests are
+ * rounded up to whole cache lines and carved from the end of the
+ * smallest extent that fits. Freed extents are merged with their free
+ * neighbours. All extent descriptors are allocated in mpool_create.
+ *
+ * Each slab has a bitmap of the blocks handed out by mpool_alloc, and a
+ * large block is looked up in the chunk it starts in, so mpool_free can
+ * drop addresses that are not allocated or already freed.
+ *
+ * Blocks of the smaller size classes are additionally cached in
+ * magazines, one per CPU in the kernel and one per thread in user
+ * mode. A magazine hit does not touch the global mpool lock. A miss
+ * refills (and a full magazine drains) half a magazine in one locked
+ * operation.
+ */
+
+/* Size classes in number of cache lines */
+static const int _mpool_class_lines[] = {
+    1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256
+};
+#define MPOOL_NUM_CLASSES \
+    ((int)(sizeof(_mpool_class_lines) / sizeof(_mpool_class_lines[0])))
+#define MPOOL_MAX_LINES         256
+
+/* Chunk size in number of cache lines */
+#define MPOOL_CHUNK_LINES       (4 * MPOOL_MAX_LINES)
+
+/* Chunk type of chunks that are not a slab (others are size classes) */
+#define MPOOL_CHUNK_NONE        -1
+
+#define MPOOL_NONE              -1
+
+/* Round cache line index up to chunk boundary */
+#define MPOOL_CHUNK_ALIGN(_line) \
+    (((_line) + MPOOL_CHUNK_LINES - 1) / MPOOL_CHUNK_LINES * MPOOL_CHUNK_LINES)
+
+/* Bitmap of blocks handed out from a slab (one bit per block) */
+#define MPOOL_OWNED_WORDS \
+    (MPOOL_CHUNK_LINES / (int)(8 * sizeof(unsigned long)))
+#define MPOOL_OWNED(_pool, _ci) (&(_pool)->owned[(_ci) * MPOOL_OWNED_WORDS])
+
+/* Size classes cached in magazines (blocks up to 16 cache lines) */
+#define MPOOL_MAG_CLASSES       8
+#define MPOOL_MAG_SIZE          8
+#define MPOOL_MAG_BATCH         (MPOOL_MAG_SIZE / 2)
+
+typedef struct mpool_mag_s {
+    int cnt[MPOOL_MAG_CLASSES];
+    void *blk[MPOOL_MAG_CLASSES][MPOOL_MAG_SIZE];
+    int cached;                 /* Bytes held in this magazine */
+    unsigned long hits;         /* Served from magazine */
+    unsigned long misses;       /* Required magazine refill */
+} mpool_mag_t;
+
+typedef struct mpool_ext_s {
+    int start;                  /* First cache line */
+    int lines;                  /* Length in cache lines */
+    int next;                   /* Next extent in list */
+} mpool_ext_t;
+
+typedef struct mpool_chunk_s {
+    int type;                   /* Size class or MPOOL_CHUNK_NONE */
+    int used;                   /* Blocks in use (slab only) */
+    int free_off;               /* First free block (slab only) */
+    int carve_off;              /* First never used block (slab only) */
+    int next;                   /* Next slab with free blocks */
+    int prev;                   /* Previous slab with free blocks */
+    int large;                  /* Large blocks starting in this chunk */
+} mpool_chunk_t;
+
 typedef struct mpool_mem_s {
-    unsigned char *address;
-    int size;
-    struct mpool_mem_s *next;
+    unsigned char *address;     /* Start of pool memory */
+    int size;                   /* Usable size of pool memory */
+    int lines;                  /* Usable size in cache lines */
+    int chunk_size;             /* Size of each chunk in bytes */
+    int nchunks;                /* Number of chunks (last may be partial) */
+    int free_ext;               /* Free extents in address order */
+    int spare_ext;              /* Unused extent descriptors */
+    int used;                   /* Bytes currently allocated */
+    int peak;                   /* Highest value of used */
+    int class_size[MPOOL_NUM_CLASSES];
+    int class_blocks[MPOOL_NUM_CLASSES]; /* Blocks allocated from slabs */
+    int large_blocks;           /* Large blocks allocated */
+    unsigned long alloc_fails;  /* Allocations that failed */
+    unsigned long bad_frees;    /* Frees of unknown or free blocks */
+    int partial[MPOOL_NUM_CLASSES]; /* Slabs with free blocks */
+    unsigned char line_class[MPOOL_MAX_LINES + 1];
+    mpool_chunk_t *chunks;
+    mpool_ext_t *ext;           /* Extent descriptors */
+    unsigned long *owned;       /* Blocks handed out, per slab */
+    mpool_mag_t *mags;          /* Per-CPU magazines (kernel only) */
+    unsigned long contended;    /* Lock acquisitions that had to wait */
+    unsigned long hits;         /* Hits of retired magazines */
+    unsigned long misses;       /* Misses of retired magazines */
 } mpool_mem_t;
 
+#define MPOOL_LINK(_pool, _ci, _off) \
+    (*(int *)((_pool)->address + (_ci) * (_pool)->chunk_size + (_off)))
+
+#ifndef __KERNEL__
+
+/*
+ * User mode keeps one magazine per thread. The magazine is bound to the
+ * first pool it is used with, and it is flushed back to that pool when
+ * the thread exits.
+ */
+typedef struct mpool_tcache_s {
+    mpool_mem_t *pool;
+    struct mpool_tcache_s *next;
+    mpool_mag_t mag;
+} mpool_tcache_t;
+
+static __thread mpool_tcache_t *_mpool_tcache;
+static mpool_tcache_t *_mpool_tcache_list;
+static pthread_key_t _mpool_tcache_key;
+
+static void _mpool_class_free(mpool_mem_t *pool, int ci, int off);
+
+/*
+ * Flush magazine of exiting thread.
+ */
+static void
+_mpool_tcache_exit(void *arg)
+{
+    mpool_tcache_t *tc = (mpool_tcache_t *)arg;
+    mpool_tcache_t **tcp;
+    mpool_mem_t *pool;
+    unsigned char *address;
+    int cls, ci;
+
+    MPOOL_LOCK();
+
+    pool = tc->pool;
+    if (pool) {
+        pool->hits += tc->mag.hits;
+        pool->misses += tc->mag.misses;
+    }
+    for (cls = 0; pool && cls < MPOOL_MAG_CLASSES; cls++) {
+        while (tc->mag.cnt[cls] > 0) {
+            address = tc->mag.blk[cls][--tc->mag.cnt[cls]];
+            ci = (address - pool->address) / pool->chunk_size;
+            _mpool_class_free(pool, ci,
+                              address - pool->address - ci * pool->chunk_size);
+        }
+    }
+    for (tcp = &_mpool_tcache_list; *tcp; tcp = &(*tcp)->next) {
+        if (*tcp == tc) {
+            *tcp = tc->next;
+            break;
+        }
+    }
+
+    MPOOL_UNLOCK();
+
+    FREE(tc);
+}
+
+static mpool_mag_t *
+_mpool_tcache_get(mpool_mem_t *pool)
+{
+    mpool_tcache_t *tc = _mpool_tcache;
+
+    if (tc == NULL) {
+        tc = (mpool_tcache_t *)MALLOC(sizeof(mpool_tcache_t));
+        if (tc == NULL) {
+            return NULL;
+        }
+        memset(tc, 0, sizeof(*tc));
+        tc->pool = pool;
+        _mpool_tcache = tc;
+        pthread_setspecific(_mpool_tcache_key, tc);
+        MPOOL_LOCK();
+        tc->next = _mpool_tcache_list;
+        _mpool_tcache_list = tc;
+        MPOOL_UNLOCK();
+    }
+    return (tc->pool == pool) ? &tc->mag : NULL;
+}
+
+#endif /* !__KERNEL__ */
+
 /*
  * Function: mpool_init
  *
@@ -90,12 +327,440 @@ int
 mpool_init(void)
 {
     MPOOL_LOCK_INIT();
+#ifndef __KERNEL__
+    pthread_key_create(&_mpool_tcache_key, _mpool_tcache_exit);
+#endif
     return 0;
 }
 
-#ifdef TRACK_DMA_USAGE
-static int _dma_mem_used = 0;
-#endif
+/*
+ * Update high-water mark after allocation. Assumes mpool lock is held.
+ */
+#define MPOOL_PEAK_UPDATE(_pool) \
+    if ((_pool)->used > (_pool)->peak) { \
+        (_pool)->peak = (_pool)->used; \
+    }
+
+/*
+ * Get and put extent descriptors. Assumes mpool lock is held.
+ */
+static int
+_mpool_ext_get(mpool_mem_t *pool)
+{
+    int e = pool->spare_ext;
+
+    if (e != MPOOL_NONE) {
+        pool->spare_ext = pool->ext[e].next;
+    }
+    return e;
+}
+
+static void
+_mpool_ext_put(mpool_mem_t *pool, int e)
+{
+    pool->ext[e].next = pool->spare_ext;
+    pool->spare_ext = e;
+}
+
+/*
+ * Carve a run of free cache lines. A slab is aligned to the chunk size
+ * and taken from the lowest extent that fits, other runs are taken from
+ * the end of the smallest extent that fits. Assumes mpool lock is held.
+ * Returns first cache line of run or MPOOL_NONE.
+ */
+static int
+_mpool_lines_get(mpool_mem_t *pool, int lines, int slab)
+{
+    mpool_ext_t *ext = pool->ext;
+    int e, prev, best, best_prev, start, tail, split;
+
+    best = best_prev = MPOOL_NONE;
+    for (prev = MPOOL_NONE, e = pool->free_ext; e != MPOOL_NONE;
+         prev = e, e = ext[e].next) {
+        if (slab) {
+            start = MPOOL_CHUNK_ALIGN(ext[e].start);
+            if (start + lines <= ext[e].start + ext[e].lines) {
+                best = e;
+                best_prev = prev;
+                break;
+            }
+        } else if (ext[e].lines >= lines &&
+                   (best == MPOOL_NONE || ext[e].lines < ext[best].lines)) {
+            best = e;
+            best_prev = prev;
+        }
+    }
+    if (best == MPOOL_NONE) {
+        return MPOOL_NONE;
+    }
+
+    e = best;
+    if (slab) {
+        start = MPOOL_CHUNK_ALIGN(ext[e].start);
+    } else {
+        start = ext[e].start + ext[e].lines - lines;
+    }
+    tail = ext[e].start + ext[e].lines - (start + lines);
+
+    if (start > ext[e].start && tail > 0) {
+        /* Run is inside the extent, the tail needs its own descriptor */
+        split = _mpool_ext_get(pool);
+        if (split == MPOOL_NONE) {
+            return MPOOL_NONE;
+        }
+        ext[split].start = start + lines;
+        ext[split].lines = tail;
+        ext[split].next = ext[e].next;
+        ext[e].next = split;
+        ext[e].lines = start - ext[e].start;
+    } else if (start > ext[e].start) {
+        ext[e].lines -= lines;
+    } else if (tail > 0) {
+        ext[e].start += lines;
+        ext[e].lines -= lines;
+    } else {
+        /* Extent is used up */
+        if (best_prev == MPOOL_NONE) {
+            pool->free_ext = ext[e].next;
+        } else {
+            ext[best_prev].next = ext[e].next;
+        }
+        _mpool_ext_put(pool, e);
+    }
+    return start;
+}
+
+/*
+ * Insert extent into the free extents, merging it with its free
+ * neighbours. The descriptor is released if the extent is merged.
+ * Assumes mpool lock is held.
+ */
+static void
+_mpool_lines_put(mpool_mem_t *pool, int e)
+{
+    mpool_ext_t *ext = pool->ext;
+    int prev, next;
+
+    for (prev = MPOOL_NONE, next = pool->free_ext;
+         next != MPOOL_NONE && ext[next].start < ext[e].start;
+         prev = next, next = ext[next].next) {
+        ;
+    }
+    ext[e].next = next;
+    if (prev == MPOOL_NONE) {
+        pool->free_ext = e;
+    } else {
+        ext[prev].next = e;
+    }
+    if (next != MPOOL_NONE && ext[e].start + ext[e].lines == ext[next].start) {
+        ext[e].lines += ext[next].lines;
+        ext[e].next = ext[next].next;
+        _mpool_ext_put(pool, next);
+    }
+    if (prev != MPOOL_NONE && ext[prev].start + ext[prev].lines == ext[e].start) {
+        ext[prev].lines += ext[e].lines;
+        ext[prev].next = ext[e].next;
+        _mpool_ext_put(pool, e);
+    }
+}
+
+static void
+_mpool_partial_add(mpool_mem_t *pool, int cls, int ci)
+{
+    mpool_chunk_t *chunk = &pool->chunks[ci];
+
+    chunk->prev = MPOOL_NONE;
+    chunk->next = pool->partial[cls];
+    if (chunk->next != MPOOL_NONE) {
+        pool->chunks[chunk->next].prev = ci;
+    }
+    pool->partial[cls] = ci;
+}
+
+static void
+_mpool_partial_del(mpool_mem_t *pool, int cls, int ci)
+{
+    mpool_chunk_t *chunk = &pool->chunks[ci];
+
+    if (chunk->prev != MPOOL_NONE) {
+        pool->chunks[chunk->prev].next = chunk->next;
+    } else {
+        pool->partial[cls] = chunk->next;
+    }
+    if (chunk->next != MPOOL_NONE) {
+        pool->chunks[chunk->next].prev = chunk->prev;
+    }
+    chunk->next = chunk->prev = MPOOL_NONE;
+}
+
+/*
+ * Allocate block from size class. Assumes mpool lock is held.
+ */
+static void *
+_mpool_class_alloc(mpool_mem_t *pool, int cls)
+{
+    mpool_chunk_t *chunk;
+    int csize = pool->class_size[cls];
+    int ci, off, line;
+
+    ci = pool->partial[cls];
+    if (ci == MPOOL_NONE) {
+        /* Create new slab */
+        line = _mpool_lines_get(pool, MPOOL_CHUNK_LINES, 1);
+        if (line == MPOOL_NONE) {
+            return NULL;
+        }
+        ci = line / MPOOL_CHUNK_LINES;
+        chunk = &pool->chunks[ci];
+        chunk->type = cls;
+        chunk->used = 0;
+        chunk->free_off = MPOOL_NONE;
+        chunk->carve_off = 0;
+        _mpool_partial_add(pool, cls, ci);
+    }
+    chunk = &pool->chunks[ci];
+
+    if (chunk->free_off != MPOOL_NONE) {
+        off = chunk->free_off;
+        chunk->free_off = MPOOL_LINK(pool, ci, off);
+    } else {
+        off = chunk->carve_off;
+        chunk->carve_off += csize;
+    }
+    chunk->used++;
+
+    /* Slab is full when no free blocks are left */
+    if (chunk->free_off == MPOOL_NONE &&
+        chunk->carve_off + csize > pool->chunk_size) {
+        _mpool_partial_del(pool, cls, ci);
+    }
+
+    pool->used += csize;
+    pool->class_blocks[cls]++;
+    MPOOL_PEAK_UPDATE(pool);
+
+    return pool->address + ci * pool->chunk_size + off;
+}
+
+/*
+ * Return block to its slab. Assumes mpool lock is held.
+ */
+static void
+_mpool_class_free(mpool_mem_t *pool, int ci, int off)
+{
+    mpool_chunk_t *chunk = &pool->chunks[ci];
+    int cls = chunk->type;
+    int csize = pool->class_size[cls];
+    int was_full, e;
+
+    was_full = (chunk->free_off == MPOOL_NONE &&
+                chunk->carve_off + csize > pool->chunk_size);
+
+    MPOOL_LINK(pool, ci, off) = chunk->free_off;
+    chunk->free_off = off;
+    chunk->used--;
+    pool->used -= csize;
+    pool->class_blocks[cls]--;
+
+    if (chunk->used == 0) {
+        /* Return empty slab to free chunks */
+        if (!was_full) {
+            _mpool_partial_del(pool, cls, ci);
+        }
+        chunk->type = MPOOL_CHUNK_NONE;
+        /* Enough descriptors exist for every free extent, see mpool_create */
+        e = _mpool_ext_get(pool);
+        if (e != MPOOL_NONE) {
+            pool->ext[e].start = ci * MPOOL_CHUNK_LINES;
+            pool->ext[e].lines = MPOOL_CHUNK_LINES;
+            _mpool_lines_put(pool, e);
+        }
+    } else if (was_full) {
+        _mpool_partial_add(pool, cls, ci);
+    }
+}
+
+/*
+ * Allocate large block with cache line granularity. Assumes mpool lock
+ * is held.
+ */
+static void *
+_mpool_large_alloc(mpool_mem_t *pool, int size)
+{
+    mpool_chunk_t *chunk;
+    int lines, start, e;
+
+    lines = (size + BCM_CACHE_LINE_BYTES - 1) / BCM_CACHE_LINE_BYTES;
+    e = _mpool_ext_get(pool);
+    if (e == MPOOL_NONE) {
+        return NULL;
+    }
+    start = _mpool_lines_get(pool, lines, 0);
+    if (start == MPOOL_NONE) {
+        _mpool_ext_put(pool, e);
+        return NULL;
+    }
+    chunk = &pool->chunks[start / MPOOL_CHUNK_LINES];
+    pool->ext[e].start = start;
+    pool->ext[e].lines = lines;
+    pool->ext[e].next = chunk->large;
+    chunk->large = e;
+
+    pool->used += lines * BCM_CACHE_LINE_BYTES;
+    pool->large_blocks++;
+    MPOOL_PEAK_UPDATE(pool);
+    return pool->address + start * BCM_CACHE_LINE_BYTES;
+}
+
+/*
+ * Free large block. Assumes mpool lock is held.
+ * Returns 0 if no large block starts at the offset.
+ */
+static int
+_mpool_large_free(mpool_mem_t *pool, int offset)
+{
+    int start = offset / BCM_CACHE_LINE_BYTES;
+    int *ep, e;
+
+    for (ep = &pool->chunks[start / MPOOL_CHUNK_LINES].large;
+         *ep != MPOOL_NONE; ep = &pool->ext[*ep].next) {
+        e = *ep;
+        if (pool->ext[e].start == start) {
+            *ep = pool->ext[e].next;
+            pool->used -= pool->ext[e].lines * BCM_CACHE_LINE_BYTES;
+            pool->large_blocks--;
+            _mpool_lines_put(pool, e);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Allocate block bypassing the magazines.
+ */
+static void *
+_mpool_locked_alloc(mpool_mem_t *pool, int cls, int size)
+{
+    void *addr;
+    MPOOL_LOCK_COUNT(pool->contended);
+
+    if (cls == MPOOL_NONE) {
+        addr = _mpool_large_alloc(pool, size);
+    } else {
+        addr = _mpool_class_alloc(pool, cls);
+    }
+    if (addr == NULL) {
+        pool->alloc_fails++;
+    }
+
+    MPOOL_UNLOCK();
+
+    return addr;
+}
+
+/*
+ * Free slab block bypassing the magazines.
+ */
+static void
+_mpool_locked_free(mpool_mem_t *pool, int ci, int off)
+{
+    MPOOL_LOCK_COUNT(pool->contended);
+
+    _mpool_class_free(pool, ci, off);
+
+    MPOOL_UNLOCK();
+}
+
+/*
+ * Free large block, or count the free as bad if it is not one.
+ */
+static void
+_mpool_locked_large_free(mpool_mem_t *pool, int offset)
+{
+    MPOOL_LOCK_COUNT(pool->contended);
+
+    if (!_mpool_large_free(pool, offset)) {
+        pool->bad_frees++;
+    }
+
+    MPOOL_UNLOCK();
+}
+
+/*
+ * Count free of an address that is not an allocated block.
+ */
+static void
+_mpool_bad_free(mpool_mem_t *pool)
+{
+    MPOOL_LOCK();
+
+    pool->bad_frees++;
+
+    MPOOL_UNLOCK();
+}
+
+/*
+ * Mark slab block as handed out to the user.
+ */
+static void
+_mpool_owned_set(mpool_mem_t *pool, unsigned char *address, int cls)
+{
+    int offset = address - pool->address;
+    int ci = offset / pool->chunk_size;
+
+    MPOOL_BIT_SET((offset - ci * pool->chunk_size) / pool->class_size[cls],
+                  MPOOL_OWNED(pool, ci));
+}
+
+/*
+ * Refill empty magazine slot with a batch of blocks.
+ */
+static void
+_mpool_mag_refill(mpool_mem_t *pool, mpool_mag_t *mag, int cls)
+{
+    void *addr;
+    MPOOL_LOCK_COUNT(pool->contended);
+
+    while (mag->cnt[cls] < MPOOL_MAG_BATCH) {
+        addr = _mpool_class_alloc(pool, cls);
+        if (addr == NULL) {
+            if (mag->cnt[cls] == 0) {
+                pool->alloc_fails++;
+            }
+            break;
+        }
+        mag->blk[cls][mag->cnt[cls]++] = addr;
+        mag->cached += pool->class_size[cls];
+    }
+
+    MPOOL_UNLOCK();
+}
+
+/*
+ * Return the oldest batch of blocks in full magazine slot to the pool.
+ */
+static void
+_mpool_mag_drain(mpool_mem_t *pool, mpool_mag_t *mag, int cls)
+{
+    unsigned char *address;
+    int idx, ci;
+    MPOOL_LOCK_COUNT(pool->contended);
+
+    for (idx = 0; idx < MPOOL_MAG_BATCH; idx++) {
+        address = mag->blk[cls][idx];
+        ci = (address - pool->address) / pool->chunk_size;
+        _mpool_class_free(pool, ci,
+                          address - pool->address - ci * pool->chunk_size);
+        mag->cached -= pool->class_size[cls];
+    }
+
+    MPOOL_UNLOCK();
+
+    mag->cnt[cls] -= MPOOL_MAG_BATCH;
+    memmove(&mag->blk[cls][0], &mag->blk[cls][MPOOL_MAG_BATCH],
+            mag->cnt[cls] * sizeof(void *));
+}
 
 /*
  * Function: mpool_alloc
@@ -107,46 +772,56 @@ static int _dma_mem_used = 0;
  *    size - size of memory block to allocate
  * Returns:
  *    Pointer to allocated memory block or NULL if allocation fails.
+ * Notes:
+ *    Blocks up to the largest size class are allocated from slabs,
+ *    larger blocks are rounded up to whole cache lines. Small blocks
+ *    are served from the local magazine when possible.
  */
 void *
 mpool_alloc(mpool_handle_t pool, int size)
 {
-    mpool_mem_t *ptr = pool, *newptr = NULL;
-    int mod;
+    mpool_mag_t *mag = NULL;
+    void *addr = NULL;
+    int lines, cls;
 
-    MPOOL_LOCK();
+    if (pool == NULL || size <= 0) {
+        return NULL;
+    }
 
-    mod = size & (BCM_CACHE_LINE_BYTES - 1);
-    if (mod != 0 ) {
-        size += (BCM_CACHE_LINE_BYTES - mod);
+    lines = (size + BCM_CACHE_LINE_BYTES - 1) / BCM_CACHE_LINE_BYTES;
+    if (lines > MPOOL_MAX_LINES) {
+        return _mpool_locked_alloc(pool, MPOOL_NONE, size);
     }
-    while (ptr && ptr->next) {
-        if (ptr->next->address - (ptr->address + ptr->size) >= size) {
-            break;
+    cls = pool->line_class[lines];
+
+    if (cls < MPOOL_MAG_CLASSES) {
+        MPOOL_MAG_LOCK();
+
+        mag = MPOOL_MAG_GET(pool);
+        if (mag) {
+            if (mag->cnt[cls] > 0) {
+                mag->hits++;
+            } else {
+                mag->misses++;
+                _mpool_mag_refill(pool, mag, cls);
+            }
+            if (mag->cnt[cls] > 0) {
+                addr = mag->blk[cls][--mag->cnt[cls]];
+                mag->cached -= pool->class_size[cls];
+            }
         }
-        ptr = ptr->next;
+
+        MPOOL_MAG_UNLOCK();
     }
-  
-    if (!(ptr && ptr->next)) {
-        MPOOL_UNLOCK();
-        return NULL;
+
+    if (mag == NULL) {
+        addr = _mpool_locked_alloc(pool, cls, size);
     }
-    newptr = MALLOC(sizeof(mpool_mem_t));
-    if (!newptr) {
-        MPOOL_UNLOCK();
-        return NULL;
+    if (addr) {
+        _mpool_owned_set(pool, addr, cls);
     }
-  
-    newptr->address = ptr->address + ptr->size;
-    newptr->size = size;
-    newptr->next = ptr->next;
-    ptr->next = newptr;
-#ifdef TRACK_DMA_USAGE
-    _dma_mem_used += size;
-#endif
-    MPOOL_UNLOCK();
 
-    return newptr->address;
+    return addr;
 }
 
 
@@ -160,33 +835,127 @@ mpool_alloc(mpool_handle_t pool, int size)
  *    addr - address of memory block to free
  * Returns:
  *    Nothing
+ * Notes:
+ *    Addresses that are not the start of an allocated block, including
+ *    blocks that were already freed, are dropped and counted in the
+ *    bad_frees statistics.
  */
 void 
 mpool_free(mpool_handle_t pool, void *addr)
 {
     unsigned char *address = (unsigned char *)addr;  
-    mpool_mem_t *ptr = pool, *prev = NULL;
+    mpool_mag_t *mag;
+    int offset, ci, off, cls;
 
-    MPOOL_LOCK();
-  
-    while (ptr && ptr->next) {
-        if (ptr->next->address == address) {
-#ifdef TRACK_DMA_USAGE
-            _dma_mem_used -= ptr->next->size;
-#endif
-            break;
+    if (pool == NULL || address < pool->address ||
+        address >= pool->address + pool->size) {
+        return;
+    }
+    offset = address - pool->address;
+    if (offset & (BCM_CACHE_LINE_BYTES - 1)) {
+        _mpool_bad_free(pool);
+        return;
+    }
+    ci = offset / pool->chunk_size;
+    off = offset - ci * pool->chunk_size;
+
+    /* Chunk type cannot change while the block is allocated */
+    cls = pool->chunks[ci].type;
+    if (cls < 0) {
+        _mpool_locked_large_free(pool, offset);
+        return;
+    }
+
+    /* Claim the block, this fails if it was not handed out */
+    if ((off % pool->class_size[cls]) != 0 ||
+        !MPOOL_BIT_TEST_CLEAR(off / pool->class_size[cls],
+                              MPOOL_OWNED(pool, ci))) {
+        _mpool_bad_free(pool);
+        return;
+    }
+    if (cls >= MPOOL_MAG_CLASSES) {
+        _mpool_locked_free(pool, ci, off);
+        return;
+    }
+
+    {
+        MPOOL_MAG_LOCK();
+
+        mag = MPOOL_MAG_GET(pool);
+        if (mag) {
+            if (mag->cnt[cls] == MPOOL_MAG_SIZE) {
+                _mpool_mag_drain(pool, mag, cls);
+            }
+            mag->blk[cls][mag->cnt[cls]++] = address;
+            mag->cached += pool->class_size[cls];
         }
-        ptr = ptr->next;
+
+        MPOOL_MAG_UNLOCK();
     }
-  
-    if (ptr && ptr->next) {
-        prev = ptr;
-        ptr = ptr->next;
-        prev->next = ptr->next;
-        FREE(ptr);
+
+    if (mag == NULL) {
+        _mpool_locked_free(pool, ci, off);
     }
+}
 
-    MPOOL_UNLOCK();
+/*
+ * Function: mpool_block_size
+ *
+ * Purpose:
+ *    Report size of allocated memory block.
+ * Parameters:
+ *    pool - mpool handle (from mpool_create)
+ *    addr - address of memory block
+ * Returns:
+ *    Size of memory block in bytes, or 0 if addr is not an allocated
+ *    block.
+ * Notes:
+ *    The size is the requested size rounded up to its size class or
+ *    to whole cache lines, i.e. the pool memory held by the block.
+ */
+int
+mpool_block_size(mpool_handle_t pool, void *addr)
+{
+    unsigned char *address = (unsigned char *)addr;
+    int offset, ci, off, cls, start, e, size = 0;
+
+    if (pool == NULL || address < pool->address ||
+        address >= pool->address + pool->size) {
+        return 0;
+    }
+    offset = address - pool->address;
+    if (offset & (BCM_CACHE_LINE_BYTES - 1)) {
+        return 0;
+    }
+    ci = offset / pool->chunk_size;
+    off = offset - ci * pool->chunk_size;
+
+    cls = pool->chunks[ci].type;
+    if (cls >= 0) {
+        if ((off % pool->class_size[cls]) == 0 &&
+            MPOOL_BIT_TEST(off / pool->class_size[cls],
+                           MPOOL_OWNED(pool, ci))) {
+            size = pool->class_size[cls];
+        }
+        return size;
+    }
+
+    {
+        MPOOL_LOCK();
+
+        start = offset / BCM_CACHE_LINE_BYTES;
+        for (e = pool->chunks[ci].large; e != MPOOL_NONE;
+             e = pool->ext[e].next) {
+            if (pool->ext[e].start == start) {
+                size = pool->ext[e].lines * BCM_CACHE_LINE_BYTES;
+                break;
+            }
+        }
+
+        MPOOL_UNLOCK();
+    }
+
+    return size;
 }
 
 /*
@@ -206,10 +975,9 @@ mpool_free(mpool_handle_t pool, void *addr)
 mpool_handle_t
 mpool_create(void *base_ptr, int size)
 {
-    mpool_mem_t *head, *tail;
+    mpool_mem_t *pool;
     int mod = (int)(((unsigned long)base_ptr) & (BCM_CACHE_LINE_BYTES - 1));
-
-    MPOOL_LOCK();
+    int cls, lines, idx, n_ext;
 
     if (mod) {
         base_ptr = (char*)base_ptr + (BCM_CACHE_LINE_BYTES - mod);
@@ -217,26 +985,91 @@ mpool_create(void *base_ptr, int size)
     }
     size &= ~(BCM_CACHE_LINE_BYTES - 1);
   
-
-    head = (mpool_mem_t *)MALLOC(sizeof(mpool_mem_t));
-    if (head == NULL) {
+    pool = (mpool_mem_t *)MALLOC(sizeof(mpool_mem_t));
+    if (pool == NULL) {
         return NULL;
     }
-    tail = (mpool_mem_t *)MALLOC(sizeof(mpool_mem_t));
-    if (tail == NULL) {
-        FREE(head);
-        return NULL;
+
+    pool->address = base_ptr;
+    pool->size = size;
+    pool->lines = size / BCM_CACHE_LINE_BYTES;
+    pool->chunk_size = MPOOL_CHUNK_LINES * BCM_CACHE_LINE_BYTES;
+    pool->nchunks = (pool->lines + MPOOL_CHUNK_LINES - 1) / MPOOL_CHUNK_LINES;
+    pool->used = 0;
+    pool->peak = 0;
+    pool->large_blocks = 0;
+    pool->alloc_fails = 0;
+    pool->bad_frees = 0;
+    pool->contended = 0;
+    pool->hits = pool->misses = 0;
+
+    /* Map number of cache lines to smallest size class that fits */
+    cls = 0;
+    for (lines = 0; lines <= MPOOL_MAX_LINES; lines++) {
+        if (lines > _mpool_class_lines[cls]) {
+            cls++;
+        }
+        pool->line_class[lines] = cls;
+    }
+    for (cls = 0; cls < MPOOL_NUM_CLASSES; cls++) {
+        pool->class_size[cls] = _mpool_class_lines[cls] * BCM_CACHE_LINE_BYTES;
+        pool->class_blocks[cls] = 0;
+        pool->partial[cls] = MPOOL_NONE;
     }
-  
-    head->size = tail->size = 0;
-    head->address = base_ptr;
-    tail->address = head->address + size;
-    head->next = tail;
-    tail->next = NULL;
 
-    MPOOL_UNLOCK();
+    /*
+     * Free extents are separated by slabs or large blocks, and a large
+     * block is longer than the largest size class. One descriptor per
+     * chunk and two per largest possible number of large blocks are
+     * therefore enough for all free extents and large blocks.
+     */
+    n_ext = pool->nchunks + 2 * (pool->lines / (MPOOL_MAX_LINES + 1)) + 2;
+
+    pool->chunks = NULL;
+    pool->ext = NULL;
+    pool->owned = NULL;
+    pool->mags = NULL;
+    if (pool->nchunks > 0) {
+        pool->chunks = MALLOC_LARGE(pool->nchunks * sizeof(mpool_chunk_t));
+        pool->ext = MALLOC_LARGE(n_ext * sizeof(mpool_ext_t));
+        pool->owned = MALLOC_LARGE(pool->nchunks * MPOOL_OWNED_WORDS *
+                                   sizeof(unsigned long));
+        if (pool->chunks == NULL || pool->ext == NULL ||
+            pool->owned == NULL) {
+            mpool_destroy(pool);
+            return NULL;
+        }
+        memset(pool->owned, 0,
+               pool->nchunks * MPOOL_OWNED_WORDS * sizeof(unsigned long));
+    }
+    for (idx = 0; idx < pool->nchunks; idx++) {
+        pool->chunks[idx].type = MPOOL_CHUNK_NONE;
+        pool->chunks[idx].next = pool->chunks[idx].prev = MPOOL_NONE;
+        pool->chunks[idx].large = MPOOL_NONE;
+    }
+
+    /* All memory starts out as one free extent */
+    pool->free_ext = MPOOL_NONE;
+    pool->spare_ext = MPOOL_NONE;
+    if (pool->nchunks > 0) {
+        for (idx = n_ext - 1; idx > 0; idx--) {
+            _mpool_ext_put(pool, idx);
+        }
+        pool->ext[0].start = 0;
+        pool->ext[0].lines = pool->lines;
+        pool->ext[0].next = MPOOL_NONE;
+        pool->free_ext = 0;
+    }
 
-    return head;
+    /* Without magazines all requests take the locked path */
+#ifdef __KERNEL__
+    pool->mags = MALLOC_LARGE(nr_cpu_ids * sizeof(mpool_mag_t));
+    if (pool->mags) {
+        memset(pool->mags, 0, nr_cpu_ids * sizeof(mpool_mag_t));
+    }
+#endif
+
+    return pool;
 }
 
 /*
@@ -252,20 +1085,101 @@ mpool_create(void *base_ptr, int size)
 int
 mpool_destroy(mpool_handle_t pool)
 {
-    mpool_mem_t *ptr, *next;
-  
-    MPOOL_LOCK();
-
-    for (ptr = pool; ptr; ptr = next) {
-        next = ptr->next;
-        FREE(ptr);
+    /* Pool must no longer be in use, so no locking is needed */
+    if (pool == NULL) {
+        return 0;
     }
+#ifndef __KERNEL__
+    {
+        mpool_tcache_t *tc;
 
-    MPOOL_UNLOCK();
+        /* Detach thread magazines still bound to this pool */
+        MPOOL_LOCK();
+        for (tc = _mpool_tcache_list; tc; tc = tc->next) {
+            if (tc->pool == pool) {
+                tc->pool = NULL;
+                memset(&tc->mag, 0, sizeof(tc->mag));
+            }
+        }
+        MPOOL_UNLOCK();
+    }
+#endif
+    if (pool->mags) {
+        FREE_LARGE(pool->mags);
+    }
+    if (pool->chunks) {
+        FREE_LARGE(pool->chunks);
+    }
+    if (pool->ext) {
+        FREE_LARGE(pool->ext);
+    }
+    if (pool->owned) {
+        FREE_LARGE(pool->owned);
+    }
+    FREE(pool);
 
     return 0;
 }
 
+/*
+ * Check if all blocks in use of a slab are held by magazines, i.e. the
+ * slab would be free memory if the magazines were drained.
+ */
+static int
+_mpool_slab_cached(mpool_mem_t *pool, int ci)
+{
+    unsigned long *owned = MPOOL_OWNED(pool, ci);
+    int idx;
+
+    for (idx = 0; idx < MPOOL_OWNED_WORDS; idx++) {
+        if (owned[idx]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Sum up magazine statistics. Assumes mpool lock is held.
+ */
+static void
+_mpool_mag_stats(mpool_mem_t *pool, mpool_stats_t *stats)
+{
+#ifdef __KERNEL__
+    int cpu, cls;
+
+    stats->cache_hits = pool->hits;
+    stats->cache_misses = pool->misses;
+    if (pool->mags == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        stats->cached += pool->mags[cpu].cached;
+        stats->cache_hits += pool->mags[cpu].hits;
+        stats->cache_misses += pool->mags[cpu].misses;
+        for (cls = 0; cls < MPOOL_MAG_CLASSES; cls++) {
+            stats->class_used[cls] -= pool->mags[cpu].cnt[cls];
+        }
+    }
+#else
+    mpool_tcache_t *tc;
+    int cls;
+
+    stats->cache_hits = pool->hits;
+    stats->cache_misses = pool->misses;
+    for (tc = _mpool_tcache_list; tc; tc = tc->next) {
+        if (tc->pool == pool) {
+            stats->cached += tc->mag.cached;
+            stats->cache_hits += tc->mag.hits;
+            stats->cache_misses += tc->mag.misses;
+            for (cls = 0; cls < MPOOL_MAG_CLASSES; cls++) {
+                stats->class_used[cls] -= tc->mag.cnt[cls];
+            }
+        }
+    }
+#endif
+}
+
 /*
  * Function: mpool_usage
  *
@@ -275,20 +1189,109 @@ mpool_destroy(mpool_handle_t pool)
  *    pool - mpool handle (from mpool_create)
  * Returns:
  *    Number of bytes currently allocated using mpool_alloc.
+ * Notes:
+ *    Blocks held in magazines are not counted as allocated.
  */
 int
 mpool_usage(mpool_handle_t pool)
 {
-    int usage = 0;
-    mpool_mem_t *ptr;
+    mpool_stats_t stats;
 
-    MPOOL_LOCK();
+    mpool_stats_get(pool, &stats);
+
+    return stats.used;
+}
+
+/*
+ * Function: mpool_stats_get
+ *
+ * Purpose:
+ *    Report mpool usage and fast path statistics.
+ * Parameters:
+ *    pool - mpool handle (from mpool_create)
+ *    stats - (OUT) statistics
+ * Returns:
+ *    Always 0
+ * Notes:
+ *    Magazine counters are read without stopping other CPUs, so
+ *    they are approximate while the pool is in use.
+ *
+ *    The fragmentation index compares the largest free extent with
+ *    all free extents. It is 0 if all free memory is contiguous and
+ *    approaches 100 as free memory gets scattered, i.e. when large
+ *    allocations may fail although enough memory is free. Slabs whose
+ *    blocks in use are all held by magazines are counted as free,
+ *    other free blocks inside slabs are not.
+ */
+int
+mpool_stats_get(mpool_handle_t pool, mpool_stats_t *stats)
+{
+    int cls, e, ci, start, len, run, run_end;
+
+    memset(stats, 0, sizeof(*stats));
 
-    for (ptr = pool; ptr; ptr = ptr->next) {
-	usage += ptr->size;
+    {
+        MPOOL_LOCK();
+
+        for (cls = 0; cls < MPOOL_NUM_CLASSES; cls++) {
+            stats->class_size[cls] = pool->class_size[cls];
+            stats->class_used[cls] = pool->class_blocks[cls];
+        }
+        stats->class_used[MPOOL_STATS_CLASSES - 1] = pool->large_blocks;
+        _mpool_mag_stats(pool, stats);
+        stats->used = pool->used - stats->cached;
+        stats->lock_contended = pool->contended;
+        stats->size = pool->size;
+        stats->peak = pool->peak;
+        stats->alloc_fails = pool->alloc_fails;
+        stats->bad_frees = pool->bad_frees;
+
+        /*
+         * Find free memory and largest free block. Free extents and
+         * slabs held by magazines are both visited in address order.
+         */
+        e = pool->free_ext;
+        ci = 0;
+        run = run_end = 0;
+        while (1) {
+            while (ci < pool->nchunks && (pool->chunks[ci].type < 0 ||
+                                          !_mpool_slab_cached(pool, ci))) {
+                ci++;
+            }
+            if (e != MPOOL_NONE &&
+                (ci >= pool->nchunks ||
+                 pool->ext[e].start < ci * MPOOL_CHUNK_LINES)) {
+                start = pool->ext[e].start;
+                len = pool->ext[e].lines;
+                e = pool->ext[e].next;
+            } else if (ci < pool->nchunks) {
+                start = ci * MPOOL_CHUNK_LINES;
+                len = MPOOL_CHUNK_LINES;
+                ci++;
+            } else {
+                break;
+            }
+            run = (start == run_end) ? run + len : len;
+            run_end = start + len;
+            stats->free += len * BCM_CACHE_LINE_BYTES;
+            if (run * BCM_CACHE_LINE_BYTES > stats->largest_free) {
+                stats->largest_free = run * BCM_CACHE_LINE_BYTES;
+            }
+        }
+
+        MPOOL_UNLOCK();
     }
 
-    MPOOL_UNLOCK();
+    for (cls = 0; cls < MPOOL_NUM_CLASSES; cls++) {
+        stats->class_bytes[cls] = stats->class_used[cls] * stats->class_size[cls];
+    }
+    stats->class_bytes[MPOOL_STATS_CLASSES - 1] = stats->used;
+    for (cls = 0; cls < MPOOL_NUM_CLASSES; cls++) {
+        stats->class_bytes[MPOOL_STATS_CLASSES - 1] -= stats->class_bytes[cls];
+    }
+    if (stats->free) {
+        stats->frag = 100 - (int)((100LL * stats->largest_free) / stats->free);
+    }
 
-    return usage;
+    return 0;
 }
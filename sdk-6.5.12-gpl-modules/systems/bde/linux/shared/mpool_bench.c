@@ -0,0 +1,434 @@
+/*
+ * Copyright 2017 Broadcom
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation (the "GPL").
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License version 2 (GPLv2) for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 (GPLv2) along with this source code.
+ */
+/*
+ * $Id: $
+ * $Copyright: (c) 2017 Broadcom Corp.
+ * All Rights Reserved.$
+ *
+ * User mode benchmark for mpool, replaying alloc/free traces.
+ *
+ * Build on the host from this directory:
+ *
+ *    cc -O2 -I../include -I../../../../include -o mpool_bench \
+ *        mpool_bench.c mpool.c -lpthread
+ *
+ * Usage:
+ *
+ *    mpool_bench [-p pool_bytes] [-n ops] [-s seed] [-t threads]
+ *                [-o out_trace] [trace]
+ *
+ * A trace has one operation per line:
+ *
+ *    a <id> <size>      allocate <size> bytes as block <id>
+ *    f <id>             free block <id>
+ *
+ * Without a trace file a trace of -n operations is generated from the
+ * seed. It keeps up to 4096 blocks live and mixes DCB-sized blocks,
+ * packet buffers, buffers of a few KB and large counter DMA tables. The
+ * generated trace can be saved with -o and replayed later.
+ *
+ * With -t each thread replays the whole trace concurrently with its own
+ * blocks, which exercises the magazines and the shared mpool lock.
+ *
+ * The replay reports the time per operation, the allocations that
+ * failed and the pool statistics after the replay, including magazine
+ * hits and lock contention. Each block is stamped with its id on
+ * allocation and checked on free to catch overlapping blocks. Finally
+ * all blocks are freed, and the pool must be empty and contiguous
+ * again, with blocks still held in magazines counted as free.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sal/core/sync.h>
+#include <mpool.h>
+
+#define BENCH_POOL_SIZE     (64 * 1024 * 1024)
+#define BENCH_OPS           2000000
+#define BENCH_LIVE          4096
+#define BENCH_MAX_THREADS   64
+
+typedef struct bench_op_s {
+    int alloc;
+    int id;
+    int size;
+} bench_op_t;
+
+typedef struct bench_blk_s {
+    unsigned char *addr;
+    int size;
+} bench_blk_t;
+
+typedef struct bench_thread_s {
+    pthread_t tid;
+    mpool_handle_t pool;
+    bench_op_t *ops;
+    int nops;
+    int maxid;
+    bench_blk_t *blks;
+    int allocs;
+    int fails;
+    int corrupt;
+} bench_thread_t;
+
+/*
+ * Minimal SAL semaphores for the user mode mpool lock. The mpool only
+ * takes its lock with a timeout of 0 or sal_sem_FOREVER.
+ */
+sal_sem_t
+sal_sem_create(char *desc, int binary, int initial_count)
+{
+    sem_t *sem = malloc(sizeof(sem_t));
+
+    if (sem) {
+        sem_init(sem, 0, initial_count);
+    }
+    return (sal_sem_t)sem;
+}
+
+void
+sal_sem_destroy(sal_sem_t b)
+{
+    sem_destroy((sem_t *)b);
+    free(b);
+}
+
+int
+sal_sem_take(sal_sem_t b, int usec)
+{
+    if (usec == 0) {
+        return sem_trywait((sem_t *)b) ? -1 : 0;
+    }
+    while (sem_wait((sem_t *)b) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+sal_sem_give(sal_sem_t b)
+{
+    return sem_post((sem_t *)b);
+}
+
+static unsigned int _seed = 1;
+
+static unsigned int
+_rand(void)
+{
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+    return _seed;
+}
+
+/*
+ * Block size mix seen on a switch: DCBs and DV headers, packet buffers,
+ * larger descriptor chains and occasional counter DMA tables.
+ */
+static int
+_gen_size(void)
+{
+    unsigned int r = _rand() % 100;
+
+    if (r < 40) {
+        return 16 + (_rand() % 4) * 16;
+    }
+    if (r < 80) {
+        return (_rand() % 2) ? 1536 + (_rand() % 512) : 9216;
+    }
+    if (r < 97) {
+        return 2048 + (_rand() % 14336);
+    }
+    return 32 * 1024 + (_rand() % (1024 * 1024));
+}
+
+static bench_op_t *
+_gen_trace(int nops)
+{
+    bench_op_t *ops;
+    char *live;
+    int idx, id;
+
+    ops = malloc(nops * sizeof(bench_op_t));
+    live = calloc(BENCH_LIVE, 1);
+    if (ops == NULL || live == NULL) {
+        free(ops);
+        free(live);
+        return NULL;
+    }
+    for (idx = 0; idx < nops; idx++) {
+        id = _rand() % BENCH_LIVE;
+        ops[idx].id = id;
+        ops[idx].alloc = !live[id];
+        ops[idx].size = (live[id]) ? 0 : _gen_size();
+        live[id] = !live[id];
+    }
+    free(live);
+    return ops;
+}
+
+static bench_op_t *
+_read_trace(const char *fname, int *nops, int *maxid)
+{
+    bench_op_t *ops = NULL, *tmp;
+    FILE *fp;
+    char line[128], op;
+    int cnt = 0, max = 0, id, size;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        perror(fname);
+        return NULL;
+    }
+    *maxid = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        size = 0;
+        if (sscanf(line, " %c %d %d", &op, &id, &size) < 2 || id < 0 ||
+            (op != 'a' && op != 'f')) {
+            continue;
+        }
+        if (cnt == max) {
+            max = (max) ? 2 * max : 4096;
+            tmp = realloc(ops, max * sizeof(bench_op_t));
+            if (tmp == NULL) {
+                free(ops);
+                fclose(fp);
+                return NULL;
+            }
+            ops = tmp;
+        }
+        ops[cnt].alloc = (op == 'a');
+        ops[cnt].id = id;
+        ops[cnt].size = size;
+        if (id >= *maxid) {
+            *maxid = id + 1;
+        }
+        cnt++;
+    }
+    fclose(fp);
+    *nops = cnt;
+    return ops;
+}
+
+static int
+_write_trace(const char *fname, bench_op_t *ops, int nops)
+{
+    FILE *fp;
+    int idx;
+
+    if ((fp = fopen(fname, "w")) == NULL) {
+        perror(fname);
+        return -1;
+    }
+    for (idx = 0; idx < nops; idx++) {
+        if (ops[idx].alloc) {
+            fprintf(fp, "a %d %d\n", ops[idx].id, ops[idx].size);
+        } else {
+            fprintf(fp, "f %d\n", ops[idx].id);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Stamp first and last word of block with its id */
+static void
+_stamp(bench_blk_t *blk, int id)
+{
+    if (blk->size >= 2 * (int)sizeof(int)) {
+        memcpy(blk->addr, &id, sizeof(int));
+        memcpy(blk->addr + blk->size - sizeof(int), &id, sizeof(int));
+    }
+}
+
+static int
+_check(bench_blk_t *blk, int id)
+{
+    int head, tail;
+
+    if (blk->size < 2 * (int)sizeof(int)) {
+        return 0;
+    }
+    memcpy(&head, blk->addr, sizeof(int));
+    memcpy(&tail, blk->addr + blk->size - sizeof(int), sizeof(int));
+    return (head != id || tail != id);
+}
+
+static void *
+_replay(void *arg)
+{
+    bench_thread_t *bt = (bench_thread_t *)arg;
+    bench_blk_t *blks = bt->blks;
+    bench_op_t *op;
+    int idx, id;
+
+    for (idx = 0; idx < bt->nops; idx++) {
+        op = &bt->ops[idx];
+        id = op->id;
+        if (op->alloc) {
+            if (blks[id].addr) {
+                continue;
+            }
+            bt->allocs++;
+            blks[id].addr = mpool_alloc(bt->pool, op->size);
+            if (blks[id].addr == NULL) {
+                bt->fails++;
+                continue;
+            }
+            blks[id].size = op->size;
+            _stamp(&blks[id], id);
+        } else if (blks[id].addr) {
+            bt->corrupt += _check(&blks[id], id);
+            mpool_free(bt->pool, blks[id].addr);
+            blks[id].addr = NULL;
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    bench_op_t *ops;
+    bench_thread_t bt[BENCH_MAX_THREADS];
+    mpool_handle_t pool;
+    mpool_stats_t stats;
+    struct timespec t0, t1;
+    const char *out = NULL;
+    void *mem;
+    double nsecs;
+    int pool_size = BENCH_POOL_SIZE, nops = BENCH_OPS, maxid = BENCH_LIVE;
+    int nthreads = 1;
+    int opt, t, id, fails = 0, corrupt = 0, allocs = 0;
+
+    while ((opt = getopt(argc, argv, "p:n:s:t:o:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pool_size = strtol(optarg, NULL, 0);
+            break;
+        case 'n':
+            nops = strtol(optarg, NULL, 0);
+            break;
+        case 's':
+            _seed = strtoul(optarg, NULL, 0) | 1;
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 0);
+            if (nthreads < 1 || nthreads > BENCH_MAX_THREADS) {
+                fprintf(stderr, "threads must be 1..%d\n", BENCH_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p pool_bytes] [-n ops] [-s seed] "
+                    "[-t threads] [-o out_trace] [trace]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        ops = _read_trace(argv[optind], &nops, &maxid);
+    } else {
+        ops = _gen_trace(nops);
+    }
+    if (ops == NULL) {
+        fprintf(stderr, "no trace\n");
+        return 1;
+    }
+    if (out && _write_trace(out, ops, nops) < 0) {
+        return 1;
+    }
+
+    mem = malloc(pool_size);
+    if (mem == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    mpool_init();
+    pool = mpool_create(mem, pool_size);
+    if (pool == NULL) {
+        fprintf(stderr, "mpool_create failed\n");
+        return 1;
+    }
+    memset(bt, 0, sizeof(bt));
+    for (t = 0; t < nthreads; t++) {
+        bt[t].pool = pool;
+        bt[t].ops = ops;
+        bt[t].nops = nops;
+        bt[t].maxid = maxid;
+        bt[t].blks = calloc(maxid, sizeof(bench_blk_t));
+        if (bt[t].blks == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    /* Magazines of the replay threads are flushed when they exit */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (t = 0; t < nthreads; t++) {
+        pthread_create(&bt[t].tid, NULL, _replay, &bt[t]);
+    }
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(bt[t].tid, NULL);
+        allocs += bt[t].allocs;
+        fails += bt[t].fails;
+        corrupt += bt[t].corrupt;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    nsecs = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+    mpool_stats_get(pool, &stats);
+    printf("threads=%d ops=%d allocs=%d fails=%d corrupt=%d "
+           "ns_per_op=%.1f mops=%.2f\n", nthreads, nops * nthreads, allocs,
+           fails, corrupt, nsecs / nops, 1e3 * nops * nthreads / nsecs);
+    printf("size=%d used=%d peak=%d free=%d largest_free=%d frag=%d\n",
+           stats.size, stats.used, stats.peak, stats.free,
+           stats.largest_free, stats.frag);
+    printf("cache_hits=%lu cache_misses=%lu lock_contended=%lu\n",
+           stats.cache_hits, stats.cache_misses, stats.lock_contended);
+
+    for (t = 0; t < nthreads; t++) {
+        for (id = 0; id < maxid; id++) {
+            if (bt[t].blks[id].addr) {
+                corrupt += _check(&bt[t].blks[id], id);
+                mpool_free(pool, bt[t].blks[id].addr);
+            }
+        }
+        free(bt[t].blks);
+    }
+    mpool_stats_get(pool, &stats);
+    printf("drained: used=%d cached=%d free=%d largest_free=%d frag=%d "
+           "corrupt=%d bad_frees=%lu\n", stats.used, stats.cached,
+           stats.free, stats.largest_free, stats.frag, corrupt,
+           stats.bad_frees);
+
+    mpool_destroy(pool);
+    free(mem);
+    free(ops);
+
+    return (corrupt || stats.used || stats.frag || stats.bad_frees) ? 1 : 0;
+}
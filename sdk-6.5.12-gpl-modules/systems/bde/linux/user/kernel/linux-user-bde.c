@@ -34,6 +34,35 @@
 #include <shared/et/bcmdevs.h>
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define BDE_INTR_EVENTFD_SUPPORT
+#include <linux/eventfd.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+#define BDE_EVENTFD_SIGNAL(_ctx)        eventfd_signal(_ctx)
+#else
+#define BDE_EVENTFD_SIGNAL(_ctx)        eventfd_signal(_ctx, 1)
+#endif
+#endif
+
+/* Shared semaphores are mapped to user space with remap_vmalloc_range */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+#define BDE_SHSEM_SUPPORT
+#include <linux/vmalloc.h>
+#endif
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/signal.h>
+#endif
+
+/* Interrupt latency self-test driven by a high resolution timer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+#define BDE_INTR_SELFTEST_SUPPORT
+#include <linux/hrtimer.h>
+#include <klat.h>
+#endif
+
 
 MODULE_AUTHOR("Broadcom Corporation");
 MODULE_DESCRIPTION("User BDE Helper Module");
@@ -115,6 +144,14 @@ typedef struct bde_ctrl_s {
     isr_f isr;
     uint32 *ba;
     int inst;   /* associate to _bde_inst_resource[] */
+    atomic_t intr_cnt;  /* interrupts since last LUBDE_GET_INTR_STATUS */
+    uint32 intr_total;
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+    struct eventfd_ctx *efd;
+    pid_t efd_owner;            /* process which attached efd */
+#endif
+    int shsem;  /* 1 + shared semaphore given on interrupt, 0 if none */
+    int intr_ring;  /* Record interrupt causes, see LUBDE_INTR_RING */
 } bde_ctrl_t;
 
 #define VALID_DEVICE(_n) (_n < LINUX_BDE_MAX_DEVICES)
@@ -131,21 +168,180 @@ static atomic_t _ether_interrupt_has_taken_place = ATOMIC_INIT(0);
  */
 static int _bde_multi_inst = 0;
 
+/* Serializes changes of the instance resources */
+static DEFINE_MUTEX(_inst_lock);
+
 typedef struct {
     unsigned int    inst_id;
     unsigned int    dma_offset;
     unsigned int    dma_size;
     wait_queue_head_t intr_wq;
     atomic_t intr;
+    atomic_t intr_cnt;          /* interrupts since last status read */
+    unsigned long intr_cause;   /* bitmap of interrupting devices */
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+    struct eventfd_ctx *efd;
+    pid_t efd_owner;            /* process which attached efd */
+#endif
+    pid_t owner;                /* attaching process, 0 for any */
 } bde_inst_resource_t;
 
 static bde_inst_resource_t _bde_inst_resource[LINUX_BDE_MAX_DEVICES];
 
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+/* Protects the eventfd contexts used by the interrupt handlers */
+static DEFINE_SPINLOCK(_intr_efd_lock);
+#endif
+
+#ifdef BDE_SHSEM_SUPPORT
+/*
+ * Shared semaphores
+ *
+ * The semaphore array is mapped to user space at LUBDE_SHSEM_MMAP_OFFSET.
+ * User space takes and gives a semaphore by atomic updates of its count
+ * and only enters the kernel (LUBDE_SHSEM_OP) to sleep when the count
+ * is zero, or to wake up sleepers after a give. The interrupt handler
+ * can give a semaphore bound to the device. The generation of a slot
+ * changes when its semaphore is destroyed, which fails the sleepers.
+ */
+static lubde_shsem_t *_shsem;
+static wait_queue_head_t _shsem_wq[LUBDE_SHSEM_MAX];
+static unsigned int _shsem_gen[LUBDE_SHSEM_MAX];
+static DEFINE_SPINLOCK(_shsem_lock);
+
+#define SHSEM_READ(_v)  (*(volatile typeof(_v) *)&(_v))
+
+static void
+_shsem_waiters_add(lubde_shsem_t *sem, int val)
+{
+    uint32_t cnt;
+
+    do {
+        cnt = SHSEM_READ(sem->waiters);
+    } while (cmpxchg(&sem->waiters, cnt, cnt + val) != cnt);
+}
+
+static int
+_shsem_trytake(lubde_shsem_t *sem)
+{
+    int32_t cnt;
+
+    while ((cnt = SHSEM_READ(sem->count)) > 0) {
+        if (cmpxchg(&sem->count, cnt, cnt - 1) == cnt) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: _shsem_give
+ *
+ * Purpose:
+ *    Give a shared semaphore from kernel mode.
+ * Parameters:
+ *    idx - semaphore index
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    May be called from interrupt context.
+ */
+static void
+_shsem_give(int idx)
+{
+    lubde_shsem_t *sem = &_shsem[idx];
+    int32_t cnt;
+
+    do {
+        cnt = SHSEM_READ(sem->count);
+        if (sem->binary && cnt > 0) {
+            break;
+        }
+    } while (cmpxchg(&sem->count, cnt, cnt + 1) != cnt);
+
+    /* Pairs with the barrier in _shsem_wait */
+    smp_mb();
+    if (SHSEM_READ(sem->waiters)) {
+        wake_up_interruptible(&_shsem_wq[idx]);
+    }
+}
+
+/* Semaphore taken, or destroyed since generation gen */
+static int
+_shsem_wait_done(int idx, unsigned int gen)
+{
+    return SHSEM_READ(_shsem_gen[idx]) != gen || _shsem_trytake(&_shsem[idx]);
+}
+
+/*
+ * Function: _shsem_wait
+ *
+ * Purpose:
+ *    Sleep until a shared semaphore can be taken.
+ * Parameters:
+ *    idx - semaphore index
+ *    usec - timeout in microseconds or sal_sem_FOREVER
+ * Returns:
+ *    0 if the semaphore was taken, -1 on timeout or signal,
+ *    -EIDRM if the semaphore was destroyed
+ */
+static int
+_shsem_wait(int idx, int usec)
+{
+    lubde_shsem_t *sem = &_shsem[idx];
+    unsigned long flags;
+    unsigned int gen;
+    long rv;
+
+    spin_lock_irqsave(&_shsem_lock, flags);
+    if (!sem->in_use) {
+        spin_unlock_irqrestore(&_shsem_lock, flags);
+        return -EIDRM;
+    }
+    gen = _shsem_gen[idx];
+    _shsem_waiters_add(sem, 1);
+    spin_unlock_irqrestore(&_shsem_lock, flags);
+
+    smp_mb();
+    if (usec == sal_sem_FOREVER) {
+        rv = wait_event_interruptible(_shsem_wq[idx],
+                                      _shsem_wait_done(idx, gen));
+        rv = (rv == 0) ? 1 : rv;
+    } else if (usec > 0) {
+        rv = wait_event_interruptible_timeout(_shsem_wq[idx],
+                                              _shsem_wait_done(idx, gen),
+                                              usecs_to_jiffies(usec));
+    } else {
+        rv = _shsem_trytake(sem);
+    }
+
+    spin_lock_irqsave(&_shsem_lock, flags);
+    if (_shsem_gen[idx] != gen) {
+        /* Destroyed while sleeping, the slot may be in use again */
+        spin_unlock_irqrestore(&_shsem_lock, flags);
+        return -EIDRM;
+    }
+    _shsem_waiters_add(sem, -1);
+    spin_unlock_irqrestore(&_shsem_lock, flags);
+
+    return (rv > 0) ? 0 : -1;
+}
+#endif /* BDE_SHSEM_SUPPORT */
+
+/*
+ * Interrupt cause rings, one LUBDE_INTR_RING_STRIDE slot per device,
+ * mapped to user space at LUBDE_INTR_RING_MMAP_OFFSET.
+ */
+static void *_intr_rings;
+
+#define _intr_ring_get(_d) \
+    ((lubde_intr_ring_t *)((uint8 *)_intr_rings + (_d) * LUBDE_INTR_RING_STRIDE))
+
 typedef struct {
     phys_addr_t  cpu_pbase; /* CPU physical base address of the DMA pool */
     phys_addr_t  dma_pbase; /* Bus base address of the DMA pool */
     uint32  total_size; /* Total size of the pool in MB */
-    uint32  offset; /* Current offset of the pool in MB */
+    uint32  used; /* Size of all instance partitions in MB */
 }_dma_pool_t;
 
 static _dma_pool_t _dma_pool;
@@ -169,6 +365,58 @@ static _dma_pool_t _dma_pool;
             writel((val), (addr))
 
 #endif
+/*
+ * Function: _intr_event
+ *
+ * Purpose:
+ *    Account for a device interrupt and signal any eventfd
+ *    registered for the device or its instance.
+ * Parameters:
+ *    ctrl - BDE control structure for this device.
+ *    res - Instance resource of the device.
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Called from interrupt context. Unlike res->intr, the counts
+ *    are accumulated until read through LUBDE_GET_INTR_STATUS, so
+ *    coalesced interrupts are not lost.
+ */
+static void
+_intr_event(bde_ctrl_t *ctrl, bde_inst_resource_t *res)
+{
+    int d;
+#if defined(BDE_INTR_EVENTFD_SUPPORT) || defined(BDE_SHSEM_SUPPORT)
+    unsigned long flags;
+#endif
+
+    d = ctrl - _devices;
+    ctrl->intr_total++;
+#ifdef BDE_SHSEM_SUPPORT
+    if (ctrl->shsem) {
+        /* Serialized with LUBDE_SHSEM_OP_DESTROY and BIND */
+        spin_lock_irqsave(&_shsem_lock, flags);
+        if (ctrl->shsem) {
+            _shsem_give(ctrl->shsem - 1);
+        }
+        spin_unlock_irqrestore(&_shsem_lock, flags);
+    }
+#endif
+    atomic_inc(&ctrl->intr_cnt);
+    atomic_inc(&res->intr_cnt);
+    set_bit(d, &res->intr_cause);
+
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+    spin_lock_irqsave(&_intr_efd_lock, flags);
+    if (ctrl->efd) {
+        BDE_EVENTFD_SIGNAL(ctrl->efd);
+    }
+    if (res->efd) {
+        BDE_EVENTFD_SIGNAL(res->efd);
+    }
+    spin_unlock_irqrestore(&_intr_efd_lock, flags);
+#endif
+}
+
 /*
  * Function: _interrupt
  *
@@ -210,6 +458,7 @@ _cmic_interrupt(bde_ctrl_t *ctrl)
 
     lkbde_irq_mask_set(d, CMIC_IRQ_MASK, 0, 0);
 
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
@@ -264,6 +513,7 @@ _cmicx_interrupt(bde_ctrl_t *ctrl)
     }
 
     /* Notify */
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -348,6 +598,7 @@ _cmicm_interrupt(bde_ctrl_t *ctrl)
         user_bde->write(d, CMIC_CMCx_PCIE_IRQ_MASK0_OFFSET(1), 0);
         user_bde->write(d, CMIC_CMCx_PCIE_IRQ_MASK0_OFFSET(2), 0);
     }
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -449,6 +700,7 @@ _cmicd_cmc0_interrupt(bde_ctrl_t *ctrl)
         user_bde->write(d, CMIC_CMCx_PCIE_IRQ_MASK5_OFFSET(cmc), 0);
         user_bde->write(d, CMIC_CMCx_PCIE_IRQ_MASK6_OFFSET(cmc), 0);
     }
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -553,6 +805,7 @@ _cmicd_interrupt(bde_ctrl_t *ctrl)
         user_bde->write(d, CMIC_CMCx_PCIE_IRQ_MASK0_OFFSET(1), 0);
         user_bde->write(d, CMIC_CMCx_PCIE_IRQ_MASK0_OFFSET(2), 0);
     }
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -573,6 +826,7 @@ _bcm88750_interrupt(bde_ctrl_t *ctrl)
 
     lkbde_irq_mask_set(d, CMIC_IRQ_MASK_1, 0, 0); 
     lkbde_irq_mask_set(d, CMIC_IRQ_MASK_2, 0, 0);
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -589,6 +843,7 @@ _qe2k_interrupt(bde_ctrl_t *ctrl)
     res = &_bde_inst_resource[ctrl->inst];
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x20/sizeof(uint32));
 
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -608,6 +863,7 @@ _fe2k_interrupt(bde_ctrl_t *ctrl)
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x2c/sizeof(uint32)); /* PC_ERROR1_MASK    */
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x34/sizeof(uint32)); /* PC_UNIT_MASK      */
 
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -627,6 +883,7 @@ _fe2kxt_interrupt(bde_ctrl_t *ctrl)
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x40/sizeof(uint32)); /* PC_ERROR1_MASK    */
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x50/sizeof(uint32)); /* PC_UNIT_MASK      */
 
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -646,6 +903,7 @@ _bme3200_interrupt(bde_ctrl_t *ctrl)
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x64/sizeof(uint32)); /* PI_PT_ERROR2 */
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x6c/sizeof(uint32)); /* PI_PT_ERROR3 */
 
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -674,6 +932,7 @@ _bm9600_interrupt(bde_ctrl_t *ctrl)
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x4c/sizeof(uint32));  /* PI_UNIT_INTERRUPT8_MASK */
     SSOC_WRITEL(0xffffffff, ctrl->ba + 0x54/sizeof(uint32));  /* PI_UNIT_INTERRUPT9_MASK */
 
+    _intr_event(ctrl, res);
     atomic_set(&res->intr, 1);
 #ifdef BDE_LINUX_NON_INTERRUPTIBLE
     wake_up(&res->intr_wq);
@@ -709,6 +968,173 @@ _ether_interrupt(bde_ctrl_t *ctrl)
 #endif
 }
 
+#ifdef BDE_INTR_SELFTEST_SUPPORT
+/*
+ * Interrupt latency self-test, see LUBDE_INTR_SELFTEST
+ *
+ * A timer fires synthetic interrupts, which wake the threads waiting
+ * in LUBDE_WAIT_FOR_INTERRUPT for a device just like a real interrupt
+ * of that device. The time from the interrupt to the waiting thread
+ * running again is recorded. No device is needed, so the test also
+ * runs on hosts without a switch device.
+ */
+static struct {
+    struct hrtimer timer;
+    spinlock_t lock;
+    ktime_t period;
+    int active;
+    int dev;                    /* Device whose waiters are woken */
+    unsigned int rate;          /* Interrupts per second */
+    u64 pending;                /* Time of unhandled interrupt, 0 if none */
+    unsigned long fired;
+    unsigned long missed;       /* Fired before previous one was handled */
+    klat_hist_t wake;           /* Interrupt to user thread wake up */
+} _intr_selftest;
+
+static enum hrtimer_restart
+_intr_selftest_isr(struct hrtimer *timer)
+{
+    bde_inst_resource_t *res;
+    u64 now = ktime_to_ns(ktime_get());
+    int d = _intr_selftest.dev;
+
+    spin_lock(&_intr_selftest.lock);
+    if (_intr_selftest.pending) {
+        _intr_selftest.missed++;
+    } else {
+        _intr_selftest.pending = now;
+    }
+    _intr_selftest.fired++;
+    spin_unlock(&_intr_selftest.lock);
+
+    /* Same wait queue as LUBDE_WAIT_FOR_INTERRUPT */
+    if (_devices[d].dev_type & BDE_SWITCH_DEV_TYPE) {
+        res = &_bde_inst_resource[_devices[d].inst];
+        atomic_set(&res->intr, 1);
+#ifdef BDE_LINUX_NON_INTERRUPTIBLE
+        wake_up(&res->intr_wq);
+#else
+        wake_up_interruptible(&res->intr_wq);
+#endif
+    } else {
+        atomic_set(&_ether_interrupt_has_taken_place, 1);
+#ifdef BDE_LINUX_NON_INTERRUPTIBLE
+        wake_up(&_ether_interrupt_wq);
+#else
+        wake_up_interruptible(&_ether_interrupt_wq);
+#endif
+    }
+
+    hrtimer_forward_now(timer, _intr_selftest.period);
+    return HRTIMER_RESTART;
+}
+
+/*
+ * Record latency of synthetic interrupt after a waiting thread woke up.
+ */
+static void
+_intr_selftest_woken(void)
+{
+    unsigned long flags;
+    u64 fired;
+
+    if (!_intr_selftest.active) {
+        return;
+    }
+    spin_lock_irqsave(&_intr_selftest.lock, flags);
+    fired = _intr_selftest.pending;
+    _intr_selftest.pending = 0;
+    spin_unlock_irqrestore(&_intr_selftest.lock, flags);
+    if (fired) {
+        klat_record(&_intr_selftest.wake, ktime_to_ns(ktime_get()) - fired);
+    }
+}
+
+static void
+_intr_selftest_stop(void)
+{
+    if (_intr_selftest.active) {
+        hrtimer_cancel(&_intr_selftest.timer);
+        _intr_selftest.active = 0;
+    }
+}
+
+/*
+ * Function: _intr_selftest_set
+ *
+ * Purpose:
+ *    Start or stop the interrupt latency self-test.
+ * Parameters:
+ *    io - ioctl control structure
+ *         dev - device whose waiters are woken
+ *         d0 - interrupts per second, 0 to stop
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    Starting the test resets the statistics.
+ */
+static int
+_intr_selftest_set(lubde_ioctl_t *io)
+{
+    if (!VALID_DEVICE(io->dev)) {
+        return -EINVAL;
+    }
+    if (io->d0 > LUBDE_INTR_SELFTEST_MAX_RATE) {
+        io->rc = LUBDE_FAIL;
+        return 0;
+    }
+    _intr_selftest_stop();
+    if (io->d0) {
+        _intr_selftest.dev = io->dev;
+        _intr_selftest.rate = io->d0;
+        _intr_selftest.period = ns_to_ktime(NSEC_PER_SEC / io->d0);
+        _intr_selftest.pending = 0;
+        _intr_selftest.fired = 0;
+        _intr_selftest.missed = 0;
+        klat_init(&_intr_selftest.wake);
+        _intr_selftest.active = 1;
+        hrtimer_start(&_intr_selftest.timer, _intr_selftest.period,
+                      HRTIMER_MODE_REL);
+    }
+    io->rc = LUBDE_SUCCESS;
+    return 0;
+}
+
+static void
+_intr_selftest_init(void)
+{
+    spin_lock_init(&_intr_selftest.lock);
+    klat_init(&_intr_selftest.wake);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0))
+    hrtimer_setup(&_intr_selftest.timer, _intr_selftest_isr,
+                  CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&_intr_selftest.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    _intr_selftest.timer.function = _intr_selftest_isr;
+#endif
+}
+
+static void
+_intr_selftest_pprint(void)
+{
+    klat_summary_t sum;
+
+    if (_intr_selftest.rate == 0) {
+        return;
+    }
+    klat_summary(&_intr_selftest.wake, &sum);
+    pprintf("Interrupt self-test: %s, device %d, %u Hz, "
+            "%lu fired, %lu missed\n",
+            _intr_selftest.active ? "running" : "stopped",
+            _intr_selftest.dev, _intr_selftest.rate,
+            _intr_selftest.fired, _intr_selftest.missed);
+    pprintf("\twake latency (ns): count %lu min %llu avg %llu "
+            "p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+            sum.count, sum.min, sum.avg, sum.p50, sum.p90, sum.p99,
+            sum.p999, sum.max);
+}
+#endif /* BDE_INTR_SELFTEST_SUPPORT */
+
 
 static struct _intr_mode_s {
     isr_f isr;
@@ -743,6 +1169,191 @@ _intr_mode_str(void *isr)
     return NULL;
 }
 
+/*
+ * Function: _cmicm_intr_cause
+ *
+ * Purpose:
+ *    Read the pending user mode interrupts of a CMICm/CMICd CMC.
+ * Parameters:
+ *    ctrl - BDE control structure for this device.
+ *    d - device number
+ *    cmc - CMC number
+ *    nregs - number of IRQ status registers (5 for CMICm, 7 for CMICd)
+ *    cause - (OUT) enabled status bits per IRQ status register
+ * Returns:
+ *    Number of words written to cause
+ */
+static int
+_cmicm_intr_cause(bde_ctrl_t *ctrl, int d, int cmc, int nregs, uint32 *cause)
+{
+    uint32 stat_reg[] = {
+        CMIC_CMCx_IRQ_STAT0_OFFSET(cmc), CMIC_CMCx_IRQ_STAT1_OFFSET(cmc),
+        CMIC_CMCx_IRQ_STAT2_OFFSET(cmc), CMIC_CMCx_IRQ_STAT3_OFFSET(cmc),
+        CMIC_CMCx_IRQ_STAT4_OFFSET(cmc), CMIC_CMCx_IRQ_STAT5_OFFSET(cmc),
+        CMIC_CMCx_IRQ_STAT6_OFFSET(cmc)
+    };
+    uint32 pcie_mask_reg[] = {
+        CMIC_CMCx_PCIE_IRQ_MASK0_OFFSET(cmc), CMIC_CMCx_PCIE_IRQ_MASK1_OFFSET(cmc),
+        CMIC_CMCx_PCIE_IRQ_MASK2_OFFSET(cmc), CMIC_CMCx_PCIE_IRQ_MASK3_OFFSET(cmc),
+        CMIC_CMCx_PCIE_IRQ_MASK4_OFFSET(cmc), CMIC_CMCx_PCIE_IRQ_MASK5_OFFSET(cmc),
+        CMIC_CMCx_PCIE_IRQ_MASK6_OFFSET(cmc)
+    };
+    uint32 uc0_mask_reg[] = {
+        CMIC_CMCx_UC0_IRQ_MASK0_OFFSET(cmc), CMIC_CMCx_UC0_IRQ_MASK1_OFFSET(cmc),
+        CMIC_CMCx_UC0_IRQ_MASK2_OFFSET(cmc), CMIC_CMCx_UC0_IRQ_MASK3_OFFSET(cmc),
+        CMIC_CMCx_UC0_IRQ_MASK4_OFFSET(cmc), CMIC_CMCx_UC0_IRQ_MASK5_OFFSET(cmc),
+        CMIC_CMCx_UC0_IRQ_MASK6_OFFSET(cmc)
+    };
+    uint32 *mask_reg;
+    uint32 mask = 0, fmask = 0;
+    int i;
+
+    mask_reg = (ctrl->dev_type & BDE_AXI_DEV_TYPE) ? uc0_mask_reg : pcie_mask_reg;
+
+    /* Register 0 is shared with the kernel handler */
+    lkbde_irq_mask_get(d, &mask, &fmask);
+    cause[0] = user_bde->read(d, stat_reg[0]) & mask & ~fmask;
+    for (i = 1; i < nregs; i++) {
+        mask = user_bde->read(d, mask_reg[i]);
+        cause[i] = user_bde->read(d, stat_reg[i]) & mask;
+    }
+    return nregs;
+}
+
+/*
+ * Function: _intr_cause
+ *
+ * Purpose:
+ *    Read the pending user mode interrupts of a device.
+ * Parameters:
+ *    ctrl - BDE control structure for this device.
+ *    d - device number
+ *    cause - (OUT) enabled status bits per interrupt status register,
+ *            LUBDE_INTR_CAUSE_WORDS entries
+ * Returns:
+ *    Number of words written to cause, -1 if the device type is unknown
+ * Notes:
+ *    Reads the same status registers as the interrupt handlers, and
+ *    must be called before the handler masks the interrupts.
+ */
+static int
+_intr_cause(bde_ctrl_t *ctrl, int d, uint32 *cause)
+{
+    uint32 stat, iena, mask = 0, fmask = 0;
+    int ind;
+
+    if (ctrl->isr == (isr_f)_cmic_interrupt) {
+        lkbde_irq_mask_get(d, &mask, &fmask);
+        stat = user_bde->read(d, CMIC_IRQ_STAT);
+        cause[0] = stat & mask & ~fmask;
+        return 1;
+    }
+    if (ctrl->isr == (isr_f)_cmicm_interrupt) {
+        return _cmicm_intr_cause(ctrl, d, BDE_CMICM_PCIE_CMC, 5, cause);
+    }
+    if (ctrl->isr == (isr_f)_cmicd_interrupt) {
+        return _cmicm_intr_cause(ctrl, d, BDE_CMICD_PCIE_CMC, 7, cause);
+    }
+    if (ctrl->isr == (isr_f)_cmicd_cmc0_interrupt) {
+        return _cmicm_intr_cause(ctrl, d, 0, 7, cause);
+    }
+    if (ctrl->isr == (isr_f)_cmicx_interrupt) {
+        lkbde_irq_mask_get(d, &mask, &fmask);
+        for (ind = 0; ind < INTC_INTR_REG_NUM; ind++) {
+            cause[ind] = 0;
+            if (fmask && ind == INTC_PDMA_INTR_REG_IND) {
+                continue;
+            }
+            READ_INTC_INTR(d, INTC_INTR_STATUS_BASE + 4 * ind, stat);
+            READ_INTC_INTR(d, INTC_INTR_ENABLE_BASE + 4 * ind, iena);
+            cause[ind] = stat & iena;
+        }
+        return INTC_INTR_REG_NUM;
+    }
+    return -1;
+}
+
+/*
+ * Function: _intr_ring_put
+ *
+ * Purpose:
+ *    Add an interrupt cause record to the ring of a device.
+ * Parameters:
+ *    d - device number
+ *    cause - enabled status bits per interrupt status register
+ *    ncause - number of words in cause
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    Lock-free, a device may interrupt on several CPUs at once (MSI-X).
+ *    The producer reserves a slot by incrementing head and publishes
+ *    the record by writing its sequence number last. The oldest
+ *    records are overwritten if user space falls behind.
+ */
+static void
+_intr_ring_put(int d, uint32 *cause, int ncause)
+{
+    lubde_intr_ring_t *ring = _intr_ring_get(d);
+    lubde_intr_rec_t *rec;
+    uint32_t seq;
+    int i;
+
+    seq = atomic_inc_return((atomic_t *)&ring->head);
+    rec = &ring->rec[(seq - 1) & (LUBDE_INTR_RING_SIZE - 1)];
+    rec->seq = 0;
+    smp_wmb();
+    rec->timestamp = ktime_to_ns(ktime_get());
+    rec->ncause = ncause;
+    for (i = 0; i < ncause; i++) {
+        rec->cause[i] = cause[i];
+    }
+    smp_wmb();
+    rec->seq = seq;
+    if (seq - *(volatile uint32_t *)&ring->tail > LUBDE_INTR_RING_SIZE) {
+        ring->overruns++;
+    }
+}
+
+/*
+ * Function: _intr_dispatch
+ *
+ * Purpose:
+ *    Interrupt handler installed in the kernel BDE for switch devices.
+ * Parameters:
+ *    ctrl - BDE control structure for this device.
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    When the kernel BDE polls the device (see lkbde_intr_poll_set),
+ *    the device handler only runs if an interrupt is pending, so an
+ *    idle device does not wake up the interrupt thread. With the
+ *    cause ring enabled, the pending status is recorded before the
+ *    device handler masks it.
+ */
+static void
+_intr_dispatch(bde_ctrl_t *ctrl)
+{
+    int d = ctrl - _devices;
+    uint32 cause[LUBDE_INTR_CAUSE_WORDS];
+    int polled, ncause, i;
+    uint32 any = 0;
+
+    polled = (lkbde_intr_poll_get(d) > 0);
+    if (polled || ctrl->intr_ring) {
+        ncause = _intr_cause(ctrl, d, cause);
+        for (i = 0; i < ncause; i++) {
+            any |= cause[i];
+        }
+        if (ncause >= 0 && any == 0 && polled) {
+            return;
+        }
+        if (ncause > 0 && any && ctrl->intr_ring && _intr_rings) {
+            _intr_ring_put(d, cause, ncause);
+        }
+    }
+    ctrl->isr(ctrl);
+}
+
 static void
 _devices_init(int d)
 {
@@ -885,6 +1496,70 @@ _devices_init(int d)
         }
     }
 }
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+/*
+ * Function: _intr_eventfd_swap
+ *
+ * Purpose:
+ *    Replace an interrupt eventfd context and release the old one.
+ * Parameters:
+ *    slot - eventfd context pointer of a device or an instance
+ *    owner - owner of the eventfd context in slot
+ *    ctx - new eventfd context or NULL
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    A new context is owned by the calling process.
+ */
+static void
+_intr_eventfd_swap(struct eventfd_ctx **slot, pid_t *owner,
+                   struct eventfd_ctx *ctx)
+{
+    struct eventfd_ctx *old;
+    unsigned long flags;
+
+    spin_lock_irqsave(&_intr_efd_lock, flags);
+    old = *slot;
+    *slot = ctx;
+    *owner = ctx ? current->tgid : 0;
+    spin_unlock_irqrestore(&_intr_efd_lock, flags);
+
+    if (old) {
+        eventfd_ctx_put(old);
+    }
+}
+
+/*
+ * Function: _intr_eventfd_release
+ *
+ * Purpose:
+ *    Release an interrupt eventfd context owned by the calling process.
+ * Parameters:
+ *    slot - eventfd context pointer of a device or an instance
+ *    owner - owner of the eventfd context in slot
+ * Returns:
+ *    Nothing
+ */
+static void
+_intr_eventfd_release(struct eventfd_ctx **slot, pid_t *owner)
+{
+    struct eventfd_ctx *old = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&_intr_efd_lock, flags);
+    if (*slot && *owner == current->tgid) {
+        old = *slot;
+        *slot = NULL;
+        *owner = 0;
+    }
+    spin_unlock_irqrestore(&_intr_efd_lock, flags);
+
+    if (old) {
+        eventfd_ctx_put(old);
+    }
+}
+#endif
+
 /*
  * Function: _init
  *
@@ -910,10 +1585,27 @@ _init(void)
     }
 
     init_waitqueue_head(&_ether_interrupt_wq);
+#ifdef BDE_INTR_SELFTEST_SUPPORT
+    _intr_selftest_init();
+#endif
 
-    lkbde_get_dma_info(&cpu_pbase, &dma_pbase, &dmasize);
-
-    memset(&_dma_pool, 0, sizeof(_dma_pool));
+#ifdef BDE_SHSEM_SUPPORT
+    _shsem = vmalloc_user(PAGE_ALIGN(LUBDE_SHSEM_MMAP_SIZE));
+    if (_shsem == NULL) {
+        gprintk("Warning: shared semaphores not available\n");
+    }
+    for (i = 0; i < LUBDE_SHSEM_MAX; i++) {
+        init_waitqueue_head(&_shsem_wq[i]);
+    }
+    _intr_rings = vmalloc_user(PAGE_ALIGN(LUBDE_INTR_RING_MMAP_SIZE));
+    if (_intr_rings == NULL) {
+        gprintk("Warning: interrupt cause rings not available\n");
+    }
+#endif
+
+    lkbde_get_dma_info(&cpu_pbase, &dma_pbase, &dmasize);
+
+    memset(&_dma_pool, 0, sizeof(_dma_pool));
     _dma_pool.cpu_pbase = cpu_pbase;
     _dma_pool.dma_pbase = dma_pbase;
     _dma_pool.total_size = dmasize / ONE_MB;
@@ -951,6 +1643,9 @@ _cleanup(void)
     int i;
 
     if (user_bde) {
+#ifdef BDE_INTR_SELFTEST_SUPPORT
+        _intr_selftest_stop();
+#endif
         for (i = 0; i < user_bde->num_devices(BDE_ALL_DEVICES); i++) {
             if (_devices[i].enabled &&
                 BDE_DEV_MEM_MAPPED(_devices[i].dev_type)) {
@@ -958,12 +1653,105 @@ _cleanup(void)
             }
             lkbde_dev_instid_set(i, 0);
         }
+        lkbde_dma_owner_update(LKBDE_DMA_OWNER_USER,
+                               -(int)(_dma_pool.used * ONE_MB));
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+        for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+            _intr_eventfd_swap(&_devices[i].efd,
+                               &_devices[i].efd_owner, NULL);
+            _intr_eventfd_swap(&_bde_inst_resource[i].efd,
+                               &_bde_inst_resource[i].efd_owner, NULL);
+        }
+#endif
+#ifdef BDE_SHSEM_SUPPORT
+        if (_shsem) {
+            vfree(_shsem);
+            _shsem = NULL;
+        }
+        if (_intr_rings) {
+            vfree(_intr_rings);
+            _intr_rings = NULL;
+        }
+#endif
         linux_bde_destroy(user_bde);
         user_bde = NULL;
     }
     return 0;
 }
 
+/*
+ * Function: _close
+ *
+ * Purpose:
+ *    Device close function.
+ * Parameters:
+ *    None
+ * Returns:
+ *    Always 0
+ * Notes:
+ *    Releases the interrupt eventfds attached by the closing
+ *    process, so they do not outlive it until detach or unload.
+ */
+static int
+_close(void)
+{
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+    int i;
+
+    for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+        _intr_eventfd_release(&_devices[i].efd, &_devices[i].efd_owner);
+        _intr_eventfd_release(&_bde_inst_resource[i].efd,
+                              &_bde_inst_resource[i].efd_owner);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Function: _dma_layout_pprint
+ *
+ * Purpose:
+ *    Print partitioning of the DMA pool in address order.
+ * Parameters:
+ *    None
+ * Returns:
+ *    Nothing
+ */
+static void
+_dma_layout_pprint(void)
+{
+    bde_inst_resource_t *res, *next;
+    unsigned int pos = 0;
+    int i;
+
+    pprintf("DMA pool layout (%d MB, %d MB used)\n",
+            _dma_pool.total_size, _dma_pool.used);
+    do {
+        next = NULL;
+        for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+            res = &_bde_inst_resource[i];
+            if (res->inst_id == 0 || res->dma_size == 0 ||
+                res->dma_offset < pos) {
+                continue;
+            }
+            if (next == NULL || res->dma_offset < next->dma_offset) {
+                next = res;
+            }
+        }
+        if (next) {
+            if (next->dma_offset > pos) {
+                pprintf("\t%4d - %4d MB: free\n", pos, next->dma_offset - 1);
+            }
+            pprintf("\t%4d - %4d MB: dev mask 0x%x\n", next->dma_offset,
+                    next->dma_offset + next->dma_size - 1, next->inst_id);
+            pos = next->dma_offset + next->dma_size;
+        }
+    } while (next);
+    if (pos < _dma_pool.total_size) {
+        pprintf("\t%4d - %4d MB: free\n", pos, _dma_pool.total_size - 1);
+    }
+}
+
 /*
  * Function: _pprint
  *
@@ -988,7 +1776,16 @@ _pprint(void)
         if (name == NULL) {
             name = "unknown";
         }
-        pprintf("\t%d: Interrupt mode  %s ",idx, name);
+        pprintf("\t%d: Interrupt mode  %s (%u) ", idx, name,
+                _devices[idx].intr_total);
+        if (lkbde_intr_poll_get(idx) > 0) {
+            pprintf("polled every %d us ", lkbde_intr_poll_get(idx));
+        }
+        if (_devices[idx].intr_ring && _intr_rings) {
+            pprintf("ring %u/%u overruns %u ",
+                    _intr_ring_get(idx)->head, _intr_ring_get(idx)->tail,
+                    _intr_ring_get(idx)->overruns);
+        }
         (void)lkbde_dev_state_get(idx, &state);
         if (state == BDE_DEV_STATE_REMOVED) {
             pprintf(" Device REMOVED ! \n");
@@ -1001,6 +1798,9 @@ _pprint(void)
             }
         }
     }
+#ifdef BDE_INTR_SELFTEST_SUPPORT
+    _intr_selftest_pprint();
+#endif
     pprintf("Instance resource \n");
 
     for (idx = 0; idx < user_bde->num_devices(BDE_ALL_DEVICES); idx++) {
@@ -1013,31 +1813,107 @@ _pprint(void)
                     res->dma_size);
         }
     }
+    if (_bde_multi_inst) {
+        _dma_layout_pprint();
+    }
 
     return 0;
 }
 
+/*
+ * Function: _dma_range_free
+ *
+ * Purpose:
+ *    Check if part of the DMA pool is not used by any instance.
+ * Parameters:
+ *    dma_offset - start of range in MB
+ *    dma_size - size of range in MB
+ *    skip - instance resource to ignore, -1 for none
+ * Returns:
+ *    1 if the range is free, otherwise 0
+ * Notes:
+ *    The default resource does not occupy the pool until the first
+ *    instance is attached.
+ */
+static int
+_dma_range_free(unsigned int dma_offset, unsigned int dma_size, int skip)
+{
+    bde_inst_resource_t *res;
+    int i;
+
+    if (dma_offset > _dma_pool.total_size ||
+        dma_size > _dma_pool.total_size - dma_offset) {
+        return 0;
+    }
+    if (_bde_multi_inst == 0) {
+        return 1;
+    }
+    for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+        res = &_bde_inst_resource[i];
+        if (i == skip || res->inst_id == 0 || res->dma_size == 0) {
+            continue;
+        }
+        if (dma_offset < res->dma_offset + res->dma_size &&
+            res->dma_offset < dma_offset + dma_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /* 
  * Allocate the DMA resource from DMA pool
  * Parameter :
  * dma_size (IN): allocate dma_size in MB
  * dma_offset (OUT): dma offset in MB
+ * skip (IN): instance resource to ignore, -1 for none
+ *
+ * The lowest free range is used. Free ranges start at the
+ * beginning of the pool or at the end of another partition.
  */
 static int
-_dma_resource_alloc(unsigned int dma_size, unsigned int *dma_offset)
+_dma_resource_alloc(unsigned int dma_size, unsigned int *dma_offset, int skip)
 {
-    uint32 left;
+    bde_inst_resource_t *res;
+    unsigned int offset;
+    int i, found = 0;
 
-    left = _dma_pool.total_size - _dma_pool.offset;
-    if (dma_size > left) {
+    if (dma_size == 0) {
+        return -1;
+    }
+    for (i = -1; i < LINUX_BDE_MAX_DEVICES; i++) {
+        if (i < 0) {
+            offset = 0;
+        } else {
+            res = &_bde_inst_resource[i];
+            if (i == skip || _bde_multi_inst == 0 || res->inst_id == 0) {
+                continue;
+            }
+            offset = res->dma_offset + res->dma_size;
+        }
+        if ((!found || offset < *dma_offset) &&
+            _dma_range_free(offset, dma_size, skip)) {
+            *dma_offset = offset;
+            found = 1;
+        }
+    }
+    if (!found) {
         gprintk("ERROR: Run out the dma resource!\n");
         return -1;
     }
-    *dma_offset = _dma_pool.offset;
-    _dma_pool.offset += dma_size;
     return 0;
 }
 
+/*
+ * Account DMA partition size change of an instance.
+ */
+static void
+_dma_resource_update(int delta)
+{
+    _dma_pool.used += delta;
+    lkbde_dma_owner_update(LKBDE_DMA_OWNER_USER, delta * ONE_MB);
+}
+
 static int
 _dma_resource_get(int inst_id, phys_addr_t *cpu_pbase, phys_addr_t *dma_pbase, ssize_t* size)
 {
@@ -1058,7 +1934,7 @@ _dma_resource_get(int inst_id, phys_addr_t *cpu_pbase, phys_addr_t *dma_pbase, s
     *dma_pbase = _dma_pool.dma_pbase + dma_offset * ONE_MB;
     *size = dma_size * ONE_MB;
 
-    return 0;
+    return dma_offset;
 }
 
 static int
@@ -1096,6 +1972,72 @@ _device_reprobe(void)
     return 0;
 }
 
+/*
+ * Check if the calling process may change or map an instance.
+ */
+static int
+_instance_owned(bde_inst_resource_t *res)
+{
+    return res->owner == 0 || res->owner == current->tgid;
+}
+
+/*
+ * Find the resource of an attached instance.
+ */
+static int
+_instance_find(unsigned int inst_id)
+{
+    int i;
+
+    if (_bde_multi_inst == 0 || inst_id == 0) {
+        return -1;
+    }
+    for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+        if (_bde_inst_resource[i].inst_id == inst_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function: _instance_resize
+ *
+ * Purpose:
+ *    Change the size of the DMA partition of an instance.
+ * Parameters:
+ *    inst_idx - instance resource
+ *    dma_size - new size in MB
+ *    flags - LUBDE_INSTANCE_RESIZE_xxx
+ * Returns:
+ *    LUBDE_SUCCESS or LUBDE_FAIL
+ * Notes:
+ *    The partition is resized in place if possible, otherwise it is
+ *    moved if LUBDE_INSTANCE_RESIZE_MOVE is set. Only the process
+ *    which attached the instance may resize it. Assumes _inst_lock
+ *    is held.
+ */
+static int
+_instance_resize(int inst_idx, unsigned int dma_size, unsigned int flags)
+{
+    bde_inst_resource_t *res = &_bde_inst_resource[inst_idx];
+    unsigned int dma_offset = res->dma_offset;
+
+    if (dma_size == 0 || !_instance_owned(res)) {
+        return LUBDE_FAIL;
+    }
+    if (!_dma_range_free(dma_offset, dma_size, inst_idx)) {
+        if (!(flags & LUBDE_INSTANCE_RESIZE_MOVE) ||
+            _dma_resource_alloc(dma_size, &dma_offset, inst_idx) < 0) {
+            return LUBDE_FAIL;
+        }
+    }
+    _dma_resource_update((int)dma_size - (int)res->dma_size);
+    res->dma_offset = dma_offset;
+    res->dma_size = dma_size;
+    return LUBDE_SUCCESS;
+}
+
 static int
 _instance_attach(unsigned int inst_id, unsigned int dma_size)
 {
@@ -1108,30 +2050,49 @@ _instance_attach(unsigned int inst_id, unsigned int dma_size)
     /* Reprobe the system for hot-plugged device */
     _device_reprobe();
 
+    mutex_lock(&_inst_lock);
+
     /* Validate the resource with inst_id */
     exist = _instance_validate(inst_id, dma_size);
-    if (exist < 0) {
-        return LUBDE_FAIL;
+    if (exist != 0) {
+        inst_idx = _instance_find(inst_id);
+        if (exist > 0 && inst_idx >= 0) {
+            /* Attached again, e.g. by a restarted process */
+            _bde_inst_resource[inst_idx].owner = current->tgid;
+        }
+        mutex_unlock(&_inst_lock);
+        return (exist < 0) ? LUBDE_FAIL : LUBDE_SUCCESS;
     }
-    if (exist > 0) {
-        return LUBDE_SUCCESS;
-    }
-    if (_dma_resource_alloc(dma_size, &dma_offset) < 0) {
-        return LUBDE_FAIL;
+
+    /* Instance attached again before init, size may differ */
+    inst_idx = _instance_find(inst_id);
+    if (inst_idx >= 0) {
+        exist = _instance_resize(inst_idx, dma_size,
+                                 LUBDE_INSTANCE_RESIZE_MOVE);
+        mutex_unlock(&_inst_lock);
+        return exist;
     }
+
     for (i = 0; i < user_bde->num_devices(BDE_ALL_DEVICES); i++) {
         res = &_bde_inst_resource[i];
         if ((_bde_multi_inst == 0) || (res->inst_id == 0)) {
-            res->inst_id = inst_id;
-            res->dma_offset = dma_offset;
-            res->dma_size = dma_size;
-            _bde_multi_inst++;
             inst_idx = i;
-            init_waitqueue_head(&res->intr_wq);
-            atomic_set(&res->intr, 0);
             break;
         }
     }
+    if (inst_idx < 0 || _dma_resource_alloc(dma_size, &dma_offset, -1) < 0) {
+        mutex_unlock(&_inst_lock);
+        return LUBDE_FAIL;
+    }
+    res = &_bde_inst_resource[inst_idx];
+    res->inst_id = inst_id;
+    res->dma_offset = dma_offset;
+    res->dma_size = dma_size;
+    res->owner = current->tgid;
+    _bde_multi_inst++;
+    _dma_resource_update(dma_size);
+    init_waitqueue_head(&res->intr_wq);
+    atomic_set(&res->intr, 0);
 
     for (i = 0; i < user_bde->num_devices(BDE_ALL_DEVICES); i++) {
         if (inst_id & (1 << i)) {
@@ -1145,9 +2106,680 @@ _instance_attach(unsigned int inst_id, unsigned int dma_size)
         }
     }
 
+    mutex_unlock(&_inst_lock);
+
+    return LUBDE_SUCCESS;
+}
+
+/*
+ * Function: _instance_detach
+ *
+ * Purpose:
+ *    Detach an instance and return its DMA partition to the pool.
+ * Parameters:
+ *    inst_id - device mask of the instance
+ * Returns:
+ *    LUBDE_SUCCESS or LUBDE_FAIL
+ * Notes:
+ *    Interrupts of all devices of the instance must be disabled.
+ *    When the last instance is detached, the default resource
+ *    covering all devices and the whole pool is restored.
+ *    Assumes _inst_lock is held.
+ */
+static int
+_instance_detach(unsigned int inst_id)
+{
+    bde_inst_resource_t *res;
+    int i, inst_idx, ndevices;
+    uint32 instid;
+
+    inst_idx = _instance_find(inst_id);
+    if (inst_idx < 0) {
+        return LUBDE_FAIL;
+    }
+    ndevices = user_bde->num_devices(BDE_ALL_DEVICES);
+    for (i = 0; i < ndevices; i++) {
+        if ((inst_id & (1 << i)) && _devices[i].inst == inst_idx &&
+            _devices[i].enabled) {
+            gprintk("ERROR: device %d interrupts still enabled\n", i);
+            return LUBDE_FAIL;
+        }
+    }
+    for (i = 0; i < ndevices; i++) {
+        if ((inst_id & (1 << i)) && _devices[i].inst == inst_idx) {
+            _devices[i].inst = 0;
+            if (lkbde_dev_instid_get(i, &instid) == 0 && instid == inst_id) {
+                lkbde_dev_instid_set(i, 0);
+            }
+        }
+    }
+
+    res = &_bde_inst_resource[inst_idx];
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+    _intr_eventfd_swap(&res->efd, &res->efd_owner, NULL);
+#endif
+    _dma_resource_update(-(int)res->dma_size);
+    res->inst_id = 0;
+    res->dma_offset = 0;
+    res->dma_size = 0;
+    res->owner = 0;
+
+    if (--_bde_multi_inst == 0) {
+        res = &_bde_inst_resource[0];
+        res->dma_offset = 0;
+        res->dma_size = _dma_pool.total_size;
+        for (i = 0; i < ndevices; i++) {
+            res->inst_id |= (1 << i);
+        }
+    }
     return LUBDE_SUCCESS;
 }
 
+/*
+ * Function: _instance_op
+ *
+ * Purpose:
+ *    Handle LUBDE_INSTANCE_OP.
+ * Parameters:
+ *    io - ioctl control structure
+ *         d0 - LUBDE_INSTANCE_OP_xxx
+ *         d1 - device mask of the instance
+ *         d2 - new DMA size in MB (resize)
+ *         d3 - LUBDE_INSTANCE_RESIZE_xxx flags (resize)
+ * Returns:
+ *    Always 0, result in io->rc
+ */
+static int
+_instance_op(lubde_ioctl_t *io)
+{
+    int inst_idx;
+
+    mutex_lock(&_inst_lock);
+
+    switch (io->d0) {
+    case LUBDE_INSTANCE_OP_DETACH:
+        io->rc = _instance_detach(io->d1);
+        break;
+    case LUBDE_INSTANCE_OP_RESIZE:
+        inst_idx = _instance_find(io->d1);
+        if (inst_idx < 0) {
+            io->rc = LUBDE_FAIL;
+            break;
+        }
+        io->rc = _instance_resize(inst_idx, io->d2, io->d3);
+        break;
+    default:
+        io->rc = LUBDE_FAIL;
+        break;
+    }
+
+    mutex_unlock(&_inst_lock);
+    return 0;
+}
+
+/* Poll interval for LUBDE_REG_OP_POLL */
+#define REG_POLL_USEC           10
+/* Poll by sleeping instead of spinning after this time */
+#define REG_POLL_SPIN_USEC      100
+/* Longest poll timeout accepted */
+#define REG_POLL_TIMEOUT_MAX    1000000
+
+/*
+ * Function: _reg_access
+ *
+ * Purpose:
+ *    Read or write a register in the selected address space.
+ * Parameters:
+ *    d - device number
+ *    space - LUBDE_REG_SPACE_xxx
+ *    addr - register address
+ *    val - (IN/OUT) value to write or value read
+ *    write - non-zero to write
+ * Returns:
+ *    0 on success, -1 on error
+ */
+static int
+_reg_access(int d, unsigned int space, unsigned int addr,
+            unsigned int *val, int write)
+{
+    switch (space) {
+    case LUBDE_REG_SPACE_REG:
+        if (write) {
+            return (user_bde->write(d, addr, *val) < 0) ? -1 : 0;
+        }
+        *val = user_bde->read(d, addr);
+        return 0;
+    case LUBDE_REG_SPACE_IPROC:
+        if (write) {
+            return (user_bde->iproc_write(d, addr, *val) == -1) ? -1 : 0;
+        }
+        *val = user_bde->iproc_read(d, addr);
+        return (*val == -1) ? -1 : 0;
+    case LUBDE_REG_SPACE_PCI_CONF:
+        if (!(_devices[d].dev_type & BDE_PCI_DEV_TYPE)) {
+            return -1;
+        }
+        if (write) {
+            return (user_bde->pci_conf_write(d, addr, *val) < 0) ? -1 : 0;
+        }
+        *val = user_bde->pci_conf_read(d, addr);
+        return 0;
+    default:
+        break;
+    }
+    return -1;
+}
+
+/*
+ * Function: _reg_op
+ *
+ * Purpose:
+ *    Execute one register access record.
+ * Parameters:
+ *    d - device number
+ *    op - register access record
+ * Returns:
+ *    0 on success, -1 on error
+ * Notes:
+ *    Poll timeouts are capped at REG_POLL_TIMEOUT_MAX microseconds,
+ *    and a poll is abandoned if the process is being killed.
+ */
+static int
+_reg_op(int d, lubde_reg_op_t *op)
+{
+    unsigned int val;
+    u64 start, now, deadline;
+
+    switch (op->op) {
+    case LUBDE_REG_OP_READ:
+        return _reg_access(d, op->space, op->addr, &op->value, 0);
+    case LUBDE_REG_OP_WRITE:
+        return _reg_access(d, op->space, op->addr, &op->value, 1);
+    case LUBDE_REG_OP_RMW:
+        if (_reg_access(d, op->space, op->addr, &val, 0) < 0) {
+            return -1;
+        }
+        val = (val & ~op->mask) | (op->value & op->mask);
+        if (_reg_access(d, op->space, op->addr, &val, 1) < 0) {
+            return -1;
+        }
+        op->value = val;
+        return 0;
+    case LUBDE_REG_OP_POLL:
+        start = ktime_to_ns(ktime_get());
+        deadline = start + (u64)min_t(unsigned int, op->timeout,
+                                      REG_POLL_TIMEOUT_MAX) * NSEC_PER_USEC;
+        for (;;) {
+            if (_reg_access(d, op->space, op->addr, &val, 0) < 0) {
+                return -1;
+            }
+            if ((val & op->mask) == op->value) {
+                break;
+            }
+            now = ktime_to_ns(ktime_get());
+            if (now >= deadline || fatal_signal_pending(current)) {
+                /* Return the last value read */
+                op->value = val;
+                return -1;
+            }
+            if (now - start < REG_POLL_SPIN_USEC * NSEC_PER_USEC) {
+                sal_udelay(REG_POLL_USEC);
+            } else {
+                sal_usleep(REG_POLL_USEC);
+            }
+        }
+        op->value = val;
+        return 0;
+    default:
+        break;
+    }
+    return -1;
+}
+
+/*
+ * Function: _reg_batch_iproc
+ *
+ * Purpose:
+ *    Execute register access records as one bulk iProc access.
+ * Parameters:
+ *    d - device number
+ *    ops - register access records
+ *    cnt - number of records
+ * Returns:
+ *    1 if executed, 0 if the records cannot be grouped, <0 on error
+ * Notes:
+ *    Only plain iProc reads and writes can be grouped. If the bulk
+ *    access fails, nothing was executed and 0 is returned, so the
+ *    records are executed one by one instead.
+ */
+static int
+_reg_batch_iproc(int d, lubde_reg_op_t *ops, unsigned int cnt)
+{
+    lkbde_iproc_op_t *iops;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < cnt; i++) {
+        if (ops[i].space != LUBDE_REG_SPACE_IPROC ||
+            (ops[i].op != LUBDE_REG_OP_READ &&
+             ops[i].op != LUBDE_REG_OP_WRITE)) {
+            return 0;
+        }
+    }
+    iops = kmalloc(cnt * sizeof(lkbde_iproc_op_t), GFP_KERNEL);
+    if (iops == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < cnt; i++) {
+        iops[i].addr = ops[i].addr;
+        iops[i].data = ops[i].value;
+        iops[i].write = (ops[i].op == LUBDE_REG_OP_WRITE);
+    }
+    rv = lkbde_iproc_bulk(d, iops, cnt);
+    if (rv < 0) {
+        kfree(iops);
+        return 0;
+    }
+    for (i = 0; i < cnt; i++) {
+        ops[i].value = iops[i].data;
+        ops[i].rc = LUBDE_SUCCESS;
+    }
+    kfree(iops);
+    return 1;
+}
+
+/*
+ * Function: _reg_batch
+ *
+ * Purpose:
+ *    Execute an array of register access records from user mode.
+ * Parameters:
+ *    io - ioctl control structure
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    This saves one system call per register for devices that
+ *    cannot be memory mapped to user space (SPI, EB bus) and for
+ *    indirect register access sequences. With LUBDE_REG_BATCH_SORT
+ *    in d2, iProc reads and writes are grouped by PAXB sub-window.
+ */
+static int
+_reg_batch(lubde_ioctl_t *io)
+{
+    lubde_reg_op_t *ops;
+    void *uptr = (void *)(unsigned long)io->p0;
+    unsigned int cnt = io->d0;
+    unsigned int i;
+    int rv;
+
+    if (!VALID_DEVICE(io->dev) || cnt == 0 || cnt > LUBDE_REG_BATCH_MAX) {
+        return -EINVAL;
+    }
+    ops = kmalloc(cnt * sizeof(lubde_reg_op_t), GFP_KERNEL);
+    if (ops == NULL) {
+        return -ENOMEM;
+    }
+    if (copy_from_user(ops, uptr, cnt * sizeof(lubde_reg_op_t))) {
+        kfree(ops);
+        return -EFAULT;
+    }
+
+    io->rc = LUBDE_SUCCESS;
+    rv = 0;
+    if (io->d2 & LUBDE_REG_BATCH_SORT) {
+        rv = _reg_batch_iproc(io->dev, ops, cnt);
+        if (rv < 0) {
+            kfree(ops);
+            return rv;
+        }
+    }
+    if (rv > 0) {
+        /* Executed as one bulk access */
+        i = cnt;
+    } else {
+        for (i = 0; i < cnt; i++) {
+            if (_reg_op(io->dev, &ops[i]) < 0) {
+                ops[i].rc = LUBDE_FAIL;
+                io->rc = LUBDE_FAIL;
+                i++;
+                break;
+            }
+            ops[i].rc = LUBDE_SUCCESS;
+        }
+    }
+    io->d1 = i;
+
+    if (copy_to_user(uptr, ops, i * sizeof(lubde_reg_op_t))) {
+        kfree(ops);
+        return -EFAULT;
+    }
+    kfree(ops);
+    return 0;
+}
+
+/*
+ * Function: _intr_eventfd_set
+ *
+ * Purpose:
+ *    Attach an eventfd to the interrupts of a device or an instance.
+ * Parameters:
+ *    io - ioctl control structure
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    d0 is the eventfd file descriptor, or LUBDE_INTR_EVENTFD_NONE
+ *    to detach. d1 selects LUBDE_INTR_SCOPE_DEVICE or
+ *    LUBDE_INTR_SCOPE_INSTANCE. The eventfd counter is increased
+ *    once per interrupt, so the value read is the number of
+ *    interrupts since the last read. The eventfd is released when
+ *    the attaching process closes the device.
+ */
+static int
+_intr_eventfd_set(lubde_ioctl_t *io)
+{
+#ifdef BDE_INTR_EVENTFD_SUPPORT
+    struct eventfd_ctx *ctx = NULL;
+    struct eventfd_ctx **slot;
+    pid_t *owner;
+
+    if (!VALID_DEVICE(io->dev) ||
+        !(_devices[io->dev].dev_type & BDE_SWITCH_DEV_TYPE)) {
+        return -EINVAL;
+    }
+    switch (io->d1) {
+    case LUBDE_INTR_SCOPE_DEVICE:
+        slot = &_devices[io->dev].efd;
+        owner = &_devices[io->dev].efd_owner;
+        break;
+    case LUBDE_INTR_SCOPE_INSTANCE:
+        slot = &_bde_inst_resource[_devices[io->dev].inst].efd;
+        owner = &_bde_inst_resource[_devices[io->dev].inst].efd_owner;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (io->d0 != LUBDE_INTR_EVENTFD_NONE) {
+        ctx = eventfd_ctx_fdget((int)io->d0);
+        if (IS_ERR(ctx)) {
+            return PTR_ERR(ctx);
+        }
+    }
+    _intr_eventfd_swap(slot, owner, ctx);
+    io->rc = LUBDE_SUCCESS;
+#else
+    io->rc = LUBDE_FAIL;
+#endif
+    return 0;
+}
+
+/*
+ * Function: _intr_status_get
+ *
+ * Purpose:
+ *    Read and clear the interrupt count and cause bitmap.
+ * Parameters:
+ *    io - ioctl control structure
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    d1 selects the scope as for LUBDE_INTR_EVENTFD. On return d0
+ *    holds the number of interrupts since the last call and d2 the
+ *    bitmap of devices which raised them.
+ */
+static int
+_intr_status_get(lubde_ioctl_t *io)
+{
+    bde_inst_resource_t *res;
+
+    if (!VALID_DEVICE(io->dev) ||
+        !(_devices[io->dev].dev_type & BDE_SWITCH_DEV_TYPE)) {
+        return -EINVAL;
+    }
+    switch (io->d1) {
+    case LUBDE_INTR_SCOPE_DEVICE:
+        io->d0 = atomic_xchg(&_devices[io->dev].intr_cnt, 0);
+        io->d2 = io->d0 ? (1U << io->dev) : 0;
+        break;
+    case LUBDE_INTR_SCOPE_INSTANCE:
+        res = &_bde_inst_resource[_devices[io->dev].inst];
+        io->d0 = atomic_xchg(&res->intr_cnt, 0);
+        io->d2 = xchg(&res->intr_cause, 0);
+        break;
+    default:
+        return -EINVAL;
+    }
+    io->rc = LUBDE_SUCCESS;
+    return 0;
+}
+
+/*
+ * Function: _shsem_op
+ *
+ * Purpose:
+ *    Handle LUBDE_SHSEM_OP.
+ * Parameters:
+ *    io - ioctl control structure
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    d0 is the operation and d1 the semaphore index.
+ *    CREATE: d1 is binary, d2 the initial count, returns index in d3.
+ *    DESTROY: sleepers in WAIT fail with -EIDRM.
+ *    WAIT: d2 is the timeout in microseconds or sal_sem_FOREVER.
+ *    WAKE: wake up sleepers after a give in user space.
+ *    BIND: give the semaphore on every interrupt of device dev,
+ *          d1 set to LUBDE_SHSEM_NONE to unbind.
+ */
+static int
+_shsem_op(lubde_ioctl_t *io)
+{
+#ifdef BDE_SHSEM_SUPPORT
+    unsigned long flags;
+    unsigned int idx = io->d1;
+    int i, rv;
+
+    if (_shsem == NULL) {
+        io->rc = LUBDE_FAIL;
+        return 0;
+    }
+    if (io->d0 != LUBDE_SHSEM_OP_CREATE &&
+        !(io->d0 == LUBDE_SHSEM_OP_BIND && idx == LUBDE_SHSEM_NONE)) {
+        if (idx >= LUBDE_SHSEM_MAX || !_shsem[idx].in_use) {
+            return -EINVAL;
+        }
+    }
+
+    io->rc = LUBDE_SUCCESS;
+    switch (io->d0) {
+    case LUBDE_SHSEM_OP_CREATE:
+        spin_lock_irqsave(&_shsem_lock, flags);
+        for (i = 0; i < LUBDE_SHSEM_MAX; i++) {
+            if (!_shsem[i].in_use) {
+                _shsem[i].count = io->d2;
+                _shsem[i].waiters = 0;
+                _shsem[i].binary = io->d1 ? 1 : 0;
+                _shsem[i].in_use = 1;
+                break;
+            }
+        }
+        spin_unlock_irqrestore(&_shsem_lock, flags);
+        if (i >= LUBDE_SHSEM_MAX) {
+            io->rc = LUBDE_FAIL;
+        }
+        io->d3 = i;
+        break;
+    case LUBDE_SHSEM_OP_DESTROY:
+        /* No interrupt handler gives the semaphore once the lock is held */
+        spin_lock_irqsave(&_shsem_lock, flags);
+        for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+            if (_devices[i].shsem == idx + 1) {
+                _devices[i].shsem = 0;
+            }
+        }
+        _shsem[idx].in_use = 0;
+        _shsem_gen[idx]++;
+        spin_unlock_irqrestore(&_shsem_lock, flags);
+        wake_up_interruptible_all(&_shsem_wq[idx]);
+        break;
+    case LUBDE_SHSEM_OP_WAIT:
+        rv = _shsem_wait(idx, (int)io->d2);
+        if (rv == -EIDRM) {
+            return rv;
+        }
+        if (rv < 0) {
+            io->rc = LUBDE_FAIL;
+        }
+        break;
+    case LUBDE_SHSEM_OP_WAKE:
+        wake_up_interruptible(&_shsem_wq[idx]);
+        break;
+    case LUBDE_SHSEM_OP_BIND:
+        if (!VALID_DEVICE(io->dev)) {
+            return -EINVAL;
+        }
+        spin_lock_irqsave(&_shsem_lock, flags);
+        if (idx != LUBDE_SHSEM_NONE && !_shsem[idx].in_use) {
+            /* Destroyed since the check above */
+            spin_unlock_irqrestore(&_shsem_lock, flags);
+            return -EINVAL;
+        }
+        _devices[io->dev].shsem = (idx == LUBDE_SHSEM_NONE) ? 0 : idx + 1;
+        spin_unlock_irqrestore(&_shsem_lock, flags);
+        break;
+    default:
+        io->rc = LUBDE_FAIL;
+        break;
+    }
+#else
+    io->rc = LUBDE_FAIL;
+#endif
+    return 0;
+}
+
+/*
+ * Function: _dma_window_mmap
+ *
+ * Purpose:
+ *    Map part of the DMA partition of an instance.
+ * Parameters:
+ *    vma - user mapping, offset relative to LUBDE_DMA_MMAP_OFFSET
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    The mapping must lie within the DMA pool and within one partition
+ *    owned by the calling process. Existing mappings are not revoked
+ *    when the partition is resized or detached.
+ */
+static int
+_dma_window_mmap(struct vm_area_struct *vma)
+{
+    unsigned long pgoff = vma->vm_pgoff - (LUBDE_DMA_MMAP_OFFSET >> PAGE_SHIFT);
+    unsigned long pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    unsigned long first, last, limit;
+    bde_inst_resource_t *res;
+    int i, rv = -EINVAL;
+
+    limit = (unsigned long)_dma_pool.total_size * (ONE_MB >> PAGE_SHIFT);
+    if (pages == 0 || pgoff > limit || pages > limit - pgoff) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&_inst_lock);
+    for (i = 0; i < LINUX_BDE_MAX_DEVICES; i++) {
+        res = &_bde_inst_resource[i];
+        if (res->inst_id == 0 || res->dma_size == 0 ||
+            !_instance_owned(res)) {
+            continue;
+        }
+        first = (unsigned long)res->dma_offset * (ONE_MB >> PAGE_SHIFT);
+        last = first + (unsigned long)res->dma_size * (ONE_MB >> PAGE_SHIFT);
+        if (pgoff >= first && pages <= last - pgoff) {
+            rv = 0;
+            break;
+        }
+    }
+    mutex_unlock(&_inst_lock);
+    if (rv < 0) {
+        return rv;
+    }
+
+    vma->vm_pgoff = (_dma_pool.cpu_pbase >> PAGE_SHIFT) + pgoff;
+#if USE_LINUX_BDE_MMAP
+    return lkbde_dma_mmap(vma);
+#else
+    if (remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff,
+                        pages << PAGE_SHIFT, vma->vm_page_prot)) {
+        return -EAGAIN;
+    }
+    return 0;
+#endif
+}
+
+/*
+ * Function: _mmap
+ *
+ * Purpose:
+ *    Map shared kernel data to user space.
+ * Parameters:
+ *    filp - file
+ *    vma - user mapping, the offset selects the area
+ * Returns:
+ *    0 on success, <0 on error
+ */
+static int
+_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+#ifdef BDE_SHSEM_SUPPORT
+    if (vma->vm_pgoff == (LUBDE_SHSEM_MMAP_OFFSET >> PAGE_SHIFT) &&
+        _shsem != NULL) {
+        return remap_vmalloc_range(vma, _shsem, 0);
+    }
+    if (vma->vm_pgoff == (LUBDE_INTR_RING_MMAP_OFFSET >> PAGE_SHIFT) &&
+        _intr_rings != NULL) {
+        return remap_vmalloc_range(vma, _intr_rings, 0);
+    }
+#endif
+    if (vma->vm_pgoff >= (LUBDE_DMA_MMAP_OFFSET >> PAGE_SHIFT)) {
+        return _dma_window_mmap(vma);
+    }
+    return -EINVAL;
+}
+
+/*
+ * Function: _intr_ring_set
+ *
+ * Purpose:
+ *    Enable or disable the interrupt cause ring of a device.
+ * Parameters:
+ *    io - ioctl control structure, d0 non-zero to enable
+ * Returns:
+ *    0 on success, <0 on error
+ * Notes:
+ *    Enabling resets the ring.
+ */
+static int
+_intr_ring_set(lubde_ioctl_t *io)
+{
+    lubde_intr_ring_t *ring;
+
+    if (!VALID_DEVICE(io->dev)) {
+        return -EINVAL;
+    }
+    if (_intr_rings == NULL) {
+        io->rc = LUBDE_FAIL;
+        return 0;
+    }
+    if (io->d0 && !_devices[io->dev].intr_ring) {
+        ring = _intr_ring_get(io->dev);
+        memset(ring, 0, sizeof(*ring));
+        ring->size = LUBDE_INTR_RING_SIZE;
+        smp_wmb();
+    }
+    _devices[io->dev].intr_ring = io->d0 ? 1 : 0;
+    io->rc = LUBDE_SUCCESS;
+    return 0;
+}
+
 /*
  * Function: _ioctl
  *
@@ -1230,9 +2862,18 @@ _ioctl(unsigned int cmd, unsigned long arg)
         }
         break;
     case LUBDE_GET_DMA_INFO:
+    case LUBDE_GET_DEV_DMA_INFO:
         inst_id = io.dev;
-        if (_bde_multi_inst){
-            _dma_resource_get(inst_id, &cpu_pbase, &dma_pbase, &size);
+        io.d3 = 0;
+        if (cmd == LUBDE_GET_DEV_DMA_INFO) {
+            if (!VALID_DEVICE(io.dev)) {
+                return -EINVAL;
+            }
+            lkbde_get_dev_dma_info(io.dev, &cpu_pbase, &dma_pbase, &size);
+        } else if (_bde_multi_inst){
+            mutex_lock(&_inst_lock);
+            io.d3 = _dma_resource_get(inst_id, &cpu_pbase, &dma_pbase, &size);
+            mutex_unlock(&_inst_lock);
         } else {
             lkbde_get_dma_info(&cpu_pbase, &dma_pbase, &size);
         }
@@ -1246,6 +2887,23 @@ _ioctl(unsigned int cmd, unsigned long arg)
         io.dx.dw[1] = cpu_pbase >> 32;
 #else
         io.dx.dw[1] = 0;
+#endif
+        break;
+    case LUBDE_GET_DMA_MMAP_INFO:
+#if USE_LINUX_BDE_MMAP
+        {
+            unsigned long page_size, huge_faults, page_faults;
+
+            lkbde_get_dma_mmap_info(&page_size, &huge_faults, &page_faults);
+            io.d0 = page_size;
+            io.d1 = huge_faults;
+            io.d2 = page_faults;
+        }
+#else
+        /* DMA memory is mapped through /dev/mem */
+        io.d0 = PAGE_SIZE;
+        io.d1 = 0;
+        io.d2 = 0;
 #endif
         break;
     case LUBDE_ENABLE_INTERRUPTS:
@@ -1255,7 +2913,7 @@ _ioctl(unsigned int cmd, unsigned long arg)
         if (_devices[io.dev].dev_type & BDE_SWITCH_DEV_TYPE) {
             if (_devices[io.dev].isr && !_devices[io.dev].enabled) {
                 user_bde->interrupt_connect(io.dev,
-                                            _devices[io.dev].isr,
+                                            (isr_f)_intr_dispatch,
                                             _devices+io.dev);
                 _devices[io.dev].enabled = 1;
             }
@@ -1312,6 +2970,9 @@ _ioctl(unsigned int cmd, unsigned long arg)
              */
             atomic_set(&_ether_interrupt_has_taken_place, 0);
         }
+#ifdef BDE_INTR_SELFTEST_SUPPORT
+        _intr_selftest_woken();
+#endif
         break;
     case LUBDE_USLEEP:
         sal_usleep(io.d0);
@@ -1319,6 +2980,37 @@ _ioctl(unsigned int cmd, unsigned long arg)
     case LUBDE_UDELAY:
         sal_udelay(io.d0);
         break;
+    case LUBDE_INTR_SELFTEST:
+#ifdef BDE_INTR_SELFTEST_SUPPORT
+        {
+            int rv = _intr_selftest_set(&io);
+
+            if (rv < 0) {
+                return rv;
+            }
+        }
+#else
+        io.rc = LUBDE_FAIL;
+#endif
+        break;
+    case LUBDE_INTR_RING:
+        {
+            int rv = _intr_ring_set(&io);
+
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        break;
+    case LUBDE_SHSEM_OP:
+        {
+            int rv = _shsem_op(&io);
+
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        break;
     case LUBDE_SEM_OP:
         switch (io.d0) {
         case LUBDE_SEM_OP_CREATE:
@@ -1409,9 +3101,66 @@ _ioctl(unsigned int cmd, unsigned long arg)
     case LUBDE_ATTACH_INSTANCE:
         io.rc = _instance_attach(io.d0, io.d1);
         break;
+    case LUBDE_INSTANCE_OP:
+        _instance_op(&io);
+        break;
     case LUBDE_GET_DEVICE_STATE:
         io.rc = lkbde_dev_state_get(io.dev, &io.d0);
         break;
+    case LUBDE_REG_BATCH:
+        {
+            int rv = _reg_batch(&io);
+
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        break;
+    case LUBDE_INTR_EVENTFD:
+        {
+            int rv = _intr_eventfd_set(&io);
+
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        break;
+    case LUBDE_GET_INTR_SOURCE:
+        {
+            int irq, cpu;
+
+            if (!VALID_DEVICE(io.dev)) {
+                return -EINVAL;
+            }
+            /*
+             * d0 is the LKBDE_INTR_SRC_xxx source. d1 is set if the
+             * source has an MSI-X vector of its own, d2 and d3 are
+             * the IRQ number and CPU serving it.
+             */
+            io.d1 = (lkbde_irq_source_get(io.dev, io.d0, &irq, &cpu) == 0);
+            io.d2 = irq;
+            io.d3 = cpu;
+        }
+        break;
+    case LUBDE_SET_INTR_POLL:
+        if (!VALID_DEVICE(io.dev)) {
+            return -EINVAL;
+        }
+        /* d0 is the poll interval in microseconds, 0 for interrupts */
+        if (lkbde_intr_poll_set(io.dev, io.d0) < 0) {
+            io.rc = LUBDE_FAIL;
+        }
+        io.d1 = lkbde_intr_poll_get(io.dev);
+        break;
+    case LUBDE_GET_INTR_STATUS:
+        {
+            int rv = _intr_status_get(&io);
+
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        break;
     default:
         gprintk("Error: Invalid ioctl (%08x)\n", cmd);
         io.rc = LUBDE_FAIL;
@@ -1435,7 +3184,9 @@ static gmodule_t _gmodule =
     init: _init, 
     cleanup: _cleanup, 
     pprint: _pprint, 
+    close: _close,
     ioctl: _ioctl,
+    mmap: _mmap,
 }; 
 
 gmodule_t*
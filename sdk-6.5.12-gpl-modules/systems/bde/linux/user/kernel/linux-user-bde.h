@@ -50,6 +50,113 @@ typedef struct  {
     } dx;
 } lubde_ioctl_t;
 
+/*
+ * Register access record for LUBDE_REG_BATCH
+ *
+ * The ioctl is issued with dev set to the device, d0 set to the number
+ * of records and p0 pointing to the record array. Records are executed
+ * in order. On return d1 holds the number of records executed, and
+ * execution stops at the first failing record.
+ */
+typedef struct {
+    unsigned int op;        /* LUBDE_REG_OP_xxx */
+    unsigned int space;     /* LUBDE_REG_SPACE_xxx */
+    unsigned int addr;      /* Register address or config space offset */
+    unsigned int value;     /* Write/compare value, read result */
+    unsigned int mask;      /* Modify/compare mask */
+    unsigned int timeout;   /* Poll timeout in microseconds, max 1 s */
+    unsigned int rc;        /* LUBDE_SUCCESS or LUBDE_FAIL */
+} lubde_reg_op_t;
+
+#define LUBDE_REG_OP_READ         1 /* value = reg */
+#define LUBDE_REG_OP_WRITE        2 /* reg = value */
+#define LUBDE_REG_OP_RMW          3 /* reg = (reg & ~mask) | (value & mask) */
+#define LUBDE_REG_OP_POLL         4 /* wait until (reg & mask) == value */
+
+#define LUBDE_REG_SPACE_REG       0 /* Bus independent register access */
+#define LUBDE_REG_SPACE_IPROC     1 /* iProc register access */
+#define LUBDE_REG_SPACE_PCI_CONF  2 /* PCI configuration space */
+
+#define LUBDE_REG_BATCH_MAX       1024
+
+/*
+ * Flag for d2 of LUBDE_REG_BATCH. If all records are iProc reads and
+ * writes, they are grouped by PAXB sub-window to save sub-window
+ * updates. Records in the same 4K page keep their order, records in
+ * different pages may be reordered.
+ */
+#define LUBDE_REG_BATCH_SORT      0x1
+
+/*
+ * Shared semaphore, see LUBDE_SHSEM_OP
+ *
+ * The semaphore array is mapped by mmap of the user BDE device at
+ * LUBDE_SHSEM_MMAP_OFFSET. Take decrements count with an atomic
+ * compare-and-swap while it is positive, and calls LUBDE_SHSEM_OP_WAIT
+ * otherwise. Give increments count (binary semaphores saturate at 1)
+ * followed by a full memory barrier, and calls LUBDE_SHSEM_OP_WAKE if
+ * waiters is non-zero.
+ */
+typedef struct {
+    int32_t  count;     /* Available count */
+    uint32_t waiters;   /* Threads sleeping in LUBDE_SHSEM_OP_WAIT */
+    uint32_t binary;    /* Binary semaphore */
+    uint32_t in_use;    /* Allocated by LUBDE_SHSEM_OP_CREATE */
+} lubde_shsem_t;
+
+#define LUBDE_SHSEM_MAX           256
+#define LUBDE_SHSEM_NONE          ((unsigned int)-1)
+
+#define LUBDE_SHSEM_MMAP_OFFSET   0
+#define LUBDE_SHSEM_MMAP_SIZE     (LUBDE_SHSEM_MAX * sizeof(lubde_shsem_t))
+
+/*
+ * Interrupt cause ring, see LUBDE_INTR_RING
+ *
+ * When enabled, the interrupt handler records the pending user mode
+ * interrupts of the device before masking them. The cause words are the
+ * enabled bits of CMIC_IRQ_STAT (CMIC/CMICe), of IRQ_STAT0-4 (CMICm) or
+ * IRQ_STAT0-6 (CMICd) of the CMC, or of the INTC status registers
+ * (CMICx).
+ *
+ * The rings of all devices are mapped by mmap of the user BDE device
+ * at LUBDE_INTR_RING_MMAP_OFFSET, the ring of device d at offset
+ * d * LUBDE_INTR_RING_STRIDE. Record n is in rec[n % size] and is
+ * valid when its seq equals n + 1. A larger seq means the record was
+ * overwritten. User space keeps its position in tail.
+ */
+#define LUBDE_INTR_CAUSE_WORDS    8
+#define LUBDE_INTR_RING_SIZE      64
+
+typedef struct {
+    uint64_t timestamp;     /* Monotonic time in nanoseconds */
+    uint32_t seq;           /* Record number + 1, 0 while being written */
+    uint32_t ncause;        /* Valid words in cause */
+    uint32_t cause[LUBDE_INTR_CAUSE_WORDS];
+} lubde_intr_rec_t;
+
+typedef struct {
+    uint32_t head;          /* Records written */
+    uint32_t tail;          /* Records read, written by user space */
+    uint32_t overruns;      /* Records overwritten before read */
+    uint32_t size;          /* LUBDE_INTR_RING_SIZE */
+    lubde_intr_rec_t rec[LUBDE_INTR_RING_SIZE];
+} lubde_intr_ring_t;
+
+#define LUBDE_INTR_RING_STRIDE      4096
+#define LUBDE_INTR_RING_MMAP_OFFSET 0x100000
+#define LUBDE_INTR_RING_MMAP_SIZE   (LINUX_BDE_MAX_DEVICES * LUBDE_INTR_RING_STRIDE)
+
+/*
+ * Per-instance DMA windows
+ *
+ * The DMA partition of an instance can be mapped by mmap of the user
+ * BDE device at LUBDE_DMA_MMAP_OFFSET plus the partition offset, which
+ * LUBDE_GET_DMA_INFO returns in d3 (in MB). A mapping must lie within
+ * the partition of a single instance.
+ */
+#define LUBDE_DMA_MMAP_OFFSET     0x40000000
+
 
 /* LUBDE ioctls */
 #define LUBDE_MAGIC 'L'
@@ -81,12 +188,58 @@ typedef struct  {
 #define LUBDE_IPROC_WRITE_REG     _IO(LUBDE_MAGIC, 28)
 #define LUBDE_ATTACH_INSTANCE     _IO(LUBDE_MAGIC, 29)
 #define LUBDE_GET_DEVICE_STATE    _IO(LUBDE_MAGIC, 30)
+#define LUBDE_GET_DEV_DMA_INFO    _IO(LUBDE_MAGIC, 31)
+#define LUBDE_GET_DMA_MMAP_INFO   _IO(LUBDE_MAGIC, 32)
+#define LUBDE_REG_BATCH           _IO(LUBDE_MAGIC, 33)
+#define LUBDE_INTR_EVENTFD        _IO(LUBDE_MAGIC, 34)
+#define LUBDE_GET_INTR_STATUS     _IO(LUBDE_MAGIC, 35)
+#define LUBDE_GET_INTR_SOURCE     _IO(LUBDE_MAGIC, 36)
+#define LUBDE_SET_INTR_POLL       _IO(LUBDE_MAGIC, 37)
+#define LUBDE_SHSEM_OP            _IO(LUBDE_MAGIC, 38)
+#define LUBDE_INTR_RING           _IO(LUBDE_MAGIC, 39)
+#define LUBDE_INSTANCE_OP         _IO(LUBDE_MAGIC, 40)
+#define LUBDE_INTR_SELFTEST       _IO(LUBDE_MAGIC, 41)
 
 #define LUBDE_SEM_OP_CREATE       1
 #define LUBDE_SEM_OP_DESTROY      2
 #define LUBDE_SEM_OP_TAKE         3
 #define LUBDE_SEM_OP_GIVE         4
 
+#define LUBDE_SHSEM_OP_CREATE     1
+#define LUBDE_SHSEM_OP_DESTROY    2
+#define LUBDE_SHSEM_OP_WAIT       3
+#define LUBDE_SHSEM_OP_WAKE       4
+#define LUBDE_SHSEM_OP_BIND       5
+
+#define LUBDE_INSTANCE_OP_DETACH  1
+#define LUBDE_INSTANCE_OP_RESIZE  2
+
+/*
+ * LUBDE_INSTANCE_OP_RESIZE flag: move the partition if it cannot be
+ * resized in place. The contents are not preserved, so DMA must be
+ * stopped and the DMA info read again.
+ */
+#define LUBDE_INSTANCE_RESIZE_MOVE 0x1
+
+/*
+ * Interrupt notification scope for LUBDE_INTR_EVENTFD and
+ * LUBDE_GET_INTR_STATUS. An instance eventfd is signalled for
+ * interrupts from any device of the instance, so one thread can
+ * poll all devices (and the KNET event stream) together.
+ */
+#define LUBDE_INTR_SCOPE_DEVICE   0
+#define LUBDE_INTR_SCOPE_INSTANCE 1
+
+#define LUBDE_INTR_EVENTFD_NONE   ((unsigned int)-1)
+
+/*
+ * LUBDE_INTR_SELFTEST fires d0 synthetic interrupts per second (0
+ * stops the test), which wake the threads waiting in
+ * LUBDE_WAIT_FOR_INTERRUPT for device dev. The device need not exist.
+ * Wake up latency percentiles are shown in /proc/linux-user-bde.
+ */
+#define LUBDE_INTR_SELFTEST_MAX_RATE 100000
+
 #define LUBDE_SUCCESS 0
 #define LUBDE_FAIL ((unsigned int)-1)
 
@@ -94,8 +247,19 @@ typedef struct  {
 /* 
  * Version history
  * 1:add LUBDE_GET_DEVICE_STATE to support PCI hot plug
+ * 2:add LUBDE_GET_DEV_DMA_INFO for per-device DMA pools
+ * 3:add LUBDE_GET_DMA_MMAP_INFO to report DMA mmap page size
+ * 4:add LUBDE_REG_BATCH for vectored register access
+ * 5:add LUBDE_INTR_EVENTFD and LUBDE_GET_INTR_STATUS
+ * 6:add LUBDE_GET_INTR_SOURCE for MSI-X interrupt source routing
+ * 7:add LUBDE_SET_INTR_POLL for interrupt polling mode
+ * 8:add LUBDE_SHSEM_OP and mmap of shared semaphores
+ * 9:add LUBDE_INTR_RING and mmap of interrupt cause rings
+ * 10:add LUBDE_REG_BATCH_SORT
+ * 11:add LUBDE_INSTANCE_OP and per-instance DMA mmap windows
+ * 12:add LUBDE_INTR_SELFTEST
  */
-#define KBDE_VERSION    1
+#define KBDE_VERSION    12
 
 
 /* This is the signal that will be used
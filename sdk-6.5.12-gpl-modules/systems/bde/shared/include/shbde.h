@@ -70,6 +70,13 @@ typedef struct shbde_hal_s {
     /* iProc configuration */
     shbde_iproc_config_t icfg;
 
+    /* Skip reprogramming of PAXB sub-window 7 if unchanged (optional) */
+    unsigned int subwin_cache;
+    /* Current sub-window 7 base address (0 if unknown) */
+    unsigned int subwin_base;
+    /* Number of sub-window 7 updates */
+    unsigned int subwin_switches;
+
 } shbde_hal_t;
 
 
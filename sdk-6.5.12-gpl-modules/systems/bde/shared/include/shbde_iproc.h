@@ -41,6 +41,9 @@ extern void
 shbde_iproc_pci_write(shbde_hal_t *shbde, void *iproc_regs,
                       unsigned int addr, unsigned int data);
 
+extern void
+shbde_iproc_subwin_flush(shbde_hal_t *shbde);
+
 extern int
 shbde_iproc_pcie_preemphasis_set(shbde_hal_t *shbde, void *iproc_regs,
                                  shbde_iproc_config_t *icfg, void *pci_dev);
@@ -236,6 +236,8 @@ shbde_iproc_paxb_init(shbde_hal_t *shbde, void *iproc_regs,
         return -1;
     }
 
+    shbde_iproc_subwin_flush(shbde);
+
     /*
      * The following code attempts to auto-detect the correct
      * iProc PCI endianess configuration by reading a well-known
@@ -290,46 +292,75 @@ shbde_iproc_paxb_init(shbde_hal_t *shbde, void *iproc_regs,
 
 /*
  * Function:
- *      shbde_iproc_pci_read
+ *      iproc_subwin_reg
  * Purpose:
- *      Read iProc register through PCI BAR 0
+ *      Get PCI BAR 0 address of an iProc register
  * Parameters:
  *      shbde - pointer to initialized hardware abstraction module
  *      iproc_regs - memory mapped iProc registers in PCI BAR
  *      addr - iProc register address in AXI memory space
  * Returns:
- *      Register value
+ *      Register address in PCI BAR 0
+ * Notes:
+ *      Registers outside the fixed windows are accessed through
+ *      sub-window 7, which is updated if it does not point to the
+ *      4K page of the register. With subwin_cache set, the current
+ *      sub-window is remembered and only updated when it changes.
  */
-unsigned int
-shbde_iproc_pci_read(shbde_hal_t *shbde, void *iproc_regs,
-                     unsigned int addr)
+static void *
+iproc_subwin_reg(shbde_hal_t *shbde, void *iproc_regs, unsigned int addr)
 {
     unsigned int subwin_base;
     void *reg;
     shbde_iproc_config_t *icfg = &shbde->icfg;
 
-    if (!iproc_regs) {
-        return -1;
-    }
-
     /* Sub-window size is 0x1000 (4K) */
     subwin_base = (addr & ~0xfff);
 
     if((icfg->cmic_ver >= 4) && (subwin_base == 0x18013000)) {
         /* Route the INTC block access through IMAP0_6 */
-        reg = ROFFS(iproc_regs, 0x6000 + (addr & 0xfff));
-    } else {
-    /* Update base address for sub-window 7 */
-        subwin_base |= 1; /* Valid bit */
-    reg = ROFFS(iproc_regs, BAR0_PAXB_IMAP0_7);
-    iproc32_write(shbde, reg, subwin_base);
+        return ROFFS(iproc_regs, 0x6000 + (addr & 0xfff));
+    }
+
+    subwin_base |= 1; /* Valid bit */
+    if (!shbde->subwin_cache || shbde->subwin_base != subwin_base) {
+        /* Update base address for sub-window 7 */
+        reg = ROFFS(iproc_regs, BAR0_PAXB_IMAP0_7);
+        iproc32_write(shbde, reg, subwin_base);
         /* Read it to make sure the write actually goes through */
-        subwin_base = iproc32_read(shbde, reg);
+        (void)iproc32_read(shbde, reg);
+        shbde->subwin_base = subwin_base;
+        shbde->subwin_switches++;
+    }
 
-    /* Read register through sub-window 7 */
-    reg = ROFFS(iproc_regs, 0x7000 + (addr & 0xfff));
+    /* Access register through sub-window 7 */
+    return ROFFS(iproc_regs, 0x7000 + (addr & 0xfff));
+}
+
+/*
+ * Function:
+ *      shbde_iproc_pci_read
+ * Purpose:
+ *      Read iProc register through PCI BAR 0
+ * Parameters:
+ *      shbde - pointer to initialized hardware abstraction module
+ *      iproc_regs - memory mapped iProc registers in PCI BAR
+ *      addr - iProc register address in AXI memory space
+ * Returns:
+ *      Register value
+ */
+unsigned int
+shbde_iproc_pci_read(shbde_hal_t *shbde, void *iproc_regs,
+                     unsigned int addr)
+{
+    void *reg;
+
+    if (!iproc_regs) {
+        return -1;
     }
 
+    reg = iproc_subwin_reg(shbde, iproc_regs, addr);
+
     return iproc32_read(shbde, reg);
 }
 
@@ -350,33 +381,36 @@ void
 shbde_iproc_pci_write(shbde_hal_t *shbde, void *iproc_regs,
                       unsigned int addr, unsigned int data)
 {
-    unsigned int subwin_base;
     void *reg;
-    shbde_iproc_config_t *icfg = &shbde->icfg;
 
     if (!iproc_regs) {
         return;
     }
 
-    /* Sub-window size is 0x1000 (4K) */
-    subwin_base = (addr & ~0xfff);
+    reg = iproc_subwin_reg(shbde, iproc_regs, addr);
 
-    if((icfg->cmic_ver >= 4) && (subwin_base == 0x18013000)) {
-        /* Route the INTC block access through IMAP0_6 */
-        reg = ROFFS(iproc_regs, 0x6000 + (addr & 0xfff));
-    } else {
-    /* Update base address for sub-window 7 */
-        subwin_base |= 1; /* Valid bit */
-    reg = ROFFS(iproc_regs, BAR0_PAXB_IMAP0_7);
-    iproc32_write(shbde, reg, subwin_base);
-        /* Read it to make sure the write actually goes through */
-        subwin_base = iproc32_read(shbde, reg);
+    iproc32_write(shbde, reg, data);
+}
 
-        /* Read register through sub-window 7 */
-    reg = ROFFS(iproc_regs, 0x7000 + (addr & 0xfff));
+/*
+ * Function:
+ *      shbde_iproc_subwin_flush
+ * Purpose:
+ *      Forget the cached PAXB sub-window 7 base address
+ * Parameters:
+ *      shbde - pointer to initialized hardware abstraction module
+ * Returns:
+ *      Nothing
+ * Notes:
+ *      Must be called if sub-window 7 may have been programmed
+ *      by other means, e.g. after a PCIe reset.
+ */
+void
+shbde_iproc_subwin_flush(shbde_hal_t *shbde)
+{
+    if (shbde) {
+        shbde->subwin_base = 0;
     }
-
-    iproc32_write(shbde, reg, data);
 }
 
 int
@@ -70,6 +70,15 @@
 #include <linux/random.h>
 #include <linux/seq_file.h>
 #include <linux/if_vlan.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/rculist.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+#include <linux/jump_label.h>
+#endif
 
 
 MODULE_AUTHOR("Broadcom Corporation");
@@ -156,6 +165,31 @@ LKM_MOD_PARAM_ARRAY(rx_burst, "1-4i", int, NULL, 0);
 MODULE_PARM_DESC(rx_burst,
 "Rx rate burst maximum in packets (default rx_rate/10)");
 
+static int rx_dump_sample[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+LKM_MOD_PARAM_ARRAY(rx_dump_sample, "1-4i", int, NULL, 0);
+MODULE_PARM_DESC(rx_dump_sample,
+"Dump one of every N Rx descriptors per channel when debugging (default 1)");
+
+static int tx_dcbs = 64;
+LKM_MOD_PARAM(tx_dcbs, "i", int, 0);
+MODULE_PARM_DESC(tx_dcbs,
+"Number of Tx DMA descriptors (default 64, range 8-4096)");
+
+static int rx_dcbs[8] = { 64, 64, 64, 64, 64, 64, 64, 64 };
+LKM_MOD_PARAM_ARRAY(rx_dcbs, "1-4i", int, NULL, 0);
+MODULE_PARM_DESC(rx_dcbs,
+"Number of Rx DMA descriptors per channel (default 64, range 8-4096)");
+
+static int tx_dump_sample = 1;
+LKM_MOD_PARAM(tx_dump_sample, "i", int, 0);
+MODULE_PARM_DESC(tx_dump_sample,
+"Dump one of every N Tx descriptors when debugging (default 1)");
+
+static int rx_flow_hash = 0;
+LKM_MOD_PARAM(rx_flow_hash, "i", int, 0);
+MODULE_PARM_DESC(rx_flow_hash,
+"Set Rx SKB flow hash from IP 5-tuple for RPS/RFS steering (default 0)");
+
 static int check_rcpu_signature = 0;
 LKM_MOD_PARAM(check_rcpu_signature, "i", int, 0);
 MODULE_PARM_DESC(check_rcpu_signature,
@@ -212,6 +246,45 @@ MODULE_PARM_DESC(basedev_suspend,
                                           DBG_LVL_DCB_RX)) \
                                  gprintk _s; } while (0)
 
+/*
+ * Descriptor and packet dumps are compiled in by default, but they
+ * can be removed entirely from production builds by compiling with
+ * BKN_DEBUG_DUMP=0.
+ *
+ * When compiled in, the dump paths are guarded by a static key (if
+ * supported by the kernel), which is only enabled while one of the
+ * dump debug levels is set. The Rx/Tx descriptor loops therefore
+ * cost a single patched branch per descriptor when dumps are off.
+ */
+#ifndef BKN_DEBUG_DUMP
+#define BKN_DEBUG_DUMP 1
+#endif
+
+#define DBG_LVL_DUMP_RX (DBG_LVL_DCB|DBG_LVL_DCB_RX|DBG_LVL_PDMP|DBG_LVL_PDMP_RX)
+#define DBG_LVL_DUMP_TX (DBG_LVL_DCB|DBG_LVL_DCB_TX|DBG_LVL_PDMP|DBG_LVL_PDMP_TX)
+
+#if BKN_DEBUG_DUMP
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+static DEFINE_STATIC_KEY_FALSE(bkn_dump_key);
+#define BKN_DUMP_ENABLED()      static_branch_unlikely(&bkn_dump_key)
+#define BKN_DUMP_KEY_SET(_on) \
+    do { if (_on) static_branch_enable(&bkn_dump_key); \
+         else static_branch_disable(&bkn_dump_key); } while (0)
+#else
+static int bkn_dump_on;
+#define BKN_DUMP_ENABLED()      unlikely(bkn_dump_on)
+#define BKN_DUMP_KEY_SET(_on)   do { bkn_dump_on = (_on); } while (0)
+#endif
+#else
+#define BKN_DUMP_ENABLED()      0
+#define BKN_DUMP_KEY_SET(_on)   do { } while (0)
+#endif
+
+#define bkn_dump_dcb(_p, _i, _d, _w, _t) \
+    do { if (BKN_DUMP_ENABLED()) _bkn_dump_dcb(_p, _i, _d, _w, _t); } while (0)
+#define bkn_dump_pkt(_d, _s, _t) \
+    do { if (BKN_DUMP_ENABLED()) _bkn_dump_pkt(_d, _s, _t); } while (0)
+
 
 /* This flag is used to indicate if debugging packet function is open or closed */
 static int dbg_pkt_enable = 0;
@@ -266,6 +339,12 @@ static int napi_weight = 0;
 
 #endif
 
+/* Interrupt latency self-test, see /proc/bcm/knet/selftest */
+#if NAPI_SUPPORT && (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29))
+#define BKN_SELFTEST_SUPPORT
+#include <klat.h>
+#endif
+
 /*
  * If proxy support is compiled in the module will attempt to use
  * the user/kernel message service provided by the linux-uk-proxy
@@ -386,6 +465,16 @@ static inline struct sk_buff *skb_padto(struct sk_buff *skb, unsigned int len)
     __vlan_hwaccel_put_tag(_skb, htons(_proto), _tci)
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+#define bkn_skb_set_hash(_skb, _hash, _l4)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#define bkn_skb_set_hash(_skb, _hash, _l4) \
+    do { (_skb)->rxhash = (_hash); } while (0)
+#else
+#define bkn_skb_set_hash(_skb, _hash, _l4) \
+    skb_set_hash(_skb, _hash, (_l4) ? PKT_HASH_TYPE_L4 : PKT_HASH_TYPE_L3)
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
 #define bkn_dma_mapping_error(d, a) \
     dma_mapping_error(a)
@@ -456,8 +545,15 @@ typedef struct bkn_dcb_chain_s {
     uint64_t dcb_dma;
 } bkn_dcb_chain_t;
 
-#define MAX_TX_DCBS 64
-#define MAX_RX_DCBS 64
+/* Ring depth limits, see tx_dcbs and rx_dcbs */
+#define MIN_DCBS 8
+#define MAX_DCBS 4096
+
+/* Rx DCBs per interrupt or poll round */
+#define RX_BUDGET 64
+
+/* SKBs per Rx batch call-back */
+#define MAX_RX_BATCH 64
 
 #define NUM_DMA_CHAN 8
 #define NUM_RX_CHAN 7
@@ -509,12 +605,15 @@ typedef struct bkn_switch_info_s {
     int evt_idx;                /* Event queue index for this device*/
     int basedev_suspended;      /* Base device suspended */
     struct {
-        bkn_desc_info_t desc[MAX_TX_DCBS+1];
+        bkn_desc_info_t *desc;  /* Tx DCBs, plus one reload DCB */
+        int dcbs;               /* Tx ring depth */
         int free;               /* Number of free Tx DCBs */
         int cur;                /* Index of current Tx DCB */
         int dirty;              /* Index of next Tx DCB to complete */
         int api_active;         /* BCM Tx API is in progress */
         int suspends;           /* Calls to netif_stop_queue (debug only) */
+        int dump_sample;        /* Dump one of every N DCBs (debug only) */
+        int dump_cnt;           /* DCBs since last dump (debug only) */
         struct list_head api_dcb_list; /* Tx DCB chains from BCM Tx API */
         bkn_dcb_chain_t *api_dcb_chain; /* Current Tx DCB chain */
         bkn_dcb_chain_t *api_dcb_chain_end; /* Tx DCB chain end */
@@ -530,7 +629,8 @@ typedef struct bkn_switch_info_s {
         uint32_t pkts_d_over_limit; /* Tx drop - length is out of range */
     } tx;
     struct {
-        bkn_desc_info_t desc[MAX_RX_DCBS+1];
+        bkn_desc_info_t *desc;  /* Rx DCBs, plus one reload DCB */
+        int dcbs;               /* Rx ring depth */
         int free;               /* Number of free Rx DCBs */
         int cur;                /* Index of current Rx DCB */
         int dirty;              /* Index of next Rx DCB to complete */
@@ -542,6 +642,10 @@ typedef struct bkn_switch_info_s {
         int sync_retry;         /* Total retry times for sync error (debug) */
         int sync_maxloop;       /* Max loop times once in recovering sync (debug) */
         int use_rx_skb;         /* Use SKBs for DMA */
+        int dump_sample;        /* Dump one of every N DCBs (debug only) */
+        int dump_cnt;           /* DCBs since last dump (debug only) */
+        struct sk_buff *batch[MAX_RX_BATCH]; /* SKBs for Rx batch call-backs */
+        int batch_cnt;          /* Number of SKBs in batch */
         uint32_t rate_max;      /* Rx rate in packets/sec */
         uint32_t burst_max;     /* Rx burst size in number of packets */
         uint32_t tokens;        /* Tokens for Rx rate control */
@@ -714,9 +818,18 @@ typedef struct bkn_filter_s {
     struct list_head list;
     int dev_no;
     unsigned long hits;
+    int sample_rate;            /* Sample 1-in-N matching packets */
     kcom_filter_t kf;
 } bkn_filter_t;
 
+/*
+ * Packet sampling rings (one per CPU, see bcm-knet.h for layout).
+ * Allocated the first time a filter sample rate is configured.
+ */
+static void *bkn_sample_mem;
+static unsigned long bkn_sample_mem_size;
+static DEFINE_PER_CPU(u32, bkn_sample_seed);
+
 
 /*
  * Multiple instance support in KNET
@@ -744,10 +857,23 @@ LIST_HEAD(_sinfo_list);
 /* Reallocation chunk size for netif array */
 #define NDEVS_CHUNK     64
 
-/* User call-backs */
-static knet_skb_cb_f knet_rx_cb = NULL;
-static knet_skb_cb_f knet_tx_cb = NULL;
-static knet_filter_cb_f knet_filter_cb = NULL;
+/*
+ * User call-back chain (sorted by priority, protected by RCU)
+ *
+ * The hook counters allow the Rx/Tx paths to skip the chain entirely
+ * when no hooks of a given type are registered.
+ */
+static LIST_HEAD(bkn_hook_list);
+static DEFINE_SPINLOCK(bkn_hook_lock);
+static int bkn_hook_rx_cnt;
+static int bkn_hook_tx_cnt;
+static int bkn_hook_filter_cnt;
+static int bkn_hook_batch_cnt;
+
+/* Hook used for the legacy single call-back interfaces */
+static knet_hook_t bkn_legacy_hook = {
+    priority:   KNET_HOOK_PRIO_DEFAULT,
+};
 
 /*
  * Thread management
@@ -1667,13 +1793,15 @@ static int
 bkn_alloc_dcbs(bkn_switch_info_t *sinfo)
 {
     int dcb_size;
-    int tx_ring_size, rx_ring_size;
+    int chan;
     dma_addr_t dcb_dma = 0;
 
+    /* Each ring has one extra DCB to reload the ring start */
     dcb_size = sinfo->dcb_wsize * sizeof(uint32_t);
-    tx_ring_size = dcb_size * (MAX_TX_DCBS + 1);
-    rx_ring_size = dcb_size * (MAX_RX_DCBS + 1);
-    sinfo->dcb_mem_size = tx_ring_size + rx_ring_size * sinfo->rx_chans;
+    sinfo->dcb_mem_size = dcb_size * (sinfo->tx.dcbs + 1);
+    for (chan = 0; chan < sinfo->rx_chans; chan++) {
+        sinfo->dcb_mem_size += dcb_size * (sinfo->rx[chan].dcbs + 1);
+    }
 
     sinfo->dcb_mem = DMA_ALLOC_COHERENT(sinfo->dma_dev,
                                         sinfo->dcb_mem_size,
@@ -1684,6 +1812,7 @@ bkn_alloc_dcbs(bkn_switch_info_t *sinfo)
         return -ENOMEM;
     }
     sinfo->dcb_dma = (uint64_t)dcb_dma;
+    lkbde_dma_owner_update(LKBDE_DMA_OWNER_KNET, sinfo->dcb_mem_size);
 
     return 0;
 }
@@ -1694,6 +1823,7 @@ bkn_free_dcbs(bkn_switch_info_t *sinfo)
     if (sinfo->dcb_mem != NULL) {
         DMA_FREE_COHERENT(sinfo->dma_dev, sinfo->dcb_mem_size,
                           sinfo->dcb_mem, (dma_addr_t)sinfo->dcb_dma);
+        lkbde_dma_owner_update(LKBDE_DMA_OWNER_KNET, -sinfo->dcb_mem_size);
         sinfo->dcb_mem = NULL;
     }
 }
@@ -1705,7 +1835,7 @@ bkn_clean_tx_dcbs(bkn_switch_info_t *sinfo)
 
     DBG_DCB_TX(("Cleaning Tx DCBs (%d %d).\n",
                 sinfo->tx.cur, sinfo->tx.dirty));
-    while (sinfo->tx.free < MAX_TX_DCBS) {
+    while (sinfo->tx.free < sinfo->tx.dcbs) {
         desc = &sinfo->tx.desc[sinfo->tx.dirty];
         if (desc->skb != NULL) {
             DBG_SKB(("Cleaning Tx SKB from DCB %d.\n",
@@ -1717,7 +1847,7 @@ bkn_clean_tx_dcbs(bkn_switch_info_t *sinfo)
             dev_kfree_skb_any(desc->skb);
             desc->skb = NULL;
         }
-        if (++sinfo->tx.dirty >= MAX_TX_DCBS) {
+        if (++sinfo->tx.dirty >= sinfo->tx.dcbs) {
             sinfo->tx.dirty = 0;
         }
         sinfo->tx.free++;
@@ -1746,7 +1876,7 @@ bkn_clean_rx_dcbs(bkn_switch_info_t *sinfo, int chan)
             dev_kfree_skb_any(desc->skb);
             desc->skb = NULL;
         }
-        if (++sinfo->rx[chan].dirty >= MAX_RX_DCBS) {
+        if (++sinfo->rx[chan].dirty >= sinfo->rx[chan].dcbs) {
             sinfo->rx[chan].dirty = 0;
         }
         sinfo->rx[chan].free--;
@@ -1786,14 +1916,14 @@ bkn_init_dcbs(bkn_switch_info_t *sinfo)
     dcb_mem = sinfo->dcb_mem;
     dcb_dma = sinfo->dcb_dma;
 
-    for (idx = 0; idx < (MAX_TX_DCBS + 1); idx++) {
+    for (idx = 0; idx < (sinfo->tx.dcbs + 1); idx++) {
         if (CDMA_CH(sinfo, XGS_DMA_TX_CHAN)) {
             if (sinfo->cmic_type == 'x') {
                 dcb_mem[2] |= 1 << 24 | 1 << 16;
             } else {
                 dcb_mem[1] |= 1 << 24 | 1 << 16;
             }
-            if (idx == MAX_TX_DCBS) {
+            if (idx == sinfo->tx.dcbs) {
                 if (sinfo->cmic_type == 'x') {
                     dcb_mem[0] = sinfo->tx.desc[0].dcb_dma;
                     dcb_mem[1] = DMA_TO_BUS_HI(sinfo->tx.desc[0].dcb_dma >> 32);
@@ -1811,7 +1941,7 @@ bkn_init_dcbs(bkn_switch_info_t *sinfo)
         dcb_dma += dcb_size;
     }
     sinfo->halt_addr[XGS_DMA_TX_CHAN] = sinfo->tx.desc[0].dcb_dma;
-    sinfo->tx.free = MAX_TX_DCBS;
+    sinfo->tx.free = sinfo->tx.dcbs;
     sinfo->tx.cur = 0;
     sinfo->tx.dirty = 0;
 
@@ -1819,14 +1949,14 @@ bkn_init_dcbs(bkn_switch_info_t *sinfo)
                 (uint32_t)sinfo->tx.desc[0].dcb_dma));
 
     for (chan = 0; chan < sinfo->rx_chans; chan++) {
-        for (idx = 0; idx < (MAX_RX_DCBS + 1); idx++) {
+        for (idx = 0; idx < (sinfo->rx[chan].dcbs + 1); idx++) {
             if (CDMA_CH(sinfo, XGS_DMA_RX_CHAN + chan)) {
                 if (sinfo->cmic_type == 'x') {
                     dcb_mem[2] |= 1 << 24 | 1 << 16;
                 } else {
                     dcb_mem[1] |= 1 << 24 | 1 << 16;
                 }
-                if (idx == MAX_RX_DCBS) {
+                if (idx == sinfo->rx[chan].dcbs) {
                     if (sinfo->cmic_type == 'x') {
                         dcb_mem[0] = sinfo->rx[chan].desc[0].dcb_dma;
                         dcb_mem[1] = DMA_TO_BUS_HI(sinfo->rx[chan].desc[0].dcb_dma >> 32);
@@ -1843,7 +1973,7 @@ bkn_init_dcbs(bkn_switch_info_t *sinfo)
             dcb_mem += sinfo->dcb_wsize;
             dcb_dma += dcb_size;
         }
-        sinfo->halt_addr[XGS_DMA_RX_CHAN + chan] = sinfo->rx[chan].desc[MAX_RX_DCBS].dcb_dma;
+        sinfo->halt_addr[XGS_DMA_RX_CHAN + chan] = sinfo->rx[chan].desc[sinfo->rx[chan].dcbs].dcb_dma;
         sinfo->rx[chan].free = 0;
         sinfo->rx[chan].cur = 0;
         sinfo->rx[chan].dirty = 0;
@@ -1853,9 +1983,44 @@ bkn_init_dcbs(bkn_switch_info_t *sinfo)
     }
 }
 
+#if BKN_DEBUG_DUMP
+/*
+ * Enable the dump static key if any of the dump debug levels are set.
+ * Must be called whenever the debug level changes.
+ */
+static void
+bkn_dump_key_update(void)
+{
+    BKN_DUMP_KEY_SET((debug & (DBG_LVL_DUMP_RX | DBG_LVL_DUMP_TX)) != 0);
+}
+
+/*
+ * Returns non-zero if the current descriptor should be dumped
+ * according to the 1-in-N sampling rate.
+ */
+static inline int
+bkn_dump_sample(int *cnt, int sample)
+{
+    if (sample <= 1) {
+        return 1;
+    }
+    if (++(*cnt) < sample) {
+        return 0;
+    }
+    *cnt = 0;
+    return 1;
+}
+
+/* Prefix index is omitted if negative */
 static void
-bkn_dump_dcb(char *prefix, uint32_t *dcb, int wsize, int txrx)
+_bkn_dump_dcb(char *prefix, int idx, uint32_t *dcb, int wsize, int txrx)
 {
+    char str[32];
+
+    if (idx >= 0) {
+        snprintf(str, sizeof(str), "%s (%d)", prefix, idx);
+        prefix = str;
+    }
     if (XGS_DMA_TX_CHAN == txrx) {
         if (wsize > 4) {
             DBG_DCB_TX(("%s: 0x%08x 0x%08x 0x%08x 0x%08x 0x%08x 0x%08x ... 0x%08x\n",
@@ -1878,7 +2043,7 @@ bkn_dump_dcb(char *prefix, uint32_t *dcb, int wsize, int txrx)
 }
 
 static void
-bkn_dump_pkt(uint8_t *data, int size, int txrx)
+_bkn_dump_pkt(uint8_t *data, int size, int txrx)
 {
     int idx;
     char str[128];
@@ -1907,6 +2072,12 @@ bkn_dump_pkt(uint8_t *data, int size, int txrx)
         gprintk(str);
     }
 }
+#else
+#define bkn_dump_key_update()
+#define bkn_dump_sample(_cnt, _sample) 0
+#define _bkn_dump_dcb(_p, _i, _d, _w, _t)
+#define _bkn_dump_pkt(_d, _s, _t)
+#endif /* BKN_DEBUG_DUMP */
 
 static bkn_switch_info_t *
 bkn_sinfo_from_unit(int unit)
@@ -2099,12 +2270,12 @@ bkn_rx_refill(bkn_switch_info_t *sinfo, int chan)
     }
 
     if (!CDMA_CH(sinfo, XGS_DMA_RX_CHAN + chan) &&
-        sinfo->rx[chan].tokens < MAX_RX_DCBS) {
+        sinfo->rx[chan].tokens < sinfo->rx[chan].dcbs) {
         /* Pause DMA for now */
         return;
     }
 
-    while (sinfo->rx[chan].free < MAX_RX_DCBS) {
+    while (sinfo->rx[chan].free < sinfo->rx[chan].dcbs) {
         desc = &sinfo->rx[chan].desc[sinfo->rx[chan].cur];
         if (desc->skb == NULL) {
             skb = dev_alloc_skb(rx_buffer_size + encap_size);
@@ -2152,8 +2323,8 @@ bkn_rx_refill(bkn_switch_info_t *sinfo, int chan)
                 dcb[1] |= 1 << 24 | 1 << 16;
             }
         } else {
-            prev = PREV_IDX(sinfo->rx[chan].cur, MAX_RX_DCBS);
-            if (prev < (MAX_RX_DCBS - 1)) {
+            prev = PREV_IDX(sinfo->rx[chan].cur, sinfo->rx[chan].dcbs);
+            if (prev < (sinfo->rx[chan].dcbs - 1)) {
                 if (sinfo->cmic_type == 'x') {
                     sinfo->rx[chan].desc[prev].dcb_mem[2] |= 1 << 16;
                 } else {
@@ -2169,12 +2340,12 @@ bkn_rx_refill(bkn_switch_info_t *sinfo, int chan)
         }
 
         if (CDMA_CH(sinfo, XGS_DMA_RX_CHAN + chan) &&
-            sinfo->rx[chan].tokens > MAX_RX_DCBS) {
+            sinfo->rx[chan].tokens > sinfo->rx[chan].dcbs) {
             /* DMA run to the new halt location */
             bkn_cdma_goto(sinfo, XGS_DMA_RX_CHAN + chan, desc->dcb_dma);
         }
 
-        if (++sinfo->rx[chan].cur >= MAX_RX_DCBS) {
+        if (++sinfo->rx[chan].cur >= sinfo->rx[chan].dcbs) {
             sinfo->rx[chan].cur = 0;
         }
         sinfo->rx[chan].free++;
@@ -2195,7 +2366,7 @@ bkn_rx_restart(bkn_switch_info_t *sinfo, int chan)
         return 0;
     }
 
-    if (sinfo->rx[chan].free < MAX_RX_DCBS) {
+    if (sinfo->rx[chan].free < sinfo->rx[chan].dcbs) {
         return 1;
     }
 
@@ -2222,7 +2393,7 @@ bkn_tx_dma_start(bkn_switch_info_t *sinfo)
     bkn_desc_info_t *desc;
 
     desc = &sinfo->tx.desc[sinfo->tx.cur];
-    if (sinfo->tx.free == MAX_TX_DCBS) {
+    if (sinfo->tx.free == sinfo->tx.dcbs) {
         if (!sinfo->tx.api_active) {
             DBG_DCB_TX(("Start Tx DMA, DCB @ 0x%08x (%d).\n",
                         (uint32_t)desc->dcb_dma, sinfo->tx.cur));
@@ -2367,11 +2538,12 @@ bkn_match_rx_pkt(bkn_switch_info_t *sinfo, uint8_t *pkt, int pktlen,
         if (match) {
             if (kf->dest_type == KCOM_DEST_T_CB) {
                 /* Check for custom filters */
-                if (knet_filter_cb != NULL && cbf != NULL) {
+                if (bkn_hook_filter_cnt && cbf != NULL) {
                     memset(cbf, 0, sizeof(*cbf));
                     memcpy(&cbf->kf, kf, sizeof(cbf->kf));
-                    if (knet_filter_cb(pkt, pktlen, sinfo->dev_no,
-                                       meta, chan, &cbf->kf)) {
+                    cbf->sample_rate = filter->sample_rate;
+                    if (bkn_hook_filter(pkt, pktlen, sinfo->dev_no,
+                                        meta, chan, &cbf->kf)) {
                         filter->hits++;
                         return cbf;
                     }
@@ -2388,6 +2560,72 @@ bkn_match_rx_pkt(bkn_switch_info_t *sinfo, uint8_t *pkt, int pktlen,
     return NULL;
 }
 
+/*
+ * Returns non-zero with a probability of 1/rate.
+ * Uses a per-CPU xorshift generator, so the caller must not be
+ * preemptible (driver lock held).
+ */
+static inline int
+bkn_sample_hit(int rate)
+{
+    u32 *seed, x;
+
+    if (rate <= 1) {
+        return 1;
+    }
+    seed = this_cpu_ptr(&bkn_sample_seed);
+    x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return (x % rate) == 0;
+}
+
+/*
+ * Copy packet header and DCB meta data into the sampling ring of the
+ * current CPU. Only this CPU writes to its ring, so no lock is needed.
+ */
+static void
+bkn_sample_pkt(bkn_switch_info_t *sinfo, int chan, bkn_filter_t *filter,
+               uint8_t *pkt, int pktlen, uint32_t *meta)
+{
+    knet_sample_ring_t *ring;
+    knet_sample_t *rec;
+    int meta_len;
+    int hdr_len;
+
+    if (bkn_sample_mem == NULL) {
+        return;
+    }
+    ring = (knet_sample_ring_t *)((uint8_t *)bkn_sample_mem +
+                                  smp_processor_id() * KNET_SAMPLE_RING_BYTES);
+    rec = &ring->rec[ring->head % KNET_SAMPLE_RING_RECS];
+
+    hdr_len = pktlen < KNET_SAMPLE_HDR_BYTES ? pktlen : KNET_SAMPLE_HDR_BYTES;
+    if (sinfo->cmic_type == 'x') {
+        meta_len = sinfo->pkt_hdr_size / sizeof(uint32_t);
+    } else {
+        meta_len = sinfo->dcb_wsize;
+    }
+    if (meta_len > KNET_SAMPLE_META_WORDS) {
+        meta_len = KNET_SAMPLE_META_WORDS;
+    }
+
+    rec->pkt_len = pktlen;
+    rec->dev_no = sinfo->dev_no;
+    rec->chan = chan;
+    rec->filter_id = filter->kf.id;
+    rec->hdr_len = hdr_len;
+    rec->meta_len = meta_len;
+    memcpy(rec->meta, meta, meta_len * sizeof(uint32_t));
+    memcpy(rec->hdr, pkt, hdr_len);
+
+    /* Make record visible before updating head */
+    smp_wmb();
+    ring->head++;
+}
+
 static bkn_priv_t *
 bkn_netif_lookup(bkn_switch_info_t *sinfo, int id)
 {
@@ -2480,6 +2718,79 @@ bkn_eth_type_update(struct sk_buff *skb, int ethertype)
 #endif
 }
 
+/*
+ * Set the SKB flow hash from the IP 5-tuple.
+ *
+ * All packets from an Rx DMA channel are processed on the same CPU,
+ * so this hash is what allows the network stack (RPS/RFS as configured
+ * through /sys/class/net/<dev>/queues/rx-0/rps_cpus) to spread the
+ * protocol processing across CPUs without dissecting every packet
+ * again. Called after eth_type_trans, i.e. skb->data points to the
+ * first byte after the Ethernet header.
+ */
+static u32 bkn_flow_hash_seed;
+
+static void
+bkn_rx_flow_hash(struct sk_buff *skb)
+{
+    uint8_t *pkt = skb->data;
+    int len = skb->len;
+    uint16_t proto = ntohs(skb->protocol);
+    uint32_t saddr, daddr, ports = 0;
+    int l4 = 0;
+    int ip_proto, hlen;
+
+    /* Skip one VLAN tag if still in packet */
+    if ((proto == ETH_P_8021Q || proto == ETH_P_8021AD) && len >= 4) {
+        proto = (pkt[2] << 8) | pkt[3];
+        pkt += 4;
+        len -= 4;
+    }
+
+    if (proto == ETH_P_IP && len >= sizeof(struct iphdr)) {
+        struct iphdr *iph = (struct iphdr *)pkt;
+        hlen = iph->ihl * 4;
+        if (hlen < sizeof(struct iphdr) || len < hlen) {
+            return;
+        }
+        saddr = iph->saddr;
+        daddr = iph->daddr;
+        ip_proto = iph->protocol;
+        /* Only first fragment carries the L4 header */
+        if (iph->frag_off & htons(IP_MF | IP_OFFSET)) {
+            ip_proto = 0;
+        }
+    } else if (proto == ETH_P_IPV6 && len >= sizeof(struct ipv6hdr)) {
+        struct ipv6hdr *ip6h = (struct ipv6hdr *)pkt;
+        hlen = sizeof(struct ipv6hdr);
+        saddr = ip6h->saddr.s6_addr32[0] ^ ip6h->saddr.s6_addr32[1] ^
+                ip6h->saddr.s6_addr32[2] ^ ip6h->saddr.s6_addr32[3];
+        daddr = ip6h->daddr.s6_addr32[0] ^ ip6h->daddr.s6_addr32[1] ^
+                ip6h->daddr.s6_addr32[2] ^ ip6h->daddr.s6_addr32[3];
+        /* Extension headers are not parsed */
+        ip_proto = ip6h->nexthdr;
+    } else {
+        return;
+    }
+
+    switch (ip_proto) {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_SCTP:
+        if (len >= hlen + 4) {
+            memcpy(&ports, &pkt[hlen], sizeof(ports));
+            l4 = 1;
+        }
+        break;
+    default:
+        break;
+    }
+
+    bkn_skb_set_hash(skb,
+                     jhash_3words(saddr, daddr, ports ^ ip_proto,
+                                  bkn_flow_hash_seed), l4);
+}
+
 #define BKN_DNX_BIT(x) (1<<(x))
 #define BKN_DNX_RBIT(x) (~(1<<(x)))
 #ifdef __LITTLE_ENDIAN
@@ -2804,6 +3115,267 @@ bkn_dnx_packet_header_parse(bkn_switch_info_t *sinfo, uint8 *buff, uint32_t buff
     return 0;
 }
 
+static inline int
+bkn_hook_netif_enabled(knet_hook_t *hook, int netif_id)
+{
+    if ((hook->flags & KNET_HOOK_F_NETIF_SELECT) == 0) {
+        return 1;
+    }
+    if (netif_id < 0 || netif_id >= KCOM_NETIF_MAX) {
+        return 0;
+    }
+    return (hook->netif_map[netif_id / 32] & (1U << (netif_id % 32))) != 0;
+}
+
+/*
+ * Pass SKB through all Rx call-backs enabled for this netif.
+ * Returns NULL if the SKB was consumed by a call-back.
+ */
+static struct sk_buff *
+bkn_hook_rx(struct sk_buff *skb, int dev_no, int netif_id, void *meta)
+{
+    knet_hook_t *hook;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(hook, &bkn_hook_list, list) {
+        knet_skb_cb_f rx_cb = hook->rx_cb;
+        if (rx_cb == NULL || !bkn_hook_netif_enabled(hook, netif_id)) {
+            continue;
+        }
+        skb = rx_cb(skb, dev_no, meta);
+        if (skb == NULL) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return skb;
+}
+
+static struct sk_buff *
+bkn_hook_tx(struct sk_buff *skb, int dev_no, int netif_id, void *meta)
+{
+    knet_hook_t *hook;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(hook, &bkn_hook_list, list) {
+        knet_skb_cb_f tx_cb = hook->tx_cb;
+        if (tx_cb == NULL || !bkn_hook_netif_enabled(hook, netif_id)) {
+            continue;
+        }
+        skb = tx_cb(skb, dev_no, meta);
+        if (skb == NULL) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return skb;
+}
+
+/*
+ * Returns non-zero if any of the filter call-backs accepts the packet.
+ */
+static int
+bkn_hook_filter(uint8_t *pkt, int size, int dev_no, void *meta,
+                int chan, kcom_filter_t *kf)
+{
+    knet_hook_t *hook;
+    int match = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(hook, &bkn_hook_list, list) {
+        knet_filter_cb_f filter_cb = hook->filter_cb;
+        if (filter_cb == NULL) {
+            continue;
+        }
+        if (filter_cb(pkt, size, dev_no, meta, chan, kf)) {
+            match = 1;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return match;
+}
+
+/*
+ * Pass the DCB type of a device being initialized to all hardware
+ * init call-backs. Called with the driver lock held before packet DMA
+ * is started. The hook lock serializes this with bkn_hook_register,
+ * so a new hook sees each device exactly once it is known.
+ */
+static void
+bkn_hook_hw_init(bkn_switch_info_t *sinfo)
+{
+    knet_hook_t *hook;
+    unsigned long flags;
+
+    spin_lock_irqsave(&bkn_hook_lock, flags);
+    list_for_each_entry(hook, &bkn_hook_list, list) {
+        if (hook->hw_init_cb) {
+            hook->hw_init_cb(sinfo->dev_no, sinfo->dcb_type);
+        }
+    }
+    spin_unlock_irqrestore(&bkn_hook_lock, flags);
+}
+
+#ifdef BKN_SELFTEST_SUPPORT
+/*
+ * Interrupt Latency Self-Test
+ *
+ * Measures the Rx path of one device in NAPI mode: bkn_isr schedules
+ * the NAPI poll, bkn_poll runs the Rx DMA and the packets are passed
+ * to the network stack. The time from the entry of bkn_isr to the
+ * poll and to the first packet delivered by that poll is recorded.
+ * On hosts without a switch device a simulated device of the kernel
+ * BDE provides both interrupts and packets: sim_poll_usecs sets the
+ * interrupt rate and sim_rx_gen the packets generated per interrupt.
+ *
+ * The state is only updated with the driver lock of the device under
+ * test held. See /proc/bcm/knet/selftest.
+ */
+static struct {
+    int unit;                   /* Device under test, -1 if stopped */
+    u64 isr_entry;              /* Entry time of current interrupt */
+    u64 pending;                /* Time of unhandled interrupt, 0 if none */
+    int polled;                 /* Poll for pending interrupt has started */
+    unsigned long interrupts;   /* Interrupts which scheduled a poll */
+    unsigned long delivered;    /* Polls which delivered packets */
+    unsigned long empty;        /* Polls which delivered no packets */
+    klat_hist_t poll;           /* Interrupt to NAPI poll */
+    klat_hist_t deliver;        /* Interrupt to first packet delivered */
+} bkn_selftest = { -1 };
+
+#define BKN_SELFTEST_ON(_s)     (bkn_selftest.unit == (_s)->dev_no)
+
+static inline void
+bkn_selftest_sched(bkn_switch_info_t *sinfo)
+{
+    if (BKN_SELFTEST_ON(sinfo) && bkn_selftest.isr_entry) {
+        bkn_selftest.pending = bkn_selftest.isr_entry;
+        bkn_selftest.isr_entry = 0;
+        bkn_selftest.polled = 0;
+        bkn_selftest.interrupts++;
+    }
+}
+
+static inline void
+bkn_selftest_poll(bkn_switch_info_t *sinfo)
+{
+    if (BKN_SELFTEST_ON(sinfo) && bkn_selftest.pending &&
+        !bkn_selftest.polled) {
+        klat_record(&bkn_selftest.poll,
+                    ktime_to_ns(ktime_get()) - bkn_selftest.pending);
+        bkn_selftest.polled = 1;
+    }
+}
+
+static inline void
+bkn_selftest_deliver(bkn_switch_info_t *sinfo)
+{
+    if (BKN_SELFTEST_ON(sinfo) && bkn_selftest.pending &&
+        bkn_selftest.polled) {
+        klat_record(&bkn_selftest.deliver,
+                    ktime_to_ns(ktime_get()) - bkn_selftest.pending);
+        bkn_selftest.pending = 0;
+        bkn_selftest.delivered++;
+    }
+}
+
+static inline void
+bkn_selftest_poll_done(bkn_switch_info_t *sinfo)
+{
+    if (BKN_SELFTEST_ON(sinfo) && bkn_selftest.pending &&
+        bkn_selftest.polled) {
+        bkn_selftest.pending = 0;
+        bkn_selftest.empty++;
+    }
+}
+#endif /* BKN_SELFTEST_SUPPORT */
+
+/*
+ * Pass queued SKBs through the Rx batch call-backs and then on to
+ * the network stack. Assumes that driver lock is held.
+ */
+static void
+bkn_rx_batch_flush(bkn_switch_info_t *sinfo, int chan)
+{
+    struct sk_buff **skbs = sinfo->rx[chan].batch;
+    int cnt = sinfo->rx[chan].batch_cnt;
+    knet_hook_t *hook;
+    int consumed = 0;
+    int idx;
+
+    if (cnt == 0) {
+        return;
+    }
+    sinfo->rx[chan].batch_cnt = 0;
+
+    /* Unlock while calling up network stack */
+    spin_unlock(&sinfo->lock);
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(hook, &bkn_hook_list, list) {
+        knet_skb_batch_cb_f rx_batch_cb = hook->rx_batch_cb;
+        if (rx_batch_cb != NULL) {
+            rx_batch_cb(skbs, cnt, sinfo->dev_no);
+        }
+    }
+    rcu_read_unlock();
+
+    for (idx = 0; idx < cnt; idx++) {
+        if (skbs[idx] == NULL) {
+            /* Consumed by call-back */
+            consumed++;
+            continue;
+        }
+        if (use_napi) {
+            netif_receive_skb(skbs[idx]);
+        } else {
+            netif_rx(skbs[idx]);
+        }
+        skbs[idx] = NULL;
+    }
+
+    spin_lock(&sinfo->lock);
+
+    sinfo->rx[chan].pkts_d_callback += consumed;
+#ifdef BKN_SELFTEST_SUPPORT
+    if (consumed < cnt) {
+        bkn_selftest_deliver(sinfo);
+    }
+#endif
+}
+
+/*
+ * Pass SKB to the network stack, or queue it for the Rx batch
+ * call-backs if any are registered. Assumes that driver lock is held.
+ */
+static void
+bkn_rx_deliver(bkn_switch_info_t *sinfo, int chan, struct sk_buff *skb)
+{
+    if (bkn_hook_batch_cnt) {
+        sinfo->rx[chan].batch[sinfo->rx[chan].batch_cnt++] = skb;
+        if (sinfo->rx[chan].batch_cnt >= MAX_RX_BATCH) {
+            bkn_rx_batch_flush(sinfo, chan);
+        }
+        return;
+    }
+
+    /* Unlock while calling up network stack */
+    spin_unlock(&sinfo->lock);
+    if (use_napi) {
+        netif_receive_skb(skb);
+    } else {
+        netif_rx(skb);
+    }
+    spin_lock(&sinfo->lock);
+#ifdef BKN_SELFTEST_SUPPORT
+    bkn_selftest_deliver(sinfo);
+#endif
+}
+
 static int
 bkn_do_api_rx(bkn_switch_info_t *sinfo, int chan, int budget)
 {
@@ -2931,6 +3503,15 @@ bkn_do_api_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                 filter = NULL;
             }
         }
+        if (filter && filter->sample_rate &&
+            bkn_sample_hit(filter->sample_rate)) {
+            if (device_is_dune(sinfo)) {
+                bkn_sample_pkt(sinfo, chan, filter, pkt, pktlen, dcb);
+            } else {
+                bkn_sample_pkt(sinfo, chan, filter, pkt + sinfo->pkt_hdr_size,
+                               pktlen - sinfo->pkt_hdr_size, meta);
+            }
+        }
         drop_api = 1;
         if (filter) {
             DBG_FLTR(("Match filter ID %d\n", filter->kf.id));
@@ -3008,11 +3589,12 @@ bkn_do_api_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                     priv->stats.rx_bytes += skb->len;
 
                     /* Optional SKB updates */
-                    if (knet_rx_cb != NULL) {
+                    if (bkn_hook_rx_cnt) {
                         KNET_SKB_CB(skb)->netif_user_data = priv->cb_user_data;
                         KNET_SKB_CB(skb)->filter_user_data = filter->kf.cb_user_data;
                         KNET_SKB_CB(skb)->dcb_type = sinfo->dcb_type & 0xFFFF;
-                        skb = knet_rx_cb(skb, sinfo->dev_no, meta);
+                        KNET_SKB_CB(skb)->netif_flags = priv->flags & 0xFFFF;
+                        skb = bkn_hook_rx(skb, sinfo->dev_no, priv->id, meta);
                         if (skb == NULL) {
                             /* Consumed by call-back */
                             sinfo->rx[chan].pkts_d_callback++;
@@ -3032,14 +3614,7 @@ bkn_do_api_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                     }
                     DBG_DUNE(("skb protocol 0x%04x\n",skb->protocol));
 
-                    /* Unlock while calling up network stack */
-                    spin_unlock(&sinfo->lock);
-                    if (use_napi) {
-                        netif_receive_skb(skb);
-                    } else {
-                        netif_rx(skb);
-                    }
-                    spin_lock(&sinfo->lock);
+                    bkn_rx_deliver(sinfo, chan, skb);
 
                     if (filter->kf.mirror_type == KCOM_DEST_T_API ||
                         dbg_pkt_enable) {
@@ -3090,6 +3665,7 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
     int pktlen;
     int idx;
     int dcbs_done = 0;
+    int dump;
     bkn_dnx_packet_info packet_info = {0};
 
     if (!sinfo->rx[chan].running) {
@@ -3098,14 +3674,20 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
     }
 
     while (dcbs_done < budget) {
-        char str[32];
-        sprintf(str, "Rx DCB (%d)", sinfo->rx[chan].dirty);
         desc = &sinfo->rx[chan].desc[sinfo->rx[chan].dirty];
         dcb = desc->dcb_mem;
-        bkn_dump_dcb(str, dcb, sinfo->dcb_wsize, XGS_DMA_RX_CHAN);
         if ((dcb[sinfo->dcb_wsize-1] & (1 << 31)) == 0) {
             break;
         }
+        dump = 0;
+        if (BKN_DUMP_ENABLED() && (debug & DBG_LVL_DUMP_RX)) {
+            dump = bkn_dump_sample(&sinfo->rx[chan].dump_cnt,
+                                   sinfo->rx[chan].dump_sample);
+        }
+        if (dump) {
+            bkn_dump_dcb("Rx DCB", sinfo->rx[chan].dirty,
+                         dcb, sinfo->dcb_wsize, XGS_DMA_RX_CHAN);
+        }
         if ((sinfo->cmic_type == 'x' && (dcb[2] & (1 << 16)) == 0) ||
             (sinfo->cmic_type != 'x' && (dcb[1] & (1 << 16)) == 0)) {
             sinfo->rx[chan].chain_complete = 1;
@@ -3131,7 +3713,9 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                          desc->skb_dma, desc->dma_size,
                          DMA_FROMDEV);
         desc->skb_dma = 0;
-        bkn_dump_pkt(skb->data, pktlen, XGS_DMA_RX_CHAN);
+        if (dump) {
+            bkn_dump_pkt(skb->data, pktlen, XGS_DMA_RX_CHAN);
+        }
 
         if (device_is_dune(sinfo)) {
             uint16_t tpid = 0;
@@ -3189,6 +3773,18 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                 filter = NULL;
             }
         }
+        if (filter && filter->sample_rate &&
+            bkn_sample_hit(filter->sample_rate)) {
+            if (device_is_dune(sinfo)) {
+                bkn_sample_pkt(sinfo, chan, filter,
+                               skb->data + packet_info.ntwrk_header_ptr,
+                               pktlen, dcb);
+            } else {
+                bkn_sample_pkt(sinfo, chan, filter,
+                               skb->data + sinfo->pkt_hdr_size,
+                               pktlen - sinfo->pkt_hdr_size, meta);
+            }
+        }
         DBG_PKT(("Rx packet (%d bytes).\n", pktlen));
         if (filter) {
             DBG_FLTR(("Match filter ID %d\n", filter->kf.id));
@@ -3277,11 +3873,12 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                     skb->dev = priv->dev;
 
                     /* Optional SKB updates */
-                    if (knet_rx_cb != NULL) {
+                    if (bkn_hook_rx_cnt) {
                         KNET_SKB_CB(skb)->netif_user_data = priv->cb_user_data;
                         KNET_SKB_CB(skb)->filter_user_data = filter->kf.cb_user_data;
                         KNET_SKB_CB(skb)->dcb_type = sinfo->dcb_type & 0xFFFF;
-                        skb = knet_rx_cb(skb, sinfo->dev_no, meta);
+                        KNET_SKB_CB(skb)->netif_flags = priv->flags & 0xFFFF;
+                        skb = bkn_hook_rx(skb, sinfo->dev_no, priv->id, meta);
                         if (skb == NULL) {
                             /* Consumed by call-back */
                             sinfo->rx[chan].pkts_d_callback++;
@@ -3300,6 +3897,8 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                     }
                     if (priv->flags & KCOM_NETIF_F_RCPU_ENCAP) {
                         bkn_eth_type_update(skb, ethertype);
+                    } else if (rx_flow_hash) {
+                        bkn_rx_flow_hash(skb);
                     }
                     DBG_DUNE(("skb protocol 0x%04x\n",skb->protocol));
 
@@ -3331,14 +3930,7 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
                         }
                     }
 
-                    /* Unlock while calling up network stack */
-                    spin_unlock(&sinfo->lock);
-                    if (use_napi) {
-                        netif_receive_skb(skb);
-                    } else {
-                        netif_rx(skb);
-                    }
-                    spin_lock(&sinfo->lock);
+                    bkn_rx_deliver(sinfo, chan, skb);
 
                     /* Ensure that we reallocate SKB for this DCB */
                     desc->skb = NULL;
@@ -3361,7 +3953,7 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
             priv->stats.rx_dropped++;
         }
         dcb[sinfo->dcb_wsize-1] &= ~(1 << 31);
-        if (++sinfo->rx[chan].dirty >= MAX_RX_DCBS) {
+        if (++sinfo->rx[chan].dirty >= sinfo->rx[chan].dcbs) {
             sinfo->rx[chan].dirty = 0;
         }
         sinfo->rx[chan].free--;
@@ -3378,13 +3970,20 @@ bkn_do_skb_rx(bkn_switch_info_t *sinfo, int chan, int budget)
 static int
 bkn_do_rx(bkn_switch_info_t *sinfo, int chan, int budget)
 {
+    int dcbs_done;
+
     if (sinfo->rx[chan].use_rx_skb == 0) {
         /* Rx buffers are provided by BCM Rx API */
-        return bkn_do_api_rx(sinfo, chan, budget);
+        dcbs_done = bkn_do_api_rx(sinfo, chan, budget);
     } else {
         /* Rx buffers are provided by Linux kernel */
-        return bkn_do_skb_rx(sinfo, chan, budget);
+        dcbs_done = bkn_do_skb_rx(sinfo, chan, budget);
     }
+
+    /* Pass batched packets to call-backs and network stack */
+    bkn_rx_batch_flush(sinfo, chan);
+
+    return dcbs_done;
 }
 
 static void
@@ -3426,7 +4025,7 @@ bkn_rx_chain_done(bkn_switch_info_t *sinfo, int chan)
             if (maxloop > sinfo->rx[chan].sync_maxloop) {
                 sinfo->rx[chan].sync_maxloop = maxloop;
             }
-            if (bkn_do_rx(sinfo, chan, MAX_RX_DCBS) > 0) {
+            if (bkn_do_rx(sinfo, chan, sinfo->rx[chan].dcbs) > 0) {
                 bkn_rx_desc_done(sinfo, chan);
             }
             if (++maxloop > rx_sync_retry) {
@@ -3500,17 +4099,19 @@ bkn_do_tx(bkn_switch_info_t *sinfo)
         return dcbs_done;
     }
 
-    while (dcbs_done < MAX_TX_DCBS) {
-        char str[32];
-        if (sinfo->tx.free == MAX_TX_DCBS) {
+    while (dcbs_done < sinfo->tx.dcbs) {
+        if (sinfo->tx.free == sinfo->tx.dcbs) {
             break;
         }
-        sprintf(str, "Tx DCB (%d)", sinfo->tx.dirty);
         desc = &sinfo->tx.desc[sinfo->tx.dirty];
-        bkn_dump_dcb(str, desc->dcb_mem, sinfo->dcb_wsize, XGS_DMA_TX_CHAN);
         if ((desc->dcb_mem[sinfo->dcb_wsize-1] & (1 << 31)) == 0) {
             break;
         }
+        if (BKN_DUMP_ENABLED() && (debug & DBG_LVL_DUMP_TX) &&
+            bkn_dump_sample(&sinfo->tx.dump_cnt, sinfo->tx.dump_sample)) {
+            bkn_dump_dcb("Tx DCB", sinfo->tx.dirty,
+                         desc->dcb_mem, sinfo->dcb_wsize, XGS_DMA_TX_CHAN);
+        }
         if (desc->skb) {
             DBG_DCB_TX(("Tx SKB DMA done (%d).\n", sinfo->tx.dirty));
             DMA_UNMAP_SINGLE(sinfo->dma_dev,
@@ -3521,10 +4122,10 @@ bkn_do_tx(bkn_switch_info_t *sinfo)
             desc->skb_dma = 0;
         }
         desc->dcb_mem[sinfo->dcb_wsize-1] &= ~(1 << 31);
-        if (++sinfo->tx.dirty >= MAX_TX_DCBS) {
+        if (++sinfo->tx.dirty >= sinfo->tx.dcbs) {
             sinfo->tx.dirty = 0;
         }
-        if (++sinfo->tx.free > MAX_TX_DCBS) {
+        if (++sinfo->tx.free > sinfo->tx.dcbs) {
             gprintk("Too many free Tx DCBs(%d).\n", sinfo->tx.free);
         }
         dcbs_done++;
@@ -3557,7 +4158,7 @@ bkn_tx_cdma_chain_switch(bkn_switch_info_t *sinfo)
         } else {
             dcb_mem[1] |= 1 << 24 | 1 << 18 | 1 << 16;
         }
-        if (++sinfo->tx.cur >= MAX_TX_DCBS) {
+        if (++sinfo->tx.cur >= sinfo->tx.dcbs) {
             sinfo->tx.cur = 0;
         }
         sinfo->tx.free--;
@@ -3607,7 +4208,8 @@ bkn_api_tx(bkn_switch_info_t *sinfo)
                                bkn_dcb_chain_t, list);
         DBG_DCB_TX(("Start API Tx DMA, first DCB @ 0x%08x (%d DCBs).\n",
                     (uint32_t)dcb_chain->dcb_dma, dcb_chain->dcb_cnt));
-        for (i = 0; i < dcb_chain->dcb_cnt && debug & DBG_LVL_PDMP; i++) {
+        for (i = 0; BKN_DUMP_ENABLED() && debug & DBG_LVL_PDMP &&
+                    i < dcb_chain->dcb_cnt; i++) {
             if (CDMA_CH(sinfo, XGS_DMA_TX_CHAN) && i == dcb_chain->dcb_cnt - 1) {
                 break;
             }
@@ -3669,7 +4271,7 @@ bkn_tx_cdma_chain_done(bkn_switch_info_t *sinfo, int done)
             kfree(sinfo->tx.api_dcb_chain);
             sinfo->tx.api_dcb_chain = NULL;
             bkn_api_tx(sinfo);
-            if ((++dcbs_done + done) >= MAX_TX_DCBS) {
+            if ((++dcbs_done + done) >= sinfo->tx.dcbs) {
                 if (sinfo->napi_poll_mode) {
                     /* Request one extra poll to reschedule Tx */
                     sinfo->napi_poll_again = 1;
@@ -3698,7 +4300,7 @@ bkn_tx_cdma_chain_done(bkn_switch_info_t *sinfo, int done)
             sinfo->tx_yield = 0;
         }
     } else {
-        if (sinfo->tx.free == MAX_TX_DCBS) {
+        if (sinfo->tx.free == sinfo->tx.dcbs) {
             /* Try API Tx if SKB Tx done */
             bkn_api_tx(sinfo);
             if (sinfo->tx.api_active) {
@@ -3739,7 +4341,7 @@ bkn_tx_chain_done(bkn_switch_info_t *sinfo, int done)
         }
     }
 
-    if (sinfo->tx.free == MAX_TX_DCBS) {
+    if (sinfo->tx.free == sinfo->tx.dcbs) {
         /* If netif Tx is idle then allow BCM API to send */
         bkn_api_tx(sinfo);
         if (sinfo->tx.api_active) {
@@ -3747,9 +4349,9 @@ bkn_tx_chain_done(bkn_switch_info_t *sinfo, int done)
         }
     } else {
         /* If two or more DCBs are pending, chain them */
-        pending = MAX_TX_DCBS - sinfo->tx.free;
+        pending = sinfo->tx.dcbs - sinfo->tx.free;
         idx = sinfo->tx.dirty;
-        while (--pending && idx < (MAX_TX_DCBS - 1)) {
+        while (--pending && idx < (sinfo->tx.dcbs - 1)) {
             if (sinfo->cmic_type == 'x') {
                 sinfo->tx.desc[idx++].dcb_mem[2] |= 1 << 16;
             } else {
@@ -3777,6 +4379,9 @@ bkn_schedule_napi_poll(bkn_switch_info_t *sinfo)
     DBG_NAPI(("Schedule NAPI poll on %s.\n", sinfo->dev->name));
     /* Disable interrupts until poll job is complete */
     sinfo->napi_poll_mode = 1;
+#ifdef BKN_SELFTEST_SUPPORT
+    bkn_selftest_sched(sinfo);
+#endif
     /* Unlock while calling up network stack */
     spin_unlock(&sinfo->lock);
     if (bkn_napi_schedule_prep(sinfo->dev, &sinfo->napi)) {
@@ -3951,7 +4556,7 @@ xgs_isr(bkn_switch_info_t *sinfo)
     } else {
         xgs_irq_mask_set(sinfo, 0);
         do {
-            rx_dcbs_done = xgs_do_dma(sinfo, MAX_RX_DCBS);
+            rx_dcbs_done = xgs_do_dma(sinfo, RX_BUDGET);
         } while (rx_dcbs_done);
     }
 
@@ -3979,9 +4584,9 @@ xgsm_isr(bkn_switch_info_t *sinfo)
     } else {
         xgsm_irq_mask_set(sinfo, 0);
         do {
-            rx_dcbs_done = xgsm_do_dma(sinfo, MAX_RX_DCBS);
+            rx_dcbs_done = xgsm_do_dma(sinfo, RX_BUDGET);
             if (sinfo->cdma_channels) {
-                if (rx_dcbs_done >= MAX_RX_DCBS || sinfo->tx_yield) {
+                if (rx_dcbs_done >= RX_BUDGET || sinfo->tx_yield) {
                     /* Continuous DMA mode requires to yield timely */
                     break;
                 }
@@ -4013,9 +4618,9 @@ xgsx_isr(bkn_switch_info_t *sinfo)
     } else {
         xgsx_irq_mask_set(sinfo, 0);
         do {
-            rx_dcbs_done = xgsx_do_dma(sinfo, MAX_RX_DCBS);
+            rx_dcbs_done = xgsx_do_dma(sinfo, RX_BUDGET);
             if (sinfo->cdma_channels) {
-                if (rx_dcbs_done >= MAX_RX_DCBS || sinfo->tx_yield) {
+                if (rx_dcbs_done >= RX_BUDGET || sinfo->tx_yield) {
                     /* Continuous DMA mode requires to yield timely */
                     break;
                 }
@@ -4030,6 +4635,9 @@ static void
 bkn_isr(void *isr_data)
 {
     bkn_switch_info_t *sinfo = isr_data;
+#ifdef BKN_SELFTEST_SUPPORT
+    u64 entry = BKN_SELFTEST_ON(sinfo) ? ktime_to_ns(ktime_get()) : 0;
+#endif
 
     /* Safe exit on SMP systems */
     if (!module_initialized) {
@@ -4050,6 +4658,12 @@ bkn_isr(void *isr_data)
         return;
     }
 
+#ifdef BKN_SELFTEST_SUPPORT
+    if (entry && BKN_SELFTEST_ON(sinfo)) {
+        bkn_selftest.isr_entry = entry;
+    }
+#endif
+
     if (DEV_IS_CMICX(sinfo)) {
         xgsx_isr(sinfo);
     } else if (DEV_IS_CMICM(sinfo)) {
@@ -4088,7 +4702,7 @@ bkn_resume_rx(bkn_switch_info_t *sinfo)
             bkn_api_rx_restart(sinfo, chan);
             if (CDMA_CH(sinfo, XGS_DMA_RX_CHAN + chan)) {
                 cur_halt = sinfo->halt_addr[XGS_DMA_RX_CHAN + chan];
-                last_dcb = sinfo->rx[chan].desc[MAX_RX_DCBS].dcb_dma;
+                last_dcb = sinfo->rx[chan].desc[sinfo->rx[chan].dcbs].dcb_dma;
                 if (cur_halt != last_dcb) {
                     desc = &sinfo->rx[chan].desc[sinfo->rx[chan].dirty + 1];
                     bkn_cdma_goto(sinfo, XGS_DMA_RX_CHAN + chan, desc->dcb_dma);
@@ -4133,7 +4747,7 @@ bkn_open(struct net_device *dev)
         /* Start DMA when base device is started */
         if (sinfo->basedev_suspended) {
             spin_lock_irqsave(&sinfo->lock, flags);
-            dev_do_dma(sinfo, MAX_RX_DCBS);
+            dev_do_dma(sinfo, RX_BUDGET);
             sinfo->basedev_suspended = 0;
             bkn_api_tx(sinfo);
             if (!sinfo->tx.api_active) {
@@ -4225,10 +4839,18 @@ bkn_poll(struct napi_struct *napi, int budget)
 
     DBG_NAPI(("NAPI poll on %s.\n", sinfo->dev->name));
 
+#ifdef BKN_SELFTEST_SUPPORT
+    bkn_selftest_poll(sinfo);
+#endif
+
     sinfo->napi_poll_again = 0;
 
     rx_dcbs_done = dev_do_dma(sinfo, budget);
 
+#ifdef BKN_SELFTEST_SUPPORT
+    bkn_selftest_poll_done(sinfo);
+#endif
+
     if (sinfo->napi_poll_again || rx_dcbs_done >= budget) {
         /* Force poll again */
         rx_dcbs_done = budget;
@@ -4666,8 +5288,8 @@ bkn_tx(struct sk_buff *skb, struct net_device *dev)
         }
 
         /* Optional SKB updates */
-        if (knet_tx_cb != NULL) {
-            skb = knet_tx_cb(skb, sinfo->dev_no, meta);
+        if (bkn_hook_tx_cnt) {
+            skb = bkn_hook_tx(skb, sinfo->dev_no, priv->id, meta);
             if (skb == NULL) {
                 /* Consumed by call-back */
                 DBG_WARN(("Tx drop: Consumed by call-back\n"));
@@ -4730,7 +5352,7 @@ bkn_tx(struct sk_buff *skb, struct net_device *dev)
             dcb[1] |= pktlen;
         }
 
-        bkn_dump_dcb("Tx RCPU", dcb, sinfo->dcb_wsize, XGS_DMA_TX_CHAN);
+        bkn_dump_dcb("Tx RCPU", -1, dcb, sinfo->dcb_wsize, XGS_DMA_TX_CHAN);
         DBG_DCB_TX(("Add Tx DCB @ 0x%08x (%d) [%d free] (%d bytes).\n",
                     (uint32_t)desc->dcb_dma, sinfo->tx.cur,
                     sinfo->tx.free, pktlen));
@@ -4745,7 +5367,7 @@ bkn_tx(struct sk_buff *skb, struct net_device *dev)
         } else {
             bkn_tx_dma_start(sinfo);
         }
-        if (++sinfo->tx.cur >= MAX_TX_DCBS) {
+        if (++sinfo->tx.cur >= sinfo->tx.dcbs) {
             sinfo->tx.cur = 0;
         }
         sinfo->tx.free--;
@@ -4832,7 +5454,7 @@ bkn_rx_add_tokens(bkn_switch_info_t *sinfo, int chan)
         bkn_rx_refill(sinfo, chan);
         desc = &sinfo->rx[chan].desc[sinfo->rx[chan].dirty];
         if (desc->dcb_dma == sinfo->halt_addr[XGS_DMA_RX_CHAN + chan]) {
-            desc = &sinfo->rx[chan].desc[MAX_RX_DCBS];
+            desc = &sinfo->rx[chan].desc[sinfo->rx[chan].dcbs];
             bkn_cdma_goto(sinfo, XGS_DMA_RX_CHAN + chan, desc->dcb_dma);
         }
     } else {
@@ -4881,6 +5503,26 @@ bkn_rxtick(unsigned long context)
     add_timer(&sinfo->rxtick);
 }
 
+/*
+ * A stopped (non-CDMA) Rx ring is restarted only once there are tokens
+ * for the whole ring, so the burst size must cover the ring depth.
+ * Continuous DMA rings are refilled one DCB at a time and keep the
+ * configured burst size. Channel types are known after hw_init.
+ */
+static void
+bkn_rx_burst_floor(bkn_switch_info_t *sinfo, int chan)
+{
+    if (chan >= sinfo->rx_chans || CDMA_CH(sinfo, XGS_DMA_RX_CHAN + chan)) {
+        return;
+    }
+    if (sinfo->rx[chan].rate_max != 0 &&
+        sinfo->rx[chan].burst_max < sinfo->rx[chan].dcbs) {
+        gprintk("Rx channel %d burst raised from %u to ring depth %d\n",
+                chan, sinfo->rx[chan].burst_max, sinfo->rx[chan].dcbs);
+        sinfo->rx[chan].burst_max = sinfo->rx[chan].dcbs;
+    }
+}
+
 static void
 bkn_rx_rate_config(bkn_switch_info_t *sinfo)
 {
@@ -4917,6 +5559,7 @@ bkn_rx_rate_config(bkn_switch_info_t *sinfo)
         if (sinfo->rx[chan].burst_max < tokens_per_rxtick) {
             sinfo->rx[chan].burst_max = tokens_per_rxtick;
         }
+        bkn_rx_burst_floor(sinfo, chan);
         /* Ensure that rate has a sane value */
         if (sinfo->rx[chan].rate_max != 0) {
             if (sinfo->rx[chan].rate_max < rxticks_per_sec) {
@@ -4933,11 +5576,67 @@ bkn_rx_rate_config(bkn_switch_info_t *sinfo)
     spin_unlock_irqrestore(&sinfo->lock, flags);
 }
 
-static void
+static int
+bkn_ring_depth(int dcbs)
+{
+    if (dcbs < MIN_DCBS) {
+        return MIN_DCBS;
+    }
+    if (dcbs > MAX_DCBS) {
+        return MAX_DCBS;
+    }
+    return dcbs;
+}
+
+static void
+bkn_free_desc(bkn_switch_info_t *sinfo)
+{
+    int chan;
+
+    kfree(sinfo->tx.desc);
+    sinfo->tx.desc = NULL;
+    for (chan = 0; chan < NUM_RX_CHAN; chan++) {
+        kfree(sinfo->rx[chan].desc);
+        sinfo->rx[chan].desc = NULL;
+    }
+}
+
+/*
+ * Allocate the descriptor info of all rings. The ring depth is taken
+ * from the tx_dcbs and rx_dcbs module parameters and stays fixed for
+ * the lifetime of the device, while the DCB memory itself is
+ * allocated when the BCM API initializes the DMA.
+ */
+static int
+bkn_alloc_desc(bkn_switch_info_t *sinfo)
+{
+    size_t size;
+    int chan;
+
+    sinfo->tx.dcbs = bkn_ring_depth(tx_dcbs);
+    size = (sinfo->tx.dcbs + 1) * sizeof(bkn_desc_info_t);
+    if ((sinfo->tx.desc = kmalloc(size, GFP_KERNEL)) == NULL) {
+        return -ENOMEM;
+    }
+    memset(sinfo->tx.desc, 0, size);
+    for (chan = 0; chan < NUM_RX_CHAN; chan++) {
+        sinfo->rx[chan].dcbs = bkn_ring_depth(rx_dcbs[chan]);
+        size = (sinfo->rx[chan].dcbs + 1) * sizeof(bkn_desc_info_t);
+        if ((sinfo->rx[chan].desc = kmalloc(size, GFP_KERNEL)) == NULL) {
+            bkn_free_desc(sinfo);
+            return -ENOMEM;
+        }
+        memset(sinfo->rx[chan].desc, 0, size);
+    }
+    return 0;
+}
+
+static void
 bkn_destroy_sinfo(bkn_switch_info_t *sinfo)
 {
     list_del(&sinfo->list);
     bkn_free_dcbs(sinfo);
+    bkn_free_desc(sinfo);
     kfree(sinfo);
 }
 
@@ -4951,6 +5650,10 @@ bkn_create_sinfo(int dev_no)
         return NULL;
     }
     memset(sinfo, 0, sizeof(*sinfo));
+    if (bkn_alloc_desc(sinfo) < 0) {
+        kfree(sinfo);
+        return NULL;
+    }
     INIT_LIST_HEAD(&sinfo->ndev_list);
     INIT_LIST_HEAD(&sinfo->rxpf_list);
     sinfo->base_addr = lkbde_get_dev_virt(dev_no);
@@ -4990,8 +5693,10 @@ bkn_create_sinfo(int dev_no)
     for (chan = 0; chan < NUM_RX_CHAN; chan++) {
         sinfo->rx[chan].rate_max = rx_rate[chan];
         sinfo->rx[chan].burst_max = rx_burst[chan];
+        sinfo->rx[chan].dump_sample = rx_dump_sample[chan];
     }
     bkn_rx_rate_config(sinfo);
+    sinfo->tx.dump_sample = tx_dump_sample;
 
     add_timer(&sinfo->rxtick);
 
@@ -5328,7 +6033,7 @@ bkn_seq_dma_next_pos(bkn_seq_dma_iter_t *iter, loff_t pos)
     sinfo = bkn_sinfo_from_unit(iter->dev_no);
     while (pos) {
         if (iter->rx_dma) {
-            if (++iter->idx >= MAX_RX_DCBS + 1) {
+            if (++iter->idx >= sinfo->rx[iter->ch_no].dcbs + 1) {
                 iter->idx = -1;
                 if (++iter->ch_no >= sinfo->rx_chans) {
                     iter->rx_dma = 0;
@@ -5340,7 +6045,7 @@ bkn_seq_dma_next_pos(bkn_seq_dma_iter_t *iter, loff_t pos)
                 }
             }
         } else {
-            if (++iter->idx >= MAX_TX_DCBS + 1) {
+            if (++iter->idx >= sinfo->tx.dcbs + 1) {
                 iter->idx = -1;
                 iter->rx_dma = 1;
             }
@@ -5441,12 +6146,14 @@ bkn_seq_dma_show(struct seq_file *s, void *v)
             spin_unlock_irqrestore(&sinfo->lock, flags);
             seq_printf(s,
                        "Tx DCB info (unit %d):\n"
+                       "  dcbs:  %d\n"
                        "  api:   %d\n"
                        "  dirty: %d\n"
                        "  cur:   %d\n"
                        "  free:  %d\n"
                        "  pause: %s\n",
                        iter->dev_no,
+                       sinfo->tx.dcbs,
                        sinfo->tx.api_active,
                        sinfo->tx.dirty,
                        sinfo->tx.cur,
@@ -5470,6 +6177,7 @@ bkn_seq_dma_show(struct seq_file *s, void *v)
             chan = iter->ch_no;
             seq_printf(s,
                        "Rx%d DCB info (unit %d):\n"
+                       "  dcbs:  %d\n"
                        "  api:   %d\n"
                        "  wait:  %d\n"
                        "  dirty: %d\n"
@@ -5477,6 +6185,7 @@ bkn_seq_dma_show(struct seq_file *s, void *v)
                        "  free:  %d\n"
                        "  run:   %d\n",
                        chan, iter->dev_no,
+                       sinfo->rx[chan].dcbs,
                        sinfo->rx[chan].api_active,
                        sinfo->rx[chan].api_wait,
                        sinfo->rx[chan].dirty,
@@ -5564,9 +6273,17 @@ static struct file_operations bkn_seq_dma_file_ops = {
  *
  *   Where <mask> corresponds to the debug module parameter.
  *
+ *   [<unit>:]rx_dump_sample=<n0>[,<n1>[,<n2]]
+ *   [<unit>:]tx_dump_sample=<n>
+ *
+ *   Where <n> means that only one of every <n> descriptors is
+ *   dumped (per Rx DMA channel for rx_dump_sample) when DCB or
+ *   packet dumps are enabled through the debug mask.
+ *
  *   Examples:
  *   debug=0xffff
  *   0:debug-0x2000
+ *   0:rx_dump_sample=100,1000
  */
 static ssize_t
 bkn_proc_debug_write(struct file *file, const char *buf,
@@ -5575,7 +6292,7 @@ bkn_proc_debug_write(struct file *file, const char *buf,
     bkn_switch_info_t *sinfo;
     char debug_str[40];
     char *ptr;
-    int unit;
+    int unit, chan;
 
     if (count >= sizeof(debug_str)) {
         count = sizeof(debug_str) - 1;
@@ -5594,6 +6311,19 @@ bkn_proc_debug_write(struct file *file, const char *buf,
     if ((ptr = strstr(debug_str, "debug=")) != NULL) {
         ptr += 6;
         debug = simple_strtol(ptr, NULL, 0);
+        bkn_dump_key_update();
+    } else if ((ptr = strstr(debug_str, "rx_dump_sample=")) != NULL) {
+        ptr += 14;
+        chan = 0;
+        do {
+            ptr++;
+            sinfo->rx[chan].dump_sample = simple_strtol(ptr, NULL, 10);
+            sinfo->rx[chan].dump_cnt = 0;
+        } while ((ptr = strchr(ptr, ',')) != NULL && ++chan < sinfo->rx_chans);
+    } else if ((ptr = strstr(debug_str, "tx_dump_sample=")) != NULL) {
+        ptr += 15;
+        sinfo->tx.dump_sample = simple_strtol(ptr, NULL, 10);
+        sinfo->tx.dump_cnt = 0;
     } else {
         gprintk("Warning: unknown configuration setting\n");
     }
@@ -5608,11 +6338,14 @@ static int
 bkn_proc_debug_show(struct seq_file *m, void *v)
 {
     int unit = 0;
+    int chan;
     struct list_head *list;
     bkn_switch_info_t *sinfo;
 
     seq_printf(m, "Configuration:\n");
     seq_printf(m, "  debug:          0x%x\n", debug);
+    seq_printf(m, "  debug_dump:     %s\n",
+               BKN_DEBUG_DUMP ? (BKN_DUMP_ENABLED() ? "on" : "off") : "n/a");
     seq_printf(m, "  mac_addr:       %02x:%02x:%02x:%02x:%02x:%02x\n",
                     bkn_dev_mac[0], bkn_dev_mac[1], bkn_dev_mac[2],
                     bkn_dev_mac[3], bkn_dev_mac[4], bkn_dev_mac[5]);
@@ -5636,9 +6369,15 @@ bkn_proc_debug_show(struct seq_file *m, void *v)
     seq_printf(m, "  use_napi:       %d\n", use_napi);
     seq_printf(m, "  napi_weight:    %d\n", napi_weight);
     seq_printf(m, "  basedev_susp:   %d\n", basedev_suspend);
+    seq_printf(m, "  rx_flow_hash:   %d\n", rx_flow_hash);
     seq_printf(m, "Thread states:\n");
     seq_printf(m, "  Command thread: %d\n", bkn_cmd_ctrl.state);
     seq_printf(m, "  Event thread:   %d\n", bkn_evt_ctrl.state);
+    seq_printf(m, "Call-back hooks:\n");
+    seq_printf(m, "  Rx:             %d\n", bkn_hook_rx_cnt);
+    seq_printf(m, "  Rx batch:       %d\n", bkn_hook_batch_cnt);
+    seq_printf(m, "  Tx:             %d\n", bkn_hook_tx_cnt);
+    seq_printf(m, "  Filter:         %d\n", bkn_hook_filter_cnt);
     seq_printf(m, "Active IOCTLs:\n");
     seq_printf(m, "  Command:        %d\n", ioctl_cmd);
     seq_printf(m, "  Event:          %d\n", ioctl_evt);
@@ -5662,6 +6401,11 @@ bkn_proc_debug_show(struct seq_file *m, void *v)
         seq_printf(m, "  napi_poll_mode: %d\n", sinfo->napi_poll_mode);
         seq_printf(m, "  inst_id:        0x%x\n", sinfo->inst_id);
         seq_printf(m, "  evt_queue:      %d\n", sinfo->evt_idx);
+        seq_printf(m, "  tx_dump_sample: %d\n", sinfo->tx.dump_sample);
+        for (chan = 0; chan < sinfo->rx_chans; chan++) {
+            seq_printf(m, "  rx%d_dump_smpl:  %d\n",
+                       chan, sinfo->rx[chan].dump_sample);
+        }
 
         unit++;
     }
@@ -5986,6 +6730,342 @@ struct file_operations bkn_proc_dstats_file_ops = {
     release:    single_release,
 };
 
+/*
+ * Packet Sampling Proc Entry
+ */
+static int
+bkn_proc_sample_show(struct seq_file *m, void *v)
+{
+    int unit = 0;
+    int cpu;
+    struct list_head *list, *flist;
+    bkn_switch_info_t *sinfo;
+    bkn_filter_t *filter;
+    knet_sample_ring_t *ring;
+
+    seq_printf(m, "Sample rings: %s\n", bkn_sample_mem ? "active" : "inactive");
+    if (bkn_sample_mem) {
+        seq_printf(m, "  Ring size:      %d records (%d bytes)\n",
+                   KNET_SAMPLE_RING_RECS, (int)KNET_SAMPLE_RING_BYTES);
+        for_each_possible_cpu(cpu) {
+            ring = (knet_sample_ring_t *)((uint8_t *)bkn_sample_mem +
+                                          cpu * KNET_SAMPLE_RING_BYTES);
+            if (ring->head) {
+                seq_printf(m, "  CPU%-3d samples  %10u\n", cpu, ring->head);
+            }
+        }
+    }
+
+    list_for_each(list, &_sinfo_list) {
+        sinfo = (bkn_switch_info_t *)list;
+
+        seq_printf(m, "Device %d:\n", unit);
+        list_for_each(flist, &sinfo->rxpf_list) {
+            filter = (bkn_filter_t *)flist;
+            if (filter->sample_rate) {
+                seq_printf(m, "  Filter %d sample rate 1/%d\n",
+                           filter->kf.id, filter->sample_rate);
+            }
+        }
+        unit++;
+    }
+    return 0;
+}
+
+static int
+bkn_proc_sample_open(struct inode * inode, struct file * file)
+{
+    return single_open(file, bkn_proc_sample_show, NULL);
+}
+
+/*
+ * Allocate sampling rings for all possible CPUs.
+ *
+ * Proc writes may race here, so the rings are set up privately and
+ * published with cmpxchg. A writer that loses the race frees its copy.
+ */
+static int
+bkn_sample_mem_alloc(void)
+{
+    unsigned long size;
+    knet_sample_ring_t *ring;
+    void *mem;
+    int cpu;
+
+    if (bkn_sample_mem) {
+        return 0;
+    }
+    size = PAGE_ALIGN(nr_cpu_ids * KNET_SAMPLE_RING_BYTES);
+    mem = vmalloc_user(size);
+    if (mem == NULL) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        ring = (knet_sample_ring_t *)((uint8_t *)mem +
+                                      cpu * KNET_SAMPLE_RING_BYTES);
+        ring->recs = KNET_SAMPLE_RING_RECS;
+    }
+    /* Size is the same for every caller, so it may be set before publish */
+    bkn_sample_mem_size = size;
+    if (cmpxchg(&bkn_sample_mem, NULL, mem) != NULL) {
+        vfree(mem);
+    }
+    return 0;
+}
+
+/*
+ * Packet Sampling Proc Write Entry
+ *
+ *   Syntax:
+ *   [<unit>:]sample=<filter_id>,<rate>
+ *
+ *   Where <rate> is N for sampling 1-in-N of the packets matching
+ *   filter <filter_id>. A rate of 0 disables sampling.
+ *
+ *   Examples:
+ *   sample=2,1000
+ *   1:sample=5,0
+ */
+static ssize_t
+bkn_proc_sample_write(struct file *file, const char *buf,
+                      size_t count, loff_t *loff)
+{
+    bkn_switch_info_t *sinfo;
+    struct list_head *flist;
+    bkn_filter_t *filter;
+    char sample_str[40];
+    char *ptr;
+    unsigned long flags;
+    int unit, id, rate;
+
+    if (count >= sizeof(sample_str)) {
+        count = sizeof(sample_str) - 1;
+    }
+    if (copy_from_user(sample_str, buf, count)) {
+        return -EFAULT;
+    }
+    sample_str[count] = 0;
+
+    unit = simple_strtol(sample_str, NULL, 10);
+    sinfo = bkn_sinfo_from_unit(unit);
+    if (sinfo == NULL) {
+        gprintk("Warning: unknown unit\n");
+        return count;
+    }
+
+    if ((ptr = strstr(sample_str, "sample=")) == NULL) {
+        gprintk("Warning: unknown configuration setting\n");
+        return count;
+    }
+    ptr += 7;
+    id = simple_strtol(ptr, NULL, 10);
+    if ((ptr = strchr(ptr, ',')) == NULL) {
+        gprintk("Warning: missing sample rate\n");
+        return count;
+    }
+    rate = simple_strtol(ptr + 1, NULL, 10);
+    if (rate < 0) {
+        rate = 0;
+    }
+
+    if (rate && bkn_sample_mem_alloc() < 0) {
+        gprintk("Warning: unable to allocate sample rings\n");
+        return count;
+    }
+
+    spin_lock_irqsave(&sinfo->lock, flags);
+    list_for_each(flist, &sinfo->rxpf_list) {
+        filter = (bkn_filter_t *)flist;
+        if (filter->kf.id == id) {
+            filter->sample_rate = rate;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&sinfo->lock, flags);
+
+    return count;
+}
+
+static int
+bkn_proc_sample_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if (bkn_sample_mem == NULL) {
+        return -ENODEV;
+    }
+    if ((vma->vm_pgoff << PAGE_SHIFT) + size > bkn_sample_mem_size) {
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, bkn_sample_mem, vma->vm_pgoff);
+}
+
+struct file_operations bkn_proc_sample_file_ops = {
+    owner:      THIS_MODULE,
+    open:       bkn_proc_sample_open,
+    read:       seq_read,
+    llseek:     seq_lseek,
+    write:      bkn_proc_sample_write,
+    mmap:       bkn_proc_sample_mmap,
+    release:    single_release,
+};
+
+#ifdef BKN_SELFTEST_SUPPORT
+static void
+bkn_selftest_stop(void)
+{
+    bkn_switch_info_t *sinfo;
+    unsigned long flags;
+
+    if (bkn_selftest.unit < 0) {
+        return;
+    }
+    sinfo = bkn_sinfo_from_unit(bkn_selftest.unit);
+    if (sinfo == NULL) {
+        /* Device is gone */
+        bkn_selftest.unit = -1;
+        return;
+    }
+    spin_lock_irqsave(&sinfo->lock, flags);
+    bkn_selftest.unit = -1;
+    spin_unlock_irqrestore(&sinfo->lock, flags);
+}
+
+/*
+ * Start self-test on a device, a unit of -1 stops it. Resets the
+ * statistics.
+ */
+static int
+bkn_selftest_start(int unit)
+{
+    bkn_switch_info_t *sinfo;
+    unsigned long flags;
+
+    bkn_selftest_stop();
+    if (unit < 0) {
+        return 0;
+    }
+    if (!use_napi) {
+        return -EINVAL;
+    }
+    sinfo = bkn_sinfo_from_unit(unit);
+    if (sinfo == NULL) {
+        return -ENODEV;
+    }
+
+    spin_lock_irqsave(&sinfo->lock, flags);
+    bkn_selftest.isr_entry = 0;
+    bkn_selftest.pending = 0;
+    bkn_selftest.polled = 0;
+    bkn_selftest.interrupts = 0;
+    bkn_selftest.delivered = 0;
+    bkn_selftest.empty = 0;
+    klat_init(&bkn_selftest.poll);
+    klat_init(&bkn_selftest.deliver);
+    bkn_selftest.unit = unit;
+    spin_unlock_irqrestore(&sinfo->lock, flags);
+    return 0;
+}
+
+static void
+bkn_selftest_init(void)
+{
+    klat_init(&bkn_selftest.poll);
+    klat_init(&bkn_selftest.deliver);
+}
+
+static void
+bkn_selftest_lat_show(struct seq_file *m, const char *name, klat_hist_t *hist)
+{
+    klat_summary_t sum;
+
+    klat_summary(hist, &sum);
+    seq_printf(m, "  %-8s count %lu min %llu avg %llu p50 %llu p90 %llu "
+               "p99 %llu p99.9 %llu max %llu\n", name,
+               sum.count, sum.min, sum.avg, sum.p50, sum.p90, sum.p99,
+               sum.p999, sum.max);
+}
+
+/*
+ * Self-Test Proc Read Entry
+ */
+static int
+bkn_proc_selftest_show(struct seq_file *m, void *v)
+{
+    if (bkn_selftest.unit < 0) {
+        seq_printf(m, "Self-test: stopped\n");
+    } else {
+        seq_printf(m, "Self-test: running on unit %d\n", bkn_selftest.unit);
+    }
+    seq_printf(m, "  interrupts %lu delivered %lu empty %lu\n",
+               bkn_selftest.interrupts, bkn_selftest.delivered,
+               bkn_selftest.empty);
+    seq_printf(m, "Latency (ns):\n");
+    bkn_selftest_lat_show(m, "poll", &bkn_selftest.poll);
+    bkn_selftest_lat_show(m, "deliver", &bkn_selftest.deliver);
+    return 0;
+}
+
+static int
+bkn_proc_selftest_open(struct inode * inode, struct file * file)
+{
+    return single_open(file, bkn_proc_selftest_show, NULL);
+}
+
+/*
+ * Self-Test Proc Write Entry
+ *
+ *   Syntax:
+ *   unit=<unit>
+ *
+ *   Where <unit> is the device to measure. A unit of -1 stops the
+ *   test. Requires use_napi=1.
+ *
+ *   Examples:
+ *   unit=0
+ *   unit=-1
+ */
+static ssize_t
+bkn_proc_selftest_write(struct file *file, const char *buf,
+                        size_t count, loff_t *loff)
+{
+    char selftest_str[40];
+    char *ptr;
+    int unit, rv;
+
+    if (count >= sizeof(selftest_str)) {
+        count = sizeof(selftest_str) - 1;
+    }
+    if (copy_from_user(selftest_str, buf, count)) {
+        return -EFAULT;
+    }
+    selftest_str[count] = 0;
+
+    if ((ptr = strstr(selftest_str, "unit=")) == NULL) {
+        gprintk("Warning: unknown configuration setting\n");
+        return count;
+    }
+    unit = simple_strtol(ptr + 5, NULL, 10);
+    rv = bkn_selftest_start(unit);
+    if (rv == -EINVAL) {
+        gprintk("Warning: self-test requires use_napi=1\n");
+    } else if (rv < 0) {
+        gprintk("Warning: unknown unit\n");
+    }
+
+    return count;
+}
+
+struct file_operations bkn_proc_selftest_file_ops = {
+    owner:      THIS_MODULE,
+    open:       bkn_proc_selftest_open,
+    read:       seq_read,
+    llseek:     seq_lseek,
+    write:      bkn_proc_selftest_write,
+    release:    single_release,
+};
+#endif /* BKN_SELFTEST_SUPPORT */
+
 static int
 bkn_proc_init(void)
 {
@@ -6015,6 +7095,16 @@ bkn_proc_init(void)
     if (entry == NULL) {
         return -1;
     }
+    PROC_CREATE(entry, "sample", 0600, bkn_proc_root, &bkn_proc_sample_file_ops);
+    if (entry == NULL) {
+        return -1;
+    }
+#ifdef BKN_SELFTEST_SUPPORT
+    PROC_CREATE(entry, "selftest", 0600, bkn_proc_root, &bkn_proc_selftest_file_ops);
+    if (entry == NULL) {
+        return -1;
+    }
+#endif
 
     return 0;
 }
@@ -6028,6 +7118,10 @@ bkn_proc_cleanup(void)
     remove_proc_entry("debug", bkn_proc_root);
     remove_proc_entry("stats", bkn_proc_root);
     remove_proc_entry("dstats", bkn_proc_root);
+    remove_proc_entry("sample", bkn_proc_root);
+#ifdef BKN_SELFTEST_SUPPORT
+    remove_proc_entry("selftest", bkn_proc_root);
+#endif
     return 0;
 }
 
@@ -6114,7 +7208,7 @@ bkn_knet_dma_info(kcom_msg_dma_info_t *kmsg, int len)
             }
         }
 
-        if (sinfo->tx.free == MAX_TX_DCBS &&
+        if (sinfo->tx.free == sinfo->tx.dcbs &&
             !sinfo->tx.api_active &&
             !sinfo->basedev_suspended) {
             bkn_api_tx(sinfo);
@@ -6169,7 +7263,7 @@ bkn_knet_dma_info(kcom_msg_dma_info_t *kmsg, int len)
                 if (CDMA_CH(sinfo, XGS_DMA_RX_CHAN + chan)) {
                     bkn_do_skb_rx(sinfo, chan, 1);
                 } else {
-                    bkn_do_skb_rx(sinfo, chan, MAX_RX_DCBS);
+                    bkn_do_skb_rx(sinfo, chan, sinfo->rx[chan].dcbs);
                     if (sinfo->rx[chan].chain_complete) {
                         bkn_rx_chain_done(sinfo, chan);
                     }
@@ -6362,6 +7456,7 @@ bkn_knet_hw_init(kcom_msg_hw_init_t *kmsg, int len)
     bkn_switch_info_t *sinfo;
     uint32_t dev_type;
     unsigned long flags;
+    int chan;
 
     kmsg->hdr.type = KCOM_MSG_TYPE_RSP;
 
@@ -6387,6 +7482,13 @@ bkn_knet_hw_init(kcom_msg_hw_init_t *kmsg, int len)
 
     /* Config Continuous DMA mode */
     sinfo->cdma_channels = kmsg->cdma_channels & ~(~0 << (sinfo->rx_chans + 1));
+    for (chan = 0; chan < sinfo->rx_chans; chan++) {
+        bkn_rx_burst_floor(sinfo, chan);
+        sinfo->rx[chan].tokens = sinfo->rx[chan].burst_max;
+    }
+
+    /* Let call-back modules set up for the DCB type */
+    bkn_hook_hw_init(sinfo);
 
     /* Ensure 32-bit PCI DMA is mapped properly on 64-bit platforms */
     dev_type = kernel_bde->get_dev_type(sinfo->dev_no);
@@ -6425,6 +7527,12 @@ bkn_knet_hw_init(kcom_msg_hw_init_t *kmsg, int len)
     kernel_bde->interrupt_connect(sinfo->dev_no | LKBDE_ISR2_DEV,
                                   bkn_isr, sinfo);
 
+    /* Take packet DMA interrupts on an MSI-X vector of their own if any */
+    if (lkbde_irq_source_connect(sinfo->dev_no, LKBDE_INTR_SRC_PKT_DMA,
+                                 bkn_isr, sinfo) == 0) {
+        DBG_IRQ(("Packet DMA ISR on dedicated MSI-X vector.\n"));
+    }
+
     /* Init DCBs */
     bkn_init_dcbs(sinfo);
 
@@ -6943,6 +8051,14 @@ bkn_knet_dbg_pkt_get(kcom_msg_dbg_pkt_get_t *kmsg, int len)
     return sizeof(kcom_msg_dbg_pkt_get_t);
 }
 
+/*
+ * Release the packet DMA API state of a unit before warm boot.
+ *
+ * Network interfaces, filters and the DCB rings are kept, so traffic
+ * to existing interfaces resumes as soon as the restarted application
+ * calls KCOM_M_HW_INIT, and the application does not need to recreate
+ * them. The DCB rings are reused by KCOM_M_HW_INIT.
+ */
 static int
 bkn_knet_wb_cleanup(kcom_msg_wb_cleanup_t *kmsg, int len)
 {
@@ -6961,6 +8077,21 @@ bkn_knet_wb_cleanup(kcom_msg_wb_cleanup_t *kmsg, int len)
 
     spin_lock_irqsave(&sinfo->lock, flags);
 
+    if (sinfo->tx.api_dcb_chain) {
+        DBG_DCB_TX(("Freeing active Tx DCB chain.\n"));
+        kfree(sinfo->tx.api_dcb_chain);
+        sinfo->tx.api_dcb_chain = NULL;
+    }
+    while (!list_empty(&sinfo->tx.api_dcb_list)) {
+        dcb_chain = list_entry(sinfo->tx.api_dcb_list.next,
+                               bkn_dcb_chain_t, list);
+        list_del(&dcb_chain->list);
+        DBG_DCB_TX(("Freeing Tx DCB chain.\n"));
+        kfree(dcb_chain);
+    }
+    sinfo->tx.api_dcb_chain_end = NULL;
+    sinfo->tx.api_active = 0;
+
     for (chan = 0; chan < sinfo->rx_chans; chan++) {
         if (sinfo->rx[chan].api_dcb_chain) {
             DBG_DCB_RX(("Freeing active Rx%d DCB chain.\n", chan));
@@ -7259,6 +8390,7 @@ _cleanup(void)
         spin_unlock_irqrestore(&sinfo->lock, flags);
 
         DBG_IRQ(("Unregister ISR.\n"));
+        lkbde_irq_source_disconnect(sinfo->dev_no, LKBDE_INTR_SRC_PKT_DMA);
         kernel_bde->interrupt_disconnect(sinfo->dev_no | LKBDE_ISR2_DEV);
 
         if (use_napi) {
@@ -7308,6 +8440,11 @@ _cleanup(void)
         bkn_destroy_sinfo(sinfo);
     }
 
+    if (bkn_sample_mem) {
+        vfree(bkn_sample_mem);
+        bkn_sample_mem = NULL;
+    }
+
     return 0;
 }
 
@@ -7427,6 +8564,15 @@ _init(void)
         return -ENODEV;
     }
 
+    /* Seed for Rx flow hash */
+    get_random_bytes(&bkn_flow_hash_seed, sizeof(bkn_flow_hash_seed));
+
+    /* Seed for packet sampling (must be non-zero) */
+    for_each_possible_cpu(idx) {
+        get_random_bytes(&per_cpu(bkn_sample_seed, idx), sizeof(u32));
+        per_cpu(bkn_sample_seed, idx) |= 1;
+    }
+
     /* Randomize Lower 3 bytes of the MAC address (TESTING ONLY) */
     get_random_bytes(&bkn_dev_mac[3], 3);
 
@@ -7451,6 +8597,9 @@ _init(void)
         }
     }
 
+    /* Enable DCB/packet dumps if requested at load time */
+    bkn_dump_key_update();
+
     /* NAPI implies that base device must be up before we can pass traffic */
     if (use_napi) {
         basedev_suspend = 1;
@@ -7468,6 +8617,9 @@ _init(void)
     proc_mkdir("bcm", NULL);
     bkn_proc_root = proc_mkdir("bcm/knet", NULL);
 
+#ifdef BKN_SELFTEST_SUPPORT
+    bkn_selftest_init();
+#endif
     bkn_proc_init();
 
     /* Initialize event queue */
@@ -7581,66 +8733,203 @@ gmodule_get(void)
  *
  * The Tx call-back allows an external module to modify SKB contents
  * before it is injected inot the switch.
+ *
+ * Multiple modules can register call-backs through the call-back
+ * chain (bkn_hook_register), see bcm-knet.h for details.
  */
 
-int
-bkn_rx_skb_cb_register(knet_skb_cb_f rx_cb)
+/*
+ * Recalculate number of registered call-backs of each type.
+ * Assumes that hook lock is held.
+ */
+static void
+bkn_hook_count_update(void)
 {
-    if (knet_rx_cb != NULL) {
-        return -1;
+    knet_hook_t *hook;
+    int rx_cnt = 0, tx_cnt = 0, filter_cnt = 0, batch_cnt = 0;
+
+    list_for_each_entry(hook, &bkn_hook_list, list) {
+        if (hook->rx_cb) {
+            rx_cnt++;
+        }
+        if (hook->tx_cb) {
+            tx_cnt++;
+        }
+        if (hook->filter_cb) {
+            filter_cnt++;
+        }
+        if (hook->rx_batch_cb) {
+            batch_cnt++;
+        }
+    }
+    bkn_hook_rx_cnt = rx_cnt;
+    bkn_hook_tx_cnt = tx_cnt;
+    bkn_hook_filter_cnt = filter_cnt;
+    bkn_hook_batch_cnt = batch_cnt;
+}
+
+static int
+bkn_hook_registered(knet_hook_t *hook)
+{
+    knet_hook_t *lhook;
+
+    list_for_each_entry(lhook, &bkn_hook_list, list) {
+        if (lhook == hook) {
+            return 1;
+        }
     }
-    knet_rx_cb = rx_cb;
     return 0;
 }
 
+/*
+ * Insert hook sorted by priority. Assumes that hook lock is held.
+ */
+static void
+bkn_hook_insert(knet_hook_t *hook)
+{
+    knet_hook_t *lhook;
+
+    list_for_each_entry(lhook, &bkn_hook_list, list) {
+        if (hook->priority < lhook->priority) {
+            break;
+        }
+    }
+    list_add_tail_rcu(&hook->list, &lhook->list);
+}
+
 int
-bkn_rx_skb_cb_unregister(knet_skb_cb_f rx_cb)
+bkn_hook_register(knet_hook_t *hook)
 {
-    if (rx_cb != NULL && knet_rx_cb != rx_cb) {
+    struct list_head *list;
+    bkn_switch_info_t *sinfo;
+    unsigned long flags;
+
+    if (hook == NULL) {
+        return -1;
+    }
+
+    spin_lock_irqsave(&bkn_hook_lock, flags);
+    if (bkn_hook_registered(hook)) {
+        spin_unlock_irqrestore(&bkn_hook_lock, flags);
         return -1;
     }
-    knet_rx_cb = NULL;
+    /* Report devices already initialized before packets can arrive */
+    if (hook->hw_init_cb) {
+        list_for_each(list, &_sinfo_list) {
+            sinfo = (bkn_switch_info_t *)list;
+            if (sinfo->dcb_type != 0) {
+                hook->hw_init_cb(sinfo->dev_no, sinfo->dcb_type);
+            }
+        }
+    }
+    bkn_hook_insert(hook);
+    bkn_hook_count_update();
+    spin_unlock_irqrestore(&bkn_hook_lock, flags);
+
     return 0;
 }
 
 int
-bkn_tx_skb_cb_register(knet_skb_cb_f tx_cb)
+bkn_hook_unregister(knet_hook_t *hook)
 {
-    if (knet_tx_cb != NULL) {
+    unsigned long flags;
+
+    if (hook == NULL) {
         return -1;
     }
-    knet_tx_cb = tx_cb;
+
+    spin_lock_irqsave(&bkn_hook_lock, flags);
+    if (!bkn_hook_registered(hook)) {
+        spin_unlock_irqrestore(&bkn_hook_lock, flags);
+        return -1;
+    }
+    list_del_rcu(&hook->list);
+    bkn_hook_count_update();
+    spin_unlock_irqrestore(&bkn_hook_lock, flags);
+
+    /* Wait for Rx/Tx paths to finish using the hook */
+    synchronize_rcu();
+
     return 0;
 }
 
-int
-bkn_tx_skb_cb_unregister(knet_skb_cb_f tx_cb)
+/*
+ * Update one call-back of the legacy hook. The hook is added to the
+ * chain when the first call-back is set and removed again when the
+ * last call-back is cleared.
+ */
+static int
+bkn_legacy_cb_set(void **cb_ptr, void *cb, int reg)
 {
-    if (tx_cb != NULL && knet_tx_cb != tx_cb) {
-        return -1;
+    knet_hook_t *hook = &bkn_legacy_hook;
+    unsigned long flags;
+
+    spin_lock_irqsave(&bkn_hook_lock, flags);
+    if (reg) {
+        if (*cb_ptr != NULL) {
+            spin_unlock_irqrestore(&bkn_hook_lock, flags);
+            return -1;
+        }
+    } else {
+        if (cb != NULL && *cb_ptr != cb) {
+            spin_unlock_irqrestore(&bkn_hook_lock, flags);
+            return -1;
+        }
+        cb = NULL;
+    }
+    *cb_ptr = cb;
+    if (hook->rx_cb || hook->tx_cb || hook->filter_cb) {
+        if (!bkn_hook_registered(hook)) {
+            bkn_hook_insert(hook);
+        }
+    } else if (bkn_hook_registered(hook)) {
+        list_del_rcu(&hook->list);
+    }
+    bkn_hook_count_update();
+    spin_unlock_irqrestore(&bkn_hook_lock, flags);
+
+    if (!reg) {
+        /* Wait for Rx/Tx paths to finish using the call-back */
+        synchronize_rcu();
     }
-    knet_tx_cb = NULL;
+
     return 0;
 }
 
+int
+bkn_rx_skb_cb_register(knet_skb_cb_f rx_cb)
+{
+    return bkn_legacy_cb_set((void **)&bkn_legacy_hook.rx_cb, rx_cb, 1);
+}
+
+int
+bkn_rx_skb_cb_unregister(knet_skb_cb_f rx_cb)
+{
+    return bkn_legacy_cb_set((void **)&bkn_legacy_hook.rx_cb, rx_cb, 0);
+}
+
+int
+bkn_tx_skb_cb_register(knet_skb_cb_f tx_cb)
+{
+    return bkn_legacy_cb_set((void **)&bkn_legacy_hook.tx_cb, tx_cb, 1);
+}
+
+int
+bkn_tx_skb_cb_unregister(knet_skb_cb_f tx_cb)
+{
+    return bkn_legacy_cb_set((void **)&bkn_legacy_hook.tx_cb, tx_cb, 0);
+}
+
 int
 bkn_filter_cb_register(knet_filter_cb_f filter_cb)
 {
-    if (knet_filter_cb != NULL) {
-        return -1;
-    }
-    knet_filter_cb = filter_cb;
-    return 0;
+    return bkn_legacy_cb_set((void **)&bkn_legacy_hook.filter_cb, filter_cb, 1);
 }
 
 int
 bkn_filter_cb_unregister(knet_filter_cb_f filter_cb)
 {
-    if (filter_cb != NULL && knet_filter_cb != filter_cb) {
-        return -1;
-    }
-    knet_filter_cb = NULL;
-    return 0;
+    return bkn_legacy_cb_set((void **)&bkn_legacy_hook.filter_cb, filter_cb, 0);
 }
 
 LKM_EXPORT_SYM(bkn_rx_skb_cb_register);
@@ -7649,3 +8938,5 @@ LKM_EXPORT_SYM(bkn_tx_skb_cb_register);
 LKM_EXPORT_SYM(bkn_tx_skb_cb_unregister);
 LKM_EXPORT_SYM(bkn_filter_cb_register);
 LKM_EXPORT_SYM(bkn_filter_cb_unregister);
+LKM_EXPORT_SYM(bkn_hook_register);
+LKM_EXPORT_SYM(bkn_hook_unregister);
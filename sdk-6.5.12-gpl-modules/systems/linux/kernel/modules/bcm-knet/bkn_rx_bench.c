@@ -0,0 +1,347 @@
+/*
+ * Copyright 2017 Broadcom
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation (the "GPL").
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License version 2 (GPLv2) for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 (GPLv2) along with this source code.
+ */
+/*
+ * $Id: $
+ * $Copyright: (c) 2017 Broadcom Corp.
+ * All Rights Reserved.$
+ *
+ * User mode benchmark of the debug instrumentation in the Rx
+ * descriptor loop of bkn_do_skb_rx.
+ *
+ * Build on the host from this directory:
+ *
+ *    cc -O2 -o bkn_rx_bench bkn_rx_bench.c
+ *
+ * Usage:
+ *
+ *    bkn_rx_bench [-n packets] [-r ring_size] [-l pkt_len]
+ *                 [-d debug] [-S dump_sample]
+ *
+ * A ring of completed CMICx DCBs with packet buffers is processed
+ * repeatedly by three versions of the descriptor loop:
+ *
+ *    legacy    formats the "Rx DCB (%d)" prefix with sprintf for every
+ *              descriptor and calls the dump helpers, which test the
+ *              debug mask themselves
+ *    guarded   tests the dump flag first and only calls the helpers
+ *              for sampled descriptors, as bkn_do_skb_rx does now
+ *    none      no instrumentation at all (BKN_DEBUG_DUMP=0)
+ *
+ * The guarded loop uses a plain flag, like kernels without static
+ * keys, so its cost is an upper bound. Packets are "delivered" by
+ * checksumming the Ethernet header, and the dump helpers format into
+ * a buffer instead of printing, so the results measure the CPU work
+ * only. With -d the dump debug levels are enabled and one of every
+ * -S descriptors is dumped.
+ *
+ * The time per packet of each loop is reported, along with the
+ * saving of the guarded loop over the legacy one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define BENCH_PACKETS       20000000
+#define BENCH_RING          256
+#define BENCH_PKT_LEN       64
+#define BENCH_DCB_WSIZE     4
+
+/* Debug levels as in bcm-knet.c */
+#define DBG_LVL_DCB         0x2
+#define DBG_LVL_PDMP        0x100
+#define DBG_LVL_DCB_RX      0x20000
+#define DBG_LVL_PDMP_RX     0x80000
+#define DBG_LVL_DUMP_RX     (DBG_LVL_DCB | DBG_LVL_DCB_RX | \
+                             DBG_LVL_PDMP | DBG_LVL_PDMP_RX)
+
+/* CMICx DCB status word */
+#define DCB_DONE            (1U << 31)
+#define DCB_LEN_MASK        0xffff
+
+#define NOINLINE            __attribute__((noinline))
+#define UNLIKELY(_x)        __builtin_expect(!!(_x), 0)
+
+static int debug;
+static int dump_on;
+static volatile uint32_t sink;
+static char dump_buf[1024];
+
+typedef struct bench_ring_s {
+    uint32_t *dcbs;
+    uint8_t **bufs;
+    int size;
+    int dirty;
+    int dump_cnt;
+    int dump_sample;
+} bench_ring_t;
+
+/* Stand-in for gprintk, formats but does not print */
+static NOINLINE void
+bench_printk(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(dump_buf, sizeof(dump_buf), fmt, args);
+    va_end(args);
+    sink += (uint8_t)dump_buf[0];
+}
+
+/* Legacy helpers, as before the change */
+static NOINLINE void
+legacy_dump_dcb(char *prefix, uint32_t *dcb, int wsize)
+{
+    int i;
+
+    if ((debug & (DBG_LVL_DCB | DBG_LVL_DCB_RX)) == 0) {
+        return;
+    }
+    bench_printk("%s\n", prefix);
+    for (i = 0; i < wsize; i++) {
+        bench_printk("  DCB[%d]: 0x%08x\n", i, dcb[i]);
+    }
+}
+
+static NOINLINE void
+legacy_dump_pkt(uint8_t *data, int size)
+{
+    if ((debug & (DBG_LVL_PDMP | DBG_LVL_PDMP_RX)) == 0) {
+        return;
+    }
+    bench_printk("Rx packet (%d bytes): %02x %02x %02x %02x\n",
+                 size, data[0], data[1], data[2], data[3]);
+}
+
+/* Current helpers, prefix index only formatted when dumping */
+static NOINLINE void
+_bench_dump_dcb(char *prefix, int idx, uint32_t *dcb, int wsize)
+{
+    char str[32];
+
+    if (idx >= 0) {
+        snprintf(str, sizeof(str), "%s (%d)", prefix, idx);
+        prefix = str;
+    }
+    legacy_dump_dcb(prefix, dcb, wsize);
+}
+
+static inline int
+bench_dump_sample(int *cnt, int sample)
+{
+    if (sample <= 1) {
+        return 1;
+    }
+    if (++(*cnt) < sample) {
+        return 0;
+    }
+    *cnt = 0;
+    return 1;
+}
+
+/* Packet delivery stand-in */
+static inline void
+bench_deliver(uint8_t *data, int len)
+{
+    uint32_t sum = len;
+    int i;
+
+    for (i = 0; i < 14; i++) {
+        sum += data[i];
+    }
+    sink += sum;
+}
+
+static NOINLINE void
+rx_loop_legacy(bench_ring_t *ring, long pkts)
+{
+    uint32_t *dcb;
+    int len;
+
+    while (pkts-- > 0) {
+        char str[32];
+
+        dcb = &ring->dcbs[ring->dirty * BENCH_DCB_WSIZE];
+        if ((dcb[BENCH_DCB_WSIZE - 1] & DCB_DONE) == 0) {
+            break;
+        }
+        sprintf(str, "Rx DCB (%d)", ring->dirty);
+        legacy_dump_dcb(str, dcb, BENCH_DCB_WSIZE);
+        len = dcb[BENCH_DCB_WSIZE - 1] & DCB_LEN_MASK;
+        legacy_dump_pkt(ring->bufs[ring->dirty], len);
+        bench_deliver(ring->bufs[ring->dirty], len);
+        if (++ring->dirty >= ring->size) {
+            ring->dirty = 0;
+        }
+    }
+}
+
+static NOINLINE void
+rx_loop_guarded(bench_ring_t *ring, long pkts)
+{
+    uint32_t *dcb;
+    int len, dump;
+
+    while (pkts-- > 0) {
+        dcb = &ring->dcbs[ring->dirty * BENCH_DCB_WSIZE];
+        if ((dcb[BENCH_DCB_WSIZE - 1] & DCB_DONE) == 0) {
+            break;
+        }
+        dump = 0;
+        if (UNLIKELY(dump_on) && (debug & DBG_LVL_DUMP_RX)) {
+            dump = bench_dump_sample(&ring->dump_cnt, ring->dump_sample);
+        }
+        if (dump) {
+            _bench_dump_dcb("Rx DCB", ring->dirty, dcb, BENCH_DCB_WSIZE);
+        }
+        len = dcb[BENCH_DCB_WSIZE - 1] & DCB_LEN_MASK;
+        if (dump) {
+            legacy_dump_pkt(ring->bufs[ring->dirty], len);
+        }
+        bench_deliver(ring->bufs[ring->dirty], len);
+        if (++ring->dirty >= ring->size) {
+            ring->dirty = 0;
+        }
+    }
+}
+
+static NOINLINE void
+rx_loop_none(bench_ring_t *ring, long pkts)
+{
+    uint32_t *dcb;
+    int len;
+
+    while (pkts-- > 0) {
+        dcb = &ring->dcbs[ring->dirty * BENCH_DCB_WSIZE];
+        if ((dcb[BENCH_DCB_WSIZE - 1] & DCB_DONE) == 0) {
+            break;
+        }
+        len = dcb[BENCH_DCB_WSIZE - 1] & DCB_LEN_MASK;
+        bench_deliver(ring->bufs[ring->dirty], len);
+        if (++ring->dirty >= ring->size) {
+            ring->dirty = 0;
+        }
+    }
+}
+
+static double
+bench_run(const char *name, void (*loop)(bench_ring_t *, long),
+          bench_ring_t *ring, long pkts)
+{
+    struct timespec t0, t1;
+    double ns;
+
+    /* Warm up caches and branch predictors */
+    ring->dirty = 0;
+    loop(ring, ring->size * 4);
+
+    ring->dirty = 0;
+    ring->dump_cnt = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    loop(ring, pkts);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("  %-8s %8.2f ns/packet\n", name, ns / pkts);
+    return ns / pkts;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n packets] [-r ring_size] [-l pkt_len] "
+            "[-d debug] [-S dump_sample]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bench_ring_t ring;
+    long pkts = BENCH_PACKETS;
+    int pkt_len = BENCH_PKT_LEN;
+    double legacy, guarded;
+    int i, opt;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.size = BENCH_RING;
+    ring.dump_sample = 1;
+
+    while ((opt = getopt(argc, argv, "n:r:l:d:S:")) != -1) {
+        switch (opt) {
+        case 'n':
+            pkts = strtol(optarg, NULL, 0);
+            break;
+        case 'r':
+            ring.size = strtol(optarg, NULL, 0);
+            break;
+        case 'l':
+            pkt_len = strtol(optarg, NULL, 0);
+            break;
+        case 'd':
+            debug = strtol(optarg, NULL, 0);
+            break;
+        case 'S':
+            ring.dump_sample = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (pkts <= 0 || ring.size <= 0 || pkt_len < 14 || pkt_len > 0xffff) {
+        usage(argv[0]);
+    }
+    /* As bkn_dump_key_update */
+    dump_on = (debug & DBG_LVL_DUMP_RX) != 0;
+
+    ring.dcbs = calloc(ring.size * BENCH_DCB_WSIZE, sizeof(uint32_t));
+    ring.bufs = calloc(ring.size, sizeof(uint8_t *));
+    if (ring.dcbs == NULL || ring.bufs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < ring.size; i++) {
+        ring.bufs[i] = malloc(pkt_len);
+        if (ring.bufs[i] == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        memset(ring.bufs[i], i, pkt_len);
+        ring.dcbs[i * BENCH_DCB_WSIZE] = i * 0x1000;
+        ring.dcbs[i * BENCH_DCB_WSIZE + BENCH_DCB_WSIZE - 1] =
+            DCB_DONE | pkt_len;
+    }
+
+    printf("Rx loop, %ld packets of %d bytes, ring %d, debug 0x%x, "
+           "dump sample %d\n", pkts, pkt_len, ring.size, debug,
+           ring.dump_sample);
+    legacy = bench_run("legacy", rx_loop_legacy, &ring, pkts);
+    guarded = bench_run("guarded", rx_loop_guarded, &ring, pkts);
+    bench_run("none", rx_loop_none, &ring, pkts);
+    printf("  saving   %8.2f ns/packet (%.1f%%)\n", legacy - guarded,
+           legacy > 0 ? 100.0 * (legacy - guarded) / legacy : 0.0);
+
+    for (i = 0; i < ring.size; i++) {
+        free(ring.bufs[i]);
+    }
+    free(ring.bufs);
+    free(ring.dcbs);
+    return 0;
+}
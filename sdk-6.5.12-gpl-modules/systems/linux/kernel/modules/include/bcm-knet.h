@@ -33,6 +33,47 @@ typedef struct  {
     uint64_t buf;
 } bkn_ioctl_t;
 
+/*
+ * Packet sampling ring layout.
+ *
+ * Packets matching a filter with a sample rate are sampled 1-in-N into
+ * a per-CPU ring of fixed-size records. The rings are exposed to user
+ * space by mapping /proc/bcm/knet/sample, where the ring for CPU n is
+ * located at offset n * KNET_SAMPLE_RING_BYTES.
+ *
+ * The kernel never waits for the reader. The head field counts records
+ * written since the ring was created, and a record is complete when
+ * head has moved past it. If head advances by more than
+ * KNET_SAMPLE_RING_RECS while a record is being read, that record may
+ * have been overwritten.
+ */
+#define KNET_SAMPLE_HDR_BYTES   128
+#define KNET_SAMPLE_META_WORDS  16
+#define KNET_SAMPLE_RING_RECS   256
+
+typedef struct {
+    uint32_t pkt_len;           /* Original packet length */
+    uint16_t dev_no;            /* Device number */
+    uint16_t chan;              /* Rx DMA channel */
+    uint16_t filter_id;         /* Matching filter */
+    uint16_t hdr_len;           /* Bytes of packet header in hdr */
+    uint16_t meta_len;          /* Words of DCB meta data in meta */
+    uint16_t reserved;
+    uint32_t meta[KNET_SAMPLE_META_WORDS];
+    uint8_t hdr[KNET_SAMPLE_HDR_BYTES];
+} knet_sample_t;
+
+typedef struct {
+    volatile uint32_t head;     /* Number of records written */
+    uint32_t recs;              /* Number of records in ring */
+    uint32_t reserved[14];
+    knet_sample_t rec[KNET_SAMPLE_RING_RECS];
+} knet_sample_ring_t;
+
+/* Ring size rounded up to keep rings 4KB-aligned */
+#define KNET_SAMPLE_RING_BYTES \
+    ((sizeof(knet_sample_ring_t) + 4095) & ~4095)
+
 #ifdef __KERNEL__
 
 /*
@@ -44,6 +85,7 @@ typedef struct {
     uint32 netif_user_data;
     uint32 filter_user_data;
     uint16 dcb_type;
+    uint16 netif_flags;         /* KCOM_NETIF_F_xxx of the destination */
 } knet_skb_cb_t;
 
 #define KNET_SKB_CB(__skb) ((knet_skb_cb_t *)&((__skb)->cb[0]))
@@ -73,6 +115,69 @@ bkn_filter_cb_register(knet_filter_cb_f filter_cb);
 extern int
 bkn_filter_cb_unregister(knet_filter_cb_f filter_cb);
 
+/*
+ * Call-back chain interface.
+ *
+ * Several modules can hook into the Rx/Tx/filter paths at the same
+ * time by registering a knet_hook_t. Hooks are called in ascending
+ * priority order (hooks with equal priority are called in order of
+ * registration). The chain is protected by RCU, so a hook must not be
+ * modified or freed before bkn_hook_unregister has returned.
+ *
+ * The single call-back interfaces above are kept for compatibility
+ * and are implemented as a hook with priority KNET_HOOK_PRIO_DEFAULT.
+ *
+ * If KNET_HOOK_F_NETIF_SELECT is set, the Rx/Tx call-backs are only
+ * called for network interfaces enabled in netif_map, otherwise they
+ * are called for all network interfaces.
+ *
+ * The Rx batch call-back is called once per Rx poll with all packets
+ * destined for the network stack. At this point eth_type_trans has
+ * been applied to the packets and the DCB meta data is no longer
+ * available. A packet can be consumed by setting its array entry
+ * to NULL.
+ *
+ * The hardware init call-back is called with the DCB type of a device
+ * when the SDK initializes its packet DMA, and for devices initialized
+ * earlier when the hook is registered. It runs before any packet of
+ * that device reaches the hook, with a spinlock held, and must not
+ * sleep.
+ */
+typedef int
+(*knet_skb_batch_cb_f)(struct sk_buff **skbs, int cnt, int dev_no);
+
+typedef void
+(*knet_hw_init_cb_f)(int dev_no, int dcb_type);
+
+#define KNET_HOOK_PRIO_DEFAULT          100
+
+#define KNET_HOOK_F_NETIF_SELECT        (1U << 0)
+
+#define KNET_HOOK_NETIF_WORDS           ((KCOM_NETIF_MAX + 31) / 32)
+
+typedef struct knet_hook_s {
+    struct list_head list;      /* Internal use only */
+    int priority;               /* Lower values are called first */
+    uint32 flags;               /* KNET_HOOK_F_XXX */
+    uint32 netif_map[KNET_HOOK_NETIF_WORDS]; /* Enabled netif IDs */
+    knet_skb_cb_f rx_cb;
+    knet_skb_cb_f tx_cb;
+    knet_filter_cb_f filter_cb;
+    knet_skb_batch_cb_f rx_batch_cb;
+    knet_hw_init_cb_f hw_init_cb;
+} knet_hook_t;
+
+#define KNET_HOOK_NETIF_ENABLE(_hook, _id) \
+    ((_hook)->netif_map[(_id) / 32] |= (1U << ((_id) % 32)))
+#define KNET_HOOK_NETIF_DISABLE(_hook, _id) \
+    ((_hook)->netif_map[(_id) / 32] &= ~(1U << ((_id) % 32)))
+
+extern int
+bkn_hook_register(knet_hook_t *hook);
+
+extern int
+bkn_hook_unregister(knet_hook_t *hook);
+
 #endif
 
 #endif /* __LINUX_BCM_KNET_H__ */
@@ -39,6 +39,9 @@ typedef struct gmodule_s {
     int (*ioctl)(unsigned int cmd, unsigned long arg);
     int (*close)(void);
     int (*mmap) (struct file *filp, struct vm_area_struct *vma);
+    unsigned long (*get_unmapped_area)(struct file *filp, unsigned long addr,
+                                       unsigned long len, unsigned long pgoff,
+                                       unsigned long flags);
 
 } gmodule_t;
   
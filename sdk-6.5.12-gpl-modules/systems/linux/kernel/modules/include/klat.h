@@ -0,0 +1,61 @@
+/*
+ * Copyright 2017 Broadcom
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation (the "GPL").
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License version 2 (GPLv2) for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * version 2 (GPLv2) along with this source code.
+ */
+/*
+ * $Id: klat.h,v 1.0 Broadcom SDK $
+ * $Copyright: (c) 2005 Broadcom Corp.
+ * All Rights Reserved.$
+ *
+ * Latency histograms for kernel modules.
+ *
+ * Samples are counted in buckets with 8 sub-buckets per power of two,
+ * so percentiles are accurate within 12.5%.
+ */
+
+#ifndef __COMMON_LINUX_KRN_KLAT_H__
+#define __COMMON_LINUX_KRN_KLAT_H__
+
+#include <lkm.h>
+
+#define KLAT_SUB_BITS   3
+#define KLAT_MAX_BITS   36      /* Samples from 2^36 ns (~68 s) on are capped */
+#define KLAT_BUCKETS    ((KLAT_MAX_BITS - KLAT_SUB_BITS + 1) << KLAT_SUB_BITS)
+
+typedef struct klat_hist_s {
+    spinlock_t lock;
+    unsigned long count;
+    u64 min;
+    u64 max;
+    u64 sum;
+    unsigned int bucket[KLAT_BUCKETS];
+} klat_hist_t;
+
+/* Latencies in ns */
+typedef struct klat_summary_s {
+    unsigned long count;
+    u64 min;
+    u64 avg;
+    u64 p50;
+    u64 p90;
+    u64 p99;
+    u64 p999;
+    u64 max;
+} klat_summary_t;
+
+extern void klat_init(klat_hist_t *hist);
+extern void klat_record(klat_hist_t *hist, u64 ns);
+extern void klat_summary(klat_hist_t *hist, klat_summary_t *sum);
+
+#endif /* __COMMON_LINUX_KRN_KLAT_H__ */
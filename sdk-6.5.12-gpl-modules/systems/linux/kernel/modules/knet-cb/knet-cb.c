@@ -42,6 +42,7 @@
 
 #include <gmodule.h> /* Must be included first */
 #include <kcom.h>
+#include <linux-bde.h>
 #include <bcm-knet.h>
 #include <linux/if_vlan.h>
 
@@ -53,22 +54,65 @@ MODULE_LICENSE("GPL");
 #define MODULE_MAJOR 121
 #define MODULE_NAME "linux-knet-cb"
 
-/* set KNET_CB_DEBUG for debug info */
+/* set KNET_CB_DEBUG to compile in debug info */
 #define KNET_CB_DEBUG
 
+#ifdef KNET_CB_DEBUG
+static int debug = 0;
+LKM_MOD_PARAM(debug, "i", int, 0);
+MODULE_PARM_DESC(debug,
+"Debug level (default 0)");
+
+#define DBG_CB(_s)      do { if (unlikely(debug)) gprintk _s; } while (0)
+#else
+#define DBG_CB(_s)
+#endif
+
+static int batch_strip = 0;
+LKM_MOD_PARAM(batch_strip, "i", int, 0);
+MODULE_PARM_DESC(batch_strip,
+"Strip VLAN tags once per Rx poll instead of once per packet (default 0)");
+
 /* Maintain tag strip statistics */
 struct strip_stats_s {
     unsigned long stripped;     /* Number of packets that have been stripped */
     unsigned long checked;
     unsigned long skipped;
+    unsigned long batches;      /* Number of Rx batches processed */
 };
 
 static struct strip_stats_s strip_stats;
 
+/*
+ * Tag status extractor for a given DCB type.
+ * Returns tag status as described for the extractors below.
+ */
+typedef int (*tag_status_f)(uint32 *dcb);
+
+/* Per-device extractor, selected at hardware init from the DCB type */
+typedef struct strip_dev_s {
+    int dcb_type;
+    tag_status_f tag_status;
+} strip_dev_t;
+
+static strip_dev_t strip_devs[LINUX_BDE_MAX_DEVICES];
+
+/*
+ * Private SKB control block area for packets marked by the Rx call-back
+ * for stripping in the Rx batch call-back. Located after the KNET area.
+ */
+typedef struct {
+    uint8 strip;
+} strip_skb_cb_t;
+
+#define STRIP_SKB_CB(__skb) \
+    ((strip_skb_cb_t *)&((__skb)->cb[sizeof(knet_skb_cb_t)]))
+
 /* Local function prototypes */
 static void strip_vlan_tag(struct sk_buff *skb);
-static int  get_tag_status(int dcb_type, void *meta);
+static int  strip_vlan_tag_parsed(struct sk_buff *skb);
 static struct sk_buff *strip_tag_rx_cb(struct sk_buff *skb, int dev_no, void *meta);
+static int  strip_tag_rx_batch_cb(struct sk_buff **skbs, int cnt, int dev_no);
 static struct sk_buff *strip_tag_tx_cb(struct sk_buff *skb, int dev_no, void *meta);
 static int  strip_tag_filter_cb(uint8_t * pkt, int size, int dev_no, void *meta,
                                 int chan, kcom_filter_t * kf);
@@ -99,7 +143,7 @@ strip_vlan_tag(struct sk_buff *skb)
  * DCB type 31, 34, 37: word 13, bits 0..1
  * DCB type 26, 32, 33, 35: word 13, bits 0..1
  *
- * The function get_tag_status() returns the tag status for known DCB types.
+ * The tag status extractors return the tag status for known DCB types.
  * 0 = Untagged
  * 1 = Single inner-tag
  * 2 = Single outer-tag
@@ -107,10 +151,26 @@ strip_vlan_tag(struct sk_buff *skb)
  * -1 = Unsupported DCB type
  */
 static int
-get_tag_status(int dcb_type, void *meta)
+tag_status_w12(uint32 *dcb)
+{
+    return (dcb[12] >> 10) & 0x3;
+}
+
+static int
+tag_status_w13(uint32 *dcb)
+{
+    return dcb[13] & 0x3;
+}
+
+static int
+tag_status_none(uint32 *dcb)
+{
+    return -1;
+}
+
+static tag_status_f
+tag_status_func(int dcb_type)
 {
-    uint32     *dcb = (uint32 *) meta;
-    int         tag_status;
     switch (dcb_type) {
       case 14:
       case 19:
@@ -118,8 +178,7 @@ get_tag_status(int dcb_type, void *meta)
       case 21:
       case 22:
       case 30:
-          tag_status = (dcb[12] > 10) & 0x3;
-          break;
+          return tag_status_w12;
       case 23:
       case 29:
       case 31:
@@ -129,13 +188,38 @@ get_tag_status(int dcb_type, void *meta)
       case 32:
       case 33:
       case 35:
-          tag_status = dcb[13] & 0x3;
-          break;
+          return tag_status_w13;
       default:
-          tag_status = -1;
-          break;
+          return tag_status_none;
     }
-    return tag_status;
+}
+
+/*
+ * Hardware init call-back. KNET calls it with the DCB type of each
+ * device before packets of the device are received, so the extractor
+ * is selected once per (re-)initialization instead of per packet.
+ */
+static void
+strip_tag_hw_init_cb(int dev_no, int dcb_type)
+{
+    strip_dev_t *sdev;
+
+    if (dev_no < 0 || dev_no >= LINUX_BDE_MAX_DEVICES) {
+        return;
+    }
+    sdev = &strip_devs[dev_no];
+    sdev->dcb_type = dcb_type;
+    sdev->tag_status = tag_status_func(dcb_type);
+}
+
+/* Get the tag status extractor for a device */
+static inline tag_status_f
+strip_dev_tag_status(int dev_no)
+{
+    if (dev_no < 0 || dev_no >= LINUX_BDE_MAX_DEVICES) {
+        return tag_status_none;
+    }
+    return strip_devs[dev_no].tag_status;
 }
 
 /*
@@ -148,20 +232,26 @@ get_tag_status(int dcb_type, void *meta)
  */
 #define NETIF_UNTAGGED_STRIP  (1 << 0)
 
-/* Rx packet callback function */
+/*
+ * Rx packet callback function
+ *
+ * In batch mode the packet is only marked here, and the tag is stripped
+ * by strip_tag_rx_batch_cb, since the DCB is not available at that point.
+ * Packets for interfaces with RCPU encapsulation are always stripped
+ * here, since the encapsulation added by KNET carries a VLAN tag too.
+ */
 static struct sk_buff *
 strip_tag_rx_cb(struct sk_buff *skb, int dev_no, void *meta)
 {
     unsigned    netif_flags = KNET_SKB_CB(skb)->netif_user_data;
-    unsigned    dcb_type;
     int         tag_status;
     /* Currently not using filter flags:
      * unsigned    filter_flags = KNET_SKB_CB(skb)->filter_user_data;
      */
 
-#ifdef KNET_CB_DEBUG
-    gprintk("%s Enter; Flags: %08X\n", __func__, netif_flags);
-#endif
+    DBG_CB(("%s Enter; Flags: %08X\n", __func__, netif_flags));
+
+    STRIP_SKB_CB(skb)->strip = 0;
 
     if ((netif_flags & NETIF_UNTAGGED_STRIP) == 0) {
         /* Untagged stripping not enabled on this netif */
@@ -169,15 +259,11 @@ strip_tag_rx_cb(struct sk_buff *skb, int dev_no, void *meta)
         return skb;
     }
 
-    /* Get DCB type for this packet, passed by KNET driver */
-    dcb_type = KNET_SKB_CB(skb)->dcb_type;
-
     /* Get tag status from DCB */
-    tag_status = get_tag_status(dcb_type, meta);
+    tag_status = strip_dev_tag_status(dev_no)((uint32 *) meta);
 
-#ifdef KNET_CB_DEBUG
-    gprintk("%s; DCB Type: %d; tag status: %d\n", __func__, dcb_type, tag_status);
-#endif
+    DBG_CB(("%s; DCB Type: %d; tag status: %d\n", __func__,
+            KNET_SKB_CB(skb)->dcb_type, tag_status));
 
     if (tag_status < 0) {
         /* Unsupported DCB type */
@@ -190,20 +276,84 @@ strip_tag_rx_cb(struct sk_buff *skb, int dev_no, void *meta)
      * device, we need to strip this off.
      */
     if (tag_status < 2) {
-#ifdef KNET_CB_DEBUG
-        gprintk("%s; Stripping VLAN\n", __func__);
-#endif
+        if (batch_strip &&
+            !(KNET_SKB_CB(skb)->netif_flags & KCOM_NETIF_F_RCPU_ENCAP)) {
+            STRIP_SKB_CB(skb)->strip = 1;
+            return skb;
+        }
+        DBG_CB(("%s; Stripping VLAN\n", __func__));
         strip_stats.stripped++;
         strip_vlan_tag(skb);
+    } else {
+        DBG_CB(("%s; Preserve VLAN\n", __func__));
     }
-#ifdef KNET_CB_DEBUG
-    else {
-        gprintk("%s; Preserve VLAN\n", __func__);
-    }
-#endif
     return skb;
 }
 
+/*
+ * Remove the VLAN tag from a packet which has been through
+ * eth_type_trans, i.e. skb->data points to the tag control field.
+ * The protocol is only updated if it is still the one derived from
+ * the tag, so a protocol set by the KNET filter is preserved.
+ */
+static int
+strip_vlan_tag_parsed(struct sk_buff *skb)
+{
+    uint8_t     *mac = skb_mac_header(skb);
+    uint16_t    vlan_proto, inner_proto;
+
+    if (skb->data - mac != ETH_HLEN || skb->len < VLAN_HLEN) {
+        return 0;
+    }
+    vlan_proto = (uint16_t) ((mac[12] << 8) | mac[13]);
+    if ((vlan_proto != 0x8100) && (vlan_proto != 0x88a8) && (vlan_proto != 0x9100)) {
+        return 0;
+    }
+    inner_proto = (uint16_t) ((skb->data[2] << 8) | skb->data[3]);
+
+    /* Move MAC addresses up to the inner EtherType */
+    memmove(mac + VLAN_HLEN, mac, 2 * ETH_ALEN);
+    skb_pull(skb, VLAN_HLEN);
+    skb_set_mac_header(skb, -ETH_HLEN);
+
+    if (skb->protocol == htons(vlan_proto)) {
+        skb->protocol = (inner_proto >= ETH_P_802_3_MIN) ?
+                        htons(inner_proto) : htons(ETH_P_802_2);
+    }
+    return 1;
+}
+
+/*
+ * Rx batch callback function
+ *
+ * Strip VLAN tags from all packets marked by strip_tag_rx_cb. The
+ * packets have already been through eth_type_trans, so the tag is
+ * removed behind the parsed Ethernet header instead of parsing again.
+ */
+static int
+strip_tag_rx_batch_cb(struct sk_buff **skbs, int cnt, int dev_no)
+{
+    struct sk_buff *skb;
+    int         idx;
+    int         stripped = 0;
+
+    for (idx = 0; idx < cnt; idx++) {
+        skb = skbs[idx];
+        if (skb == NULL || !STRIP_SKB_CB(skb)->strip) {
+            continue;
+        }
+        STRIP_SKB_CB(skb)->strip = 0;
+        stripped += strip_vlan_tag_parsed(skb);
+    }
+
+    DBG_CB(("%s; Stripped %d of %d packets\n", __func__, stripped, cnt));
+
+    strip_stats.stripped += stripped;
+    strip_stats.batches++;
+
+    return 0;
+}
+
 /* Tx callback not used */
 static struct sk_buff *
 strip_tag_tx_cb(struct sk_buff *skb, int dev_no, void *meta)
@@ -221,6 +371,23 @@ strip_tag_filter_cb(uint8_t * pkt, int size, int dev_no, void *meta,
     return 0;
 }
 
+/*
+ * The call-backs are registered as a hook in the KNET call-back chain,
+ * which allows other modules to be stacked in front of or behind the
+ * tag stripper by choosing a lower or higher hook priority.
+ */
+static int strip_tag_hook_prio = KNET_HOOK_PRIO_DEFAULT;
+LKM_MOD_PARAM(strip_tag_hook_prio, "i", int, 0);
+MODULE_PARM_DESC(strip_tag_hook_prio,
+"Priority of VLAN stripper in KNET call-back chain (default 100)");
+
+static knet_hook_t strip_tag_hook = {
+    rx_cb:      strip_tag_rx_cb,
+    tx_cb:      strip_tag_tx_cb,
+    filter_cb:  strip_tag_filter_cb,
+    hw_init_cb: strip_tag_hw_init_cb,
+};
+
 /*
  * Get statistics.
  * % cat /proc/linux-knet-cb
@@ -232,6 +399,8 @@ _pprint(void)
     pprintf("    %lu stripped packets\n", strip_stats.stripped);
     pprintf("    %lu packets checked\n", strip_stats.checked);
     pprintf("    %lu packets skipped\n", strip_stats.skipped);
+    pprintf("    %lu batches processed\n", strip_stats.batches);
+    pprintf("    hook priority %d\n", strip_tag_hook.priority);
 
     return 0;
 }
@@ -239,9 +408,7 @@ _pprint(void)
 static int
 _cleanup(void)
 {
-    bkn_rx_skb_cb_unregister(strip_tag_rx_cb);
-    bkn_tx_skb_cb_unregister(strip_tag_tx_cb);
-    bkn_filter_cb_unregister(strip_tag_filter_cb);
+    bkn_hook_unregister(&strip_tag_hook);
 
     return 0;
 }   
@@ -249,9 +416,20 @@ _cleanup(void)
 static int
 _init(void)
 {
-    bkn_rx_skb_cb_register(strip_tag_rx_cb);
-    bkn_tx_skb_cb_register(strip_tag_tx_cb);
-    bkn_filter_cb_register(strip_tag_filter_cb);
+    int         idx;
+
+    /* Devices not yet initialized by KNET have no known DCB type */
+    for (idx = 0; idx < LINUX_BDE_MAX_DEVICES; idx++) {
+        strip_devs[idx].tag_status = tag_status_none;
+    }
+    strip_tag_hook.priority = strip_tag_hook_prio;
+    if (batch_strip) {
+        strip_tag_hook.rx_batch_cb = strip_tag_rx_batch_cb;
+    }
+    if (bkn_hook_register(&strip_tag_hook) < 0) {
+        gprintk("Failed to register KNET call-back hook\n");
+        return -EBUSY;
+    }
 
     return 0;
 }
@@ -374,6 +374,11 @@ init_module(void)
     _gmodule = gmodule_get();
     if(!_gmodule) return -ENODEV;
 
+    /* Optional placement of mmap areas */
+    if (_gmodule->get_unmapped_area) {
+        _gmodule_fops.get_unmapped_area = _gmodule->get_unmapped_area;
+    }
+
 
     /* Register ourselves */
 #ifdef GMODULE_CONFIG_DEVFS_FS
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2017 Broadcom
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as
+ * published by the Free Software Foundation (the "GPL").
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License version 2 (GPLv2) for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * version 2 (GPLv2) along with this source code.
+ */
+/*
+ * $Id: klat.c,v 1.0 Broadcom SDK $
+ * $Copyright: (c) 2005 Broadcom Corp.
+ * All Rights Reserved.$
+ */
+
+#include "lkm.h"
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <klat.h>
+
+#define KLAT_SUB_MASK   ((1 << KLAT_SUB_BITS) - 1)
+
+/*
+ * Bucket of a sample. Values below 2^KLAT_SUB_BITS have a bucket of
+ * their own, larger values are split into 2^KLAT_SUB_BITS buckets per
+ * power of two.
+ */
+static int
+_klat_bucket(u64 ns)
+{
+    int msb;
+
+    if (ns <= KLAT_SUB_MASK) {
+        return (int)ns;
+    }
+    msb = fls64(ns) - 1;
+    if (msb >= KLAT_MAX_BITS) {
+        return KLAT_BUCKETS - 1;
+    }
+    return ((msb - KLAT_SUB_BITS + 1) << KLAT_SUB_BITS) +
+        (int)((ns >> (msb - KLAT_SUB_BITS)) & KLAT_SUB_MASK);
+}
+
+/*
+ * Lowest value counted in a bucket.
+ */
+static u64
+_klat_bucket_value(int idx)
+{
+    int grp = idx >> KLAT_SUB_BITS;
+
+    if (grp == 0) {
+        return idx;
+    }
+    return (u64)((1 << KLAT_SUB_BITS) | (idx & KLAT_SUB_MASK)) << (grp - 1);
+}
+
+/*
+ * Function: klat_init
+ *
+ * Purpose:
+ *    Initialize or reset latency histogram.
+ * Parameters:
+ *    hist - histogram
+ * Returns:
+ *    Nothing
+ */
+void
+klat_init(klat_hist_t *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    spin_lock_init(&hist->lock);
+}
+
+/*
+ * Function: klat_record
+ *
+ * Purpose:
+ *    Add sample to latency histogram.
+ * Parameters:
+ *    hist - histogram
+ *    ns - latency in ns
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    May be called in interrupt context.
+ */
+void
+klat_record(klat_hist_t *hist, u64 ns)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&hist->lock, flags);
+    if (hist->count == 0 || ns < hist->min) {
+        hist->min = ns;
+    }
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+    hist->sum += ns;
+    hist->count++;
+    hist->bucket[_klat_bucket(ns)]++;
+    spin_unlock_irqrestore(&hist->lock, flags);
+}
+
+/*
+ * Function: klat_summary
+ *
+ * Purpose:
+ *    Get percentiles of latency histogram.
+ * Parameters:
+ *    hist - histogram
+ *    sum - (OUT) summary
+ * Returns:
+ *    Nothing
+ * Notes:
+ *    A percentile is reported as the lowest value of the bucket
+ *    holding it, but never below the minimum or above the maximum.
+ */
+void
+klat_summary(klat_hist_t *hist, klat_summary_t *sum)
+{
+    static const int permille[] = { 500, 900, 990, 999 };
+    u64 *pval[4];
+    unsigned long flags, rank, seen;
+    int idx, p;
+
+    pval[0] = &sum->p50;
+    pval[1] = &sum->p90;
+    pval[2] = &sum->p99;
+    pval[3] = &sum->p999;
+
+    memset(sum, 0, sizeof(*sum));
+
+    spin_lock_irqsave(&hist->lock, flags);
+    sum->count = hist->count;
+    if (hist->count) {
+        sum->min = hist->min;
+        sum->max = hist->max;
+        sum->avg = div64_u64(hist->sum, hist->count);
+        for (p = 0, idx = 0, seen = 0; p < 4; p++) {
+            /* Rank of percentile, counting from 1 */
+            rank = (unsigned long)
+                div64_u64((u64)hist->count * permille[p] + 999, 1000);
+            while (idx < KLAT_BUCKETS && seen + hist->bucket[idx] < rank) {
+                seen += hist->bucket[idx++];
+            }
+            *pval[p] = _klat_bucket_value(idx);
+            if (*pval[p] < sum->min) {
+                *pval[p] = sum->min;
+            }
+            if (*pval[p] > sum->max) {
+                *pval[p] = sum->max;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&hist->lock, flags);
+}
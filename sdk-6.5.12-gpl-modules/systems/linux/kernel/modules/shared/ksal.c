@@ -35,6 +35,17 @@
 #endif
 #include <linux/time.h>
 
+/* usleep_range and hrtimer based waits */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#define SAL_HRTIMER_SUPPORT
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#endif
+
+/* Longest sleep done with usleep_range, which is not interruptible */
+#define SAL_USLEEP_RANGE_MAX    20000
+
 #ifdef MAX_USER_RT_PRIO
 /* Assume 2.6 scheduler */
 #define SAL_YIELD(task) \
@@ -65,6 +76,8 @@ do { \
  *
  *   The semaphore control type uses the binary property to implement
  *   timed semaphores with improved performance using wait queues.
+ *   With SAL_HRTIMER_SUPPORT all semaphores use the wait queue for
+ *   timed takes.
  */
 
 typedef struct sem_ctrl_s {
@@ -82,9 +95,8 @@ sal_sem_create(char *desc, int binary, int initial_count)
     if ((s = sal_alloc(sizeof(*s), desc)) != 0) {
 	sema_init(&s->sem, initial_count);
         s->binary = binary;
-        if (s->binary) {
-            init_waitqueue_head(&s->wq);
-        }
+        s->cnt = 0;
+        init_waitqueue_head(&s->wq);
     }
 
     return (sal_sem_t) s;
@@ -113,6 +125,18 @@ sal_sem_take(sal_sem_t b, int usec)
 
     if (usec == sal_sem_FOREVER && !in_interrupt()) {
 	err = down_interruptible(&s->sem);
+#ifdef SAL_HRTIMER_SUPPORT
+    } else if (usec == 0 || in_interrupt()) {
+        err = down_trylock(&s->sem);
+    } else if (usec != sal_sem_FOREVER) {
+        /*
+         * Sleep until given, timed out or interrupted by a signal, no
+         * polling. Like down_interruptible, but with a timeout.
+         */
+        err = wait_event_interruptible_timeout(s->wq,
+                                               down_trylock(&s->sem) == 0,
+                                               USEC_TO_JIFFIES(usec)) <= 0;
+#endif
     } else {
 	int		time_wait = 1;
         int             cnt = s->cnt;
@@ -170,24 +194,54 @@ sal_sem_give(sal_sem_t b)
     sem_ctrl_t *s = (sem_ctrl_t *) b;
 
     up(&s->sem);
+#ifdef SAL_HRTIMER_SUPPORT
+    s->cnt++;
+    wake_up_interruptible(&s->wq);
+#else
     if (s->binary) {
         s->cnt++;
         wake_up_interruptible(&s->wq);
     }
+#endif
     return 0;
 }
 
 uint32
 sal_time_usecs(void)
 {
+#ifdef SAL_HRTIMER_SUPPORT
+    return (uint32)ktime_to_us(ktime_get());
+#else
     struct timeval ltv;
     do_gettimeofday(&ltv);
     return (ltv.tv_sec * SECOND_USEC + ltv.tv_usec);
+#endif
 }
     
 void
 sal_usleep(uint32 usec)
 {
+#ifdef SAL_HRTIMER_SUPPORT
+    ktime_t expires;
+
+    /*
+     * High resolution sleep. Allow the wakeup to slip by 1/16 of the
+     * sleep time (at least 1 usec), so close timers can be coalesced.
+     * Long sleeps end early on a signal.
+     */
+    if (usec == 0) {
+        SAL_YIELD(current);
+        return;
+    }
+    if (usec < SAL_USLEEP_RANGE_MAX) {
+        usleep_range(usec, usec + (usec >> 4) + 1);
+        return;
+    }
+    expires = ns_to_ktime((u64)usec * NSEC_PER_USEC);
+    set_current_state(TASK_INTERRUPTIBLE);
+    schedule_hrtimeout_range(&expires, (u64)(usec >> 4) * NSEC_PER_USEC,
+                             HRTIMER_MODE_REL);
+#else
     uint32 start_usec;
     wait_queue_head_t queue;
 
@@ -200,11 +254,22 @@ sal_usleep(uint32 usec)
         init_waitqueue_head(&queue);
         WQ_SLEEP(queue, USEC_TO_JIFFIES(usec));
     }
+#endif
 }
 
 void
 sal_udelay(uint32 usec)
 {
+#ifdef SAL_HRTIMER_SUPPORT
+    /* udelay may overflow on long delays on some architectures */
+    if (usec >= 1000) {
+        mdelay(usec / 1000);
+        usec %= 1000;
+    }
+    if (usec) {
+        udelay(usec);
+    }
+#else
     static volatile int _sal_udelay_counter;
     static int loops = 0;
     int ix, iy;
@@ -246,4 +311,5 @@ sal_udelay(uint32 usec)
             _sal_udelay_counter++;      /* Prevent optimizations */
         }
     }
+#endif
 }